@@ -0,0 +1,787 @@
+/*
+ * A microbenchmark for the verbs the examples are built on.
+ *
+ * One side listens (-l) and does nothing but keep receives posted for sends
+ * and writes with immediate; the other side connects and sweeps every
+ * combination of operation (write, read, send, write_imm), message size,
+ * queue depth and signaling interval. WRs are posted through the send queue
+ * manager (rdma_sendq.h), the same way the client posts its records, so
+ * small writes and sends go inline and only every Nth WR is signaled.
+ *
+ * For every combination one line goes to stdout, as CSV or, with -j, as a
+ * JSON array: the throughput in Gbit/s and million operations per second,
+ * and the 50th, 99th and 99.9th percentile latency. The latency of a WR is
+ * the time from posting it until the send queue manager retires it. An
+ * unsignaled WR is only known to be complete once the next signaled one
+ * completes, and with a depth above one a WR queues behind the ones in
+ * flight, so only depth 1 with signal 1 measures the plain round trip.
+ *
+ * Nothing here needs more than a plain RC QP, so it runs against Soft-RoCE
+ * as well as against a real NIC:
+ *   modprobe rdma_rxe
+ *   rdma link add rxe0 type rxe netdev eth0
+ *   ./rdma_bench -l -a <eth0 address> &
+ *   ./rdma_bench -a <eth0 address> -o write,send -m 64,4096 -d 1,32
+ */
+
+#include <poll.h>
+
+#include "rdma_common.h"
+#include "rdma_sendq.h"
+#include "rdma_sizing.h"
+
+/* Largest message, also the size of the buffer each side registers */
+#define BENCH_MAX_MSG (1 << 22)
+/* Receives the server keeps posted */
+#define BENCH_RECV_WR (256)
+/* Most values in a list on the command line */
+#define BENCH_MAX_LIST (32)
+/* WRs per combination, and WRs posted before measuring */
+#define DEFAULT_BENCH_ITERS (10000)
+#define BENCH_WARMUP (1000)
+
+enum bench_op
+{
+	BENCH_WRITE = 0,
+	BENCH_READ,
+	BENCH_SEND,
+	BENCH_WRITE_IMM,
+	BENCH_NR_OPS,
+};
+
+static const char *bench_op_names[BENCH_NR_OPS] =
+{
+	"write", "read", "send", "write_imm",
+};
+
+static const enum ibv_wr_opcode bench_opcodes[BENCH_NR_OPS] =
+{
+	IBV_WR_RDMA_WRITE, IBV_WR_RDMA_READ, IBV_WR_SEND, IBV_WR_RDMA_WRITE_WITH_IMM,
+};
+
+/* One combination of the sweep, and what it measured */
+struct bench_run
+{
+	enum bench_op op;
+	uint32_t size, depth, signal_every;
+	uint64_t iters;
+	/* when WR i was posted, and how long it took to retire */
+	uint64_t *post_ns, *lat_ns;
+	uint64_t elapsed_ns;
+};
+
+/* RDMA resources, one connection at a time */
+static struct rdma_event_channel *cm_event_channel = NULL;
+static struct rdma_cm_id *cm_listen_id = NULL, *cm_id = NULL;
+static struct ibv_pd *pd = NULL;
+static struct ibv_cq *cq = NULL;
+static struct ibv_qp_init_attr qp_init_attr;
+static struct rdma_sizing sizing;
+static struct rdma_comp_poller poller;
+static struct ibv_mr *buffer_mr = NULL, *attr_mr = NULL;
+/* the server's buffer, as it told the client */
+static struct rdma_buffer_attr buffer_attr;
+
+/* The sweep */
+static uint32_t ops[BENCH_MAX_LIST], nr_ops;
+static uint32_t sizes[BENCH_MAX_LIST], nr_sizes;
+static uint32_t depths[BENCH_MAX_LIST], nr_depths;
+static uint32_t signals[BENCH_MAX_LIST], nr_signals;
+static uint64_t iters = DEFAULT_BENCH_ITERS;
+static int json = 0;
+
+/* Parses a comma separated list of numbers, returns how many or -EINVAL */
+static int parse_list(const char *arg, uint32_t *vals)
+{
+	char *end;
+	int n = 0;
+	while (*arg)
+	{
+		if (n == BENCH_MAX_LIST)
+			return -EINVAL;
+		vals[n++] = strtoul(arg, &end, 0);
+		if (end == arg || (*end && *end != ','))
+			return -EINVAL;
+		arg = *end ? end + 1 : end;
+	}
+	return n ? n : -EINVAL;
+}
+
+/* Parses a comma separated list of operation names */
+static int parse_ops(const char *arg, uint32_t *vals)
+{
+	const char *end;
+	size_t len;
+	int n = 0, op;
+	while (*arg)
+	{
+		end = strchr(arg, ',');
+		len = end ? (size_t)(end - arg) : strlen(arg);
+		for (op = 0; op < BENCH_NR_OPS; op++)
+		{
+			if (strlen(bench_op_names[op]) == len &&
+			        !strncmp(arg, bench_op_names[op], len))
+				break;
+		}
+		if (op == BENCH_NR_OPS || n == BENCH_MAX_LIST)
+			return -EINVAL;
+		vals[n++] = op;
+		arg += len;
+		if (*arg)
+			arg++;
+	}
+	return n ? n : -EINVAL;
+}
+
+/*
+ * Sets up the PD, the buffer, the CQ and the QP of a connection. The queues
+ * are taken down to what the device allows.
+ */
+static int setup_resources(struct rdma_cm_id *id, uint32_t send_wr,
+                           uint32_t recv_wr)
+{
+	const uint64_t copies[2] = { 1, 1 };
+	uint32_t depth[2];
+	int ret;
+	pd = ibv_alloc_pd(id->verbs);
+	if (!pd)
+	{
+		rdma_error("Failed to alloc pd, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_sizing_query(&sizing, id->verbs, id->port_num);
+	if (ret)
+		return ret;
+	buffer_mr = rdma_buffer_alloc(pd, BENCH_MAX_MSG,
+	                              (IBV_ACCESS_LOCAL_WRITE |
+	                               IBV_ACCESS_REMOTE_READ |
+	                               IBV_ACCESS_REMOTE_WRITE));
+	if (!buffer_mr)
+		return -ENOMEM;
+	attr_mr = rdma_buffer_register(pd, &buffer_attr, sizeof(buffer_attr),
+	                               IBV_ACCESS_LOCAL_WRITE);
+	if (!attr_mr)
+		return -ENOMEM;
+	bzero(&qp_init_attr, sizeof qp_init_attr);
+	depth[0] = rdma_sizing_wr(&sizing, send_wr);
+	depth[1] = rdma_sizing_wr(&sizing, recv_wr);
+	ret = rdma_sizing_fit_cq(&sizing, depth, copies, 2);
+	if (ret < 0)
+		return ret;
+	qp_init_attr.cap.max_send_wr = depth[0];
+	qp_init_attr.cap.max_recv_wr = depth[1];
+	qp_init_attr.cap.max_send_sge = 1;
+	qp_init_attr.cap.max_recv_sge = 1;
+	/* Busy polled, no completion channel */
+	cq = ibv_create_cq(id->verbs, depth[0] + depth[1], NULL, NULL, 0);
+	if (!cq)
+	{
+		rdma_error("Failed to create CQ, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_comp_poller_init(&poller, cq, NULL, RDMA_COMP_POLL, 0);
+	if (ret)
+		return ret;
+	qp_init_attr.qp_type = IBV_QPT_RC;
+	qp_init_attr.send_cq = cq;
+	qp_init_attr.recv_cq = cq;
+	ret = rdma_create_qp_inline(id, pd, &qp_init_attr);
+	if (ret)
+	{
+		rdma_error("Failed to create QP, errno: %d \n", -errno);
+		return -errno;
+	}
+	debug("QP created, send wr: %u recv wr: %u inline: %u \n",
+	      qp_init_attr.cap.max_send_wr, qp_init_attr.cap.max_recv_wr,
+	      qp_init_attr.cap.max_inline_data);
+	return 0;
+}
+
+static void cleanup_resources()
+{
+	if (cm_id && cm_id->qp)
+		rdma_destroy_qp(cm_id);
+	if (cq)
+		ibv_destroy_cq(cq);
+	if (attr_mr)
+		rdma_buffer_deregister(attr_mr);
+	if (buffer_mr)
+		rdma_buffer_free(buffer_mr);
+	if (pd)
+		ibv_dealloc_pd(pd);
+	if (cm_id)
+		rdma_destroy_id(cm_id);
+	cm_id = NULL;
+	cq = NULL;
+	attr_mr = NULL;
+	buffer_mr = NULL;
+	pd = NULL;
+}
+
+/* Posts one receive of 'length' bytes at 'addr'. All receives of the server
+ * share its buffer, nobody looks at what arrives. */
+static int post_recv(struct ibv_mr *mr, void *addr, uint32_t length)
+{
+	struct ibv_recv_wr wr, *bad_wr = NULL;
+	struct ibv_sge sge;
+	sge.addr = (uint64_t) addr;
+	sge.length = length;
+	sge.lkey = mr->lkey;
+	bzero(&wr, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	return -ibv_post_recv(cm_id->qp, &wr, &bad_wr);
+}
+
+/* Looks for a CM event without blocking. Returns 1 and the event if there
+ * is one, 0 if not. */
+static int cm_event_pending(struct rdma_cm_event **cm_event)
+{
+	struct pollfd pfd;
+	pfd.fd = cm_event_channel->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+	if (rdma_get_cm_event(cm_event_channel, cm_event))
+		return 0;
+	return 1;
+}
+
+/*
+ * Serves one client: keeps the receive queue full and tells the client
+ * where its buffer is, until the client disconnects.
+ */
+static int serve_client()
+{
+	struct rdma_cm_event *cm_event = NULL;
+	struct rdma_conn_param conn_param, peer;
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	struct ibv_wc wc[RDMA_SENDQ_POLL_BATCH];
+	struct ibv_sge sge;
+	uint64_t received = 0;
+	uint32_t i, idle = 0;
+	int ret, n, done = 0;
+	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_CONNECT_REQUEST,
+	                            &cm_event);
+	if (ret)
+		return ret;
+	cm_id = cm_event->id;
+	peer = cm_event->param.conn;
+	rdma_ack_cm_event(cm_event);
+	ret = setup_resources(cm_id, 1, BENCH_RECV_WR);
+	if (ret)
+		return ret;
+	for (i = 0; i < qp_init_attr.cap.max_recv_wr; i++)
+	{
+		ret = post_recv(buffer_mr, buffer_mr->addr, BENCH_MAX_MSG);
+		if (ret)
+		{
+			rdma_error("Failed to post a receive, ret = %d \n", ret);
+			return ret;
+		}
+	}
+	bzero(&conn_param, sizeof(conn_param));
+	rdma_sizing_conn_param(&sizing, &conn_param, &peer);
+	ret = rdma_accept(cm_id, &conn_param);
+	if (ret)
+	{
+		rdma_error("Failed to accept the connection, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_ESTABLISHED,
+	                            &cm_event);
+	if (ret)
+		return ret;
+	rdma_ack_cm_event(cm_event);
+	/* Tell the client where to write to and read from */
+	buffer_attr.address = (uint64_t) buffer_mr->addr;
+	buffer_attr.length = buffer_mr->length;
+	buffer_attr.stag.local_stag = buffer_mr->rkey;
+	sge.addr = (uint64_t) &buffer_attr;
+	sge.length = sizeof(buffer_attr);
+	sge.lkey = attr_mr->lkey;
+	bzero(&wr, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	ret = ibv_post_send(cm_id->qp, &wr, &bad_wr);
+	if (ret)
+	{
+		rdma_error("Failed to send the buffer attributes, errno: %d \n", -ret);
+		return -ret;
+	}
+	ret = rdma_wait_work_completions(&poller, wc, 1);
+	if (ret != 1)
+		return ret < 0 ? ret : -EIO;
+	printf("Serving client, buffer of %u bytes \n", buffer_attr.length);
+	while (!done)
+	{
+		n = ibv_poll_cq(cq, RDMA_SENDQ_POLL_BATCH, wc);
+		if (n < 0)
+		{
+			rdma_error("Failed to poll cq for wc due to %d \n", n);
+			return n;
+		}
+		for (i = 0; i < (uint32_t) n; i++)
+		{
+			/* the client going away flushes the receives */
+			if (wc[i].status == IBV_WC_WR_FLUSH_ERR)
+				continue;
+			if (wc[i].status != IBV_WC_SUCCESS)
+			{
+				rdma_error("Work completion (WC) has error status: %s \n",
+				           ibv_wc_status_str(wc[i].status));
+				return -(wc[i].status);
+			}
+			received++;
+			ret = post_recv(buffer_mr, buffer_mr->addr, BENCH_MAX_MSG);
+			if (ret)
+			{
+				rdma_error("Failed to post a receive, ret = %d \n", ret);
+				return ret;
+			}
+		}
+		/* Reads and plain writes never show up here, so look for the
+		 * disconnect whenever the CQ has been quiet for a while */
+		if (n)
+		{
+			idle = 0;
+			continue;
+		}
+		if (++idle < 1024)
+			continue;
+		idle = 0;
+		if (!cm_event_pending(&cm_event))
+			continue;
+		if (cm_event->event == RDMA_CM_EVENT_DISCONNECTED)
+			done = 1;
+		else
+		{
+			debug("Ignoring %s \n", rdma_event_str(cm_event->event));
+		}
+		rdma_ack_cm_event(cm_event);
+	}
+	rdma_disconnect(cm_id);
+	printf("Client disconnected after %lu receives \n", (unsigned long) received);
+	return 0;
+}
+
+static int bench_server(struct sockaddr_in *addr)
+{
+	int ret;
+	cm_event_channel = rdma_create_event_channel();
+	if (!cm_event_channel)
+	{
+		rdma_error("Creating cm event channel failed, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_create_id(cm_event_channel, &cm_listen_id, NULL, RDMA_PS_TCP);
+	if (ret)
+	{
+		rdma_error("Creating cm id failed with errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_bind_addr(cm_listen_id, (struct sockaddr*) addr);
+	if (ret)
+	{
+		rdma_error("Failed to bind server address, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_listen(cm_listen_id, 1);
+	if (ret)
+	{
+		rdma_error("rdma_listen failed to listen on server address, errno: %d \n",
+		           -errno);
+		return -errno;
+	}
+	printf("Benchmark server is listening at: %s , port: %d \n",
+	       inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+	/* One client after the other, until something breaks */
+	do
+	{
+		ret = serve_client();
+		cleanup_resources();
+	}
+	while (!ret);
+	rdma_destroy_id(cm_listen_id);
+	rdma_destroy_event_channel(cm_event_channel);
+	return ret;
+}
+
+/* Connects to the server and learns where its buffer is */
+static int bench_connect(struct sockaddr_in *addr, uint32_t max_depth)
+{
+	struct rdma_cm_event *cm_event = NULL;
+	struct rdma_conn_param conn_param;
+	struct ibv_wc wc;
+	int ret;
+	cm_event_channel = rdma_create_event_channel();
+	if (!cm_event_channel)
+	{
+		rdma_error("Creating cm event channel failed, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_create_id(cm_event_channel, &cm_id, NULL, RDMA_PS_TCP);
+	if (ret)
+	{
+		rdma_error("Creating cm id failed with errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = rdma_resolve_addr(cm_id, NULL, (struct sockaddr*) addr, 2000);
+	if (ret)
+	{
+		rdma_error("Failed to resolve address, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_ADDR_RESOLVED,
+	                            &cm_event);
+	if (ret)
+		return ret;
+	rdma_ack_cm_event(cm_event);
+	ret = rdma_resolve_route(cm_id, 2000);
+	if (ret)
+	{
+		rdma_error("Failed to resolve route, errno: %d \n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_ROUTE_RESOLVED,
+	                            &cm_event);
+	if (ret)
+		return ret;
+	rdma_ack_cm_event(cm_event);
+	ret = setup_resources(cm_id, max_depth, 1);
+	if (ret)
+		return ret;
+	ret = post_recv(attr_mr, &buffer_attr, sizeof(buffer_attr));
+	if (ret)
+	{
+		rdma_error("Failed to post the receive for the buffer attributes, ret = %d \n", ret);
+		return ret;
+	}
+	bzero(&conn_param, sizeof(conn_param));
+	rdma_sizing_conn_param(&sizing, &conn_param, NULL);
+	conn_param.retry_count = 7;
+	/* Sends outrun the server reposting its receives, retry forever */
+	conn_param.rnr_retry_count = 7;
+	ret = rdma_connect(cm_id, &conn_param);
+	if (ret)
+	{
+		rdma_error("Failed to connect to remote host , errno: %d\n", -errno);
+		return -errno;
+	}
+	ret = process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_ESTABLISHED,
+	                            &cm_event);
+	if (ret)
+		return ret;
+	rdma_ack_cm_event(cm_event);
+	ret = rdma_wait_work_completions(&poller, &wc, 1);
+	if (ret != 1)
+		return ret < 0 ? ret : -EIO;
+	fprintf(stderr, "Connected, server buffer of %u bytes, send queue of %u WRs, inline %u bytes \n",
+	        buffer_attr.length, qp_init_attr.cap.max_send_wr,
+	        qp_init_attr.cap.max_inline_data);
+	return 0;
+}
+
+static void bench_retire(struct rdma_sendq *sq, uint64_t wr_id)
+{
+	struct bench_run *run = sq->context;
+	run->lat_ns[wr_id] = rdma_now_ns() - run->post_ns[wr_id];
+}
+
+/* Posts 'count' WRs through the send queue manager and waits for all of
+ * them. The last one is signaled, so nothing is left over for a drain WR. */
+static int bench_pass(struct rdma_sendq *sq, struct bench_run *run,
+                      uint64_t count)
+{
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	struct ibv_sge sge;
+	uint64_t i, start;
+	int ret;
+	start = rdma_now_ns();
+	for (i = 0; i < count; i++)
+	{
+		sge.addr = (uint64_t) buffer_mr->addr;
+		sge.length = run->size;
+		sge.lkey = buffer_mr->lkey;
+		bzero(&wr, sizeof(wr));
+		wr.wr_id = i;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr.opcode = bench_opcodes[run->op];
+		wr.send_flags = i == count - 1 ? IBV_SEND_SIGNALED : 0;
+		wr.imm_data = htonl((uint32_t) i);
+		wr.wr.rdma.remote_addr = buffer_attr.address;
+		wr.wr.rdma.rkey = buffer_attr.stag.remote_stag;
+		run->post_ns[i] = rdma_now_ns();
+		ret = rdma_sendq_post(sq, &wr, &bad_wr);
+		if (ret)
+		{
+			rdma_error("Failed to post WR %lu, ret = %d \n", (unsigned long) i, ret);
+			return ret;
+		}
+	}
+	ret = rdma_sendq_drain(sq);
+	if (ret)
+		return ret;
+	run->elapsed_ns = rdma_now_ns() - start;
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Value below which a fraction 'q' of the sorted samples lie, in us */
+static double percentile_us(uint64_t *sorted, uint64_t n, double q)
+{
+	uint64_t i = (uint64_t)(q * n);
+	if (i >= n)
+		i = n - 1;
+	return sorted[i] / 1000.0;
+}
+
+static void report(struct bench_run *run, int first)
+{
+	double ns = run->elapsed_ns ? run->elapsed_ns : 1;
+	double gbps = (double) run->size * run->iters * 8 / ns;
+	double mops = run->iters * 1000.0 / ns;
+	double p50, p99, p999;
+	qsort(run->lat_ns, run->iters, sizeof(*run->lat_ns), cmp_u64);
+	p50 = percentile_us(run->lat_ns, run->iters, 0.50);
+	p99 = percentile_us(run->lat_ns, run->iters, 0.99);
+	p999 = percentile_us(run->lat_ns, run->iters, 0.999);
+	if (json)
+	{
+		printf("%s  {\"op\": \"%s\", \"size\": %u, \"depth\": %u, \"signal\": %u, "
+		       "\"iters\": %lu, \"gbps\": %.3f, \"mops\": %.3f, "
+		       "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}",
+		       first ? "" : ",\n", bench_op_names[run->op], run->size,
+		       run->depth, run->signal_every, (unsigned long) run->iters,
+		       gbps, mops, p50, p99, p999);
+	}
+	else
+	{
+		printf("%s,%u,%u,%u,%lu,%.3f,%.3f,%.2f,%.2f,%.2f\n",
+		       bench_op_names[run->op], run->size, run->depth,
+		       run->signal_every, (unsigned long) run->iters,
+		       gbps, mops, p50, p99, p999);
+	}
+	fflush(stdout);
+}
+
+/* Tells whether a value clamped to 'limit' was already clamped to it
+ * earlier in the list, so the combination would only run twice */
+static int clamped_before(uint32_t *vals, uint32_t i, uint32_t limit)
+{
+	uint32_t k;
+	if (vals[i] <= limit)
+		return 0;
+	for (k = 0; k < i; k++)
+	{
+		if (vals[k] >= limit)
+			return 1;
+	}
+	return 0;
+}
+
+/* Runs every combination, one after the other, on the one connection */
+static int bench_sweep()
+{
+	struct rdma_sendq sq;
+	struct bench_run run;
+	uint32_t o, s, d, g;
+	int ret = 0, first = 1;
+	bzero(&run, sizeof(run));
+	run.iters = iters;
+	run.post_ns = calloc(iters, sizeof(uint64_t));
+	run.lat_ns = calloc(iters, sizeof(uint64_t));
+	if (!run.post_ns || !run.lat_ns)
+	{
+		rdma_error("Failed to allocate %lu samples, -ENOMEM\n", (unsigned long) iters);
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (json)
+		printf("[\n");
+	else
+		printf("op,size,depth,signal,iters,gbps,mops,p50_us,p99_us,p999_us\n");
+	for (o = 0; o < nr_ops; o++)
+		for (s = 0; s < nr_sizes; s++)
+			for (d = 0; d < nr_depths; d++)
+				for (g = 0; g < nr_signals; g++)
+				{
+					run.op = ops[o];
+					run.size = sizes[s];
+					/* no deeper than the QP we got */
+					run.depth = depths[d] < qp_init_attr.cap.max_send_wr ?
+					            depths[d] : qp_init_attr.cap.max_send_wr;
+					run.signal_every = signals[g] < run.depth ? signals[g] : run.depth;
+					if (clamped_before(depths, d, run.depth) ||
+					        clamped_before(signals, g, run.depth))
+						continue;
+					ret = rdma_sendq_init(&sq, cm_id->qp, cq, run.depth,
+					                      run.signal_every);
+					if (ret)
+						goto out;
+					sq.retire = bench_retire;
+					sq.context = &run;
+					ret = bench_pass(&sq, &run, iters < BENCH_WARMUP ? iters : BENCH_WARMUP);
+					if (!ret)
+						ret = bench_pass(&sq, &run, iters);
+					rdma_sendq_destroy(&sq);
+					if (ret)
+						goto out;
+					report(&run, first);
+					first = 0;
+				}
+	if (json)
+		printf("\n]\n");
+out:
+	free(run.post_ns);
+	free(run.lat_ns);
+	return ret;
+}
+
+static int bench_client(struct sockaddr_in *addr)
+{
+	struct rdma_cm_event *cm_event = NULL;
+	uint32_t i, max_depth = 1;
+	int ret;
+	for (i = 0; i < nr_depths; i++)
+	{
+		if (depths[i] > max_depth)
+			max_depth = depths[i];
+	}
+	ret = bench_connect(addr, max_depth);
+	if (!ret)
+	{
+		for (i = 0; i < nr_sizes; i++)
+		{
+			if (sizes[i] > buffer_attr.length)
+			{
+				rdma_error("Messages of %u bytes do not fit the server buffer\n",
+				           sizes[i]);
+				ret = -EINVAL;
+			}
+		}
+	}
+	if (!ret)
+		ret = bench_sweep();
+	if (cm_id && !rdma_disconnect(cm_id))
+	{
+		if (!process_rdma_cm_event(cm_event_channel, RDMA_CM_EVENT_DISCONNECTED,
+		                           &cm_event))
+			rdma_ack_cm_event(cm_event);
+	}
+	cleanup_resources();
+	rdma_destroy_event_channel(cm_event_channel);
+	return ret;
+}
+
+void usage()
+{
+	printf("Usage:\n");
+	printf("rdma_bench: -l [-a <server_addr>] [-p <server_port>]\n");
+	printf("rdma_bench: -a <server_addr> [-p <server_port>] [-o <ops>] [-m <sizes>] [-d <depths>] [-s <signal intervals>] [-n <iterations>] [-j]\n");
+	printf("(default port is %d)\n", DEFAULT_RDMA_PORT);
+	printf("-l: be the server, which only keeps receives posted\n");
+	printf("-o: comma separated operations out of write,read,send,write_imm (default all)\n");
+	printf("-m, -d, -s: comma separated message sizes (at most %d bytes), queue depths and signaling intervals to sweep\n",
+	       BENCH_MAX_MSG);
+	printf("-n: WRs per combination (default %d), -j: print JSON instead of CSV\n",
+	       DEFAULT_BENCH_ITERS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in server_sockaddr;
+	int ret, option, server = 0, have_addr = 0;
+	uint32_t i;
+	bzero(&server_sockaddr, sizeof server_sockaddr);
+	server_sockaddr.sin_family = AF_INET;
+	server_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
+	nr_ops = parse_ops("write,read,send,write_imm", ops);
+	nr_sizes = parse_list("8,64,512,4096,65536", sizes);
+	nr_depths = parse_list("1,16,128", depths);
+	nr_signals = parse_list("1,16", signals);
+	while ((option = getopt(argc, argv, "la:p:o:m:d:s:n:j")) != -1)
+	{
+		switch (option)
+		{
+		case 'l':
+			server = 1;
+			break;
+		case 'a':
+			ret = get_addr(optarg, (struct sockaddr*) &server_sockaddr);
+			if (ret)
+			{
+				rdma_error("Invalid IP \n");
+				return ret;
+			}
+			have_addr = 1;
+			break;
+		case 'p':
+			server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+			break;
+		case 'o':
+			ret = parse_ops(optarg, ops);
+			if (ret < 0)
+				usage();
+			nr_ops = ret;
+			break;
+		case 'm':
+			ret = parse_list(optarg, sizes);
+			if (ret < 0)
+				usage();
+			nr_sizes = ret;
+			break;
+		case 'd':
+			ret = parse_list(optarg, depths);
+			if (ret < 0)
+				usage();
+			nr_depths = ret;
+			break;
+		case 's':
+			ret = parse_list(optarg, signals);
+			if (ret < 0)
+				usage();
+			nr_signals = ret;
+			break;
+		case 'n':
+			iters = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	if (iters == 0 || (!server && !have_addr))
+		usage();
+	for (i = 0; i < nr_sizes; i++)
+	{
+		if (sizes[i] > BENCH_MAX_MSG)
+			usage();
+	}
+	for (i = 0; i < nr_depths; i++)
+	{
+		if (depths[i] == 0)
+			usage();
+	}
+	if (server)
+		ret = bench_server(&server_sockaddr);
+	else
+		ret = bench_client(&server_sockaddr);
+	if (ret)
+		rdma_error("Benchmark failed, ret = %d \n", ret);
+	return ret;
+}
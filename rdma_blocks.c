@@ -0,0 +1,113 @@
+/*
+ * Implementation of multi-buffered block shipping.
+ */
+
+#include "rdma_blocks.h"
+
+int rdma_blocks_init(struct rdma_blocks *blocks, struct rdma_ring_producer *prod,
+                     struct ibv_mr **mrs, uint32_t nr_blocks,
+                     uint32_t chunk_size, uint32_t depth)
+{
+	uint32_t i;
+	if (!blocks || !prod || !mrs || nr_blocks == 0 ||
+	        nr_blocks > RDMA_BLOCKS_MAX || chunk_size == 0)
+	{
+		rdma_error("Passed block set resources are NULL or invalid\n");
+		return -EINVAL;
+	}
+	bzero(blocks, sizeof(*blocks));
+	blocks->prod = prod;
+	blocks->nr_blocks = nr_blocks;
+	blocks->chunk_size = chunk_size;
+	blocks->depth = depth;
+	for (i = 0; i < nr_blocks; i++)
+	{
+		if (!mrs[i])
+		{
+			rdma_error("Block %u is not registered\n", i);
+			return -EINVAL;
+		}
+		blocks->mr[i] = mrs[i];
+	}
+	debug("Shipping through %u blocks \n", nr_blocks);
+	return 0;
+}
+
+int rdma_blocks_progress(struct rdma_blocks *blocks)
+{
+	uint32_t i, busy = 0;
+	int ret;
+	/* Oldest first, so the chunks go into the ring in the order the
+	 * blocks were handed in */
+	for (i = 0; i < blocks->nr_blocks; i++)
+	{
+		uint32_t b = (blocks->fill + i) % blocks->nr_blocks;
+		if (!blocks->busy[b])
+			continue;
+		ret = rdma_bulk_progress(&blocks->bulk[b]);
+		if (ret < 0)
+			return ret;
+		if (ret == 1)
+		{
+			/* the NIC read all of it, the block is the producer's */
+			blocks->busy[b] = 0;
+			blocks->shipped++;
+		}
+		else
+		{
+			busy++;
+		}
+	}
+	return busy;
+}
+
+void *rdma_blocks_get(struct rdma_blocks *blocks)
+{
+	if (blocks->busy[blocks->fill])
+	{
+		/* counted once per block we have to wait for */
+		if (!blocks->waiting)
+			blocks->waits++;
+		blocks->waiting = 1;
+		return NULL;
+	}
+	blocks->waiting = 0;
+	return blocks->mr[blocks->fill]->addr;
+}
+
+int rdma_blocks_put(struct rdma_blocks *blocks, uint64_t length)
+{
+	uint32_t b = blocks->fill;
+	int ret;
+	if (blocks->busy[b])
+		return -EBUSY;
+	ret = rdma_bulk_start(&blocks->bulk[b], blocks->prod, blocks->mr[b],
+	                      blocks->mr[b]->addr, length, blocks->chunk_size,
+	                      blocks->depth, blocks->next_id);
+	if (ret)
+		return ret;
+	blocks->busy[b] = 1;
+	blocks->next_id++;
+	blocks->fill = (b + 1) % blocks->nr_blocks;
+	/* get the first chunks on the wire before the producer goes on */
+	ret = rdma_blocks_progress(blocks);
+	return ret < 0 ? ret : 0;
+}
+
+int rdma_blocks_drain(struct rdma_blocks *blocks)
+{
+	int ret;
+	while ((ret = rdma_blocks_progress(blocks)) > 0)
+		cpu_relax();
+	return ret;
+}
+
+int rdma_blocks_retire(struct rdma_blocks *blocks, uint64_t wr_id)
+{
+	uintptr_t first = (uintptr_t) &blocks->bulk[0];
+	if (wr_id < first || wr_id >= (uintptr_t) &blocks->bulk[blocks->nr_blocks] ||
+	        (wr_id - first) % sizeof(blocks->bulk[0]) != 0)
+		return 0;
+	rdma_bulk_retire((struct rdma_bulk*)(uintptr_t) wr_id);
+	return 1;
+}
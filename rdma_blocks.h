@@ -0,0 +1,83 @@
+/*
+ * Header file for multi-buffered block shipping.
+ *
+ * With a single block, the producer fills it, ships it, and has to wait
+ * until the NIC has read all of it before it can fill it again; the two
+ * never overlap. The block set rotates over N registered blocks instead:
+ * while block k is on the wire as a bulk transfer (see rdma_bulk.h), the
+ * producer already fills block k + 1. A block is owned either by the
+ * producer or by the NIC. It goes to the NIC when it is handed in, and comes
+ * back when the completion of its last chunk is retired, so ownership
+ * changes hands without any extra message.
+ *
+ * This is sender-only recycling: the consumer never owns a block and sends
+ * no release for one. A block comes back on the local completion alone,
+ * which is safe because by then its bytes have been copied into the
+ * consumer's log ring, and the consumer works on them there. The
+ * consumer's release is the head write of the ring, which hands ring space
+ * back; while the consumer is behind, chunks wait for ring space
+ * (rdma_bulk_progress()) and the blocks stay with the NIC.
+ */
+
+#ifndef RDMA_BLOCKS_H
+#define RDMA_BLOCKS_H
+
+#include "rdma_bulk.h"
+
+/* Most blocks in a set */
+#define RDMA_BLOCKS_MAX (16)
+
+struct rdma_blocks
+{
+	struct rdma_ring_producer *prod;
+	uint32_t nr_blocks;
+	struct ibv_mr *mr[RDMA_BLOCKS_MAX];
+	uint32_t chunk_size, depth;
+	/* the transfer of every block the NIC owns */
+	struct rdma_bulk bulk[RDMA_BLOCKS_MAX];
+	int busy[RDMA_BLOCKS_MAX];
+	/* the block the producer fills next; blocks are used round robin */
+	uint32_t fill;
+	uint32_t next_id;
+	int waiting;
+	/* totals, for whoever is curious */
+	uint64_t shipped, waits;
+};
+
+/*
+ * Sets up a block set over registered blocks, all owned by the producer.
+ * @blocks: block set to initialize
+ * @prod: ring the chunks are appended to
+ * @mrs: the blocks, each its own memory region
+ * @nr_blocks: number of blocks, at most RDMA_BLOCKS_MAX
+ * @chunk_size, @depth: chunking of every transfer, see rdma_bulk_start()
+ */
+int rdma_blocks_init(struct rdma_blocks *blocks, struct rdma_ring_producer *prod,
+                     struct ibv_mr **mrs, uint32_t nr_blocks,
+                     uint32_t chunk_size, uint32_t depth);
+
+/*
+ * Returns the block the producer fills next, or NULL while the NIC still
+ * reads from it; rdma_blocks_progress() brings it back. The block stays the
+ * producer's until rdma_blocks_put().
+ */
+void *rdma_blocks_get(struct rdma_blocks *blocks);
+
+/* Hands the block returned by rdma_blocks_get() to the NIC, which ships its
+ * first 'length' bytes */
+int rdma_blocks_put(struct rdma_blocks *blocks, uint64_t length);
+
+/* Moves the transfers on, without blocking. Returns the number of blocks
+ * the NIC still owns, or a negative error. */
+int rdma_blocks_progress(struct rdma_blocks *blocks);
+
+/* Waits until the producer owns every block again */
+int rdma_blocks_drain(struct rdma_blocks *blocks);
+
+/*
+ * For the retire callback of the send queue: if 'wr_id' is a chunk of one of
+ * the transfers, retires it and returns 1, otherwise returns 0.
+ */
+int rdma_blocks_retire(struct rdma_blocks *blocks, uint64_t wr_id);
+
+#endif /* RDMA_BLOCKS_H */
@@ -0,0 +1,109 @@
+/*
+ * Implementation of pipelined bulk transfers over the log ring.
+ */
+
+#include "rdma_bulk.h"
+
+int rdma_bulk_start(struct rdma_bulk *bulk, struct rdma_ring_producer *prod,
+                    struct ibv_mr *mr, void *addr, uint64_t length,
+                    uint32_t chunk_size, uint32_t depth, uint32_t id)
+{
+	uint64_t nr_chunks;
+	if (!bulk || !prod || !mr || !addr || chunk_size == 0)
+	{
+		rdma_error("Passed bulk transfer resources are NULL or empty\n");
+		return -EINVAL;
+	}
+	if ((char*) addr < (char*) mr->addr ||
+	        (char*) addr + length > (char*) mr->addr + mr->length)
+	{
+		rdma_error("Bulk transfer of %lu bytes is not inside its memory region\n",
+		           (unsigned long) length);
+		return -EINVAL;
+	}
+	/* A chunk is a single record, which never wraps around the ring */
+	if (rdma_ring_record_size(sizeof(struct rdma_bulk_hdr) + chunk_size) > prod->size)
+	{
+		rdma_error("Chunks of %u bytes do not fit into the ring of %lu bytes\n",
+		           chunk_size, (unsigned long) prod->size);
+		return -EINVAL;
+	}
+	nr_chunks = (length + chunk_size - 1) / chunk_size;
+	if (nr_chunks > UINT32_MAX)
+		return -EINVAL;
+	bzero(bulk, sizeof(*bulk));
+	bulk->prod = prod;
+	bulk->mr = mr;
+	bulk->addr = addr;
+	bulk->length = length;
+	bulk->chunk_size = chunk_size;
+	bulk->depth = depth ? depth : RDMA_BULK_DEPTH;
+	bulk->id = id;
+	bulk->nr_chunks = nr_chunks;
+	debug("Bulk transfer %u: %lu bytes in %u chunks, %u in flight \n", id,
+	      (unsigned long) length, bulk->nr_chunks, bulk->depth);
+	return 0;
+}
+
+void rdma_bulk_retire(struct rdma_bulk *bulk)
+{
+	uint32_t chunk = bulk->done++;
+	if (bulk->on_chunk)
+		bulk->on_chunk(bulk, chunk);
+}
+
+int rdma_bulk_progress(struct rdma_bulk *bulk)
+{
+	struct rdma_bulk_hdr *hdr = NULL;
+	struct ibv_sge frag;
+	uint64_t off;
+	uint32_t len;
+	int ret;
+	while (bulk->posted < bulk->nr_chunks &&
+	        bulk->posted - bulk->done < bulk->depth)
+	{
+		off = (uint64_t) bulk->posted * bulk->chunk_size;
+		len = bulk->length - off < bulk->chunk_size ?
+		      bulk->length - off : bulk->chunk_size;
+		ret = rdma_ring_reserve(bulk->prod, sizeof(*hdr) + len, (void**) &hdr);
+		/* no room in the ring, the receiver has to catch up first */
+		if (ret == -EAGAIN)
+			break;
+		if (ret)
+			return ret;
+		hdr->magic = RDMA_BULK_MAGIC;
+		hdr->id = bulk->id;
+		hdr->chunk = bulk->posted;
+		hdr->nr_chunks = bulk->nr_chunks;
+		hdr->offset = off;
+		hdr->total = bulk->length;
+		frag.addr = (uint64_t) (bulk->addr + off);
+		frag.length = len;
+		frag.lkey = bulk->mr->lkey;
+		/* Every chunk is signaled: its completion is what lets the
+		 * sender refill it, so it must not wait for the signal_every-th
+		 * WR */
+		ret = rdma_ring_commit_frags(bulk->prod, sizeof(*hdr), &frag, 1,
+		                             IBV_SEND_SIGNALED, (uintptr_t) bulk);
+		if (ret)
+			return ret;
+		bulk->posted++;
+		/* a pulled chunk was copied, there is no write to wait for */
+		if (bulk->prod->pull)
+			rdma_bulk_retire(bulk);
+	}
+	if (bulk->done == bulk->nr_chunks)
+		return 1;
+	ret = rdma_sendq_reap(bulk->prod->sq);
+	if (ret < 0)
+		return ret;
+	return bulk->done == bulk->nr_chunks;
+}
+
+int rdma_bulk_wait(struct rdma_bulk *bulk)
+{
+	int ret;
+	while ((ret = rdma_bulk_progress(bulk)) == 0)
+		cpu_relax();
+	return ret < 0 ? ret : 0;
+}
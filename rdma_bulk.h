@@ -0,0 +1,106 @@
+/*
+ * Header file for pipelined bulk transfers over the log ring.
+ *
+ * A large buffer written with one RDMA write serializes both sides: the
+ * sender may not touch the buffer until the write completed, and the
+ * receiver can not start on it until the last byte landed. A bulk transfer
+ * cuts the buffer into chunks and appends every chunk to the ring as a
+ * record of its own, with up to 'depth' chunks in flight. The record payload
+ * is a small chunk header, built in the staging buffer, followed by the chunk
+ * itself, which the NIC gathers straight from the caller's registered buffer.
+ *
+ * Every chunk completes on its own at both ends: the receiver sees chunk i
+ * as soon as its record footer landed and can process it while chunk i + 1
+ * is still on the wire, and the sender learns through the send queue's
+ * retire callback when the NIC is done reading chunk i, so that part of the
+ * buffer may be refilled.
+ */
+
+#ifndef RDMA_BULK_H
+#define RDMA_BULK_H
+
+#include "rdma_ring.h"
+
+/* First word of every chunk record, no message starts with it */
+#define RDMA_BULK_MAGIC (0xb01cb01cu)
+/* Default chunks in flight */
+#define RDMA_BULK_DEPTH (4)
+
+/* Header in front of the data of a chunk record */
+struct rdma_bulk_hdr
+{
+	uint32_t magic;
+	/* which transfer, as the sender numbers them */
+	uint32_t id;
+	uint32_t chunk;
+	uint32_t nr_chunks;
+	/* where the chunk data starts in the transfer, and the transfer size */
+	uint64_t offset;
+	uint64_t total;
+};
+
+struct rdma_bulk;
+
+/* Called once per chunk, in order, when the sender may reuse its bytes */
+typedef void (*rdma_bulk_chunk_fn)(struct rdma_bulk *bulk, uint32_t chunk);
+
+/* Sender side of a bulk transfer */
+struct rdma_bulk
+{
+	struct rdma_ring_producer *prod;
+	/* what is sent, inside a registered memory region */
+	struct ibv_mr *mr;
+	char *addr;
+	uint64_t length;
+	uint32_t chunk_size;
+	uint32_t depth;
+	uint32_t id;
+	uint32_t nr_chunks;
+	/* chunks appended to the ring, and chunks the NIC is done with */
+	uint32_t posted, done;
+	rdma_bulk_chunk_fn on_chunk;
+	void *context;
+};
+
+/*
+ * Prepares the transfer of 'length' bytes at 'addr'. Nothing is posted yet,
+ * see rdma_bulk_progress().
+ * @bulk: transfer to initialize
+ * @prod: ring the chunks are appended to
+ * @mr: registered memory region that holds the bytes
+ * @chunk_size: bytes per chunk; a chunk record has to fit into the ring
+ * @depth: most chunks in flight, 0 for RDMA_BULK_DEPTH
+ * @id: tells the receiver which transfer a chunk belongs to
+ */
+int rdma_bulk_start(struct rdma_bulk *bulk, struct rdma_ring_producer *prod,
+                    struct ibv_mr *mr, void *addr, uint64_t length,
+                    uint32_t chunk_size, uint32_t depth, uint32_t id);
+
+/*
+ * Appends as many chunks as the depth and the ring allow, and reaps the send
+ * queue. Never blocks. Returns 1 once every chunk is done, 0 while the
+ * transfer goes on, or a negative error.
+ */
+int rdma_bulk_progress(struct rdma_bulk *bulk);
+
+/* Calls rdma_bulk_progress() until the transfer is done */
+int rdma_bulk_wait(struct rdma_bulk *bulk);
+
+/*
+ * Marks the oldest chunk in flight done. The retire callback of the send
+ * queue has to call this for every WR whose wr_id is the transfer,
+ * (uintptr_t) bulk.
+ */
+void rdma_bulk_retire(struct rdma_bulk *bulk);
+
+/* Receiver side: returns the chunk header if a record payload is a chunk,
+ * NULL if it is anything else. The chunk data follows the header. */
+static inline struct rdma_bulk_hdr *rdma_bulk_parse(void *payload, uint32_t length)
+{
+	struct rdma_bulk_hdr *hdr = payload;
+	if (length < sizeof(*hdr) || hdr->magic != RDMA_BULK_MAGIC)
+		return NULL;
+	return hdr;
+}
+
+#endif /* RDMA_BULK_H */
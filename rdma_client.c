@@ -7,6 +7,16 @@
  */
 
 #include "rdma_common.h"
+#include "rdma_ring.h"
+#include "rdma_sendq.h"
+#include "rdma_pool.h"
+#include "rdma_mrcache.h"
+#include "rdma_slots.h"
+#include "rdma_sizing.h"
+#include "rdma_blocks.h"
+#include "rdma_trace.h"
+#include "rdma_stats.h"
+#include "rdma_stripe.h"
 
 #include <sys/time.h>
 #include <time.h>
@@ -14,7 +24,21 @@
 
 #define BLOCK_SZ 25000000
 #define BLOCK_NUM 4
+/* The first block holds the staging copy of the ring, the others are
+ * shipped in turns with -B */
 char* block_mem[BLOCK_NUM];
+/* The blocks are carved out of huge page arenas that are registered once */
+static struct ibv_mr *block_mr[BLOCK_NUM];
+static struct rdma_pool pool;
+/* The rows of doubles that -g gathers from, one per message slot. They are
+ * the application's own memory, registered for every message through the
+ * cache, which keeps the registration from one message to the next. Each
+ * slot holds on to its cache entry until it is sent. */
+#define ROWS_PINNED (16 * 1024 * 1024)
+static double *rows;
+static uint32_t nr_rows;
+static struct rdma_mrcache mrcache;
+static struct rdma_mrcache_entry **row_entries;
 
 /* These are basic RDMA resources */
 /* These are RDMA connection related resources */
@@ -23,19 +47,92 @@ static struct rdma_cm_id *cm_client_id = NULL;
 static struct ibv_pd *pd = NULL;
 static struct ibv_comp_channel *io_completion_channel = NULL;
 static struct ibv_cq *client_cq = NULL;
+/* How we wait for completions on client_cq, set from the command line */
+static struct rdma_comp_poller client_poller;
+static enum rdma_comp_mode comp_mode = RDMA_COMP_EVENT;
+static unsigned int comp_spin_us = DEFAULT_COMP_SPIN_US;
+/* Write every imm_every-th record with immediate data, 0 = never */
+static unsigned int imm_every = 0;
+/* Post up to batch_wrs WRs with one doorbell, waiting at most
+ * batch_window_us for the batch to fill, 0/1 = post every WR right away */
+#define DEFAULT_BATCH_WINDOW_US 20
+static unsigned int batch_wrs = 0, batch_window_us = DEFAULT_BATCH_WINDOW_US;
 static struct ibv_qp_init_attr qp_init_attr;
+/* Limits of the device the route goes through */
+static struct rdma_sizing sizing;
 static struct ibv_qp *client_qp;
 /* These are memory buffers related resources */
 static struct ibv_mr *client_metadata_mr = NULL,
 	                      *client_src_mr = NULL,
 	                       *client_dst_mr = NULL,
 	                        *server_metadata_mr = NULL;
-static struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
+static struct rdma_client_metadata client_metadata_attr;
+static struct rdma_server_metadata server_metadata_attr;
 static struct ibv_send_wr client_send_wr, *bad_client_send_wr = NULL;
 static struct ibv_recv_wr server_recv_wr, *bad_server_recv_wr = NULL;
 static struct ibv_sge client_send_sge, server_recv_sge;
 /* Source and Destination buffers, where RDMA operations source and sink */
 static char *src = NULL, *dst = NULL;
+/* The log ring in the server buffer that we append our messages to */
+static struct rdma_ring_producer ring;
+/* Selective signaling and completion reaping for the send queue */
+static struct rdma_sendq client_sendq;
+/* Messages are built in pre-registered slots, which the send queue gives
+ * back once the record is written */
+#define MAX_ELE_NUM 10
+#define MSG_MAX_LEN (sizeof(int) + MAX_ELE_NUM * sizeof(double))
+static struct rdma_slots msg_slots;
+/* With -g the doubles are gathered by the NIC from our own array instead of
+ * being built in the slot */
+static int gather = 0;
+/* With -P we only stage the records, and the server reads them */
+static int pull = 0;
+/* With -B, bulk_blocks blocks worth of data are shipped before the
+ * messages, in chunks of bulk_chunk bytes with bulk_depth of them in flight.
+ * The blocks after the first take turns: one is filled while the others are
+ * on the wire. */
+#define DEFAULT_BULK_BLOCKS 8
+static uint32_t bulk_chunk = 0, bulk_depth = RDMA_BULK_DEPTH;
+static uint32_t bulk_blocks = DEFAULT_BULK_BLOCKS;
+static struct rdma_blocks blocks;
+/* With -H we record latency histograms, printed on SIGUSR1 and at the end */
+static int hist = 0;
+/* With -T we trace into this file */
+static char *trace_path = NULL;
+/* With -Q we ask for stripe_qps QPs in all, and stripe writes and reads of
+ * the window the server gives us over the ones we get, STRIPE_ROUNDS times
+ * each way */
+#define STRIPE_ROUNDS 64
+static uint32_t stripe_qps = 1;
+static struct rdma_stripe stripe;
+/* With -M the lanes go over these rails, in turn; without, they go where
+ * the connection does */
+static struct rdma_rail rails[RDMA_STRIPE_MAX_QPS - 1];
+static int nr_rails = 0;
+
+/* Lets go of the registration of the row of a slot. The slot pool calls it
+ * for every slot that comes back, also for the inline and pulled records
+ * that the ring recycles when it posts them, without a retire. */
+static void put_row(struct rdma_slots *slots, void *slot)
+{
+	uint32_t i;
+	if (!row_entries)
+		return;
+	i = rdma_slots_index(slots, slot);
+	if (row_entries[i])
+		rdma_mrcache_put(&mrcache, row_entries[i]);
+	row_entries[i] = NULL;
+}
+
+/* Send queue retire callback: counts units of striped transfers, hands
+ * chunks back to the blocks and slots back to the slot pool, which hands
+ * the registrations of their rows back to the cache */
+static void client_retire(struct rdma_sendq *sq, uint64_t wr_id)
+{
+	if (rdma_stripe_retire(&stripe, wr_id) || rdma_blocks_retire(&blocks, wr_id))
+		return;
+	rdma_slots_retire(sq, wr_id);
+}
 
 /* This is our testing function */
 static int check_src_dst()
@@ -53,7 +150,9 @@ static int check_src_dst()
 static int client_prepare_connection(struct sockaddr_in *s_addr)
 {
 	struct rdma_cm_event *cm_event = NULL;
-	int ret = -1;
+	const uint64_t copies[2] = { 1, 1 };
+	uint32_t depth[2];
+	int ret = -1, i;
 	/*  Open a channel used to report asynchronous communication event */
 	cm_event_channel = rdma_create_event_channel();
 	if (!cm_event_channel)
@@ -138,6 +237,25 @@ static int client_prepare_connection(struct sockaddr_in *s_addr)
 		return -errno;
 	}
 	debug("pd allocated at %p \n", pd);
+	ret = rdma_sizing_query(&sizing, cm_client_id->verbs, cm_client_id->port_num);
+	if (ret)
+		return ret;
+	ret = rdma_pool_init(&pool, pd, (IBV_ACCESS_LOCAL_WRITE |
+	                                 IBV_ACCESS_REMOTE_READ |
+	                                 IBV_ACCESS_REMOTE_WRITE), 0);
+	if (ret)
+		return ret;
+	for (i = 0; i < BLOCK_NUM; i++)
+	{
+		block_mr[i] = rdma_pool_alloc(&pool, BLOCK_SZ);
+		if (!block_mr[i])
+		{
+			rdma_error("Failed to allocate block %d\n", i);
+			return -ENOMEM;
+		}
+		block_mem[i] = block_mr[i]->addr;
+	}
+	src = block_mem[0];
 	/* Now we need a completion channel, were the I/O completion
 	 * notifications are sent. Remember, this is different from connection
 	 * management (CM) event notifications.
@@ -157,9 +275,20 @@ static int client_prepare_connection(struct sockaddr_in *s_addr)
 	 * called struct ibv_wc (wc = work completion). ibv_wc has detailed
 	 * information about the work completion. An I/O request in RDMA world
 	 * is called "work" ;)
+	 * A record is written with two WRs, so the send queue needs two WRs per
+	 * record that is in flight while the link is busy. The CQ has room for
+	 * all of them and the one receive.
 	 */
+	bzero(&qp_init_attr, sizeof qp_init_attr);
+	depth[0] = rdma_sizing_depth(&sizing, rdma_ring_record_size(MSG_MAX_LEN) / 2);
+	depth[1] = 1;
+	/* a device with small CQs gets a shallower send queue */
+	ret = rdma_sizing_fit_cq(&sizing, depth, copies, 2);
+	if (ret < 0)
+		return ret;
+	qp_init_attr.cap.max_send_wr = depth[0];
 	client_cq = ibv_create_cq(cm_client_id->verbs /* which device*/,
-	                          20000 /* maximum capacity*/,
+	                          depth[0] + depth[1] /* maximum capacity*/,
 	                          NULL /* user context, not used here */,
 	                          io_completion_channel /* which IO completion channel */,
 	                          0 /* signaling vector, not used here*/);
@@ -169,28 +298,31 @@ static int client_prepare_connection(struct sockaddr_in *s_addr)
 		return -errno;
 	}
 	debug("CQ created at %p with %d elements \n", client_cq, client_cq->cqe);
-	ret = ibv_req_notify_cq(client_cq, 0);
+	/* The poller arms the CQ itself whenever it is about to sleep */
+	ret = rdma_comp_poller_init(&client_poller, client_cq,
+	                            io_completion_channel, comp_mode, comp_spin_us);
 	if (ret)
 	{
-		rdma_error("Failed to request notifications, errno: %d\n", -errno);
-		return -errno;
+		rdma_error("Failed to set up the completion poller, ret = %d\n", ret);
+		return ret;
 	}
-	/* Now the last step, set up the queue pair (send, recv) queues and their capacity.
-	  * The capacity here is define statically but this can be probed from the
-	* device. We just use a small number as defined in rdma_common.h */
-	bzero(&qp_init_attr, sizeof qp_init_attr);
+	/* Now the last step, set up the queue pair (send, recv) queues and their
+	 * capacity, as far as the device allows. */
 	qp_init_attr.cap.max_recv_sge = MAX_SGE; /* Maximum SGE per receive posting */
 	qp_init_attr.cap.max_recv_wr = 1; /* Maximum receive posting capacity */
-	qp_init_attr.cap.max_send_sge = MAX_SGE; /* Maximum SGE per send posting */
-	qp_init_attr.cap.max_send_wr = 15000; /* Maximum send posting capacity */
+	/* A record is a header plus payload fragments, take as many SGEs as
+	 * the device and the ring allow */
+	qp_init_attr.cap.max_send_sge = sizing.max_sge; /* Maximum SGE per send posting */
+	if (qp_init_attr.cap.max_send_sge > RDMA_RING_MAX_FRAGS + 1)
+		qp_init_attr.cap.max_send_sge = RDMA_RING_MAX_FRAGS + 1;
 	qp_init_attr.qp_type = IBV_QPT_RC; /* QP type, RC = Reliable connection */
 	/* We use same completion queue, but one can use different queues */
 	qp_init_attr.recv_cq = client_cq; /* Where should I notify for receive completion operations */
 	qp_init_attr.send_cq = client_cq; /* Where should I notify for send completion operations */
 	/*Lets create a QP */
-	ret = rdma_create_qp(cm_client_id /* which connection id */,
-	                     pd /* which protection domain*/,
-	                     &qp_init_attr /* Initial attributes */);
+	ret = rdma_create_qp_inline(cm_client_id /* which connection id */,
+	                            pd /* which protection domain*/,
+	                            &qp_init_attr /* Initial attributes */);
 	if (ret)
 	{
 		rdma_error("Failed to create QP, errno: %d \n", -errno);
@@ -198,6 +330,53 @@ static int client_prepare_connection(struct sockaddr_in *s_addr)
 	}
 	client_qp = cm_client_id->qp;
 	debug("QP created at %p \n", client_qp);
+	/* We signal every RDMA_SENDQ_SIGNAL_EVERY writes and reap completions
+	 * from client_cq when the send queue fills up */
+	ret = rdma_sendq_init(&client_sendq, client_qp, client_cq,
+	                      qp_init_attr.cap.max_send_wr,
+	                      RDMA_SENDQ_SIGNAL_EVERY);
+	if (ret)
+	{
+		rdma_error("Failed to set up the send queue, ret = %d \n", ret);
+		return ret;
+	}
+	/* What goes through the send queue and the CQ is counted live */
+	client_sendq.stats = rdma_stats_get("client");
+	client_poller.stats = client_sendq.stats;
+	rdma_stats_set(client_sendq.stats, RDMA_STATS_CQ_SIZE, client_cq->cqe);
+	/* A record takes at least two WRs, so no more than half the send queue
+	 * worth of slots can be in flight: one more and a free slot is always
+	 * only a reap away */
+	ret = rdma_slots_create(&msg_slots, pd, qp_init_attr.cap.max_send_wr / 2 + 1,
+	                        rdma_ring_record_size(MSG_MAX_LEN));
+	if (ret)
+	{
+		rdma_error("Failed to set up the message slots, ret = %d \n", ret);
+		return ret;
+	}
+	/* every slot has a row of doubles of its own */
+	ret = rdma_mrcache_init(&mrcache, ROWS_PINNED);
+	if (ret)
+		return ret;
+	rdma_buffer_use_cache(&mrcache);
+	nr_rows = msg_slots.nr_slots;
+	rows = calloc((uint64_t) nr_rows * MAX_ELE_NUM, sizeof(double));
+	row_entries = calloc(nr_rows, sizeof(*row_entries));
+	if (!rows || !row_entries)
+	{
+		rdma_error("Failed to allocate the rows of the message slots\n");
+		return -ENOMEM;
+	}
+	msg_slots.on_put = put_row;
+	client_sendq.retire = client_retire;
+	client_sendq.context = &msg_slots;
+	ret = rdma_sendq_set_batch(&client_sendq, batch_wrs,
+	                           (uint64_t) batch_window_us * 1000);
+	if (ret)
+	{
+		rdma_error("Failed to set up send batching, ret = %d \n", ret);
+		return ret;
+	}
 	return 0;
 }
 
@@ -241,9 +420,13 @@ static int client_connect_to_server()
 	struct rdma_cm_event *cm_event = NULL;
 	int ret = -1;
 	bzero(&conn_param, sizeof(conn_param));
-	conn_param.initiator_depth = 3;
-	conn_param.responder_resources = 3;
+	/* offer as many RDMA reads in flight as the device takes, the server
+	 * answers with what it can do */
+	rdma_sizing_conn_param(&sizing, &conn_param, NULL);
 	conn_param.retry_count = 3; // if fail, then how many times to retry
+	/* a write with immediate that finds no posted receive is retried until
+	 * the server re-posts one (7 = forever) */
+	conn_param.rnr_retry_count = imm_every ? 7 : 0;
 	ret = rdma_connect(cm_client_id, &conn_param);
 	if (ret)
 	{
@@ -270,28 +453,46 @@ static int client_connect_to_server()
 	return 0;
 }
 
-/* Send client side src buffer metadata to the server. This metadata on
- * the server side is unused. This is shown for the illustration purpose. */
+/* Send client side src buffer metadata to the server. The ring is staged in
+ * the src buffer, which the server reads from in pull mode. */
 static int client_send_metadata_to_server()
 {
 	struct ibv_wc wc[2];
 	int ret = -1;
-	//strlen-sizeof
-	client_src_mr = rdma_buffer_register(pd,
-	                                     src,
-	                                     BLOCK_SZ,
-	                                     (IBV_ACCESS_LOCAL_WRITE |
-	                                      IBV_ACCESS_REMOTE_READ |
-	                                      IBV_ACCESS_REMOTE_WRITE));
-	if (!client_src_mr)
-	{
-		rdma_error("Failed to register the first buffer, ret = %d \n", ret);
+	/* The first block is already registered with its arena */
+	client_src_mr = block_mr[0];
+	/* we prepare metadata for the first buffer */
+	client_metadata_attr.buffer.address = (uint64_t) client_src_mr->addr;
+	client_metadata_attr.buffer.length = client_src_mr->length;
+	client_metadata_attr.buffer.stag.local_stag = client_src_mr->rkey;
+	/* The server writes the head of the ring into our ring head, so we
+	 * advertise it together with our buffer */
+	ret = rdma_ring_producer_init(&ring, pd, &client_sendq, client_src_mr);
+	if (ret)
+	{
+		rdma_error("Failed to set up the ring producer, ret = %d \n", ret);
 		return ret;
 	}
-	/* we prepare metadata for the first buffer */
-	client_metadata_attr.address = (uint64_t) client_src_mr->addr;
-	client_metadata_attr.length = client_src_mr->length;
-	client_metadata_attr.stag.local_stag = client_src_mr->lkey;
+	client_metadata_attr.ring_head.address = (uint64_t) ring.head_mr->addr;
+	client_metadata_attr.ring_head.length = ring.head_mr->length;
+	client_metadata_attr.ring_head.stag.local_stag = ring.head_mr->rkey;
+	ring.imm_every = imm_every;
+	client_metadata_attr.flags = imm_every ? RDMA_META_WRITE_IMM : 0;
+	client_metadata_attr.lanes = stripe_qps - 1;
+	if (pull)
+	{
+		/* ... and the tail, which the server reads to find new records */
+		ret = rdma_ring_producer_enable_pull(&ring, pd);
+		if (ret)
+		{
+			rdma_error("Failed to set up pull mode, ret = %d \n", ret);
+			return ret;
+		}
+		client_metadata_attr.ring_tail.address = (uint64_t) ring.tail_mr->addr;
+		client_metadata_attr.ring_tail.length = ring.tail_mr->length;
+		client_metadata_attr.ring_tail.stag.local_stag = ring.tail_mr->rkey;
+		client_metadata_attr.flags = RDMA_META_PULL;
+	}
 	/* now we register the metadata memory */
 	client_metadata_mr = rdma_buffer_register(pd,
 	                     &client_metadata_attr,
@@ -325,14 +526,151 @@ static int client_send_metadata_to_server()
 	/* at this point we are expecting 2 work completion. One for our
 	 * send and one for recv that we will get from the server for
 	 * its buffer information */
-	ret = process_work_completion_events(io_completion_channel, wc, 2);
+	ret = rdma_wait_work_completions(&client_poller, wc, 2);
 	if (ret != 2)
 	{
 		rdma_error("We failed to get 2 work completions , ret = %d \n", ret);
 		return ret;
 	}
 	debug("Server sent us its buffer location and credentials, showing \n");
-	show_rdma_buffer_attr(&server_metadata_attr);
+	show_rdma_buffer_attr(&server_metadata_attr.buffer);
+	/* The server buffer is the log ring we append to */
+	return rdma_ring_producer_connect(&ring, &server_metadata_attr.buffer);
+}
+
+/* Opens the lanes the server granted us next to our connection */
+static int client_open_lanes(struct sockaddr_in *s_addr)
+{
+	struct rdma_rail rail;
+	uint32_t i;
+	int ret;
+	ret = rdma_stripe_init(&stripe, &client_sendq, 0, rdma_sizing_gbps(&sizing));
+	/* what we stripe from and into, before lanes on other devices need it */
+	if (!ret)
+		ret = rdma_stripe_register(&stripe, block_mr[1]);
+	if (!ret)
+		ret = rdma_stripe_register(&stripe, block_mr[2]);
+	if (ret)
+		return ret;
+	bzero(&rail, sizeof(rail));
+	rail.dst = *s_addr;
+	for (i = 0; i < server_metadata_attr.lanes; i++)
+	{
+		ret = rdma_stripe_add_lane(&stripe, cm_event_channel, pd,
+		                           nr_rails ? &rails[i % nr_rails] : &rail,
+		                           server_metadata_attr.token,
+		                           server_metadata_attr.window.stag.remote_stag);
+		if (ret)
+		{
+			rdma_error("Failed to open lane %u, ret = %d \n", i + 1, ret);
+			return ret;
+		}
+	}
+	if (stripe_qps > 1)
+		printf("Striping over %u QPs, the server granted %u lanes \n",
+		       stripe.nr_qps, server_metadata_attr.lanes);
+	return 0;
+}
+
+/* Writes a block into the window of the server and reads it back into
+ * another, striped over all our QPs */
+static int client_striped_transfer()
+{
+	struct rdma_buffer_attr *window = &server_metadata_attr.window;
+	uint64_t start, ns, len = window->length, total = STRIPE_ROUNDS * len;
+	uint64_t i;
+	int ret;
+	if (len > BLOCK_SZ)
+		len = BLOCK_SZ;
+	for (i = 0; i < len; i++)
+		block_mem[1][i] = (char) (i * 7);
+	start = rdma_now_ns();
+	for (i = 0; i < STRIPE_ROUNDS; i++)
+	{
+		ret = rdma_stripe_post(&stripe, IBV_WR_RDMA_WRITE, block_mr[1],
+		                       block_mem[1], len, window, 0, i);
+		if (ret)
+			return ret;
+	}
+	ret = rdma_stripe_wait(&stripe);
+	if (ret)
+		return ret;
+	ns = rdma_now_ns() - start;
+	printf("Wrote %lu bytes over %u QPs in %lu us, %.2f Gbit/s \n",
+	       (unsigned long) total, stripe.nr_qps, (unsigned long) (ns / 1000),
+	       ns ? (double) total * 8 / ns : 0.0);
+	start = rdma_now_ns();
+	for (i = 0; i < STRIPE_ROUNDS; i++)
+	{
+		ret = rdma_stripe_post(&stripe, IBV_WR_RDMA_READ, block_mr[2],
+		                       block_mem[2], len, window, 0, i);
+		if (ret)
+			return ret;
+	}
+	ret = rdma_stripe_wait(&stripe);
+	if (ret)
+		return ret;
+	ns = rdma_now_ns() - start;
+	printf("Read %lu bytes over %u QPs in %lu us, %.2f Gbit/s \n",
+	       (unsigned long) total, stripe.nr_qps, (unsigned long) (ns / 1000),
+	       ns ? (double) total * 8 / ns : 0.0);
+	if (memcmp(block_mem[1], block_mem[2], len))
+	{
+		rdma_error("The window did not read back what we wrote\n");
+		return -EIO;
+	}
+	for (i = 0; i < stripe.nr_qps; i++)
+	{
+		printf("QP %lu: %lu bytes, weight %u%s \n", (unsigned long) i,
+		       (unsigned long) stripe.qp_bytes[i], stripe.weight[i],
+		       stripe.failed[i] ? ", failed" : "");
+	}
+	if (stripe.resent)
+		printf("%lu units were sent again after a lane failed \n",
+		       (unsigned long) stripe.resent);
+	return 0;
+}
+
+/* Ships bulk_blocks blocks worth of data to the server in chunks. While
+ * the NIC reads one block, we fill the next, and the server works on one
+ * chunk while the next ones are on the wire. */
+static int client_bulk_transfer()
+{
+	uint64_t start, ns, total = (uint64_t) bulk_blocks * BLOCK_SZ;
+	uint32_t n;
+	char *block;
+	int ret, i;
+	ret = rdma_blocks_init(&blocks, &ring, &block_mr[1], BLOCK_NUM - 1,
+	                       bulk_chunk, bulk_depth);
+	if (ret)
+		return ret;
+	start = rdma_now_ns();
+	for (n = 0; n < bulk_blocks; n++)
+	{
+		/* the block comes back once the NIC read all of it */
+		while (!(block = rdma_blocks_get(&blocks)))
+		{
+			ret = rdma_blocks_progress(&blocks);
+			if (ret < 0)
+				return ret;
+			cpu_relax();
+		}
+		for (i = 0; i < BLOCK_SZ; i++)
+			block[i] = (char) (n + i);
+		ret = rdma_blocks_put(&blocks, BLOCK_SZ);
+		if (ret)
+		{
+			rdma_error("Failed to ship block %u, ret = %d \n", n, ret);
+			return ret;
+		}
+	}
+	ret = rdma_blocks_drain(&blocks);
+	if (ret)
+		return ret;
+	ns = rdma_now_ns() - start;
+	printf("Shipped %lu bytes through %u blocks in %lu us, %.2f Gbit/s, waited for %lu blocks \n",
+	       (unsigned long) total, blocks.nr_blocks, (unsigned long) (ns / 1000),
+	       ns ? (double) total * 8 / ns : 0.0, (unsigned long) blocks.waits);
 	return 0;
 }
 
@@ -344,80 +682,127 @@ static int client_send_metadata_to_server()
 static int client_remote_memory_ops()
 {
 	int ret = -1;
-
-	struct ibv_send_wr *bad_wr = NULL;
-
-	/***************************
-	 * Send RDMA write request *
-	 ***************************/
-
-	// In RDMA write, the sge is used to tell the local CA what memory
-	// we want to transfer to the remote CA.
-	// The remote address is set below in rdma_write_wr.wr.rdma.remote_addr.
-	struct ibv_sge rdma_write_sge;
-	rdma_write_sge.addr = (uint64_t)client_src_mr->addr;
-	rdma_write_sge.length = client_src_mr->length;
-	rdma_write_sge.lkey = client_src_mr->lkey;
-
-	// Create work request to send to local CA.
-	struct ibv_send_wr rdma_write_wr;
-	bzero(&rdma_write_wr, sizeof(rdma_write_wr));
-	rdma_write_wr.sg_list = &rdma_write_sge;
-	rdma_write_wr.num_sge = 1;
-	rdma_write_wr.opcode = IBV_WR_RDMA_WRITE;
-	rdma_write_wr.wr.rdma.remote_addr = server_metadata_attr.address;
-	rdma_write_wr.wr.rdma.rkey = server_metadata_attr.stag.local_stag;
 	int cnt = 0;
-	int* tmp_int = (void*)src;
-	*tmp_int = 0;
-	debug("Trying to perform RDMA write... tmp_int=%d\n", *tmp_int);
+	/* A message is a 4 byte element count followed by the doubles. Messages
+	 * are appended to the log ring in the server buffer, and only the bytes of
+	 * the record go on the wire, straight from the slot the message was built
+	 * in. We do not wait for the server between
+	 * messages; the ring only stalls us when the server is a full ring
+	 * behind, and the send queue only when the NIC is behind. */
+	debug("Trying to perform RDMA write... \n");
 	getchar();
+	if (bulk_chunk)
+	{
+		ret = client_bulk_transfer();
+		if (ret)
+			return ret;
+	}
+	if (server_metadata_attr.window.length)
+	{
+		ret = client_striped_transfer();
+		if (ret)
+			return ret;
+	}
 
 	while (1 == 1)
 	{
-
-		int ele_num = random() % 10;
-		*tmp_int = ele_num;
-		size_t data_sz = ele_num * sizeof(double);
-		double*d_data = (double*)malloc(data_sz);
-		for (int i = 0; i < ele_num; i++)
+		rdma_hist_poll(stdout);
+		int ele_num = random() % MAX_ELE_NUM;
+		uint32_t msg_len = sizeof(int) + ele_num * sizeof(double);
+		char *slot = rdma_slots_get(&msg_slots);
+		if (!slot)
 		{
-			d_data[i] = drand48();
-			printf("%lf\t", d_data[i] );
+			/* all slots are in flight, the send queue gives them back */
+			ret = rdma_sendq_reap(&client_sendq);
+			if (ret < 0)
+			{
+				break;
+			}
+			ret = 0;
+			continue;
 		}
-		printf("\n");
-		char* buf = (void*) tmp_int;
-		memcpy(buf + sizeof(int), d_data, data_sz);
-		printf("cnt=%d *src =%d\n",  cnt, *((int*)((void*)src)) );
-
-		ret = ibv_post_send(client_qp, &rdma_write_wr, &bad_wr);
-
-		if (ret == 12)
+		char *buf = rdma_ring_slot_payload(slot);
+		*((int*)(void*)buf) = ele_num;
+		if (gather)
 		{
-			debug("ret = %d  cnt=%d *src =%d\n", ret, cnt, *src);
-			sleep(1);
+			/* Only the count goes into the slot. The doubles stay in our
+			 * own array, in the row of the slot, which is free whenever
+			 * the slot is, and the NIC gathers them from there. */
+			uint32_t row = rdma_slots_index(&msg_slots, slot);
+			double *d_data = rows + (uint64_t) row * MAX_ELE_NUM;
+			struct ibv_sge frag;
+			for (int i = 0; i < ele_num; i++)
+				d_data[i] = drand48();
+			rdma_trace(RDMA_TRACE_MESSAGE, cnt, ele_num, msg_len, 0);
+			frag.addr = (uint64_t) d_data;
+			frag.length = ele_num * sizeof(double);
+			frag.lkey = 0;
+			if (ele_num)
+			{
+				/* a hit once the rows around it were sent before */
+				row_entries[row] = rdma_mrcache_get(&mrcache, pd, d_data,
+				                                    frag.length,
+				                                    IBV_ACCESS_LOCAL_WRITE);
+				if (!row_entries[row])
+				{
+					rdma_slots_put(&msg_slots, slot);
+					ret = -ENOMEM;
+					break;
+				}
+				frag.lkey = row_entries[row]->mr->lkey;
+			}
+			do
+			{
+				ret = rdma_ring_commit_iov(&ring, &msg_slots, slot, sizeof(int),
+				                           &frag, ele_num ? 1 : 0, 0);
+			}
+			while (ret == -EAGAIN);
 		}
-
-
-
-
-
-
-		getchar();
-
-
+		else
+		{
+			/* Serialize straight into the slot. The doubles follow the
+			 * count unaligned, hence the memcpy of each value. */
+			for (int i = 0; i < ele_num; i++)
+			{
+				double d = drand48();
+				memcpy(buf + sizeof(int) + i * sizeof(double), &d, sizeof(d));
+			}
+			rdma_trace(RDMA_TRACE_MESSAGE, cnt, ele_num, msg_len, 0);
+			/* the server has not caught up yet if there is no room, it
+			 * sends us its head once it consumed a part of the ring */
+			do
+			{
+				ret = rdma_ring_commit_slot(&ring, &msg_slots, slot, msg_len, 0);
+			}
+			while (ret == -EAGAIN);
+		}
+		if (ret)
+		{
+			rdma_slots_put(&msg_slots, slot);
+			break;
+		}
+		cnt++;
 	}
 
-
-	debug("FIN Performed RMDA write... tmp_int= %d\n", *tmp_int);
+	debug("FIN Performed RMDA write... cnt= %d\n", cnt);
 
 	if (ret)
 	{
-		rdma_error("Failed to do rdma write, errno: %d\n", -ret);
-		return -ret;
+		rdma_error("Failed to do rdma write, errno: %d\n", ret);
+		return ret;
 	}
 
-	return 0;
+	/* the server learns about the last records, and we wait for the
+	 * outstanding writes before we tear anything down */
+	ret = rdma_ring_notify(&ring);
+	if (ret)
+	{
+		return ret;
+	}
+	/* in pull mode the records stay ours until the server read them */
+	while (pull && __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) != ring.tail)
+		cpu_relax();
+	return rdma_sendq_drain(&client_sendq);
 }
 
 /* This function disconnects the RDMA connection from the server and cleans up
@@ -426,7 +811,9 @@ static int client_remote_memory_ops()
 static int client_disconnect_and_clean()
 {
 	struct rdma_cm_event *cm_event = NULL;
-	int ret = -1;
+	int ret = -1, i;
+	/* the lanes go first, their events come on our channel as well */
+	rdma_stripe_close(&stripe, cm_event_channel);
 	/* active disconnect from the client side */
 	ret = rdma_disconnect(cm_client_id);
 	if (ret)
@@ -451,6 +838,9 @@ static int client_disconnect_and_clean()
 		//continuing anyways
 	}
 	/* Destroy QP */
+	rdma_stats_put(client_sendq.stats);
+	rdma_sendq_destroy(&client_sendq);
+	rdma_slots_destroy(&msg_slots);
 	rdma_destroy_qp(cm_client_id);
 	/* Destroy client cm id */
 	ret = rdma_destroy_id(cm_client_id);
@@ -460,6 +850,7 @@ static int client_disconnect_and_clean()
 		// we continue anyways;
 	}
 	/* Destroy CQ */
+	rdma_comp_poller_destroy(&client_poller);
 	ret = ibv_destroy_cq(client_cq);
 	if (ret)
 	{
@@ -474,12 +865,37 @@ static int client_disconnect_and_clean()
 		// we continue anyways;
 	}
 	/* Destroy memory buffers */
+	rdma_ring_producer_destroy(&ring);
 	rdma_buffer_deregister(server_metadata_mr);
 	rdma_buffer_deregister(client_metadata_mr);
-	rdma_buffer_deregister(client_src_mr);
 	rdma_buffer_deregister(client_dst_mr);
 	/* We free the buffers */
-	free(src);
+	for (i = 0; i < BLOCK_NUM; i++)
+	{
+		if (block_mr[i])
+			rdma_pool_free(&pool, block_mr[i]);
+	}
+	/* The QP is gone, so rows that were still in flight are ours again */
+	if (nr_rows)
+	{
+		for (i = 0; row_entries && i < nr_rows; i++)
+		{
+			if (row_entries[i])
+				rdma_mrcache_put(&mrcache, row_entries[i]);
+		}
+		if (gather)
+			printf("The rows were registered %lu times for %lu messages \n",
+			       (unsigned long) mrcache.misses,
+			       (unsigned long) (mrcache.hits + mrcache.misses));
+		if (rows)
+			rdma_mrcache_invalidate(&mrcache, rows, (uint64_t) nr_rows *
+			                        MAX_ELE_NUM * sizeof(double));
+		free(rows);
+		free(row_entries);
+		rdma_buffer_use_cache(NULL);
+		rdma_mrcache_destroy(&mrcache);
+	}
+	rdma_pool_destroy(&pool);
 	free(dst);
 	/* Destroy protection domain */
 	ret = ibv_dealloc_pd(pd);
@@ -489,6 +905,7 @@ static int client_disconnect_and_clean()
 		// we continue anyways;
 	}
 	rdma_destroy_event_channel(cm_event_channel);
+	rdma_stats_close();
 	printf("Client resource clean up is complete \n");
 	return 0;
 }
@@ -496,18 +913,31 @@ static int client_disconnect_and_clean()
 void usage()
 {
 	printf("Usage:\n");
-	printf("rdma_client: [-a <server_addr>] [-p <server_port>] -s string (required)\n");
-	printf("(default IP is 127.0.0.1 and port is %d)\n", DEFAULT_RDMA_PORT);
+	printf("rdma_client: [-a <server_addr>] [-p <server_port>] [-c <event|poll|adaptive>] [-w <spin_us>] [-i <n>] [-b <wrs>] [-W <window_us>] [-g] [-P] [-B <chunk_bytes>] [-K <chunks>] [-N <blocks>] [-Q <qps>] [-M <rails>] [-D] [-H] [-T <trace_file>]\n");
+	printf("(default IP is 12.12.10.17 and port is %d)\n", DEFAULT_RDMA_PORT);
+	printf("-c: how to wait for completions (default event), -w: spin budget of the adaptive mode (default %d us)\n",
+	       DEFAULT_COMP_SPIN_US);
+	printf("-i: write every n-th message with immediate data, so the server gets a completion (default off)\n");
+	printf("-b: post up to this many WRs with one doorbell (default off), -W: for at most this long (default %d us)\n",
+	       DEFAULT_BATCH_WINDOW_US);
+	printf("-g: leave the doubles in the application's buffer and let the NIC gather them behind the count\n");
+	printf("-P: pull mode, only stage the messages and let the server read them (not with -i)\n");
+	printf("-B: first ship blocks in chunks of this many bytes (default off), -K: with this many chunks in flight (default %d)\n",
+	       RDMA_BULK_DEPTH);
+	printf("-N: how many blocks to ship with -B (default %d)\n", DEFAULT_BULK_BLOCKS);
+	printf("-Q: stripe writes and reads of a server window over this many QPs, at most %d (default off)\n",
+	       RDMA_STRIPE_MAX_QPS);
+	printf("-M: open one lane over each of these rails, [local]:remote[:weight],... (see rdma_rail.h)\n");
+	printf("-D: list the RDMA devices and ports of this host, and exit\n");
+	printf("-H: record latency histograms, printed on SIGUSR1 and at the end\n");
+	printf("-T: trace into this file, see rdma_trace_decode\n");
 	exit(1);
 }
 
 int main(int argc, char **argv)
 {
-	for (int i = 0; i < BLOCK_NUM ; i++)
-	{
-		block_mem[i] = calloc(BLOCK_SZ, 1);
-	}
 	struct sockaddr_in server_sockaddr;
+	char *rail_spec = NULL;
 	int ret, option;
 	bzero(&server_sockaddr, sizeof server_sockaddr);
 	server_sockaddr.sin_family = AF_INET;
@@ -517,11 +947,112 @@ int main(int argc, char **argv)
 
 	get_addr("12.12.10.17", (struct sockaddr*) &server_sockaddr);
 	server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
+	/* Parse Command Line Arguments */
+	while ((option = getopt(argc, argv, "a:p:c:w:i:b:W:gPB:K:N:Q:M:DHT:")) != -1)
+	{
+		switch (option)
+		{
+		case 'a':
+			/* remember, this overwrites the port info */
+			ret = get_addr(optarg, (struct sockaddr*) &server_sockaddr);
+			if (ret)
+			{
+				rdma_error("Invalid IP \n");
+				return ret;
+			}
+			server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT);
+			break;
+		case 'p':
+			/* passed port to listen on */
+			server_sockaddr.sin_port = htons(strtol(optarg, NULL, 0));
+			break;
+		case 'c':
+			ret = rdma_comp_mode_parse(optarg);
+			if (ret < 0)
+				usage();
+			comp_mode = ret;
+			break;
+		case 'w':
+			comp_spin_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			imm_every = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch_wrs = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			batch_window_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gather = 1;
+			break;
+		case 'P':
+			pull = 1;
+			break;
+		case 'B':
+			bulk_chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'K':
+			bulk_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'N':
+			bulk_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'Q':
+			stripe_qps = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			/* parsed once we know the port */
+			rail_spec = optarg;
+			break;
+		case 'D':
+			return rdma_rail_list_devices(stdout) < 0;
+		case 'H':
+			hist = 1;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	if (rail_spec)
+	{
+		nr_rails = rdma_rail_parse(rail_spec, rails, RDMA_STRIPE_MAX_QPS - 1,
+		                           server_sockaddr.sin_port);
+		if (nr_rails <= 0)
+			usage();
+		/* a lane per rail, unless -Q asks for more */
+		if (stripe_qps < 1 + (uint32_t) nr_rails)
+			stripe_qps = 1 + nr_rails;
+	}
+	if ((pull && imm_every) || stripe_qps == 0 || stripe_qps > RDMA_STRIPE_MAX_QPS)
+		usage();
+	if (hist)
+	{
+		ret = rdma_hist_thread_init("client");
+		if (!ret)
+			ret = rdma_hist_dump_on_signal(SIGUSR1, -1);
+		if (ret)
+			return ret;
+	}
+	if (trace_path)
+	{
+		ret = rdma_trace_thread_init("client", 0);
+		if (!ret)
+			ret = rdma_trace_start(trace_path);
+		if (ret)
+			return ret;
+	}
+	/* rdma_stat shows what we do, we run without it as well */
+	if (rdma_stats_open("rdma_client"))
+		rdma_error("Running without live statistics\n");
 	//src = calloc(INT_SIZE , 1);
 	//dst = calloc(INT_SIZE, 1);
 
-	src = block_mem[0];
-	debug("currently src(int) = %d", *((int*)(void*)src));
 	ret = client_prepare_connection(&server_sockaddr);
 	if (ret)
 	{
@@ -547,8 +1078,19 @@ int main(int argc, char **argv)
 		rdma_error("Failed to setup client connection , ret = %d \n", ret);
 		return ret;
 	}
+	ret = client_open_lanes(&server_sockaddr);
+	if (ret)
+	{
+		rdma_error("Failed to setup client connection , ret = %d \n", ret);
+		return ret;
+	}
 
 	ret = client_remote_memory_ops();
+	if (hist)
+		rdma_hist_dump(stdout);
+	if (trace_path)
+		printf("Trace is in %s, %lu records were lost \n", trace_path,
+		       (unsigned long) rdma_trace_stop());
 	if (ret)
 	{
 		rdma_error("Failed to finish remote memory ops, ret = %d \n", ret);
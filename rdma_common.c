@@ -6,6 +6,16 @@
  */
 
 #include "rdma_common.h"
+#include "rdma_hist.h"
+#include "rdma_mrcache.h"
+#include "rdma_pool.h"
+#include "rdma_stats.h"
+#include "rdma_trace.h"
+
+/* Set by rdma_buffer_use_pool() */
+static struct rdma_pool *buffer_pool = NULL;
+/* Set by rdma_buffer_use_cache() */
+static struct rdma_mrcache *buffer_cache = NULL;
 
 void show_rdma_cmid(struct rdma_cm_id *id)
 {
@@ -63,6 +73,18 @@ struct ibv_mr* rdma_buffer_alloc(struct ibv_pd *pd, uint32_t size,
 		rdma_error("Protection domain is NULL \n");
 		return NULL;
 	}
+	/* Carve it out of the pool's registered arenas if they are registered
+	 * with exactly these rights. Arenas with more would hand the caller's
+	 * buffer to whoever knows the arena's key. */
+	if (buffer_pool && buffer_pool->pd == pd && buffer_pool->access == permission)
+	{
+		mr = rdma_pool_alloc(buffer_pool, size);
+		if (mr)
+		{
+			debug("Buffer allocated from pool: %p , len: %u \n", mr->addr, size);
+			return mr;
+		}
+	}
 	void *buf = calloc(1, size);
 	if (!buf)
 	{
@@ -78,10 +100,19 @@ struct ibv_mr* rdma_buffer_alloc(struct ibv_pd *pd, uint32_t size,
 	return mr;
 }
 
+void rdma_buffer_use_pool(struct rdma_pool *pool)
+{
+	buffer_pool = pool;
+}
+
+void rdma_buffer_use_cache(struct rdma_mrcache *cache)
+{
+	buffer_cache = cache;
+}
+
 struct ibv_mr* rdma_buffer_alloc1(struct ibv_pd *pd, void* buf, uint32_t size,
                                   enum ibv_access_flags permission)
 {
-	struct ibv_mr *mr = NULL;
 	if (!pd)
 	{
 		rdma_error("Protection domain is NULL \n");
@@ -93,12 +124,8 @@ struct ibv_mr* rdma_buffer_alloc1(struct ibv_pd *pd, void* buf, uint32_t size,
 		return NULL;
 	}
 	debug("Buffer allocated: %p , len: %u \n", buf, size);
-	mr = rdma_buffer_register(pd, buf, size, permission);
-	if (!mr)
-	{
-		free(buf);
-	}
-	return mr;
+	/* The buffer belongs to the caller, it is not ours to free */
+	return rdma_buffer_register(pd, buf, size, permission);
 }
 
 
@@ -118,6 +145,8 @@ struct ibv_mr *rdma_buffer_register(struct ibv_pd *pd,
 		rdma_error("Failed to create mr on buffer, errno: %d \n", -errno);
 		return NULL;
 	}
+	rdma_stats_add_process(RDMA_STATS_REGISTRATIONS, 1);
+	rdma_stats_add_process(RDMA_STATS_PINNED_BYTES, mr->length);
 	debug("Registered: %p , len: %u , stag: 0x%x \n",
 	      mr->addr,
 	      (unsigned int) mr->length,
@@ -132,7 +161,17 @@ void rdma_buffer_free(struct ibv_mr *mr)
 		rdma_error("Passed memory region is NULL, ignoring\n");
 		return ;
 	}
+	if (buffer_pool && rdma_pool_owns(buffer_pool, mr))
+	{
+		debug("Buffer %p given back to pool\n", mr->addr);
+		rdma_pool_free(buffer_pool, mr);
+		return;
+	}
 	void *to_free = mr->addr;
+	/* The cache must not hand out an MR of pages that are not ours any
+	 * more */
+	if (buffer_cache)
+		rdma_mrcache_invalidate(buffer_cache, to_free, mr->length);
 	rdma_buffer_deregister(mr);
 	debug("Buffer %p free'ed\n", to_free);
 	free(to_free);
@@ -149,9 +188,91 @@ void rdma_buffer_deregister(struct ibv_mr *mr)
 	      mr->addr,
 	      (unsigned int) mr->length,
 	      mr->lkey);
+	rdma_stats_add_process(RDMA_STATS_REGISTRATIONS, -1);
+	rdma_stats_add_process(RDMA_STATS_PINNED_BYTES, -(int64_t) mr->length);
 	ibv_dereg_mr(mr);
 }
 
+int rdma_post_write(struct ibv_qp *qp,
+                    struct ibv_mr *mr,
+                    uint64_t local_offset,
+                    uint32_t length,
+                    struct rdma_buffer_attr *remote,
+                    uint64_t remote_offset,
+                    unsigned int send_flags)
+{
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	struct ibv_sge sge;
+	if (!qp || !mr || !remote)
+	{
+		rdma_error("Passed qp, mr or remote attr is NULL\n");
+		return -EINVAL;
+	}
+	if (local_offset + length > mr->length ||
+	        remote_offset + length > remote->length)
+	{
+		rdma_error("Write of %u bytes is out of bounds (local off %lu, remote off %lu)\n",
+		           length,
+		           (unsigned long) local_offset,
+		           (unsigned long) remote_offset);
+		return -EINVAL;
+	}
+	/* the sge tells the local CA which bytes to transfer, and only those */
+	sge.addr = (uint64_t) mr->addr + local_offset;
+	sge.length = length;
+	sge.lkey = mr->lkey;
+	bzero(&wr, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_RDMA_WRITE;
+	wr.send_flags = send_flags;
+	wr.wr.rdma.remote_addr = remote->address + remote_offset;
+	wr.wr.rdma.rkey = remote->stag.remote_stag;
+	/* ibv_post_send returns the errno value directly, e.g. ENOMEM when the
+	 * send queue is full */
+	return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+int rdma_create_qp_inline(struct rdma_cm_id *id, struct ibv_pd *pd,
+                          struct ibv_qp_init_attr *attr)
+{
+	struct ibv_qp_cap cap = attr->cap;
+	uint32_t max_inline;
+	int ret = -1;
+	for (max_inline = RDMA_MAX_INLINE; ; max_inline /= 2)
+	{
+		/* a failed attempt may have changed the capabilities */
+		attr->cap = cap;
+		attr->cap.max_inline_data = max_inline;
+		ret = rdma_create_qp(id, pd, attr);
+		if (!ret || max_inline == 0)
+			break;
+	}
+	if (ret)
+		return ret;
+	debug("QP created with %u bytes of inline data \n", attr->cap.max_inline_data);
+	return 0;
+}
+
+uint32_t rdma_qp_max_inline(struct ibv_qp *qp)
+{
+	struct ibv_qp_attr attr;
+	struct ibv_qp_init_attr init_attr;
+	if (ibv_query_qp(qp, &attr, IBV_QP_CAP, &init_attr))
+		return 0;
+	return attr.cap.max_inline_data;
+}
+
+uint32_t rdma_qp_max_send_sge(struct ibv_qp *qp)
+{
+	struct ibv_qp_attr attr;
+	struct ibv_qp_init_attr init_attr;
+	if (ibv_query_qp(qp, &attr, IBV_QP_CAP, &init_attr) ||
+	        attr.cap.max_send_sge == 0)
+		return MAX_SGE;
+	return attr.cap.max_send_sge;
+}
+
 int process_rdma_cm_event(struct rdma_event_channel *echannel,
                           enum rdma_cm_event_type expected_event,
                           struct rdma_cm_event **cm_event)
@@ -189,51 +310,76 @@ int process_rdma_cm_event(struct rdma_event_channel *echannel,
 }
 
 
-int process_work_completion_events (struct ibv_comp_channel *comp_channel,
-                                    struct ibv_wc *wc, int max_wc)
+int rdma_comp_mode_parse(const char *name)
 {
-	struct ibv_cq *cq_ptr = NULL;
-	void *context = NULL;
-	int ret = -1, i, total_wc = 0;
-	/* We wait for the notification on the CQ channel */
-	ret = ibv_get_cq_event(comp_channel, /* IO channel where we are expecting the notification */
-	                       &cq_ptr, /* which CQ has an activity. This should be the same as CQ we created before */
-	                       &context); /* Associated CQ user context, which we did set */
-	if (ret)
+	if (!strcmp(name, "event"))
+		return RDMA_COMP_EVENT;
+	if (!strcmp(name, "poll"))
+		return RDMA_COMP_POLL;
+	if (!strcmp(name, "adaptive"))
+		return RDMA_COMP_ADAPTIVE;
+	return -1;
+}
+
+int rdma_comp_poller_init(struct rdma_comp_poller *poller,
+                          struct ibv_cq *cq,
+                          struct ibv_comp_channel *channel,
+                          enum rdma_comp_mode mode,
+                          unsigned int spin_us)
+{
+	if (!poller || !cq)
 	{
-		rdma_error("Failed to get next CQ event due to %d \n", -errno);
-		return -errno;
+		rdma_error("Passed poller or CQ is NULL\n");
+		return -EINVAL;
 	}
-	/* Request for more notifications. */
-	ret = ibv_req_notify_cq(cq_ptr, 0);
-	if (ret)
+	if (mode != RDMA_COMP_POLL && !channel)
 	{
-		rdma_error("Failed to request further notifications %d \n", -errno);
-		return -errno;
+		rdma_error("Completion mode %d needs a completion channel\n", mode);
+		return -EINVAL;
 	}
-	/* We got notification. We reap the work completion (WC) element. It is
-	* unlikely but a good practice it write the CQ polling code that
-	      * can handle zero WCs. ibv_poll_cq can return zero. Same logic as
-	      * MUTEX conditional variables in pthread programming.
-	*/
-	total_wc = 0;
-	do
-	{
-		ret = ibv_poll_cq(cq_ptr /* the CQ, we got notification for */,
-		                  max_wc - total_wc /* number of remaining WC elements*/,
-		                  wc + total_wc/* where to store */);
-		if (ret < 0)
-		{
-			rdma_error("Failed to poll cq for wc due to %d \n", ret);
-			/* ret is errno here */
-			return ret;
-		}
-		total_wc += ret;
+	bzero(poller, sizeof(*poller));
+	poller->cq = cq;
+	poller->channel = channel;
+	poller->mode = mode;
+	poller->spin_ns = (uint64_t) spin_us * 1000;
+	return 0;
+}
+
+void rdma_comp_poller_destroy(struct rdma_comp_poller *poller)
+{
+	if (poller && poller->unacked)
+	{
+		ibv_ack_cq_events(poller->cq, poller->unacked);
+		poller->unacked = 0;
+	}
+}
+
+uint64_t rdma_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Polls the CQ once and checks the status of what it got */
+static int poll_once(struct rdma_comp_poller *poller, struct ibv_wc *wc, int max_wc)
+{
+	int ret, i;
+	ret = ibv_poll_cq(poller->cq, max_wc, wc);
+	if (ret < 0)
+	{
+		rdma_error("Failed to poll cq for wc due to %d \n", ret);
+		/* ret is errno here */
+		return ret;
+	}
+	rdma_stats_add(poller->stats, RDMA_STATS_CQ_POLLS, 1);
+	if (ret > 0)
+	{
+		rdma_hist_record(RDMA_HIST_CQ_BATCH, ret);
+		rdma_stats_add(poller->stats, RDMA_STATS_CQ_WCS, ret);
 	}
-	while (total_wc < max_wc);
-	debug("%d WC are completed \n", total_wc);
 	/* Now we check validity and status of I/O work completions */
-	for ( i = 0 ; i < total_wc ; i++)
+	for ( i = 0 ; i < ret ; i++)
 	{
 		if (wc[i].status != IBV_WC_SUCCESS)
 		{
@@ -245,10 +391,112 @@ int process_work_completion_events (struct ibv_comp_channel *comp_channel,
 			return -(wc[i].status);
 		}
 	}
-	/* Similar to connection management events, we need to acknowledge CQ events */
-	ibv_ack_cq_events(cq_ptr,
-	                  1 /* we received one event notification. This is not
-		       number of WC elements */);
+	return ret;
+}
+
+int rdma_comp_poller_arm(struct rdma_comp_poller *poller)
+{
+	int ret = ibv_req_notify_cq(poller->cq, 0);
+	if (ret)
+	{
+		rdma_error("Failed to request further notifications %d \n", -errno);
+		return -errno;
+	}
+	return 0;
+}
+
+int rdma_comp_poller_get_event(struct rdma_comp_poller *poller)
+{
+	struct ibv_cq *cq_ptr = NULL;
+	void *context = NULL;
+	int ret;
+	/* We wait for the notification on the CQ channel */
+	ret = ibv_get_cq_event(poller->channel, /* IO channel where we are expecting the notification */
+	                       &cq_ptr, /* which CQ has an activity. This should be the same as CQ we created before */
+	                       &context); /* Associated CQ user context, which we did set */
+	if (ret)
+	{
+		rdma_error("Failed to get next CQ event due to %d \n", -errno);
+		return -errno;
+	}
+	/* Similar to connection management events, we need to acknowledge CQ
+	 * events. Acknowledging takes a lock, so we do it in batches. */
+	if (++poller->unacked >= 64)
+	{
+		ibv_ack_cq_events(cq_ptr, poller->unacked);
+		poller->unacked = 0;
+	}
+	return 0;
+}
+
+/* Arms the CQ and sleeps on the completion channel until it fires */
+static int sleep_on_channel(struct rdma_comp_poller *poller,
+                            struct ibv_wc *wc, int max_wc)
+{
+	int ret;
+	/* Request a notification first and then poll again */
+	ret = rdma_comp_poller_arm(poller);
+	if (ret)
+		return ret;
+	ret = poll_once(poller, wc, max_wc);
+	if (ret)
+		return ret;
+	return rdma_comp_poller_get_event(poller);
+}
+
+int process_work_completion_events(struct rdma_comp_poller *poller,
+                                   struct ibv_wc *wc, int max_wc)
+{
+	uint64_t deadline = 0;
+	unsigned int spins = 0;
+	int ret;
+	if (poller->mode == RDMA_COMP_ADAPTIVE)
+		deadline = rdma_now_ns() + poller->spin_ns;
+	/* It is a good practice to write the CQ polling code so that it can
+	 * handle zero WCs. ibv_poll_cq can return zero, even after an event. */
+	while (1)
+	{
+		ret = poll_once(poller, wc, max_wc);
+		if (ret)
+			break;
+		switch (poller->mode)
+		{
+		case RDMA_COMP_POLL:
+			cpu_relax();
+			continue;
+		case RDMA_COMP_ADAPTIVE:
+			/* reading the clock costs more than a poll, so only now and then */
+			if ((++spins & 63) || rdma_now_ns() < deadline)
+			{
+				cpu_relax();
+				continue;
+			}
+			/* the budget is spent, we go to sleep */
+			/* fall through */
+		case RDMA_COMP_EVENT:
+			ret = sleep_on_channel(poller, wc, max_wc);
+			break;
+		}
+		if (ret)
+			break;
+	}
+	if (ret > 0)
+		rdma_trace(RDMA_TRACE_WC_BATCH, ret, 0, 0, 0);
+	return ret;
+}
+
+int rdma_wait_work_completions(struct rdma_comp_poller *poller,
+                               struct ibv_wc *wc, int nr_wc)
+{
+	int ret, total_wc = 0;
+	while (total_wc < nr_wc)
+	{
+		ret = process_work_completion_events(poller, wc + total_wc,
+		                                     nr_wc - total_wc);
+		if (ret < 0)
+			return ret;
+		total_wc += ret;
+	}
 	return total_wc;
 }
 
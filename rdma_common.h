@@ -35,8 +35,9 @@
   fprintf(stderr, "%s : %d : ERROR : "msg, __FILE__, __LINE__, ## args);\
 }while(0);
 
-#define ACN_RDMA_DEBUG
-
+/* Debug messages go through printf, which is far too slow for the hot paths,
+ * so they are only compiled in when asked for: make DEBUG=1. The hot paths
+ * leave trace records instead (rdma_trace.h), and are timed by rdma_hist.h. */
 #ifdef ACN_RDMA_DEBUG
 /* Debug Macro */
 #define debug(msg, args...) do {\
@@ -49,12 +50,19 @@
 
 #endif /* ACN_RDMA_DEBUG */
 
-/* Capacity of the completion queue (CQ) */
-#define CQ_CAPACITY (16)
+/* Tells the CPU that we are spinning on memory someone else writes */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
 /* MAX SGE capacity */
 #define MAX_SGE (2)
-/* MAX work requests */
-#define MAX_WR (8)
+/* Zero length receives the server keeps posted for writes with immediate */
+#define RECV_POOL_SIZE (256)
 /* Default port where the RDMA server is listening */
 #define DEFAULT_RDMA_PORT (20886)
 
@@ -76,6 +84,68 @@ struct __attribute((packed)) rdma_buffer_attr
     uint32_t remote_stag;
   } stag;
 };
+
+/* The client writes ring footers with immediate data */
+#define RDMA_META_WRITE_IMM (1 << 0)
+/* The server reads the records from the client's buffer (pull mode) */
+#define RDMA_META_PULL (1 << 1)
+
+/*
+ * What the client sends the server right after the connection is set up.
+ * @buffer: the client side source buffer, where the client stages its ring
+ * @ring_head: where the server writes the head of the log ring it consumes
+ * @ring_tail: in pull mode, where the server reads the tail of the ring
+ * @flags: OR of RDMA_META_* flags
+ * @lanes: how many QPs the client would like to open next to this one, to
+ *         stripe large transfers over (see rdma_stripe.h)
+ */
+struct __attribute((packed)) rdma_client_metadata
+{
+  struct rdma_buffer_attr buffer;
+  struct rdma_buffer_attr ring_head;
+  struct rdma_buffer_attr ring_tail;
+  uint32_t flags;
+  uint32_t lanes;
+};
+
+/*
+ * What the server answers with.
+ * @buffer: the slice of server memory that holds the log ring
+ * @window: a second slice the client may RDMA write and read at will, length
+ *          0 if there is none
+ * @lanes: how many QPs the client may open next to this one, up to what it
+ *         asked for
+ * @token: what those QPs show the server when they connect
+ */
+struct __attribute((packed)) rdma_server_metadata
+{
+  struct rdma_buffer_attr buffer;
+  struct rdma_buffer_attr window;
+  uint32_t lanes;
+  uint32_t token;
+};
+
+/* A QP that a client opens next to its connection carries this as private
+ * data of its connect request. @rkey is the remote key of the server memory
+ * the lane is going to access, as the connection knows it. */
+#define RDMA_LANE_MAGIC (0x1a9e1a9eu)
+struct __attribute((packed)) rdma_lane_hello
+{
+  uint32_t magic;
+  uint32_t token;
+  uint32_t lane;
+  uint32_t rkey;
+};
+
+/* ... and the server accepts it with this: the key of the same memory on
+ * the device the lane came in on, which may be another one (see
+ * rdma_rail.h) */
+struct __attribute((packed)) rdma_lane_welcome
+{
+  uint32_t magic;
+  uint32_t rkey;
+};
+
 /* resolves a given destination name to sin_addr */
 int get_addr(char *dst, struct sockaddr *addr);
 
@@ -103,17 +173,34 @@ struct ibv_mr* rdma_buffer_alloc(struct ibv_pd *pd,
                                  uint32_t length,
                                  enum ibv_access_flags permission);
 
+struct rdma_pool;
+
+/* Makes rdma_buffer_alloc() take its buffers from a pool (see rdma_pool.h)
+ * when the pd and the permissions are the same, NULL to stop. The pool must outlive the
+ * buffers it gave out; rdma_buffer_free() hands them back to it. */
+void rdma_buffer_use_pool(struct rdma_pool *pool);
+
+struct rdma_mrcache;
+
+/* Makes rdma_buffer_free() forget what a registration cache (see
+ * rdma_mrcache.h) holds of a buffer before freeing it, NULL to stop */
+void rdma_buffer_use_cache(struct rdma_mrcache *cache);
+
+/* Registers 'size' bytes of a buffer the caller allocated, like
+ * rdma_buffer_register(). The buffer stays the caller's, also on failure. */
 struct ibv_mr* rdma_buffer_alloc1(struct ibv_pd *pd, void* buf, uint32_t size,
                                   enum ibv_access_flags permission);
 
 /* Frees a previously allocated RDMA buffer. The buffer must be allocated by
- * calling rdma_buffer_alloc();
+ * calling rdma_buffer_alloc(); pool buffers go back to the pool, others are
+ * invalidated in the cache set with rdma_buffer_use_cache() first.
  * @mr: RDMA memory region to free
  */
 void rdma_buffer_free(struct ibv_mr *mr);
 
 /* This function registers a previously allocated memory. Returns a memory region
- * (MR) identifier or NULL on error.
+ * (MR) identifier or NULL on error. Every call registers anew; buffers that are
+ * registered per transfer should go through the cache in rdma_mrcache.h.
  * @pd: protection domain where to register memory
  * @addr: Buffer address
  * @length: Length of the buffer
@@ -128,16 +215,125 @@ struct ibv_mr *rdma_buffer_register(struct ibv_pd *pd,
  */
 void rdma_buffer_deregister(struct ibv_mr *mr);
 
-/* Processes a work completion (WC) notification.
- * @comp_channel: Completion channel where the notifications are expected to arrive
+/* Posts a single RDMA write of 'length' bytes starting at 'local_offset' in
+ * the local memory region 'mr' to 'remote_offset' in the remote buffer described
+ * by 'remote'. Only the given bytes go on the wire, not the whole region.
+ * @qp: QP to post the write on
+ * @mr: local memory region holding the source bytes
+ * @local_offset: offset of the first source byte inside mr
+ * @length: number of bytes to write
+ * @remote: remote buffer attributes as received from the peer
+ * @remote_offset: offset of the first destination byte inside the remote buffer
+ * @send_flags: OR of IBV_SEND_* flags for the work request
+ */
+int rdma_post_write(struct ibv_qp *qp,
+                    struct ibv_mr *mr,
+                    uint64_t local_offset,
+                    uint32_t length,
+                    struct rdma_buffer_attr *remote,
+                    uint64_t remote_offset,
+                    unsigned int send_flags);
+
+/* Most inline data we ask for when creating a QP */
+#define RDMA_MAX_INLINE (1024)
+
+/* Creates the QP of a connection like rdma_create_qp(), with as much inline
+ * data as the device allows: starting at RDMA_MAX_INLINE, the request is
+ * halved until the QP can be created. Payloads up to that size are copied
+ * into the work request by the CPU, which spares the NIC a DMA read. On
+ * return attr->cap.max_inline_data is what the QP supports.
+ */
+int rdma_create_qp_inline(struct rdma_cm_id *id, struct ibv_pd *pd,
+                          struct ibv_qp_init_attr *attr);
+
+/* Returns the inline data limit of a QP, 0 if it cannot be queried */
+uint32_t rdma_qp_max_inline(struct ibv_qp *qp);
+
+/* Returns how many SGEs a send WR of a QP may have, MAX_SGE if it cannot be
+ * queried */
+uint32_t rdma_qp_max_send_sge(struct ibv_qp *qp);
+
+/*
+ * How a completion poller waits for work completions:
+ * RDMA_COMP_EVENT: arm the CQ and sleep on the completion channel right away
+ * RDMA_COMP_POLL: busy-poll the CQ, never sleep; no completion channel needed
+ * RDMA_COMP_ADAPTIVE: busy-poll for a spin budget, then arm and sleep
+ */
+enum rdma_comp_mode
+{
+  RDMA_COMP_EVENT = 0,
+  RDMA_COMP_POLL,
+  RDMA_COMP_ADAPTIVE,
+};
+
+/* Default spin budget of the adaptive mode, in microseconds */
+#define DEFAULT_COMP_SPIN_US (50)
+
+/* Waits for completions on one CQ, in one of the modes above */
+struct rdma_stats_slot;
+
+struct rdma_comp_poller
+{
+  struct ibv_cq *cq;
+  struct ibv_comp_channel *channel;
+  enum rdma_comp_mode mode;
+  uint64_t spin_ns;
+  /* CQ events received but not acknowledged yet */
+  unsigned int unacked;
+  /* where polls and completions are counted, may be NULL (rdma_stats.h) */
+  struct rdma_stats_slot *stats;
+};
+
+/* Parses "event", "poll" or "adaptive", returns -1 for anything else */
+int rdma_comp_mode_parse(const char *name);
+
+/* Initializes a poller for a CQ.
+ * @cq: CQ to reap
+ * @channel: completion channel of cq, may be NULL for RDMA_COMP_POLL
+ * @mode: how to wait
+ * @spin_us: spin budget for RDMA_COMP_ADAPTIVE
+ */
+int rdma_comp_poller_init(struct rdma_comp_poller *poller,
+                          struct ibv_cq *cq,
+                          struct ibv_comp_channel *channel,
+                          enum rdma_comp_mode mode,
+                          unsigned int spin_us);
+
+/* Acknowledges outstanding CQ events, must be called before the CQ is
+ * destroyed */
+void rdma_comp_poller_destroy(struct rdma_comp_poller *poller);
+
+/* Requests a notification for the next completion on the poller's CQ. Poll
+ * the CQ once more afterwards: a completion that arrived before the CQ was
+ * armed does not generate an event. */
+int rdma_comp_poller_arm(struct rdma_comp_poller *poller);
+
+/* Blocks until the armed CQ raises an event on the completion channel, and
+ * takes care of acknowledging it */
+int rdma_comp_poller_get_event(struct rdma_comp_poller *poller);
+
+/* Monotonic clock in nanoseconds */
+uint64_t rdma_now_ns();
+
+/* Processes work completion (WC) notifications. Waits, as the poller's mode
+ * says, until there is at least one completion and returns what is there
+ * right now, at most max_wc. Returns the number of completions, or a
+ * negative error if a completion failed.
+ * @poller: poller of the CQ where the completions are expected
  * @wc: Array where to hold the work completion elements
- * @max_wc: Maximum number of expected work completion (WC) elements. wc must be
- *          atleast this size.
+ * @max_wc: Maximum number of work completion (WC) elements to return. wc
+ *          must be atleast this size.
  */
-int process_work_completion_events(struct ibv_comp_channel *comp_channel,
+int process_work_completion_events(struct rdma_comp_poller *poller,
                                    struct ibv_wc *wc,
                                    int max_wc);
 
+/* Calls process_work_completion_events() until exactly 'nr_wc' completions
+ * have been collected into wc. Returns nr_wc or a negative error. */
+int rdma_wait_work_completions(struct rdma_comp_poller *poller,
+                               struct ibv_wc *wc,
+                               int nr_wc);
+
 /* prints some details from the cm id */
 void show_rdma_cmid(struct rdma_cm_id *id);
 
@@ -0,0 +1,158 @@
+/*
+ * Implementation of the latency histograms.
+ */
+
+#include <pthread.h>
+
+#include "rdma_hist.h"
+
+__thread struct rdma_hist_set *rdma_hist_self = NULL;
+volatile sig_atomic_t rdma_hist_dump_pending = 0;
+
+/* Every set ever handed out, for the dump. Only taken to add a thread. */
+static pthread_mutex_t sets_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rdma_hist_set *sets = NULL;
+
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+static double ns_per_tick = 1.0;
+static int wake_fd = -1;
+
+static const char *hist_names[RDMA_HIST_NR] =
+{
+	"post_complete", "write_visible", "consume", "cq_batch",
+};
+
+/* Counts cycles over a few milliseconds of the monotonic clock */
+static void calibrate()
+{
+	uint64_t ns0, ns1, tsc0, tsc1;
+	ns0 = rdma_now_ns();
+	tsc0 = rdma_tsc();
+	do
+	{
+		ns1 = rdma_now_ns();
+	}
+	while (ns1 - ns0 < 10 * 1000 * 1000);
+	tsc1 = rdma_tsc();
+	if (tsc1 > tsc0)
+		ns_per_tick = (double)(ns1 - ns0) / (tsc1 - tsc0);
+	debug("Cycle counter runs at %.3f ticks per ns \n", 1.0 / ns_per_tick);
+}
+
+double rdma_tsc_ns_per_tick(void)
+{
+	pthread_once(&calibrate_once, calibrate);
+	return ns_per_tick;
+}
+
+int rdma_hist_thread_init(const char *name)
+{
+	struct rdma_hist_set *set;
+	int i;
+	if (rdma_hist_self)
+		return 0;
+	rdma_tsc_ns_per_tick();
+	set = calloc(1, sizeof(*set));
+	if (!set)
+	{
+		rdma_error("Failed to allocate histograms, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	snprintf(set->name, sizeof(set->name), "%s", name ? name : "thread");
+	for (i = 0; i < RDMA_HIST_NR; i++)
+		set->hist[i].min = UINT64_MAX;
+	pthread_mutex_lock(&sets_lock);
+	set->next = sets;
+	sets = set;
+	pthread_mutex_unlock(&sets_lock);
+	rdma_hist_self = set;
+	return 0;
+}
+
+/* Smallest value that falls into a bucket */
+static uint64_t bucket_value(uint32_t b)
+{
+	uint32_t shift;
+	if (b < 2 * RDMA_HIST_SUB)
+		return b;
+	shift = b / RDMA_HIST_SUB - 1;
+	return (uint64_t)(b - shift * RDMA_HIST_SUB) << shift;
+}
+
+/* Value below which a fraction 'q' of the samples lie */
+static uint64_t percentile(struct rdma_hist *h, uint64_t count, double q)
+{
+	uint64_t want = (uint64_t)(q * count), seen = 0;
+	uint32_t b;
+	for (b = 0; b < RDMA_HIST_BUCKETS; b++)
+	{
+		seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+		if (seen > want)
+			return bucket_value(b);
+	}
+	return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+void rdma_hist_dump(FILE *out)
+{
+	struct rdma_hist_set *set;
+	struct rdma_hist *h;
+	uint64_t count;
+	double scale;
+	int i;
+	pthread_mutex_lock(&sets_lock);
+	for (set = sets; set; set = set->next)
+	{
+		for (i = 0; i < RDMA_HIST_NR; i++)
+		{
+			h = &set->hist[i];
+			count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+			if (!count)
+				continue;
+			/* batch sizes are counts, everything else is cycles */
+			scale = i == RDMA_HIST_CQ_BATCH ? 1.0 : ns_per_tick;
+			fprintf(out, "%s %s: count %lu min %.0f p50 %.0f p90 %.0f p99 %.0f p999 %.0f max %.0f mean %.1f\n",
+			        set->name, hist_names[i], (unsigned long) count,
+			        __atomic_load_n(&h->min, __ATOMIC_RELAXED) * scale,
+			        percentile(h, count, 0.50) * scale,
+			        percentile(h, count, 0.90) * scale,
+			        percentile(h, count, 0.99) * scale,
+			        percentile(h, count, 0.999) * scale,
+			        __atomic_load_n(&h->max, __ATOMIC_RELAXED) * scale,
+			        (double) __atomic_load_n(&h->sum, __ATOMIC_RELAXED) * scale / count);
+		}
+	}
+	pthread_mutex_unlock(&sets_lock);
+	fflush(out);
+}
+
+static void on_signal(int signo)
+{
+	uint64_t one = 1;
+	int saved = errno;
+	rdma_hist_dump_pending = 1;
+	if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0)
+	{
+		/* nothing we could do about it in a handler */
+	}
+	errno = saved;
+}
+
+int rdma_hist_dump_on_signal(int signo, int fd)
+{
+	struct sigaction sa;
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	/* No SA_RESTART: a poll() the signal interrupts returns, and the loop
+	 * around it gets to rdma_hist_poll() */
+	sa.sa_flags = 0;
+	wake_fd = fd;
+	if (sigaction(signo, &sa, NULL))
+	{
+		rdma_error("Failed to install the handler for signal %d, errno: %d \n",
+		           signo, -errno);
+		return -errno;
+	}
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Header file for the latency histograms.
+ *
+ * The hot paths take a timestamp from the CPU's cycle counter (the TSC on
+ * x86) when they post work, when it completes and when a record is consumed,
+ * and add the difference to a histogram. Every thread records into a set of
+ * histograms of its own, so recording takes no lock and no atomic, only a
+ * handful of instructions, and never touches stdio. A thread that did not
+ * call rdma_hist_thread_init() records nothing and pays one thread local
+ * load per timestamp.
+ *
+ * The histograms are log-linear, like HDR histograms: every power of two is
+ * cut into RDMA_HIST_SUB buckets, so a value is kept to within 1/16 of
+ * itself over the whole 64 bit range, in a fixed 8K per histogram.
+ *
+ * What is recorded:
+ * RDMA_HIST_POST_COMPLETE: from ringing the doorbell for a send WR until the
+ *   send queue manager retires it. An unsignaled WR is retired with the next
+ *   signaled one.
+ * RDMA_HIST_WRITE_VISIBLE: from posting a chain that ends in an RDMA write
+ *   until that write is retired. An RC write only completes once the
+ *   responder placed its data, and a ring record is posted as one chain, so
+ *   this is how long it takes until a record is visible to the consumer.
+ * RDMA_HIST_CONSUME: from a record first being returned by rdma_ring_peek()
+ *   until rdma_ring_release(), the time the consumer spends on it.
+ * RDMA_HIST_CQ_BATCH: completions returned by a non-empty poll of a CQ.
+ *
+ * The histograms of all threads are printed by rdma_hist_dump(), or, once
+ * rdma_hist_dump_on_signal() is set up, by the next rdma_hist_poll() after
+ * the signal arrived.
+ */
+
+#ifndef RDMA_HIST_H
+#define RDMA_HIST_H
+
+#include <signal.h>
+
+#include "rdma_common.h"
+
+/* Buckets per power of two, as a power of two itself */
+#define RDMA_HIST_SUB_BITS (4)
+#define RDMA_HIST_SUB (1 << RDMA_HIST_SUB_BITS)
+#define RDMA_HIST_BUCKETS ((64 - RDMA_HIST_SUB_BITS + 1) * RDMA_HIST_SUB)
+
+enum rdma_hist_id
+{
+	RDMA_HIST_POST_COMPLETE = 0,
+	RDMA_HIST_WRITE_VISIBLE,
+	RDMA_HIST_CONSUME,
+	RDMA_HIST_CQ_BATCH,
+	RDMA_HIST_NR,
+};
+
+struct rdma_hist
+{
+	uint64_t count, sum, min, max;
+	uint64_t buckets[RDMA_HIST_BUCKETS];
+};
+
+/* The histograms of one thread */
+struct rdma_hist_set
+{
+	char name[32];
+	struct rdma_hist hist[RDMA_HIST_NR];
+	struct rdma_hist_set *next;
+};
+
+/* Histograms of the calling thread, NULL while it does not record */
+extern __thread struct rdma_hist_set *rdma_hist_self;
+/* Set by the signal handler, taken by rdma_hist_poll() */
+extern volatile sig_atomic_t rdma_hist_dump_pending;
+
+/* Reads the cycle counter. Where there is none we can read from user space,
+ * this falls back to the monotonic clock. */
+static inline uint64_t rdma_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+	return rdma_now_ns();
+#endif
+}
+
+/* Nanoseconds per tick of rdma_tsc(). The first call calibrates the cycle
+ * counter against the monotonic clock, which takes 10 ms. */
+double rdma_tsc_ns_per_tick(void);
+
+/* Tells whether the calling thread records */
+static inline int rdma_hist_on(void)
+{
+	return rdma_hist_self != NULL;
+}
+
+/* Bucket of a value: values below 2 * RDMA_HIST_SUB have one of their own,
+ * above that the top RDMA_HIST_SUB_BITS + 1 bits pick it */
+static inline uint32_t rdma_hist_bucket(uint64_t v)
+{
+	uint32_t shift;
+	if (v < 2 * RDMA_HIST_SUB)
+		return v;
+	shift = 63 - __builtin_clzll(v) - RDMA_HIST_SUB_BITS;
+	return shift * RDMA_HIST_SUB + (uint32_t)(v >> shift);
+}
+
+static inline void rdma_hist_add(struct rdma_hist *h, uint64_t v)
+{
+	h->buckets[rdma_hist_bucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Records a value into a histogram of the calling thread, if it records */
+static inline void rdma_hist_record(enum rdma_hist_id id, uint64_t v)
+{
+	struct rdma_hist_set *set = rdma_hist_self;
+	if (set)
+		rdma_hist_add(&set->hist[id], v);
+}
+
+/*
+ * Makes the calling thread record from now on, into histograms that stay
+ * around for rdma_hist_dump() after the thread is gone. The first call also
+ * calibrates the cycle counter, see rdma_tsc_ns_per_tick().
+ * @name: what the dump calls the thread
+ */
+int rdma_hist_thread_init(const char *name);
+
+/* Prints the histograms of every thread that recorded anything. Latencies
+ * are printed in nanoseconds. A thread that records while its histograms are
+ * printed may be a few samples ahead of what is shown. */
+void rdma_hist_dump(FILE *out);
+
+/*
+ * Dumps the histograms whenever signal 'signo' arrives, at the next
+ * rdma_hist_poll(); the handler itself only sets a flag. If 'wake_fd' is an
+ * eventfd, the handler also writes to it, to wake up a thread that sleeps
+ * in poll().
+ */
+int rdma_hist_dump_on_signal(int signo, int wake_fd);
+
+/* Dumps the histograms if a signal asked for it. Cheap enough for every
+ * turn of an event loop. */
+static inline void rdma_hist_poll(FILE *out)
+{
+	if (rdma_hist_dump_pending)
+	{
+		rdma_hist_dump_pending = 0;
+		rdma_hist_dump(out);
+	}
+}
+
+#endif /* RDMA_HIST_H */
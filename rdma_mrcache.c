@@ -0,0 +1,411 @@
+/*
+ * Implementation of the memory registration cache.
+ */
+
+#include "rdma_mrcache.h"
+
+static uintptr_t page_size()
+{
+	static uintptr_t size;
+	if (!size)
+		size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+/* Cheap pseudo random treap priorities */
+static uint32_t next_prio(struct rdma_mrcache *cache)
+{
+	cache->seed = cache->seed * 1103515245u + 12345u;
+	return cache->seed;
+}
+
+static void update(struct rdma_mrcache_entry *e)
+{
+	e->max_end = e->end;
+	if (e->left && e->left->max_end > e->max_end)
+		e->max_end = e->left->max_end;
+	if (e->right && e->right->max_end > e->max_end)
+		e->max_end = e->right->max_end;
+}
+
+/* Orders by start, and entries with the same start by address */
+static int before(struct rdma_mrcache_entry *a, struct rdma_mrcache_entry *b)
+{
+	return a->start < b->start || (a->start == b->start && a < b);
+}
+
+static struct rdma_mrcache_entry *tree_insert(struct rdma_mrcache_entry *root,
+                                              struct rdma_mrcache_entry *e)
+{
+	struct rdma_mrcache_entry *child;
+	if (!root)
+	{
+		e->left = e->right = NULL;
+		update(e);
+		return e;
+	}
+	if (before(e, root))
+	{
+		root->left = child = tree_insert(root->left, e);
+		if (child->prio > root->prio)
+		{
+			/* rotate right */
+			root->left = child->right;
+			child->right = root;
+			update(root);
+			update(child);
+			return child;
+		}
+	}
+	else
+	{
+		root->right = child = tree_insert(root->right, e);
+		if (child->prio > root->prio)
+		{
+			/* rotate left */
+			root->right = child->left;
+			child->left = root;
+			update(root);
+			update(child);
+			return child;
+		}
+	}
+	update(root);
+	return root;
+}
+
+static struct rdma_mrcache_entry *tree_join(struct rdma_mrcache_entry *a,
+                                            struct rdma_mrcache_entry *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio > b->prio)
+	{
+		a->right = tree_join(a->right, b);
+		update(a);
+		return a;
+	}
+	b->left = tree_join(a, b->left);
+	update(b);
+	return b;
+}
+
+static struct rdma_mrcache_entry *tree_remove(struct rdma_mrcache_entry *root,
+                                              struct rdma_mrcache_entry *e)
+{
+	if (!root)
+		return NULL;
+	if (root == e)
+		return tree_join(root->left, root->right);
+	if (before(e, root))
+		root->left = tree_remove(root->left, e);
+	else
+		root->right = tree_remove(root->right, e);
+	update(root);
+	return root;
+}
+
+static int remember(struct rdma_mrcache *cache, struct rdma_mrcache_entry *e)
+{
+	struct rdma_mrcache_entry **found;
+	unsigned int max;
+	if (cache->nr_found == cache->max_found)
+	{
+		max = cache->max_found ? 2 * cache->max_found : 16;
+		found = realloc(cache->found, max * sizeof(*found));
+		if (!found)
+			return -ENOMEM;
+		cache->found = found;
+		cache->max_found = max;
+	}
+	cache->found[cache->nr_found++] = e;
+	return 0;
+}
+
+/* Collects all entries that overlap [start, end) into cache->found */
+static int find_overlaps(struct rdma_mrcache *cache,
+                         struct rdma_mrcache_entry *node,
+                         uintptr_t start, uintptr_t end)
+{
+	int ret;
+	/* nothing in this subtree reaches past start */
+	if (!node || node->max_end <= start)
+		return 0;
+	ret = find_overlaps(cache, node->left, start, end);
+	if (ret)
+		return ret;
+	/* everything from here on starts at or after end */
+	if (node->start >= end)
+		return 0;
+	if (node->end > start)
+	{
+		ret = remember(cache, node);
+		if (ret)
+			return ret;
+	}
+	return find_overlaps(cache, node->right, start, end);
+}
+
+static void lru_remove(struct rdma_mrcache *cache, struct rdma_mrcache_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		cache->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		cache->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_append(struct rdma_mrcache *cache, struct rdma_mrcache_entry *e)
+{
+	e->lru_next = NULL;
+	e->lru_prev = cache->lru_tail;
+	if (cache->lru_tail)
+		cache->lru_tail->lru_next = e;
+	else
+		cache->lru_head = e;
+	cache->lru_tail = e;
+}
+
+static void release(struct rdma_mrcache *cache, struct rdma_mrcache_entry *e)
+{
+	cache->pinned -= e->end - e->start;
+	rdma_buffer_deregister(e->mr);
+	free(e);
+}
+
+/* Takes an entry out of the tree. An unused one is deregistered right away,
+ * one in use once it is put. */
+static void detach(struct rdma_mrcache *cache, struct rdma_mrcache_entry *e)
+{
+	cache->root = tree_remove(cache->root, e);
+	e->cached = 0;
+	if (e->refs)
+		return;
+	lru_remove(cache, e);
+	release(cache, e);
+}
+
+/* Deregisters unused entries, oldest first, until 'extra' more bytes fit
+ * into the budget. Entries that are being merged are skipped. */
+static int make_room(struct rdma_mrcache *cache, uint64_t extra)
+{
+	struct rdma_mrcache_entry *e = cache->lru_head, *next;
+	if (!cache->max_pinned)
+		return 0;
+	while (e && cache->pinned + extra > cache->max_pinned)
+	{
+		next = e->lru_next;
+		if (!e->merging)
+		{
+			cache->evictions++;
+			detach(cache, e);
+		}
+		e = next;
+	}
+	return cache->pinned + extra > cache->max_pinned ? -ENOMEM : 0;
+}
+
+int rdma_mrcache_init(struct rdma_mrcache *cache, uint64_t max_pinned)
+{
+	if (!cache)
+	{
+		rdma_error("Passed cache is NULL\n");
+		return -EINVAL;
+	}
+	bzero(cache, sizeof(*cache));
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->max_pinned = max_pinned;
+	cache->seed = 0x9e3779b9u;
+	return 0;
+}
+
+void rdma_mrcache_destroy(struct rdma_mrcache *cache)
+{
+	struct rdma_mrcache_entry *e;
+	if (!cache)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	while (cache->root)
+	{
+		e = cache->root;
+		cache->root = tree_remove(cache->root, e);
+		if (e->refs)
+		{
+			rdma_error("Cached MR %p is still in use\n", e->mr);
+		}
+		else
+		{
+			lru_remove(cache, e);
+		}
+		release(cache, e);
+	}
+	debug("Registration cache: %lu hits, %lu misses, %lu merges, %lu evictions \n",
+	      (unsigned long) cache->hits, (unsigned long) cache->misses,
+	      (unsigned long) cache->merges, (unsigned long) cache->evictions);
+	free(cache->found);
+	cache->found = NULL;
+	pthread_mutex_unlock(&cache->lock);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+struct rdma_mrcache_entry *rdma_mrcache_get(struct rdma_mrcache *cache,
+                                            struct ibv_pd *pd,
+                                            void *addr, uint64_t length,
+                                            enum ibv_access_flags access)
+{
+	struct rdma_mrcache_entry *e, *found = NULL;
+	uintptr_t start, end, lo, hi;
+	uint64_t reclaimed = 0;
+	unsigned int i, n;
+	if (!cache || !pd || !addr || !length)
+	{
+		rdma_error("Passed cache, pd or buffer is NULL\n");
+		return NULL;
+	}
+	/* Registrations pin whole pages anyway */
+	start = (uintptr_t) addr & ~(page_size() - 1);
+	end = ((uintptr_t) addr + length + page_size() - 1) & ~(page_size() - 1);
+	pthread_mutex_lock(&cache->lock);
+	cache->nr_found = 0;
+	if (find_overlaps(cache, cache->root, start, end))
+		goto fail;
+	/* An entry that covers the buffer with enough rights will do */
+	for (i = 0; i < cache->nr_found; i++)
+	{
+		e = cache->found[i];
+		if (e->pd == pd && (e->access & access) == (int) access &&
+		        e->start <= start && e->end >= end)
+		{
+			found = e;
+			break;
+		}
+	}
+	if (found)
+	{
+		if (found->refs++ == 0)
+			lru_remove(cache, found);
+		cache->hits++;
+		pthread_mutex_unlock(&cache->lock);
+		return found;
+	}
+	/* Otherwise one new MR replaces the overlapping ones with the same
+	 * rights. They do not overlap each other, so the union is one range.
+	 * Only those stay in 'found': make_room() may evict the others, and
+	 * we must not touch them after that. */
+	cache->misses++;
+	lo = start;
+	hi = end;
+	n = 0;
+	for (i = 0; i < cache->nr_found; i++)
+	{
+		e = cache->found[i];
+		if (e->pd != pd || e->access != (int) access)
+			continue;
+		cache->found[n++] = e;
+		e->merging = 1;
+		if (e->start < lo)
+			lo = e->start;
+		if (e->end > hi)
+			hi = e->end;
+		if (!e->refs)
+			reclaimed += e->end - e->start;
+	}
+	cache->nr_found = n;
+	/* rdma_buffer_register() takes a 32 bit length */
+	if (hi - lo > UINT32_MAX)
+	{
+		rdma_error("Cannot register %lu bytes at once\n", (unsigned long)(hi - lo));
+		goto fail;
+	}
+	if (make_room(cache, (hi - lo) > reclaimed ? (hi - lo) - reclaimed : 0))
+	{
+		rdma_error("Registering %lu bytes exceeds the pinned memory budget\n",
+		           (unsigned long)(hi - lo));
+		errno = ENOMEM;
+		goto fail;
+	}
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		goto fail;
+	e->mr = rdma_buffer_register(pd, (void*) lo, hi - lo, access);
+	if (!e->mr)
+	{
+		free(e);
+		goto fail;
+	}
+	e->pd = pd;
+	e->access = access;
+	e->start = lo;
+	e->end = hi;
+	e->refs = 1;
+	e->cached = 1;
+	e->prio = next_prio(cache);
+	for (i = 0; i < cache->nr_found; i++)
+	{
+		if (cache->found[i]->merging)
+		{
+			cache->merges++;
+			cache->found[i]->merging = 0;
+			detach(cache, cache->found[i]);
+		}
+	}
+	cache->pinned += hi - lo;
+	cache->root = tree_insert(cache->root, e);
+	pthread_mutex_unlock(&cache->lock);
+	return e;
+fail:
+	for (i = 0; i < cache->nr_found; i++)
+		cache->found[i]->merging = 0;
+	pthread_mutex_unlock(&cache->lock);
+	return NULL;
+}
+
+void rdma_mrcache_put(struct rdma_mrcache *cache,
+                      struct rdma_mrcache_entry *entry)
+{
+	if (!cache || !entry)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	if (--entry->refs == 0)
+	{
+		if (entry->cached)
+		{
+			lru_append(cache, entry);
+			/* The budget may have been exceeded while it was in use */
+			make_room(cache, 0);
+		}
+		else
+		{
+			release(cache, entry);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void rdma_mrcache_invalidate(struct rdma_mrcache *cache,
+                             void *addr, uint64_t length)
+{
+	unsigned int i;
+	if (!cache || !length)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	cache->nr_found = 0;
+	/* If we cannot even remember them, we forget everything */
+	if (find_overlaps(cache, cache->root, (uintptr_t) addr,
+	                  (uintptr_t) addr + length))
+	{
+		rdma_error("Failed to look up cached MRs, dropping all of them\n");
+		while (cache->root)
+			detach(cache, cache->root);
+		cache->nr_found = 0;
+	}
+	for (i = 0; i < cache->nr_found; i++)
+		detach(cache, cache->found[i]);
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,100 @@
+/*
+ * Header file for the memory registration cache.
+ *
+ * ibv_reg_mr() pins the pages of a buffer and sets up the translation in the
+ * NIC, which takes tens of microseconds. Buffers that are sent from again and
+ * again should not be registered again and again. The cache keeps memory
+ * regions (MRs) after use and hands them out again for any buffer they cover.
+ *
+ * Entries are keyed by (pd, address range, access flags) and live in an
+ * interval tree, so the MRs that cover or overlap a buffer are found in
+ * O(log n). A buffer that is only partly covered gets one new MR over the
+ * union of the buffer and the MRs it overlaps, which replaces them. Entries
+ * are reference counted; unused ones stay registered in LRU order and are
+ * deregistered when the pinned memory would exceed the budget. Memory that is
+ * freed must be invalidated first, or the cache keeps handing out an MR for
+ * pages that may by then belong to someone else; rdma_buffer_use_cache()
+ * makes rdma_buffer_free() do that.
+ *
+ * The cache is thread safe.
+ */
+
+#ifndef RDMA_MRCACHE_H
+#define RDMA_MRCACHE_H
+
+#include "rdma_common.h"
+
+#include <pthread.h>
+
+/* One cached registration */
+struct rdma_mrcache_entry
+{
+	struct ibv_mr *mr;
+	struct ibv_pd *pd;
+	int access;
+	/* registered range, page aligned */
+	uintptr_t start, end;
+	unsigned int refs;
+	/* in the tree; an entry that was replaced or invalidated while in use
+	 * is only kept until its last user puts it */
+	int cached;
+	int merging;
+	/* interval tree: a treap ordered by start, with the largest end of each
+	 * subtree */
+	struct rdma_mrcache_entry *left, *right;
+	uint32_t prio;
+	uintptr_t max_end;
+	/* LRU list of the unused entries */
+	struct rdma_mrcache_entry *lru_prev, *lru_next;
+};
+
+struct rdma_mrcache
+{
+	pthread_mutex_t lock;
+	struct rdma_mrcache_entry *root;
+	/* least recently used first */
+	struct rdma_mrcache_entry *lru_head, *lru_tail;
+	/* bytes pinned by all entries, and the most we allow, 0 = no limit */
+	uint64_t pinned, max_pinned;
+	uint32_t seed;
+	/* scratch space for the entries a lookup finds */
+	struct rdma_mrcache_entry **found;
+	unsigned int nr_found, max_found;
+	/* totals, for whoever is curious */
+	uint64_t hits, misses, merges, evictions;
+};
+
+/*
+ * Sets up an empty cache.
+ * @cache: cache to initialize
+ * @max_pinned: most bytes the cached MRs may pin, 0 = no limit
+ */
+int rdma_mrcache_init(struct rdma_mrcache *cache, uint64_t max_pinned);
+
+/* Deregisters all entries. None may be in use any more. */
+void rdma_mrcache_destroy(struct rdma_mrcache *cache);
+
+/*
+ * Returns a cache entry whose MR covers 'length' bytes at 'addr' with at
+ * least the given access, registering or extending an MR if needed. The
+ * lkey/rkey of entry->mr are valid for the buffer until the entry is put.
+ * Returns NULL if the registration fails or would exceed the budget.
+ */
+struct rdma_mrcache_entry *rdma_mrcache_get(struct rdma_mrcache *cache,
+                                            struct ibv_pd *pd,
+                                            void *addr, uint64_t length,
+                                            enum ibv_access_flags access);
+
+/* Drops a reference taken by rdma_mrcache_get() */
+void rdma_mrcache_put(struct rdma_mrcache *cache,
+                      struct rdma_mrcache_entry *entry);
+
+/*
+ * Forgets every registration that overlaps 'length' bytes at 'addr'. Has to
+ * be called before that memory is freed or unmapped. Entries still in use
+ * are deregistered when they are put.
+ */
+void rdma_mrcache_invalidate(struct rdma_mrcache *cache,
+                             void *addr, uint64_t length);
+
+#endif /* RDMA_MRCACHE_H */
@@ -0,0 +1,262 @@
+/*
+ * Implementation of the registered memory pool.
+ */
+
+#include "rdma_pool.h"
+
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+
+/* A buffer handed out by the pool; the user only sees the MR */
+struct rdma_pool_buf
+{
+	struct ibv_mr mr;
+	struct rdma_pool_arena *arena;
+	size_t offset;
+	size_t length;
+};
+
+static size_t round_up(size_t value, size_t align)
+{
+	return (value + align - 1) & ~(align - 1);
+}
+
+/* Maps 'size' bytes with the largest page size that is available */
+static void *map_huge(size_t size, size_t page_size)
+{
+	int shift = page_size == HUGE_1G ? 30 : 21;
+	void *addr;
+	if (size % page_size)
+		return NULL;
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+	            (shift << MAP_HUGE_SHIFT), -1, 0);
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static struct rdma_pool_arena *map_arena(struct rdma_pool *pool, size_t size)
+{
+	struct rdma_pool_arena *arena;
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+	/* 1 GB pages only for arenas of whole gigabytes, so that no more is
+	 * mapped than asked for */
+	arena->size = round_up(size, HUGE_2M);
+	if (arena->size % HUGE_1G == 0 && (arena->base = map_huge(arena->size, HUGE_1G)))
+		arena->page_size = HUGE_1G;
+	else if ((arena->base = map_huge(arena->size, HUGE_2M)))
+		arena->page_size = HUGE_2M;
+	else
+	{
+		/* No huge pages reserved: normal pages, which the kernel may
+		 * still back with transparent huge pages */
+		arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+		                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (arena->base == MAP_FAILED)
+		{
+			rdma_error("Failed to map an arena of %lu bytes, errno: %d \n",
+			           (unsigned long) arena->size, -errno);
+			free(arena);
+			return NULL;
+		}
+		madvise(arena->base, arena->size, MADV_HUGEPAGE);
+		arena->page_size = sysconf(_SC_PAGESIZE);
+	}
+	arena->free = calloc(1, sizeof(*arena->free));
+	arena->mr = rdma_buffer_register(pool->pd, arena->base, arena->size,
+	                                 pool->access);
+	if (!arena->free || !arena->mr)
+	{
+		rdma_error("Failed to set up an arena of %lu bytes\n",
+		           (unsigned long) arena->size);
+		if (arena->mr)
+			rdma_buffer_deregister(arena->mr);
+		free(arena->free);
+		munmap(arena->base, arena->size);
+		free(arena);
+		return NULL;
+	}
+	arena->free->length = arena->size;
+	pool->mapped += arena->size;
+	if (arena->page_size >= HUGE_2M)
+		pool->huge_mapped += arena->size;
+	debug("Pool arena of %lu bytes on %lu byte pages at %p \n",
+	      (unsigned long) arena->size, (unsigned long) arena->page_size,
+	      arena->base);
+	return arena;
+}
+
+/* First fit: takes 'length' bytes from the first free range that has them */
+static int take(struct rdma_pool_arena *arena, size_t length, size_t *offset)
+{
+	struct rdma_pool_extent **pp, *ext;
+	for (pp = &arena->free; (ext = *pp); pp = &ext->next)
+	{
+		if (ext->length < length)
+			continue;
+		*offset = ext->offset;
+		ext->offset += length;
+		ext->length -= length;
+		if (ext->length == 0)
+		{
+			*pp = ext->next;
+			free(ext);
+		}
+		return 0;
+	}
+	return -ENOMEM;
+}
+
+/* Puts a range back, merging it with its free neighbours */
+static int give(struct rdma_pool_arena *arena, size_t offset, size_t length)
+{
+	struct rdma_pool_extent **pp, *prev = NULL, *ext;
+	for (pp = &arena->free; *pp && (*pp)->offset < offset; pp = &(*pp)->next)
+		prev = *pp;
+	if (prev && prev->offset + prev->length == offset)
+	{
+		prev->length += length;
+		ext = prev->next;
+		if (ext && prev->offset + prev->length == ext->offset)
+		{
+			prev->length += ext->length;
+			prev->next = ext->next;
+			free(ext);
+		}
+		return 0;
+	}
+	if (*pp && offset + length == (*pp)->offset)
+	{
+		(*pp)->offset = offset;
+		(*pp)->length += length;
+		return 0;
+	}
+	ext = calloc(1, sizeof(*ext));
+	if (!ext)
+		return -ENOMEM;
+	ext->offset = offset;
+	ext->length = length;
+	ext->next = *pp;
+	*pp = ext;
+	return 0;
+}
+
+int rdma_pool_init(struct rdma_pool *pool, struct ibv_pd *pd,
+                   enum ibv_access_flags access, size_t arena_size)
+{
+	if (!pool || !pd)
+	{
+		rdma_error("Passed pool or pd is NULL\n");
+		return -EINVAL;
+	}
+	bzero(pool, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->pd = pd;
+	pool->access = access;
+	pool->arena_size = arena_size ? arena_size : RDMA_POOL_ARENA_SZ;
+	return 0;
+}
+
+void rdma_pool_destroy(struct rdma_pool *pool)
+{
+	struct rdma_pool_arena *arena;
+	struct rdma_pool_extent *ext;
+	if (!pool)
+		return;
+	debug("Pool mapped %lu bytes, %lu of them on huge pages \n",
+	      (unsigned long) pool->mapped, (unsigned long) pool->huge_mapped);
+	while ((arena = pool->arenas))
+	{
+		pool->arenas = arena->next;
+		while ((ext = arena->free))
+		{
+			arena->free = ext->next;
+			free(ext);
+		}
+		rdma_buffer_deregister(arena->mr);
+		munmap(arena->base, arena->size);
+		free(arena);
+	}
+	pthread_mutex_destroy(&pool->lock);
+}
+
+struct ibv_mr *rdma_pool_alloc(struct rdma_pool *pool, size_t length)
+{
+	struct rdma_pool_arena *arena;
+	struct rdma_pool_buf *buf;
+	size_t offset = 0;
+	if (!pool || length == 0)
+	{
+		rdma_error("Passed pool is NULL or length is 0\n");
+		return NULL;
+	}
+	buf = calloc(1, sizeof(*buf));
+	if (!buf)
+		return NULL;
+	length = round_up(length, RDMA_POOL_ALIGN);
+	pthread_mutex_lock(&pool->lock);
+	for (arena = pool->arenas; arena; arena = arena->next)
+	{
+		if (take(arena, length, &offset) == 0)
+			break;
+	}
+	if (!arena)
+	{
+		arena = map_arena(pool, length > pool->arena_size ? length : pool->arena_size);
+		if (!arena || take(arena, length, &offset))
+		{
+			pthread_mutex_unlock(&pool->lock);
+			free(buf);
+			return NULL;
+		}
+		arena->next = pool->arenas;
+		pool->arenas = arena;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	buf->arena = arena;
+	buf->offset = offset;
+	buf->length = length;
+	/* The view: the arena's registration, narrowed down to the buffer */
+	buf->mr = *arena->mr;
+	buf->mr.addr = arena->base + offset;
+	buf->mr.length = length;
+	/* like calloc(), also when the range was used before */
+	memset(buf->mr.addr, 0, length);
+	return &buf->mr;
+}
+
+void rdma_pool_free(struct rdma_pool *pool, struct ibv_mr *mr)
+{
+	struct rdma_pool_buf *buf = (struct rdma_pool_buf*) mr;
+	if (!pool || !mr)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	if (give(buf->arena, buf->offset, buf->length))
+		rdma_error("Failed to give %lu bytes back to the pool, they are lost\n",
+		           (unsigned long) buf->length);
+	pthread_mutex_unlock(&pool->lock);
+	free(buf);
+}
+
+int rdma_pool_owns(struct rdma_pool *pool, struct ibv_mr *mr)
+{
+	struct rdma_pool_arena *arena;
+	int owns = 0;
+	if (!pool || !mr)
+		return 0;
+	pthread_mutex_lock(&pool->lock);
+	for (arena = pool->arenas; arena && !owns; arena = arena->next)
+	{
+		owns = mr->handle == arena->mr->handle &&
+		       (char*) mr->addr >= arena->base &&
+		       (char*) mr->addr < arena->base + arena->size;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return owns;
+}
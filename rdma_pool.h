@@ -0,0 +1,86 @@
+/*
+ * Header file for the registered memory pool.
+ *
+ * Buffers from malloc() live on 4 KB pages. Registering 100 MB of them pins
+ * and translates 25000 pages, and the NIC needs as many translation entries
+ * to reach them. The pool instead maps large arenas on 1 GB or 2 MB huge pages
+ * (falling back to normal pages, with transparent huge pages requested),
+ * registers each arena once, and carves buffers out of them. A buffer comes
+ * as a memory region (MR) of its own, so it can be used like any other: the
+ * addr and length are those of the buffer, the keys those of its arena.
+ *
+ * Such an MR is only a view of the arena's registration. It must be given
+ * back with rdma_pool_free(), never deregistered.
+ */
+
+#ifndef RDMA_POOL_H
+#define RDMA_POOL_H
+
+#include "rdma_common.h"
+
+#include <pthread.h>
+
+/* Default arena size, larger buffers get an arena of their own */
+#define RDMA_POOL_ARENA_SZ (64UL << 20)
+/* Every buffer starts on a cache line */
+#define RDMA_POOL_ALIGN (64)
+
+/* A free range of an arena */
+struct rdma_pool_extent
+{
+	size_t offset;
+	size_t length;
+	struct rdma_pool_extent *next;
+};
+
+/* One mapped and registered arena */
+struct rdma_pool_arena
+{
+	char *base;
+	size_t size;
+	/* page size the arena is mapped with */
+	size_t page_size;
+	struct ibv_mr *mr;
+	/* free ranges, by offset */
+	struct rdma_pool_extent *free;
+	struct rdma_pool_arena *next;
+};
+
+struct rdma_pool
+{
+	pthread_mutex_t lock;
+	struct ibv_pd *pd;
+	/* every arena is registered with these rights */
+	enum ibv_access_flags access;
+	size_t arena_size;
+	struct rdma_pool_arena *arenas;
+	/* totals, for whoever is curious */
+	uint64_t mapped, huge_mapped;
+};
+
+/*
+ * Sets up an empty pool; arenas are mapped as buffers are needed.
+ * @pool: pool to initialize
+ * @pd: protection domain the arenas are registered in
+ * @access: OR of IBV_ACCESS_* rights of every buffer of the pool
+ * @arena_size: size of an arena, 0 for RDMA_POOL_ARENA_SZ
+ */
+int rdma_pool_init(struct rdma_pool *pool, struct ibv_pd *pd,
+                   enum ibv_access_flags access, size_t arena_size);
+
+/* Unmaps all arenas. No buffer may be in use any more. */
+void rdma_pool_destroy(struct rdma_pool *pool);
+
+/*
+ * Returns a zeroed, registered buffer of 'length' bytes as an MR, or NULL if
+ * there is no memory.
+ */
+struct ibv_mr *rdma_pool_alloc(struct rdma_pool *pool, size_t length);
+
+/* Gives a buffer from rdma_pool_alloc() back */
+void rdma_pool_free(struct rdma_pool *pool, struct ibv_mr *mr);
+
+/* Tells whether an MR is a buffer of the pool */
+int rdma_pool_owns(struct rdma_pool *pool, struct ibv_mr *mr);
+
+#endif /* RDMA_POOL_H */
@@ -0,0 +1,104 @@
+/*
+ * Implementation of rails.
+ */
+
+#include "rdma_rail.h"
+#include "rdma_sizing.h"
+
+int rdma_rail_parse(char *spec, struct rdma_rail *rails, int max, uint16_t port)
+{
+	char *save = NULL, *item, *local, *remote, *weight;
+	int n = 0, ret;
+	for (item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save))
+	{
+		if (n == max)
+		{
+			rdma_error("More than %d rails\n", max);
+			return -E2BIG;
+		}
+		local = item;
+		remote = strchr(item, ':');
+		if (!remote || !remote[1])
+		{
+			rdma_error("Rail %s has no remote address\n", item);
+			return -EINVAL;
+		}
+		*remote++ = '\0';
+		weight = strchr(remote, ':');
+		if (weight)
+			*weight++ = '\0';
+		bzero(&rails[n], sizeof(rails[n]));
+		if (*local)
+		{
+			ret = get_addr(local, (struct sockaddr*) &rails[n].src);
+			if (ret)
+				return -EINVAL;
+			rails[n].src.sin_port = 0;
+		}
+		ret = get_addr(remote, (struct sockaddr*) &rails[n].dst);
+		if (ret)
+			return -EINVAL;
+		rails[n].dst.sin_port = port;
+		rails[n].weight = weight ? strtoul(weight, NULL, 0) : 0;
+		n++;
+	}
+	return n;
+}
+
+static const char *port_state(enum ibv_port_state state)
+{
+	switch (state)
+	{
+	case IBV_PORT_DOWN: return "down";
+	case IBV_PORT_INIT: return "init";
+	case IBV_PORT_ARMED: return "armed";
+	case IBV_PORT_ACTIVE: return "active";
+	default: return "?";
+	}
+}
+
+int rdma_rail_list_devices(FILE *out)
+{
+	struct ibv_device **list;
+	struct ibv_context *verbs;
+	struct ibv_device_attr dev_attr;
+	struct ibv_port_attr port_attr;
+	int nr = 0, i, p;
+	list = ibv_get_device_list(&nr);
+	if (!list)
+	{
+		rdma_error("Failed to get the RDMA devices, errno: %d \n", -errno);
+		return -errno;
+	}
+	for (i = 0; i < nr; i++)
+	{
+		verbs = ibv_open_device(list[i]);
+		if (!verbs)
+		{
+			fprintf(out, "%s: failed to open, errno: %d\n",
+			        ibv_get_device_name(list[i]), -errno);
+			continue;
+		}
+		if (ibv_query_device(verbs, &dev_attr))
+		{
+			fprintf(out, "%s: failed to query, errno: %d\n",
+			        ibv_get_device_name(list[i]), -errno);
+			ibv_close_device(verbs);
+			continue;
+		}
+		for (p = 1; p <= dev_attr.phys_port_cnt; p++)
+		{
+			if (ibv_query_port(verbs, p, &port_attr))
+				continue;
+			fprintf(out, "%s port %d: %s, %s, %lu Mbit/s\n",
+			        ibv_get_device_name(list[i]), p,
+			        port_state(port_attr.state),
+			        port_attr.link_layer == IBV_LINK_LAYER_ETHERNET ?
+			        "Ethernet" : "InfiniBand",
+			        (unsigned long) rdma_sizing_port_mbps(&port_attr));
+		}
+		ibv_close_device(verbs);
+	}
+	ibv_free_device_list(list);
+	return nr;
+}
@@ -0,0 +1,46 @@
+/*
+ * Header file for rails: the several RDMA devices and ports of a host.
+ *
+ * A host with a dual-port NIC, or with more than one NIC, has one link per
+ * port, and a connection only ever uses the port its address resolves to.
+ * A rail is one path between the two hosts: a local address, which picks
+ * the local device and port, and the address of the peer on the same
+ * network. Opening a stripe lane (see rdma_stripe.h) on every rail spreads
+ * one connection's transfers over all of the links, in proportion to the
+ * weight of each rail, by default the link speed of its local port.
+ *
+ * Rails are given on the command line as a comma separated list of
+ * [local]:remote[:weight], for instance
+ *     10.0.0.1:10.0.0.2,10.0.1.1:10.0.1.2:2
+ * Without a local address the route picks the device.
+ */
+
+#ifndef RDMA_RAIL_H
+#define RDMA_RAIL_H
+
+#include "rdma_common.h"
+
+/* Most rails, and most addresses a server listens on */
+#define RDMA_RAIL_MAX (8)
+
+struct rdma_rail
+{
+	/* sin_family 0 = whatever the route picks */
+	struct sockaddr_in src;
+	struct sockaddr_in dst;
+	/* share of the traffic, 0 = the link speed of the local port in Gbit/s */
+	uint32_t weight;
+};
+
+/*
+ * Parses a list of rails. Returns how many there are, or a negative error.
+ * @spec: [local]:remote[:weight],... ; it is cut up in place
+ * @port: port of every remote address, in network order
+ */
+int rdma_rail_parse(char *spec, struct rdma_rail *rails, int max, uint16_t port);
+
+/* Prints every RDMA device of the host with its ports, their state and
+ * their link speed. Returns the number of devices, or a negative error. */
+int rdma_rail_list_devices(FILE *out);
+
+#endif /* RDMA_RAIL_H */
@@ -0,0 +1,813 @@
+/*
+ * Implementation of the single-producer/single-consumer log ring.
+ */
+
+#include "rdma_ring.h"
+#include "rdma_trace.h"
+#include "rdma_stats.h"
+
+/* Sequence numbers start at 1 and skip 0, which is what a zeroed ring holds */
+static uint32_t next_seq(uint32_t seq)
+{
+	seq++;
+	return seq ? seq : 1;
+}
+
+uint64_t rdma_ring_usable_size(uint64_t length)
+{
+	return length - (length % RDMA_RING_ALIGN);
+}
+
+/* Offset of the footer from the start of a record */
+static uint64_t footer_offset(uint32_t length)
+{
+	uint64_t sz = sizeof(struct rdma_ring_hdr) + (uint64_t) length;
+	return (sz + sizeof(struct rdma_ring_ftr) - 1) &
+	       ~((uint64_t) sizeof(struct rdma_ring_ftr) - 1);
+}
+
+/* Prepares an RDMA write of 'length' bytes from 'addr' to ring offset 'off' */
+static void prepare_write(struct rdma_ring_producer *prod,
+                          struct ibv_send_wr *wr, struct ibv_sge *sge,
+                          char *addr, uint32_t lkey,
+                          uint64_t off, uint32_t length)
+{
+	sge->addr = (uint64_t) addr;
+	sge->length = length;
+	sge->lkey = lkey;
+	bzero(wr, sizeof(*wr));
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->opcode = IBV_WR_RDMA_WRITE;
+	wr->wr.rdma.remote_addr = prod->remote.address + off;
+	wr->wr.rdma.rkey = prod->remote.stag.remote_stag;
+}
+
+uint64_t rdma_ring_record_size(uint32_t length)
+{
+	uint64_t sz = footer_offset(length) + sizeof(struct rdma_ring_ftr);
+	return (sz + RDMA_RING_ALIGN - 1) & ~((uint64_t) RDMA_RING_ALIGN - 1);
+}
+
+int rdma_ring_producer_init(struct rdma_ring_producer *prod,
+                            struct ibv_pd *pd,
+                            struct rdma_sendq *sq,
+                            struct ibv_mr *mr)
+{
+	if (!prod || !pd || !sq || !mr)
+	{
+		rdma_error("Passed producer resources are NULL\n");
+		return -EINVAL;
+	}
+	bzero(prod, sizeof(*prod));
+	prod->sq = sq;
+	prod->mr = mr;
+	prod->seq = 1;
+	/* The consumer writes its head here */
+	prod->head_mr = rdma_buffer_register(pd, &prod->head, sizeof(prod->head),
+	                                     (IBV_ACCESS_LOCAL_WRITE |
+	                                      IBV_ACCESS_REMOTE_WRITE));
+	if (!prod->head_mr)
+	{
+		rdma_error("Failed to register the ring head, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+int rdma_ring_producer_connect(struct rdma_ring_producer *prod,
+                               struct rdma_buffer_attr *remote)
+{
+	if (!prod || !remote)
+	{
+		rdma_error("Passed producer or remote attr is NULL\n");
+		return -EINVAL;
+	}
+	memcpy(&prod->remote, remote, sizeof(prod->remote));
+	/* The staging buffer mirrors the remote ring, so the ring can not be
+	 * larger than either of them */
+	prod->size = rdma_ring_usable_size(remote->length < prod->mr->length ?
+	                                   remote->length : prod->mr->length);
+	if (prod->size == 0)
+	{
+		rdma_error("Ring buffer is too small, remote: %u local: %lu\n",
+		           remote->length, (unsigned long) prod->mr->length);
+		return -EINVAL;
+	}
+	debug("Ring producer ready, size: %lu bytes \n", (unsigned long) prod->size);
+	return 0;
+}
+
+int rdma_ring_producer_enable_pull(struct rdma_ring_producer *prod,
+                                   struct ibv_pd *pd)
+{
+	if (!prod || !pd)
+	{
+		rdma_error("Passed producer or pd is NULL\n");
+		return -EINVAL;
+	}
+	/* The consumer reads our tail from here */
+	prod->tail_mr = rdma_buffer_register(pd, &prod->pull_tail,
+	                                     sizeof(prod->pull_tail),
+	                                     (IBV_ACCESS_LOCAL_WRITE |
+	                                      IBV_ACCESS_REMOTE_READ));
+	if (!prod->tail_mr)
+	{
+		rdma_error("Failed to register the ring tail, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	prod->pull = 1;
+	return 0;
+}
+
+void rdma_ring_producer_destroy(struct rdma_ring_producer *prod)
+{
+	if (!prod)
+		return;
+	if (prod->head_mr)
+	{
+		rdma_buffer_deregister(prod->head_mr);
+		prod->head_mr = NULL;
+	}
+	if (prod->tail_mr)
+	{
+		rdma_buffer_deregister(prod->tail_mr);
+		prod->tail_mr = NULL;
+	}
+}
+
+/* Free bytes as far as the producer knows. The head only grows, so a stale
+ * value only makes us more conservative. */
+static uint64_t ring_free(struct rdma_ring_producer *prod)
+{
+	uint64_t head = __atomic_load_n(&prod->head, __ATOMIC_ACQUIRE);
+	return prod->size - (prod->tail - head);
+}
+
+/* Makes room for a record at the tail, writing a wrap header first if the
+ * record would straddle the end of the ring. Returns 0, -EAGAIN when the ring
+ * has no room yet, or another negative error. */
+static int reserve(struct rdma_ring_producer *prod, uint32_t length)
+{
+	uint64_t rec = rdma_ring_record_size(length);
+	uint64_t off = prod->tail % prod->size;
+	uint64_t skip = 0;
+	struct rdma_ring_hdr *hdr;
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	struct ibv_sge sge;
+	int ret;
+	if (rec > prod->size)
+	{
+		rdma_error("Record of %u bytes does not fit into the ring\n", length);
+		return -EINVAL;
+	}
+	/* A record never straddles the end of the ring */
+	if (off + rec > prod->size)
+		skip = prod->size - off;
+	if (ring_free(prod) < skip + rec)
+	{
+		/* The consumer only makes room for records it can see, so none
+		 * may be left waiting in a batch */
+		ret = rdma_sendq_flush(prod->sq);
+		return ret ? ret : -EAGAIN;
+	}
+	if (skip)
+	{
+		/* Tell the consumer to continue at the start. Offsets are aligned,
+		 * so there is always room for a header before the end. */
+		hdr = (void*)((char*) prod->mr->addr + off);
+		hdr->seq = prod->seq;
+		hdr->length = RDMA_RING_WRAP;
+		/* in pull mode it is read along with the next record */
+		if (!prod->pull)
+		{
+			prepare_write(prod, &wr, &sge, (char*) hdr, prod->mr->lkey, off,
+			              sizeof(*hdr));
+			ret = rdma_sendq_post(prod->sq, &wr, &bad_wr);
+			if (ret)
+				return ret;
+		}
+		prod->tail += skip;
+		prod->seq = next_seq(prod->seq);
+	}
+	return 0;
+}
+
+/* Pull mode: lays out a record at the tail of the staging buffer, as
+ * post_record() would write it into the remote ring, and publishes the new
+ * tail. The consumer reads the tail before the record, so the record has to
+ * be in place first. */
+static int stage_record(struct rdma_ring_producer *prod, char *rec,
+                        uint32_t hdr_len, struct ibv_sge *frags, int nr_frags)
+{
+	char *dst = (char*) prod->mr->addr + prod->tail % prod->size;
+	struct rdma_ring_hdr *hdr = (void*) dst;
+	struct rdma_ring_ftr *ftr;
+	uint32_t length = hdr_len;
+	char *p;
+	int i;
+	if (rec != dst)
+		memcpy(dst + sizeof(*hdr), rec + sizeof(*hdr), hdr_len);
+	p = dst + sizeof(*hdr) + hdr_len;
+	for (i = 0; i < nr_frags; i++)
+	{
+		memcpy(p, (void*)(uintptr_t) frags[i].addr, frags[i].length);
+		p += frags[i].length;
+		length += frags[i].length;
+	}
+	ftr = (void*)(dst + footer_offset(length));
+	hdr->seq = ftr->seq = prod->seq;
+	hdr->length = ftr->length = length;
+	prod->tail += rdma_ring_record_size(length);
+	rdma_trace(RDMA_TRACE_RING_COMMIT, prod->seq, length, prod->tail, 0);
+	rdma_stats_add(prod->sq->stats, RDMA_STATS_MESSAGES, 1);
+	rdma_stats_add(prod->sq->stats, RDMA_STATS_MESSAGE_BYTES, length);
+	prod->seq = next_seq(prod->seq);
+	__atomic_store_n(&prod->pull_tail, prod->tail, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Writes a record to the tail: the header and the first 'hdr_len' payload
+ * bytes laid out at 'rec', followed by the payload fragments, if any, in
+ * one write, and the footer, which is placed behind the first part at 'rec',
+ * in a second write. That one carries 'wr_id', so whoever retires it knows
+ * that neither 'rec' nor the fragments are read any more. */
+static int post_record(struct rdma_ring_producer *prod, char *rec, uint32_t lkey,
+                       uint32_t hdr_len, struct ibv_sge *frags, int nr_frags,
+                       unsigned int send_flags, uint64_t wr_id)
+{
+	uint64_t off = prod->tail % prod->size;
+	struct rdma_ring_hdr *hdr = (void*) rec;
+	struct rdma_ring_ftr *ftr = (void*)(rec + footer_offset(hdr_len));
+	struct ibv_send_wr wr[2], *bad_wr = NULL;
+	struct ibv_sge sge[RDMA_RING_MAX_FRAGS + 2];
+	uint32_t length = hdr_len;
+	int notify = prod->imm_every && prod->unnotified + 1 >= prod->imm_every;
+	int ret, i;
+	if (prod->pull)
+		return stage_record(prod, rec, hdr_len, frags, nr_frags);
+	for (i = 0; i < nr_frags; i++)
+		length += frags[i].length;
+	hdr->seq = ftr->seq = prod->seq;
+	hdr->length = ftr->length = length;
+	/* The header and the payload first, and the footer last, in a write of
+	 * its own */
+	prepare_write(prod, &wr[0], &sge[0], rec, lkey, off, sizeof(*hdr) + hdr_len);
+	for (i = 0; i < nr_frags; i++)
+		sge[1 + i] = frags[i];
+	wr[0].num_sge = 1 + nr_frags;
+	prepare_write(prod, &wr[1], &sge[RDMA_RING_MAX_FRAGS + 1], (char*) ftr, lkey,
+	              off + footer_offset(length), sizeof(*ftr));
+	wr[0].next = &wr[1];
+	wr[1].send_flags = send_flags;
+	wr[1].wr_id = wr_id;
+	/* Every imm_every-th record also raises a completion at the consumer */
+	if (notify)
+	{
+		wr[1].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+		wr[1].imm_data = htonl(prod->seq);
+	}
+	ret = rdma_sendq_post(prod->sq, wr, &bad_wr);
+	if (ret)
+	{
+		/* If only the payload made it into the send queue, the consumer
+		 * never sees a footer for it; committing again simply rewrites
+		 * the same record. */
+		return ret;
+	}
+	prod->unnotified = notify ? 0 : prod->unnotified + 1;
+	prod->tail += rdma_ring_record_size(length);
+	rdma_trace(RDMA_TRACE_RING_COMMIT, prod->seq, length, prod->tail, 0);
+	rdma_stats_add(prod->sq->stats, RDMA_STATS_MESSAGES, 1);
+	rdma_stats_add(prod->sq->stats, RDMA_STATS_MESSAGE_BYTES, length);
+	prod->seq = next_seq(prod->seq);
+	return 0;
+}
+
+int rdma_ring_reserve(struct rdma_ring_producer *prod, uint32_t length,
+                      void **payload)
+{
+	int ret = reserve(prod, length);
+	if (ret)
+		return ret;
+	*payload = (char*) prod->mr->addr + prod->tail % prod->size +
+	           sizeof(struct rdma_ring_hdr);
+	return 0;
+}
+
+int rdma_ring_commit(struct rdma_ring_producer *prod, uint32_t length,
+                     unsigned int send_flags)
+{
+	return post_record(prod, (char*) prod->mr->addr + prod->tail % prod->size,
+	                   prod->mr->lkey, length, NULL, 0, send_flags, 0);
+}
+
+/* Checks that a header and 'nr_frags' fragments fit into one write */
+static int check_frags(struct rdma_ring_producer *prod, int nr_frags)
+{
+	if (nr_frags < 0 || nr_frags > RDMA_RING_MAX_FRAGS ||
+	        1 + (uint32_t) nr_frags > prod->sq->max_sge)
+	{
+		rdma_error("%d payload fragments are more than the %u SGEs of the QP take\n",
+		           nr_frags, prod->sq->max_sge);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int rdma_ring_commit_frags(struct rdma_ring_producer *prod, uint32_t hdr_len,
+                           struct ibv_sge *frags, int nr_frags,
+                           unsigned int send_flags, uint64_t wr_id)
+{
+	int ret = check_frags(prod, nr_frags);
+	if (ret)
+		return ret;
+	return post_record(prod, (char*) prod->mr->addr + prod->tail % prod->size,
+	                   prod->mr->lkey, hdr_len, frags, nr_frags, send_flags,
+	                   wr_id);
+}
+
+int rdma_ring_commit_iov(struct rdma_ring_producer *prod,
+                         struct rdma_slots *slots, void *slot, uint32_t hdr_len,
+                         struct ibv_sge *frags, int nr_frags,
+                         unsigned int send_flags)
+{
+	uint64_t length = hdr_len;
+	int ret, i;
+	if (rdma_ring_record_size(hdr_len) > slots->slot_size)
+	{
+		rdma_error("Record header of %u bytes does not fit into a slot\n", hdr_len);
+		return -EINVAL;
+	}
+	ret = check_frags(prod, nr_frags);
+	if (ret)
+		return ret;
+	for (i = 0; i < nr_frags; i++)
+		length += frags[i].length;
+	if (length >= RDMA_RING_WRAP)
+	{
+		rdma_error("Record of %lu bytes is too long for a record header\n",
+		           (unsigned long) length);
+		return -EINVAL;
+	}
+	ret = reserve(prod, length);
+	if (ret)
+		return ret;
+	/* An inline record is copied out of the slot and the fragments when it
+	 * is posted, and a pulled one into the staging buffer, so the slot is
+	 * free again right away, not when the write is retired */
+	if (prod->pull ||
+	        rdma_sendq_inlines(prod->sq, sizeof(struct rdma_ring_hdr) + length))
+	{
+		ret = post_record(prod, slot, slots->mr->lkey, hdr_len, frags, nr_frags,
+		                  send_flags, 0);
+		if (!ret)
+			rdma_slots_put(slots, slot);
+		return ret;
+	}
+	return post_record(prod, slot, slots->mr->lkey, hdr_len, frags, nr_frags,
+	                   send_flags, (uintptr_t) slot);
+}
+
+int rdma_ring_commit_slot(struct rdma_ring_producer *prod,
+                          struct rdma_slots *slots, void *slot,
+                          uint32_t length, unsigned int send_flags)
+{
+	return rdma_ring_commit_iov(prod, slots, slot, length, NULL, 0, send_flags);
+}
+
+int rdma_ring_notify(struct rdma_ring_producer *prod)
+{
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	int ret;
+	if (prod->pull || !prod->imm_every || !prod->unnotified)
+		return 0;
+	/* A zero length write needs no memory, only the immediate matters */
+	bzero(&wr, sizeof(wr));
+	wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr.imm_data = htonl(prod->seq);
+	wr.wr.rdma.remote_addr = prod->remote.address;
+	wr.wr.rdma.rkey = prod->remote.stag.remote_stag;
+	ret = rdma_sendq_post(prod->sq, &wr, &bad_wr);
+	if (ret)
+		return ret;
+	prod->unnotified = 0;
+	return 0;
+}
+
+int rdma_ring_consumer_init(struct rdma_ring_consumer *cons,
+                            struct ibv_pd *pd,
+                            struct ibv_qp *qp,
+                            char *base,
+                            uint64_t length,
+                            struct rdma_buffer_attr *remote_head)
+{
+	if (!cons || !pd || !qp || !base || !remote_head)
+	{
+		rdma_error("Passed consumer resources are NULL\n");
+		return -EINVAL;
+	}
+	bzero(cons, sizeof(*cons));
+	cons->qp = qp;
+	cons->base = base;
+	cons->size = rdma_ring_usable_size(length);
+	cons->seq = 1;
+	/* The head update is 8 bytes, small enough to go inline on most QPs */
+	cons->max_inline = rdma_qp_max_inline(qp);
+	memcpy(&cons->remote_head, remote_head, sizeof(cons->remote_head));
+	if (cons->size == 0 || remote_head->length < sizeof(uint64_t))
+	{
+		rdma_error("Ring buffer or remote head is too small\n");
+		return -EINVAL;
+	}
+	cons->publish_mr = rdma_buffer_register(pd, &cons->publish_value,
+	                                        sizeof(cons->publish_value),
+	                                        IBV_ACCESS_LOCAL_WRITE);
+	if (!cons->publish_mr)
+	{
+		rdma_error("Failed to register the ring head, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	debug("Ring consumer ready, size: %lu bytes \n", (unsigned long) cons->size);
+	return 0;
+}
+
+void rdma_ring_consumer_destroy(struct rdma_ring_consumer *cons)
+{
+	if (!cons)
+		return;
+	if (cons->publish_mr)
+	{
+		rdma_buffer_deregister(cons->publish_mr);
+		cons->publish_mr = NULL;
+	}
+	if (cons->pull_mr)
+	{
+		rdma_buffer_deregister(cons->pull_mr);
+		cons->pull_mr = NULL;
+	}
+	free(cons->recv_wrs);
+	cons->recv_wrs = NULL;
+}
+
+void *rdma_ring_peek(struct rdma_ring_consumer *cons, uint32_t *length)
+{
+	struct rdma_ring_hdr hdr;
+	struct rdma_ring_ftr *ftr;
+	uint64_t off, word;
+	if (cons->error)
+		return NULL;
+	while (1)
+	{
+		off = cons->head % cons->size;
+		/* The header is read as one 8 byte word, so the sequence number and
+		 * the length we act on belong to the same write */
+		word = __atomic_load_n((uint64_t*)(void*)(cons->base + off),
+		                       __ATOMIC_ACQUIRE);
+		memcpy(&hdr, &word, sizeof(hdr));
+		if ((cons->pull && cons->head >= cons->pulled) || hdr.seq != cons->seq)
+		{
+			/* Nothing new. Let the producer see what we consumed so far,
+			 * so that it never waits on a head we are sitting on, and in
+			 * pull mode go and get more. */
+			rdma_ring_publish_head(cons);
+			cons->error = rdma_ring_pull(cons);
+			return NULL;
+		}
+		if (hdr.length != RDMA_RING_WRAP)
+			break;
+		cons->head += cons->size - off;
+		cons->seq = next_seq(cons->seq);
+	}
+	if (rdma_ring_record_size(hdr.length) > cons->size - off)
+	{
+		rdma_error("Corrupt ring record, seq: %u length: %u\n",
+		           hdr.seq, hdr.length);
+		cons->error = -EIO;
+		return NULL;
+	}
+	/* A pulled record is complete once all of it is read; a read may end in
+	 * the middle of one */
+	if (cons->pull && cons->head + rdma_ring_record_size(hdr.length) > cons->pulled)
+	{
+		cons->error = rdma_ring_pull(cons);
+		return NULL;
+	}
+	/* The payload is only complete once the footer has landed as well */
+	ftr = (void*)(cons->base + off + footer_offset(hdr.length));
+	word = __atomic_load_n((uint64_t*)(void*) ftr, __ATOMIC_ACQUIRE);
+	if (memcmp(&word, &hdr, sizeof(hdr)) != 0)
+		return NULL;
+	cons->peeked = hdr.length;
+	if (!cons->peek_tsc && rdma_hist_on())
+		cons->peek_tsc = rdma_tsc();
+	*length = hdr.length;
+	return cons->base + off + sizeof(hdr);
+}
+
+void *rdma_ring_wait(struct rdma_ring_consumer *cons, uint32_t *length)
+{
+	struct ibv_qp *qp = cons->qp;
+	struct ibv_wc wc;
+	void *payload;
+	int ret;
+	while (!(payload = rdma_ring_peek(cons, length)))
+	{
+		if (cons->error)
+			return NULL;
+		ret = ibv_poll_cq(qp->send_cq, 1, &wc);
+		if (ret == 0 && qp->recv_cq != qp->send_cq)
+			ret = ibv_poll_cq(qp->recv_cq, 1, &wc);
+		if (ret < 0)
+		{
+			rdma_error("Failed to poll cq for wc due to %d \n", ret);
+			return NULL;
+		}
+		if (ret == 0)
+			cpu_relax();
+		else if (rdma_ring_consumer_complete(cons, &wc) < 0)
+			return NULL;
+	}
+	return payload;
+}
+
+int rdma_ring_consumer_complete(struct rdma_ring_consumer *cons,
+                                struct ibv_wc *wc)
+{
+	struct ibv_recv_wr *bad_wr = NULL;
+	int ret;
+	if (wc->status != IBV_WC_SUCCESS)
+	{
+		rdma_error("Work completion (WC) has error status: %d (means: %s)\n",
+		           -wc->status, ibv_wc_status_str(wc->status));
+		return -(wc->status);
+	}
+	if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM)
+	{
+		/* The data of a write with immediate is placed before its
+		 * completion is generated. The receive goes back to the pool. */
+		cons->notified++;
+		/* Receives from a shared receive queue are up to its owner */
+		if (!cons->recv_wrs)
+			return 1;
+		if (wc->wr_id >= cons->nr_recv)
+			return -EINVAL;
+		ret = ibv_post_recv(cons->qp, &cons->recv_wrs[wc->wr_id], &bad_wr);
+		if (ret)
+		{
+			rdma_error("Failed to re-post a receive, errno: %d \n", ret);
+			return -ret;
+		}
+		return 1;
+	}
+	if (wc->wr_id == (uintptr_t) cons)
+		cons->publish_inflight = 0;
+	else if (wc->wr_id == (uintptr_t) &cons->pull_value)
+	{
+		/* The producer never gets more than a ring ahead of our head, and
+		 * its tail never goes back */
+		cons->pull_inflight = 0;
+		if (cons->pull_value < cons->tail_seen ||
+		        cons->pull_value > cons->head + cons->size)
+		{
+			rdma_error("Corrupt ring tail: %lu\n", (unsigned long) cons->pull_value);
+			return -EINVAL;
+		}
+		/* the records right away, if there are new ones */
+		if (cons->pull_value != cons->tail_seen)
+		{
+			cons->tail_seen = cons->pull_value;
+			cons->pull_backoff_ns = 0;
+			return rdma_ring_pull(cons);
+		}
+		if (cons->pull_backoff_ns < RDMA_RING_PULL_BACKOFF_NS)
+			cons->pull_backoff_ns = cons->pull_backoff_ns ?
+			                        cons->pull_backoff_ns * 2 : 1000;
+		cons->pull_next_ns = rdma_now_ns() + cons->pull_backoff_ns;
+	}
+	else if (wc->wr_id == (uintptr_t) &cons->pulled)
+	{
+		cons->pull_inflight = 0;
+		cons->pulled = cons->pull_target;
+	}
+	return 0;
+}
+
+int rdma_ring_consumer_enable_pull(struct rdma_ring_consumer *cons,
+                                   struct ibv_pd *pd, uint32_t lkey,
+                                   struct rdma_buffer_attr *remote_ring,
+                                   struct rdma_buffer_attr *remote_tail,
+                                   uint32_t chunk)
+{
+	if (!cons || !pd || !remote_ring || !remote_tail)
+	{
+		rdma_error("Passed consumer resources are NULL\n");
+		return -EINVAL;
+	}
+	/* The producer lays out its ring in its staging buffer exactly like we
+	 * do in ours */
+	if (remote_ring->length < cons->size || remote_tail->length < sizeof(uint64_t))
+	{
+		rdma_error("Producer ring or tail is too small\n");
+		return -EINVAL;
+	}
+	cons->pull_mr = rdma_buffer_register(pd, &cons->pull_value,
+	                                     sizeof(cons->pull_value),
+	                                     IBV_ACCESS_LOCAL_WRITE);
+	if (!cons->pull_mr)
+	{
+		rdma_error("Failed to register the pulled tail, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	memcpy(&cons->remote_ring, remote_ring, sizeof(cons->remote_ring));
+	memcpy(&cons->remote_tail, remote_tail, sizeof(cons->remote_tail));
+	cons->lkey = lkey;
+	/* Reads end on a record boundary or a multiple of RDMA_RING_ALIGN, so
+	 * a header is always read as a whole */
+	if (chunk == 0)
+		chunk = RDMA_RING_PULL_CHUNK;
+	cons->pull_chunk = chunk - (chunk % RDMA_RING_ALIGN);
+	if (cons->pull_chunk == 0)
+		cons->pull_chunk = RDMA_RING_ALIGN;
+	cons->pull = 1;
+	debug("Ring consumer pulls %u bytes at a time \n", cons->pull_chunk);
+	return 0;
+}
+
+/* Prepares an RDMA read of 'length' bytes at ring offset 'off' into the same
+ * offset of our ring */
+static void prepare_read(struct rdma_ring_consumer *cons,
+                         struct ibv_send_wr *wr, struct ibv_sge *sge,
+                         uint64_t off, uint32_t length)
+{
+	sge->addr = (uint64_t) (cons->base + off);
+	sge->length = length;
+	sge->lkey = cons->lkey;
+	bzero(wr, sizeof(*wr));
+	wr->sg_list = sge;
+	wr->num_sge = 1;
+	wr->opcode = IBV_WR_RDMA_READ;
+	wr->wr.rdma.remote_addr = cons->remote_ring.address + off;
+	wr->wr.rdma.rkey = cons->remote_ring.stag.remote_stag;
+}
+
+int rdma_ring_pull(struct rdma_ring_consumer *cons)
+{
+	struct ibv_send_wr wr[2], *bad_wr = NULL;
+	struct ibv_sge sge[2];
+	uint64_t off, len = 0, first;
+	int ret;
+	if (!cons->pull || cons->pull_inflight)
+		return 0;
+	if (cons->pulled == cons->tail_seen)
+	{
+		/* An idle producer is asked less and less often, so that a
+		 * worker spinning on many rings does not flood their QPs with
+		 * tail reads */
+		if (cons->pull_backoff_ns && rdma_now_ns() < cons->pull_next_ns)
+			return 0;
+		/* We have everything we know of, ask for the tail. It is
+		 * published after the records before it are in place, and we
+		 * read those only once the tail read completed. */
+		sge[0].addr = (uint64_t) cons->pull_mr->addr;
+		sge[0].length = sizeof(cons->pull_value);
+		sge[0].lkey = cons->pull_mr->lkey;
+		bzero(&wr[0], sizeof(wr[0]));
+		wr[0].wr_id = (uintptr_t) &cons->pull_value;
+		wr[0].sg_list = &sge[0];
+		wr[0].num_sge = 1;
+		wr[0].opcode = IBV_WR_RDMA_READ;
+		wr[0].send_flags = IBV_SEND_SIGNALED;
+		wr[0].wr.rdma.remote_addr = cons->remote_tail.address;
+		wr[0].wr.rdma.rkey = cons->remote_tail.stag.remote_stag;
+	}
+	else
+	{
+		/* The next chunk of records, in two reads if it wraps around the
+		 * end of the ring. Both land where the producer staged them. */
+		len = cons->tail_seen - cons->pulled;
+		if (len > cons->pull_chunk)
+			len = cons->pull_chunk;
+		off = cons->pulled % cons->size;
+		first = len < cons->size - off ? len : cons->size - off;
+		prepare_read(cons, &wr[0], &sge[0], off, first);
+		if (first < len)
+		{
+			prepare_read(cons, &wr[1], &sge[1], 0, len - first);
+			wr[0].next = &wr[1];
+		}
+		wr[first < len ? 1 : 0].wr_id = (uintptr_t) &cons->pulled;
+		wr[first < len ? 1 : 0].send_flags = IBV_SEND_SIGNALED;
+		cons->pull_target = cons->pulled + len;
+	}
+	/* At most a head update and one read (two if it wraps) are in flight,
+	 * so a failed post is not a full send queue */
+	ret = ibv_post_send(cons->qp, wr, &bad_wr);
+	if (ret)
+	{
+		rdma_error("Failed to pull the ring, errno: %d \n", ret);
+		return -ret;
+	}
+	cons->pull_inflight = 1;
+	cons->pulls++;
+	if (len)
+		rdma_trace(RDMA_TRACE_PULL, len, cons->pulled, 0, 0);
+	return 0;
+}
+
+int rdma_ring_consumer_enable_imm(struct rdma_ring_consumer *cons,
+                                  uint32_t nr_recv)
+{
+	struct ibv_recv_wr *bad_wr = NULL;
+	uint32_t i;
+	int ret;
+	if (!cons || nr_recv == 0)
+	{
+		rdma_error("Passed consumer is NULL or pool is empty\n");
+		return -EINVAL;
+	}
+	cons->recv_wrs = calloc(nr_recv, sizeof(*cons->recv_wrs));
+	if (!cons->recv_wrs)
+	{
+		rdma_error("Failed to allocate receive pool, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	/* A write with immediate consumes a receive but places no data in it,
+	 * so the receives need no buffers at all */
+	for (i = 0 ; i < nr_recv ; i++)
+	{
+		cons->recv_wrs[i].wr_id = i;
+		cons->recv_wrs[i].num_sge = 0;
+		cons->recv_wrs[i].next = (i + 1 < nr_recv) ? &cons->recv_wrs[i + 1] : NULL;
+	}
+	cons->nr_recv = nr_recv;
+	ret = ibv_post_recv(cons->qp, cons->recv_wrs, &bad_wr);
+	/* from now on every receive is re-posted on its own */
+	for (i = 0 ; i < nr_recv ; i++)
+		cons->recv_wrs[i].next = NULL;
+	if (ret)
+	{
+		rdma_error("Failed to pre-post %u receives, errno: %d \n", nr_recv, ret);
+		free(cons->recv_wrs);
+		cons->recv_wrs = NULL;
+		return -ret;
+	}
+	debug("Pre-posted %u zero length receives for immediate data \n", nr_recv);
+	return 0;
+}
+
+void rdma_ring_release(struct rdma_ring_consumer *cons)
+{
+	cons->head += rdma_ring_record_size(cons->peeked);
+	rdma_trace(RDMA_TRACE_RING_RELEASE, cons->seq, cons->peeked, cons->head, 0);
+	rdma_stats_add(cons->stats, RDMA_STATS_MESSAGES, 1);
+	rdma_stats_add(cons->stats, RDMA_STATS_MESSAGE_BYTES, cons->peeked);
+	cons->seq = next_seq(cons->seq);
+	if (cons->peek_tsc)
+	{
+		rdma_hist_record(RDMA_HIST_CONSUME, rdma_tsc() - cons->peek_tsc);
+		cons->peek_tsc = 0;
+	}
+	/* We do not publish per record, only once a good part of the ring is
+	 * free again */
+	if (cons->head - cons->published >= cons->size / 4)
+		rdma_ring_publish_head(cons);
+}
+
+int rdma_ring_publish_head(struct rdma_ring_consumer *cons)
+{
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	struct ibv_sge sge;
+	int ret;
+	/* There is at most one head update in flight. Its completion is handed
+	 * to us through rdma_ring_consumer_complete(). */
+	if (cons->publish_inflight || cons->head == cons->published)
+		return 0;
+	/* The write is sourced from publish_value, which we do not touch until
+	 * the write completed */
+	cons->publish_value = cons->head;
+	sge.addr = (uint64_t) cons->publish_mr->addr;
+	sge.length = sizeof(cons->publish_value);
+	sge.lkey = cons->publish_mr->lkey;
+	bzero(&wr, sizeof(wr));
+	wr.wr_id = (uintptr_t) cons;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_RDMA_WRITE;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	if (cons->max_inline >= sizeof(cons->publish_value))
+		wr.send_flags |= IBV_SEND_INLINE;
+	wr.wr.rdma.remote_addr = cons->remote_head.address;
+	wr.wr.rdma.rkey = cons->remote_head.stag.remote_stag;
+	ret = ibv_post_send(cons->qp, &wr, &bad_wr);
+	if (ret)
+	{
+		/* the send queue is busy, we try again with the next release */
+		rdma_trace(RDMA_TRACE_HEAD_PUBLISH_FAIL, ret, cons->head, 0, 0);
+		return ret;
+	}
+	cons->published = cons->head;
+	cons->publish_inflight = 1;
+	rdma_trace(RDMA_TRACE_HEAD_PUBLISH, cons->head, 0, 0, 0);
+	return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Header file for the single-producer/single-consumer log ring that lives in
+ * the server's registered buffer.
+ *
+ * The client (producer) appends records at a tail that only it knows and
+ * writes them into the server buffer with RDMA writes. The server (consumer)
+ * walks the records at its head and, every now and then, writes the head back
+ * into a small memory region on the client. The client therefore never
+ * overwrites unread records and never needs a round trip per message.
+ *
+ * Positions (head, tail) are byte counts that only ever grow; the offset in
+ * the buffer is the position modulo the ring size.
+ *
+ * A record is framed as
+ *
+ *   | header (seq, length) | payload | pad to 8 bytes | footer (seq, length) |
+ *
+ * and padded to RDMA_RING_ALIGN. The header and the payload go in one RDMA
+ * write, and the footer in a second write that is posted right behind it in
+ * the same ibv_post_send() call. Writes on one RC QP are executed in order,
+ * so the footer only becomes visible once the payload has landed, and the
+ * consumer can read a record while the NIC is still writing the next one.
+ *
+ * The writes are sourced from a local staging buffer that mirrors the ring,
+ * or from a message slot (see rdma_slots.h) that the record was built in,
+ * optionally followed by payload fragments that the NIC gathers from the
+ * application's own buffers.
+ *
+ * Instead of spinning on the ring memory, the consumer can also be told about
+ * new records: the producer then writes the footer with RDMA_WRITE_WITH_IMM,
+ * which consumes one of the zero length receives the consumer pre-posted and
+ * raises a completion on its CQ. The consumer can then sleep on the CQ, and
+ * still reads the records from the ring, so the data path stays zero-copy.
+ *
+ * In pull mode the roles of the NICs are swapped: the producer only builds
+ * its records in the staging buffer and publishes its tail in a word of its
+ * own, and the consumer RDMA reads first that tail and then the new records
+ * into its ring, whenever it runs out of records. The consumer sets the pace
+ * and takes the records in chunks of its choosing; the producer posts
+ * nothing but still waits for the head before it reuses a part of its ring.
+ *
+ * The consumer does not poll any CQ itself; whoever owns the CQ hands the
+ * completions of the consumer's QP to rdma_ring_consumer_complete().
+ */
+
+#ifndef RDMA_RING_H
+#define RDMA_RING_H
+
+#include "rdma_common.h"
+#include "rdma_sendq.h"
+#include "rdma_slots.h"
+
+/* Every record starts on a boundary of this many bytes */
+#define RDMA_RING_ALIGN (64)
+/* Header length value that tells the consumer to continue at offset 0 */
+#define RDMA_RING_WRAP (0xffffffffu)
+/* Most payload fragments of a record, see rdma_ring_commit_iov() */
+#define RDMA_RING_MAX_FRAGS (15)
+/* Default bytes the consumer reads at once in pull mode */
+#define RDMA_RING_PULL_CHUNK (64 * 1024)
+/* Pull mode: longest wait between two reads of a tail that did not move */
+#define RDMA_RING_PULL_BACKOFF_NS (64 * 1000)
+
+/*
+ * Record header, placed at the start of every record. Two 32 bit fields, so
+ * there is no padding and the header is read as one aligned 8 byte word. A
+ * record is valid when its sequence number is the one the consumer expects
+ * next; a stale record from an older lap never is.
+ */
+struct rdma_ring_hdr
+{
+	uint32_t seq;
+	uint32_t length; /* payload bytes after the header, or RDMA_RING_WRAP */
+};
+
+/* Record footer, the last 8 bytes written for a record. It repeats the
+ * header, and the record is complete once it matches. A wrap header has no
+ * footer, it is a single 8 byte write. */
+struct rdma_ring_ftr
+{
+	uint32_t seq;
+	uint32_t length;
+};
+
+/* Producer (client) side of a ring */
+struct rdma_ring_producer
+{
+	/* send queue the records are written through */
+	struct rdma_sendq *sq;
+	/* local staging buffer, laid out exactly like the remote ring */
+	struct ibv_mr *mr;
+	/* the remote ring */
+	struct rdma_buffer_attr remote;
+	uint64_t size;
+	uint64_t tail;
+	uint32_t seq;
+	/* write every imm_every-th footer with immediate data, 0 = never */
+	uint32_t imm_every;
+	uint32_t unnotified;
+	/* consumer position, RDMA written by the consumer into head_mr */
+	uint64_t head __attribute__((aligned(8)));
+	struct ibv_mr *head_mr;
+	/* pull mode: the tail as far as it is published, RDMA read by the
+	 * consumer from tail_mr */
+	int pull;
+	uint64_t pull_tail __attribute__((aligned(8)));
+	struct ibv_mr *tail_mr;
+};
+
+/* Consumer (server) side of a ring */
+struct rdma_ring_consumer
+{
+	struct ibv_qp *qp;
+	char *base;
+	uint64_t size;
+	uint64_t head;
+	uint32_t seq;
+	/* length of the record returned by the last rdma_ring_peek(), and
+	 * the cycle counter when it was first returned, if we record */
+	uint32_t peeked;
+	uint64_t peek_tsc;
+	/* 0, or the negative error a corrupt record or a failed read left the
+	 * ring in; nothing is peeked from then on */
+	int error;
+	/* head value last sent to the producer, and the registered copy of it
+	 * that the RDMA write is sourced from */
+	uint64_t published;
+	uint64_t publish_value __attribute__((aligned(8)));
+	int publish_inflight;
+	struct ibv_mr *publish_mr;
+	/* inline data limit of the QP */
+	uint32_t max_inline;
+	/* where the producer wants the head to be written */
+	struct rdma_buffer_attr remote_head;
+	/* pool of zero length receives for writes with immediate, NULL when
+	 * the producer does not send any */
+	struct ibv_recv_wr *recv_wrs;
+	uint32_t nr_recv;
+	uint64_t notified;
+	/* pull mode: the producer's staging buffer and tail, how far we read
+	 * the ring and the last tail we saw, the read in flight and the memory
+	 * the tail is read into */
+	int pull;
+	struct rdma_buffer_attr remote_ring;
+	struct rdma_buffer_attr remote_tail;
+	uint32_t lkey;
+	uint32_t pull_chunk;
+	uint64_t pulled;
+	uint64_t tail_seen;
+	uint64_t pull_target;
+	int pull_inflight;
+	uint64_t pull_value __attribute__((aligned(8)));
+	struct ibv_mr *pull_mr;
+	uint64_t pulls;
+	/* wait before the next tail read, doubled every time the tail did not
+	 * move, and when that read may go out */
+	uint64_t pull_backoff_ns;
+	uint64_t pull_next_ns;
+	/* where the records consumed are counted, may be NULL (rdma_stats.h) */
+	struct rdma_stats_slot *stats;
+};
+
+/* Returns the ring size that fits into a buffer of 'length' bytes */
+uint64_t rdma_ring_usable_size(uint64_t length);
+
+/* Returns the bytes a record with 'length' payload bytes takes in the ring */
+uint64_t rdma_ring_record_size(uint32_t length);
+
+/*
+ * Sets up the producer side and registers the head memory region, which has
+ * to be advertised to the consumer before it can send us its head.
+ * @prod: producer to initialize
+ * @pd: protection domain of the connection
+ * @sq: send queue the records are written through
+ * @mr: local staging buffer, laid out like the remote ring
+ */
+int rdma_ring_producer_init(struct rdma_ring_producer *prod,
+                            struct ibv_pd *pd,
+                            struct rdma_sendq *sq,
+                            struct ibv_mr *mr);
+
+/*
+ * Attaches the producer to the remote ring as advertised by the consumer.
+ * The ring is as large as both the remote ring and the staging buffer allow.
+ */
+int rdma_ring_producer_connect(struct rdma_ring_producer *prod,
+                               struct rdma_buffer_attr *remote);
+
+/*
+ * Switches the producer to pull mode and registers the tail memory region,
+ * which has to be advertised to the consumer together with the staging
+ * buffer; the staging buffer needs IBV_ACCESS_REMOTE_READ. From now on
+ * records are only built in the staging buffer, and immediate data is not
+ * sent.
+ */
+int rdma_ring_producer_enable_pull(struct rdma_ring_producer *prod,
+                                   struct ibv_pd *pd);
+
+/* Releases the resources of a producer */
+void rdma_ring_producer_destroy(struct rdma_ring_producer *prod);
+
+/*
+ * Reserves room for a record of 'length' payload bytes and points 'payload'
+ * into the local staging buffer where the payload has to be placed. Returns
+ * 0, -EAGAIN when the ring has no room yet (the caller retries later), or
+ * another negative error, after which retrying does not help.
+ */
+int rdma_ring_reserve(struct rdma_ring_producer *prod, uint32_t length,
+                      void **payload);
+
+/*
+ * Writes the record prepared after rdma_ring_reserve() into the remote
+ * ring. Waits for room in the send queue if needed. Returns 0 or a negative
+ * error, in which case nothing was appended.
+ * @send_flags: OR of IBV_SEND_* flags for the write
+ */
+int rdma_ring_commit(struct rdma_ring_producer *prod, uint32_t length,
+                     unsigned int send_flags);
+
+/*
+ * Like rdma_ring_commit(), but only the first 'hdr_len' payload bytes are in
+ * the staging buffer; the rest is gathered by the NIC from the payload
+ * fragments, which stay in the caller's registered memory. The room has to
+ * be reserved for the whole payload, 'hdr_len' plus the fragments. The
+ * footer write carries 'wr_id', so the send queue's retire callback learns
+ * when the fragments are no longer read. In pull mode they are copied into
+ * the staging buffer right away, and nothing is retired.
+ */
+int rdma_ring_commit_frags(struct rdma_ring_producer *prod, uint32_t hdr_len,
+                           struct ibv_sge *frags, int nr_frags,
+                           unsigned int send_flags, uint64_t wr_id);
+
+/* Where the payload goes in a message slot, see rdma_ring_commit_slot() */
+static inline void *rdma_ring_slot_payload(void *slot)
+{
+	return (char*) slot + sizeof(struct rdma_ring_hdr);
+}
+
+/*
+ * Appends a record whose payload was serialized into a message slot at
+ * rdma_ring_slot_payload(slot), instead of into the staging buffer. The slot
+ * is laid out like the record, so it is the source of the writes, and it
+ * must hold rdma_ring_record_size(length) bytes. On success the slot belongs
+ * to the send queue until the footer write is retired; with
+ * rdma_slots_retire() as the retire callback it then goes back to 'slots'.
+ * A record small enough to be sent inline is copied when it is posted, and
+ * its slot goes back to 'slots' before this returns.
+ * Returns 0, -EAGAIN when the ring has no room yet (the caller keeps the slot
+ * and retries), or another negative error.
+ */
+int rdma_ring_commit_slot(struct rdma_ring_producer *prod,
+                          struct rdma_slots *slots, void *slot,
+                          uint32_t length, unsigned int send_flags);
+
+/*
+ * Appends a record whose payload is gathered by the NIC: the first 'hdr_len'
+ * bytes from the slot, at rdma_ring_slot_payload(slot), and the rest from the
+ * payload fragments, which stay in the caller's registered memory and are
+ * not copied. Header and fragments go out in one write with 1 + nr_frags
+ * SGEs, which the QP has to take (sq->max_sge). The slot must hold
+ * rdma_ring_record_size(hdr_len) bytes; it and the fragments are handled
+ * like the slot of rdma_ring_commit_slot(), so the fragments must stay
+ * unchanged until the slot is back in 'slots'.
+ */
+int rdma_ring_commit_iov(struct rdma_ring_producer *prod,
+                         struct rdma_slots *slots, void *slot, uint32_t hdr_len,
+                         struct ibv_sge *frags, int nr_frags,
+                         unsigned int send_flags);
+
+/*
+ * Makes sure the consumer gets a completion for every committed record: if
+ * records were committed since the last write with immediate, a zero length
+ * one is sent. A no-op when immediate data is not used.
+ */
+int rdma_ring_notify(struct rdma_ring_producer *prod);
+
+/*
+ * Sets up the consumer side over a registered ring buffer.
+ * @cons: consumer to initialize
+ * @pd: protection domain of the connection
+ * @qp: QP the head updates are written on
+ * @base: start of the ring buffer
+ * @length: length of the ring buffer
+ * @remote_head: the producer's head memory region
+ */
+int rdma_ring_consumer_init(struct rdma_ring_consumer *cons,
+                            struct ibv_pd *pd,
+                            struct ibv_qp *qp,
+                            char *base,
+                            uint64_t length,
+                            struct rdma_buffer_attr *remote_head);
+
+/*
+ * Switches the consumer to immediate notifications by pre-posting 'nr_recv'
+ * zero length receives on the consumer's QP. Must be done before the
+ * producer sends its first write with immediate.
+ */
+int rdma_ring_consumer_enable_imm(struct rdma_ring_consumer *cons,
+                                  uint32_t nr_recv);
+
+/*
+ * Switches the consumer to pull mode: it reads the producer's records
+ * itself, at most 'chunk' bytes at a time, instead of waiting for them to be
+ * written. Reads are posted from rdma_ring_peek() when it runs out of
+ * records, and their completions go to rdma_ring_consumer_complete().
+ * @lkey: local key of the ring buffer of the consumer
+ * @remote_ring: the producer's staging buffer
+ * @remote_tail: the producer's tail memory region
+ * @chunk: most bytes per read, 0 for RDMA_RING_PULL_CHUNK
+ */
+int rdma_ring_consumer_enable_pull(struct rdma_ring_consumer *cons,
+                                   struct ibv_pd *pd, uint32_t lkey,
+                                   struct rdma_buffer_attr *remote_ring,
+                                   struct rdma_buffer_attr *remote_tail,
+                                   uint32_t chunk);
+
+/*
+ * Pull mode: reads what the producer appended since the last read, or,
+ * when we have read everything we knew about, the producer's tail. A no-op
+ * while a read is in flight, and while backing off from a tail that did not
+ * move. Returns 0 or the negative error of the post.
+ */
+int rdma_ring_pull(struct rdma_ring_consumer *cons);
+
+/*
+ * Handles a completion of the consumer's QP: a finished head update or read,
+ * or a write with immediate, whose receive is re-posted. If the QP takes its
+ * receives from a shared receive queue, rdma_ring_consumer_enable_imm() is
+ * not called and the caller re-posts the receive itself. Returns 1 for a
+ * write with immediate, 0 for anything else, or a negative error.
+ */
+int rdma_ring_consumer_complete(struct rdma_ring_consumer *cons,
+                                struct ibv_wc *wc);
+
+/* Releases the resources of a consumer */
+void rdma_ring_consumer_destroy(struct rdma_ring_consumer *cons);
+
+/*
+ * Returns the payload of the next record and stores its length in
+ * 'length', or returns NULL when there is no complete new record yet. The
+ * record stays valid until rdma_ring_release(). Never blocks. A corrupt
+ * record, or a pull read that failed to post, also returns NULL, but sets
+ * cons->error for good: the caller has to check it and give up on the ring.
+ */
+void *rdma_ring_peek(struct rdma_ring_consumer *cons, uint32_t *length);
+
+/*
+ * Like rdma_ring_peek(), but spins until there is a record. Only for a
+ * consumer whose QP has its CQs to itself: while it waits, it hands their
+ * completions to rdma_ring_consumer_complete(), so that head updates, reads
+ * and writes with immediate go on. Returns NULL on a completion error, or
+ * once cons->error is set.
+ */
+void *rdma_ring_wait(struct rdma_ring_consumer *cons, uint32_t *length);
+
+/* Consumes the record returned by the last rdma_ring_peek() */
+void rdma_ring_release(struct rdma_ring_consumer *cons);
+
+/*
+ * Sends the current head to the producer if it moved since the last time
+ * and no earlier update is still in flight. The completion of the update has
+ * to be handed to rdma_ring_consumer_complete().
+ */
+int rdma_ring_publish_head(struct rdma_ring_consumer *cons);
+
+#endif /* RDMA_RING_H */
@@ -0,0 +1,471 @@
+/*
+ * Implementation of the send queue manager.
+ */
+
+#include "rdma_sendq.h"
+#include "rdma_trace.h"
+#include "rdma_stats.h"
+
+int rdma_sendq_init(struct rdma_sendq *sq, struct ibv_qp *qp,
+                    struct ibv_cq *cq, uint32_t depth, uint32_t signal_every)
+{
+	if (!sq || !qp || !cq || depth == 0)
+	{
+		rdma_error("Passed send queue resources are NULL\n");
+		return -EINVAL;
+	}
+	bzero(sq, sizeof(*sq));
+	/* With at most 'depth' WRs outstanding there has to be a signaled one
+	 * among them, otherwise nothing would ever free the queue */
+	if (signal_every == 0 || signal_every > depth)
+		signal_every = depth;
+	sq->qp = qp;
+	sq->cq = cq;
+	sq->depth = depth;
+	sq->signal_every = signal_every;
+	/* What rdma_create_qp_inline() got us, or 0 */
+	sq->max_inline = rdma_qp_max_inline(qp);
+	sq->max_sge = rdma_qp_max_send_sge(qp);
+	sq->slots = calloc(depth, sizeof(*sq->slots));
+	if (!sq->slots)
+	{
+		rdma_error("Failed to allocate send queue slots, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	debug("Send queue manager for QP %p, depth: %u signal every: %u inline: %u sge: %u \n",
+	      qp, depth, signal_every, sq->max_inline, sq->max_sge);
+	return 0;
+}
+
+void rdma_sendq_destroy(struct rdma_sendq *sq)
+{
+	if (!sq)
+		return;
+	free(sq->slots);
+	free(sq->batch_wrs);
+	free(sq->batch_sges);
+	free(sq->batch_inline);
+	sq->slots = NULL;
+	sq->batch_wrs = NULL;
+	sq->batch_sges = NULL;
+	sq->batch_inline = NULL;
+}
+
+int rdma_sendq_set_batch(struct rdma_sendq *sq, uint32_t max_batch,
+                         uint64_t window_ns)
+{
+	int ret = rdma_sendq_flush(sq);
+	if (ret)
+		return ret;
+	/* A chain is signaled on its last WR, so a whole batch may follow
+	 * signal_every - 1 unsignaled WRs and still has to fit */
+	if (max_batch + sq->signal_every > sq->depth)
+		max_batch = sq->depth > sq->signal_every ? sq->depth - sq->signal_every : 1;
+	free(sq->batch_wrs);
+	free(sq->batch_sges);
+	free(sq->batch_inline);
+	sq->batch_wrs = NULL;
+	sq->batch_sges = NULL;
+	sq->batch_inline = NULL;
+	sq->max_batch = max_batch;
+	sq->window_ns = window_ns;
+	if (max_batch <= 1)
+		return 0;
+	sq->batch_wrs = calloc(max_batch, sizeof(*sq->batch_wrs));
+	sq->batch_sges = calloc(max_batch * sq->max_sge, sizeof(*sq->batch_sges));
+	/* Inline payloads are copied into the batch, so the caller may reuse
+	 * them right away as if they had been posted */
+	if (sq->max_inline)
+		sq->batch_inline = malloc((size_t) max_batch * sq->max_inline);
+	if (!sq->batch_wrs || !sq->batch_sges || (sq->max_inline && !sq->batch_inline))
+	{
+		rdma_error("Failed to allocate the batch, -ENOMEM\n");
+		free(sq->batch_wrs);
+		free(sq->batch_sges);
+		free(sq->batch_inline);
+		sq->batch_wrs = NULL;
+		sq->batch_sges = NULL;
+		sq->batch_inline = NULL;
+		sq->max_batch = 1;
+		return -ENOMEM;
+	}
+	debug("Send queue batches up to %u WRs for %lu ns \n", max_batch,
+	      (unsigned long) window_ns);
+	return 0;
+}
+
+/* Retires all WRs up to and including the next signaled one. 'now' is the
+ * cycle counter when the completion was polled. */
+static void retire_batch(struct rdma_sendq *sq, uint64_t now)
+{
+	struct rdma_sendq_slot *slot;
+	while (sq->head != sq->tail)
+	{
+		slot = &sq->slots[sq->head % sq->depth];
+		sq->head++;
+		sq->completed++;
+		if (slot->tsc)
+		{
+			rdma_hist_record(RDMA_HIST_POST_COMPLETE, now - slot->tsc);
+			if (slot->write_end)
+				rdma_hist_record(RDMA_HIST_WRITE_VISIBLE, now - slot->tsc);
+		}
+		if (sq->retire)
+			sq->retire(sq, slot->wr_id);
+		if (slot->signaled)
+			return;
+	}
+}
+
+static int reap(struct rdma_sendq *sq)
+{
+	struct ibv_wc wc[RDMA_SENDQ_POLL_BATCH];
+	uint64_t before = sq->completed, now = 0;
+	int ret, i;
+	do
+	{
+		ret = ibv_poll_cq(sq->cq, RDMA_SENDQ_POLL_BATCH, wc);
+		if (ret < 0)
+		{
+			rdma_error("Failed to poll cq for wc due to %d \n", ret);
+			return ret;
+		}
+		rdma_stats_add(sq->stats, RDMA_STATS_CQ_POLLS, 1);
+		rdma_stats_add(sq->stats, RDMA_STATS_CQ_WCS, ret);
+		if (ret > 0 && rdma_hist_on())
+		{
+			now = rdma_tsc();
+			rdma_hist_record(RDMA_HIST_CQ_BATCH, ret);
+		}
+		for (i = 0 ; i < ret ; i++)
+		{
+			if (wc[i].status != IBV_WC_SUCCESS)
+			{
+				rdma_error("Work completion (WC) has error status: %d (means: %s) at index %d\n",
+				           -wc[i].status,
+				           ibv_wc_status_str(wc[i].status),
+				           i);
+				return -(wc[i].status);
+			}
+			if (wc[i].opcode & IBV_WC_RECV)
+			{
+				if (!sq->recv)
+				{
+					rdma_error("Receive completion on the CQ of a send queue without a recv callback\n");
+					return -EINVAL;
+				}
+				ret = sq->recv(sq, &wc[i]);
+				if (ret < 0)
+					return ret;
+				continue;
+			}
+			retire_batch(sq, now);
+		}
+	}
+	while (ret == RDMA_SENDQ_POLL_BATCH);
+	if (sq->completed != before)
+	{
+		rdma_stats_add(sq->stats, RDMA_STATS_WRS_COMPLETED, sq->completed - before);
+		rdma_stats_set(sq->stats, RDMA_STATS_OUTSTANDING, rdma_sendq_outstanding(sq));
+	}
+	return (int)(sq->completed - before);
+}
+
+/* Number of WRs in a chain */
+static uint32_t chain_length(struct ibv_send_wr *wr)
+{
+	uint32_t n = 0;
+	for (; wr; wr = wr->next)
+		n++;
+	return n;
+}
+
+/* Total bytes a WR moves */
+static uint32_t wr_length(struct ibv_send_wr *wr)
+{
+	uint32_t length = 0;
+	int i;
+	for (i = 0; i < wr->num_sge; i++)
+		length += wr->sg_list[i].length;
+	return length;
+}
+
+/* Sends the payload of small writes and sends inline */
+static void pick_inline(struct rdma_sendq *sq, struct ibv_send_wr *wr)
+{
+	switch (wr->opcode)
+	{
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		if (rdma_sendq_inlines(sq, wr_length(wr)))
+		{
+			wr->send_flags |= IBV_SEND_INLINE;
+			sq->inlined++;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static int post_now(struct rdma_sendq *sq, struct ibv_send_wr *wr,
+                    struct ibv_send_wr **bad_wr);
+
+/* Posts a signaled zero length write behind unsignaled WRs, so that their
+ * completion comes in. A zero length write needs no memory on either
+ * side. */
+static int post_signal(struct rdma_sendq *sq)
+{
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	bzero(&wr, sizeof(wr));
+	wr.opcode = IBV_WR_RDMA_WRITE;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	return post_now(sq, &wr, &bad_wr);
+}
+
+/* Posts a chain right away, with one ibv_post_send() */
+static int post_now(struct rdma_sendq *sq, struct ibv_send_wr *wr,
+                    struct ibv_send_wr **bad_wr)
+{
+	struct ibv_send_wr *cur;
+	struct rdma_sendq_slot *slot;
+	uint32_t n = chain_length(wr), unsignaled;
+	uint64_t tsc, bytes = 0, before;
+	int ret;
+	if (n > sq->depth)
+	{
+		rdma_error("Chain of %u WRs does not fit a send queue of %u\n",
+		           n, sq->depth);
+		*bad_wr = wr;
+		return -EINVAL;
+	}
+	/* Backpressure: wait for the NIC to free enough slots */
+	if (rdma_sendq_outstanding(sq) + n > sq->depth)
+	{
+		sq->full++;
+		rdma_stats_add(sq->stats, RDMA_STATS_SENDQ_FULL, 1);
+		rdma_trace(RDMA_TRACE_SENDQ_FULL, rdma_sendq_outstanding(sq), n, 0, 0);
+		while (rdma_sendq_outstanding(sq) + n > sq->depth)
+		{
+			/* Nothing that is outstanding is signaled, so no completion
+			 * would ever make room: a chain longer than any before
+			 * found the queue nearly full of unsignaled WRs */
+			if (sq->unsignaled == rdma_sendq_outstanding(sq))
+			{
+				ret = post_signal(sq);
+				if (ret)
+				{
+					*bad_wr = wr;
+					return ret;
+				}
+			}
+			ret = reap(sq);
+			if (ret < 0)
+			{
+				*bad_wr = wr;
+				return ret;
+			}
+			if (ret == 0)
+				cpu_relax();
+		}
+	}
+	/* Pick the WRs that get signaled: if the Nth WR falls into the chain,
+	 * its last WR is signaled instead, which also retires the ones before.
+	 * So is a chain that leaves less room than the longest chain takes,
+	 * or that chain could wait for a completion nobody asked for. */
+	if (n > sq->max_chain)
+		sq->max_chain = n;
+	unsignaled = sq->unsignaled;
+	for (cur = wr; cur; cur = cur->next)
+	{
+		if (!(cur->send_flags & IBV_SEND_INLINE))
+			pick_inline(sq, cur);
+		if (cur->send_flags & IBV_SEND_SIGNALED)
+			unsignaled = 0;
+		else
+			unsignaled++;
+		if (!cur->next && unsignaled &&
+		        (unsignaled >= sq->signal_every ||
+		         sq->depth - rdma_sendq_outstanding(sq) - n < sq->max_chain))
+			cur->send_flags |= IBV_SEND_SIGNALED;
+	}
+	*bad_wr = NULL;
+	tsc = rdma_hist_on() ? rdma_tsc() : 0;
+	ret = ibv_post_send(sq->qp, wr, bad_wr);
+	/* Account for what made it into the send queue */
+	before = sq->posted;
+	for (cur = wr; cur && cur != *bad_wr; cur = cur->next)
+	{
+		if (sq->stats)
+			bytes += wr_length(cur);
+		slot = &sq->slots[sq->tail % sq->depth];
+		slot->wr_id = cur->wr_id;
+		slot->signaled = !!(cur->send_flags & IBV_SEND_SIGNALED);
+		slot->write_end = !cur->next && (cur->opcode == IBV_WR_RDMA_WRITE ||
+		                                 cur->opcode == IBV_WR_RDMA_WRITE_WITH_IMM);
+		slot->tsc = tsc;
+		sq->tail++;
+		sq->posted++;
+		sq->unsignaled = slot->signaled ? 0 : sq->unsignaled + 1;
+	}
+	if (sq->stats)
+	{
+		rdma_stats_add(sq->stats, RDMA_STATS_WRS_POSTED, sq->posted - before);
+		rdma_stats_add(sq->stats, RDMA_STATS_BYTES_POSTED, bytes);
+		rdma_stats_set(sq->stats, RDMA_STATS_OUTSTANDING, rdma_sendq_outstanding(sq));
+		if (ret == ENOMEM)
+			rdma_stats_add(sq->stats, RDMA_STATS_POST_ENOMEM, 1);
+	}
+	if (ret)
+	{
+		rdma_error("Failed to post send, errno: %d \n", ret);
+		return -ret;
+	}
+	return 0;
+}
+
+int rdma_sendq_flush(struct rdma_sendq *sq)
+{
+	struct ibv_send_wr *bad_wr = NULL;
+	int ret;
+	if (!sq->nr_batched)
+		return 0;
+	sq->batch_wrs[sq->nr_batched - 1].next = NULL;
+	ret = post_now(sq, sq->batch_wrs, &bad_wr);
+	sq->nr_batched = 0;
+	sq->flushes++;
+	return ret;
+}
+
+/* Gathers the payload of an inline WR into the batch, into one SGE */
+static void copy_inline(struct rdma_sendq *sq, struct ibv_send_wr *wr,
+                        struct ibv_send_wr *copy)
+{
+	char *data = sq->batch_inline + (size_t) sq->nr_batched * sq->max_inline;
+	uint32_t length = 0;
+	int i;
+	for (i = 0; i < wr->num_sge; i++)
+	{
+		memcpy(data + length, (void*)(uintptr_t) wr->sg_list[i].addr,
+		       wr->sg_list[i].length);
+		length += wr->sg_list[i].length;
+	}
+	/* The lkey does not matter, inline data is never DMA read */
+	copy->sg_list[0].addr = (uintptr_t) data;
+	copy->sg_list[0].length = length;
+	copy->sg_list[0].lkey = wr->sg_list[0].lkey;
+	copy->num_sge = 1;
+}
+
+int rdma_sendq_post(struct rdma_sendq *sq, struct ibv_send_wr *wr,
+                    struct ibv_send_wr **bad_wr)
+{
+	struct ibv_send_wr *cur, *copy;
+	uint32_t n = 0;
+	int ret, flush = 0;
+	if (sq->max_batch <= 1)
+		return post_now(sq, wr, bad_wr);
+	for (cur = wr; cur; cur = cur->next)
+	{
+		if (!(cur->send_flags & IBV_SEND_INLINE))
+			pick_inline(sq, cur);
+		/* Inline data is copied by ibv_post_send(), the caller may reuse
+		 * it right after we return. We copy what fits into the batch, the
+		 * rest can not wait. */
+		if ((cur->send_flags & IBV_SEND_INLINE) &&
+		        !rdma_sendq_inlines(sq, wr_length(cur)))
+			flush = 1;
+		if (cur->num_sge > sq->max_sge)
+			break;
+		n++;
+	}
+	/* Too much to batch: post what is batched, then the chain */
+	if (cur || n > sq->max_batch)
+	{
+		ret = rdma_sendq_flush(sq);
+		if (ret)
+		{
+			*bad_wr = wr;
+			return ret;
+		}
+		return post_now(sq, wr, bad_wr);
+	}
+	if (sq->nr_batched + n > sq->max_batch)
+	{
+		ret = rdma_sendq_flush(sq);
+		if (ret)
+		{
+			*bad_wr = wr;
+			return ret;
+		}
+	}
+	if (!sq->nr_batched && sq->window_ns)
+		sq->batch_start = rdma_now_ns();
+	/* The WRs and SGEs may live on the caller's stack, so they are copied.
+	 * The memory they point to has to stay put until completion anyway. */
+	for (cur = wr; cur; cur = cur->next)
+	{
+		copy = &sq->batch_wrs[sq->nr_batched];
+		*copy = *cur;
+		copy->sg_list = &sq->batch_sges[sq->nr_batched * sq->max_sge];
+		if ((cur->send_flags & IBV_SEND_INLINE) &&
+		        rdma_sendq_inlines(sq, wr_length(cur)))
+		{
+			copy_inline(sq, cur, copy);
+		}
+		else if (cur->num_sge)
+		{
+			memcpy(copy->sg_list, cur->sg_list, cur->num_sge * sizeof(*cur->sg_list));
+		}
+		if (sq->nr_batched)
+			sq->batch_wrs[sq->nr_batched - 1].next = copy;
+		sq->nr_batched++;
+	}
+	sq->batched += n;
+	*bad_wr = NULL;
+	if (flush || sq->nr_batched == sq->max_batch ||
+	        (sq->window_ns && rdma_now_ns() - sq->batch_start >= sq->window_ns))
+	{
+		ret = rdma_sendq_flush(sq);
+		if (ret)
+		{
+			/* We can not tell which of the batched WRs failed */
+			*bad_wr = wr;
+			return ret;
+		}
+	}
+	return 0;
+}
+
+int rdma_sendq_reap(struct rdma_sendq *sq)
+{
+	/* Completions only come for what was posted */
+	int ret = rdma_sendq_flush(sq);
+	if (ret)
+		return ret;
+	return reap(sq);
+}
+
+int rdma_sendq_drain(struct rdma_sendq *sq)
+{
+	int ret = rdma_sendq_flush(sq);
+	if (ret)
+		return ret;
+	if (sq->unsignaled && rdma_sendq_outstanding(sq))
+	{
+		ret = post_signal(sq);
+		if (ret)
+			return ret;
+	}
+	while (rdma_sendq_outstanding(sq))
+	{
+		ret = reap(sq);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			cpu_relax();
+	}
+	return 0;
+}
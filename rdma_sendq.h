@@ -0,0 +1,162 @@
+/*
+ * Header file for the send queue manager.
+ *
+ * Posting only unsignaled work requests (WRs) never frees a send queue slot,
+ * and posting only signaled ones costs a completion per WR. The manager sits
+ * between the application and ibv_post_send(): it signals every Nth WR, reaps
+ * completions in batches, and keeps track of how many WRs are outstanding.
+ * When the send queue is full, posting reaps completions until there is room
+ * again, so the sender is slowed down to the pace of the NIC instead of
+ * failing with ENOMEM.
+ *
+ * Completions on an RC QP arrive in posting order, so the completion of a
+ * signaled WR also retires every unsignaled WR posted before it.
+ *
+ * The manager polls the CQ itself. If that CQ also takes the receive
+ * completions of the QP, they would be lost to whoever owns the receives, so
+ * they go to the recv callback, and without one they are an error.
+ *
+ * Every ibv_post_send() rings the doorbell of the NIC with an MMIO write,
+ * which for small messages costs more than the message itself. With batching
+ * turned on, posted WRs are collected and linked into one chain that goes out
+ * with a single ibv_post_send() once the batch is full, once the oldest WR
+ * waited for the batching window, or when the caller flushes. The window is
+ * only checked when posting, so a latency critical message, or the last one
+ * before going idle, has to be followed by rdma_sendq_flush().
+ *
+ * Writes and sends whose payload fits the inline limit of the QP (see
+ * rdma_create_qp_inline()) are posted with IBV_SEND_INLINE: the CPU copies
+ * the payload into the work request, which saves the NIC a DMA read across
+ * PCIe, and the source buffer may be reused as soon as the post returns.
+ */
+
+#ifndef RDMA_SENDQ_H
+#define RDMA_SENDQ_H
+
+#include "rdma_common.h"
+
+/* Default: signal every this many WRs */
+#define RDMA_SENDQ_SIGNAL_EVERY (64)
+/* Completions reaped per ibv_poll_cq() call */
+#define RDMA_SENDQ_POLL_BATCH (32)
+
+struct rdma_sendq;
+
+/* Called once for every WR that is known to be complete, in posting order */
+typedef void (*rdma_sendq_retire_fn)(struct rdma_sendq *sq, uint64_t wr_id);
+
+/* Called for a successful receive completion found on the CQ. Returns 0, or
+ * a negative error that the reap returns. */
+typedef int (*rdma_sendq_recv_fn)(struct rdma_sendq *sq, struct ibv_wc *wc);
+
+/* One posted but not yet retired WR */
+struct rdma_sendq_slot
+{
+	uint64_t wr_id;
+	int signaled;
+	/* last WR of its chain, and an RDMA write */
+	int write_end;
+	/* cycle counter when it was posted, 0 when the thread does not record
+	 * histograms (see rdma_hist.h) */
+	uint64_t tsc;
+};
+
+struct rdma_sendq
+{
+	struct ibv_qp *qp;
+	struct ibv_cq *cq;
+	/* send queue capacity, the max_send_wr the QP was created with */
+	uint32_t depth;
+	uint32_t signal_every;
+	/* WRs posted since the last signaled one, and the longest chain
+	 * posted so far */
+	uint32_t unsignaled;
+	uint32_t max_chain;
+	/* FIFO of outstanding WRs, 'depth' entries */
+	struct rdma_sendq_slot *slots;
+	uint64_t head, tail;
+	rdma_sendq_retire_fn retire;
+	/* NULL when the CQ only takes send completions */
+	rdma_sendq_recv_fn recv;
+	void *context;
+	/* WRs waiting to be posted in one chain, max_batch <= 1 = no batching */
+	uint32_t max_batch, nr_batched;
+	uint64_t window_ns, batch_start;
+	struct ibv_send_wr *batch_wrs;
+	struct ibv_sge *batch_sges;
+	char *batch_inline;
+	/* writes and sends of up to this many bytes go inline */
+	uint32_t max_inline;
+	/* most SGEs per WR */
+	uint32_t max_sge;
+	/* totals, for whoever is curious */
+	uint64_t posted, completed, full, batched, flushes, inlined;
+	/* where the live counters go, may be NULL (see rdma_stats.h) */
+	struct rdma_stats_slot *stats;
+};
+
+/*
+ * Sets up a send queue manager for a QP.
+ * @sq: manager to initialize
+ * @qp: QP whose send queue is managed
+ * @cq: CQ the send completions of qp go to. If receive completions go there
+ *      as well, set sq->recv.
+ * @depth: max_send_wr of the QP
+ * @signal_every: signal every this many WRs, at most depth
+ */
+int rdma_sendq_init(struct rdma_sendq *sq, struct ibv_qp *qp,
+                    struct ibv_cq *cq, uint32_t depth, uint32_t signal_every);
+
+/* Releases the resources of the manager. Outstanding WRs are forgotten. */
+void rdma_sendq_destroy(struct rdma_sendq *sq);
+
+/* Tells whether a payload of 'length' bytes is sent inline */
+static inline int rdma_sendq_inlines(struct rdma_sendq *sq, uint32_t length)
+{
+	return length && length <= sq->max_inline;
+}
+
+/* Number of WRs posted and not yet known to be complete */
+static inline uint32_t rdma_sendq_outstanding(struct rdma_sendq *sq)
+{
+	return (uint32_t)(sq->tail - sq->head);
+}
+
+/*
+ * Turns batching on, or off with max_batch <= 1. Whatever is batched is
+ * flushed first.
+ * @max_batch: most WRs per ibv_post_send(), leaving room for signal_every
+ * @window_ns: flush a batch whose oldest WR is this old, 0 = no window
+ */
+int rdma_sendq_set_batch(struct rdma_sendq *sq, uint32_t max_batch,
+                         uint64_t window_ns);
+
+/*
+ * Posts a chain of WRs linked through wr->next. Every Nth WR gets
+ * IBV_SEND_SIGNALED, or rather the last WR of the chain it is posted in; WRs
+ * the caller already marked signaled are honored. Waits, reaping completions,
+ * until the send queue has room for the whole chain. When batching, the WRs
+ * are copied into the batch and may only be posted later. Returns 0, or a
+ * negative error, in which case none of the WRs from *bad_wr onwards were
+ * posted; an error of a batch that is flushed here covers the whole chain.
+ */
+int rdma_sendq_post(struct rdma_sendq *sq, struct ibv_send_wr *wr,
+                    struct ibv_send_wr **bad_wr);
+
+/* Posts the batched WRs, if any, in one chain. Returns 0 or a negative error. */
+int rdma_sendq_flush(struct rdma_sendq *sq);
+
+/*
+ * Flushes the batch and reaps available send completions without waiting.
+ * Returns the number of WRs retired, or a negative error if a WR failed.
+ */
+int rdma_sendq_reap(struct rdma_sendq *sq);
+
+/*
+ * Flushes the batch and waits until every posted WR is complete. If the last
+ * WR was posted unsignaled, a signaled zero length write is posted to flush
+ * it.
+ */
+int rdma_sendq_drain(struct rdma_sendq *sq);
+
+#endif /* RDMA_SENDQ_H */
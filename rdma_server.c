@@ -5,148 +5,1608 @@
  * Author: Animesh Trivedi
  *         atr@zurich.ibm.com (atrivedi@student.ethz.ch)
  *
- * TODO: Cleanup previously allocated resources in case of an error condition
+ * The server runs a connection management (CM) event loop and serves any
+ * number of clients at the same time. All clients share one protection
+ * domain and the block memory; every client gets its own connection context,
+ * QP and slice of the block memory, in which it appends to its log ring.
+ *
+ * The completions and the rings of the clients are handled by workers. Each
+ * worker owns a completion queue (CQ) with its own completion channel and
+ * completion vector, and serves the clients whose QPs use that CQ. By default
+ * there is one worker, run by the same thread as the CM event loop. With -t
+ * every worker gets a thread of its own, pinned to a core, and the main
+ * thread only handles CM and device events.
+ *
+ * A client may open a few more QPs, lanes, next to its connection, to stripe
+ * large transfers over (see rdma_stripe.h). Lanes are accepted by the CM
+ * thread and only ever answer the client's RDMA writes and reads into a
+ * window slice of its own; they have no worker and see no completions.
+ *
+ * The server listens on every address given with -a, one per rail (see
+ * rdma_rail.h). Clients connect on the device of the first one that came,
+ * their lanes on any: a lane on another device gets a PD of its own there,
+ * in which the memory it reaches is registered once more.
  */
 
+#define _GNU_SOURCE
 #include "rdma_common.h"
+#include "rdma_ring.h"
+#include "rdma_srq.h"
+#include "rdma_pool.h"
+#include "rdma_sizing.h"
+#include "rdma_bulk.h"
+#include "rdma_trace.h"
+#include "rdma_stats.h"
+#include "rdma_stripe.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+/* Where a connection is in its life */
+enum conn_state
+{
+	CONN_ACCEPTING = 0, /* accepted, waiting for the client metadata */
+	CONN_READY,         /* metadata exchanged, the ring is live */
+	CONN_ERROR,         /* failed, waiting for the disconnect */
+};
+
+struct server_worker;
+
+/* A connection that may open lanes, known by its token. It is part of the
+ * connection; the CM thread adds it once the connection is accepted and
+ * removes it, and disconnects its lanes, once the connection is gone. */
+struct server_grant
+{
+	uint32_t token;
+	/* lanes the metadata granted, 0 until the worker sent it, and the
+	 * window slice they stripe into */
+	uint32_t lanes;
+	int window_slice;
+	/* the key of the window the metadata handed out, which lanes show */
+	uint32_t window_rkey;
+	struct server_grant *next;
+};
+
+/* Everything the server keeps per client connection */
+struct server_conn
+{
+	struct rdma_cm_id *cm_id;
+	struct ibv_qp *qp;
+	enum conn_state state;
+	/* the worker whose CQ the QP uses, it owns the connection once it is
+	 * accepted */
+	struct server_worker *worker;
+	/* the client metadata is received here */
+	struct rdma_client_metadata client_metadata_attr;
+	struct ibv_mr *client_metadata_mr;
+	struct ibv_recv_wr client_recv_wr;
+	struct ibv_sge client_recv_sge;
+	/* our slice of the block memory, and what we tell the client about it */
+	int slice;
+	char *buf;
+	/* the slice and the window registered by themselves: the client gets
+	 * keys that reach nothing of the other clients' slices */
+	struct ibv_mr *slice_mr, *window_mr;
+	struct rdma_server_metadata server_metadata_attr;
+	struct ibv_mr *server_metadata_mr;
+	/* the slice the client stripes over its lanes into, or -1, and what
+	 * its lanes show us when they connect */
+	int window_slice;
+	uint32_t token;
+	struct server_grant grant;
+	/* the log ring in buf that the client appends to */
+	struct rdma_ring_consumer ring;
+	/* the client tells us about new records with immediate data */
+	int imm;
+	uint64_t records;
+	/* chunk bytes of bulk transfers received */
+	uint64_t bulk_bytes;
+	/* the worker's connections, and its qp_num lookup chain */
+	struct server_conn *prev, *next, *hash_next;
+	int linked;
+	/* in the mailbox of the worker, and disconnected; under its lock */
+	struct server_conn *mail_next;
+	int mailed, gone;
+};
+
+/* A lane a client opened next to its connection. Lanes are the CM
+ * thread's. */
+struct server_lane
+{
+	struct rdma_cm_id *cm_id;
+	uint32_t token;
+	/* only an established lane gets a disconnect event */
+	int established;
+	struct server_lane *next;
+};
+
+/* Connections of a worker are found by QP number in a small hash */
+#define CONN_HASH_SIZE (1024)
+
+/* A worker and everything it owns. Apart from the mailbox and the flags, it
+ * is only touched by the thread running the worker. */
+struct server_worker
+{
+	unsigned int id;
+	pthread_t thread;
+	struct ibv_comp_channel *channel;
+	struct ibv_cq *cq;
+	/* How we wait for completions on cq, set from the command line */
+	struct rdma_comp_poller poller;
+	/* With -q the clients of a worker share one receive queue */
+	struct rdma_srq srq;
+	struct server_conn *conns;
+	struct server_conn *conn_hash[CONN_HASH_SIZE];
+	/* Ready connections that write without immediate data, we have to spin
+	 * on their rings */
+	unsigned int nr_spinning;
+	/* connections assigned to the worker */
+	unsigned int nr_conns;
+	/* connections handed over by the CM thread, and the eventfd that wakes
+	 * the worker up for them */
+	pthread_mutex_t lock;
+	struct server_conn *mail;
+	int wake_fd;
+	/* set by the CM thread when the SRQ ran low */
+	int refill;
+	int stop;
+	uint64_t records;
+	/* live counters of the worker's CQ, may be NULL */
+	struct rdma_stats_slot *stats;
+};
 
 /* These are the RDMA resources needed to setup an RDMA connection */
 /* Event channel, where connection management (cm) related events are relayed */
 static struct rdma_event_channel *cm_event_channel = NULL;
-static struct rdma_cm_id *cm_server_id = NULL, *cm_client_id = NULL;
+static struct rdma_cm_id *cm_server_ids[RDMA_RAIL_MAX];
+static int nr_listeners = 0;
+/* These are shared by all connections and set up with the first one */
 static struct ibv_pd *pd = NULL;
-static struct ibv_comp_channel *io_completion_channel = NULL;
-static struct ibv_cq *cq = NULL;
-static struct ibv_qp_init_attr qp_init_attr;
-static struct ibv_qp *client_qp = NULL;
-/* RDMA memory resources */
-static struct ibv_mr *client_metadata_mr = NULL, *server_buffer_mr = NULL, *server_metadata_mr = NULL;
-static struct rdma_buffer_attr client_metadata_attr, server_metadata_attr;
-static struct ibv_recv_wr client_recv_wr, *bad_client_recv_wr = NULL;
-static struct ibv_sge client_recv_sge;
-
-static char* buf_for_rwrite = NULL;
+static int shared_ready = 0;
+/* Limits of the device, and the queue depths of a client QP derived from
+ * them */
+static struct rdma_sizing sizing;
+static uint32_t conn_send_wr, conn_recv_wr;
+static enum rdma_comp_mode comp_mode = RDMA_COMP_EVENT;
+static unsigned int comp_spin_us = DEFAULT_COMP_SPIN_US;
+/* With -q all clients of a worker share one receive queue with this many
+ * buffers, otherwise each gets its own */
+static uint32_t srq_bufs = 0;
+/* Bytes we read at once from clients in pull mode, 0 = the ring's default */
+static uint32_t pull_chunk = 0;
+/* With -H every thread records latency histograms, dumped on SIGUSR1 and
+ * at shutdown */
+static int hist = 0;
+/* With -T every thread traces, and the trace goes to this file */
+static char *trace_path = NULL;
+
+/* The workers, and whether they run in threads of their own (-t) */
+static struct server_worker *workers = NULL;
+static unsigned int nr_workers = 1;
+static int threaded = 0;
+/* Set by a worker thread that failed, the main thread then shuts down */
+static int worker_failed = 0;
+static int main_wake_fd = -1;
+
+static unsigned int nr_conns = 0, max_conns = 64;
+
+/* How many lanes a client may open (-L), the lanes that are open and the
+ * connections they may belong to */
+static uint32_t max_lanes = RDMA_STRIPE_MAX_QPS - 1;
+static struct server_lane *lanes = NULL;
+static struct server_grant *grants = NULL;
+/* tokens are handed out from a seeded counter, so a stale lane of an
+ * earlier server does not fit a new connection */
+static uint32_t next_token = 0;
+
 #define BLOCK_SZ 25000000
 #define BLOCK_NUM 4
 char* block_mem[BLOCK_NUM];
-/* When we call this function cm_client_id must be set to a valid identifier.
- * This is where, we prepare client connection before we accept it. This
- * mainly involve pre-posting a receive buffer to receive client side
- * RDMA credentials
- */
-static int setup_client_resources()
+static struct ibv_mr *block_mr[BLOCK_NUM];
+/* The blocks, and whatever else rdma_buffer_alloc() hands out with the same
+ * rights, come from huge page arenas that are registered once */
+static struct rdma_pool pool;
+static int pool_ready = 0;
+/* The block memory is cut into slices, one per client. The CM thread takes
+ * them, the workers give them back. */
+#define DEFAULT_SLICE_SZ (1 << 20)
+static uint64_t slice_sz = DEFAULT_SLICE_SZ;
+static int *free_slices = NULL;
+static int nr_free_slices = 0, slices_per_block = 0;
+static pthread_mutex_t slice_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A window slice registered on the device of a rail */
+struct server_rail_key
+{
+	int slice;
+	struct ibv_mr *mr;
+	struct server_rail_key *next;
+};
+
+/* The lanes that came in on one device. Their QPs share one CQ that never
+ * sees a completion, their peers only read and write. Rail 0 is the
+ * clients' device, with the PD of the clients; the others have their own. */
+struct server_rail
+{
+	struct ibv_context *verbs;
+	struct ibv_pd *pd;
+	struct ibv_cq *cq;
+	struct rdma_sizing sizing;
+	struct server_rail_key *keys;
+};
+static struct server_rail rails[RDMA_RAIL_MAX];
+static int nr_rails = 0;
+
+static struct server_conn *find_conn(struct server_worker *w, uint32_t qp_num)
+{
+	struct server_conn *conn = w->conn_hash[qp_num % CONN_HASH_SIZE];
+	while (conn && conn->qp->qp_num != qp_num)
+		conn = conn->hash_next;
+	return conn;
+}
+
+static void link_conn(struct server_conn *conn)
+{
+	struct server_worker *w = conn->worker;
+	struct server_conn **bucket = &w->conn_hash[conn->qp->qp_num % CONN_HASH_SIZE];
+	conn->hash_next = *bucket;
+	*bucket = conn;
+	conn->prev = NULL;
+	conn->next = w->conns;
+	if (w->conns)
+		w->conns->prev = conn;
+	w->conns = conn;
+	conn->linked = 1;
+}
+
+static void unlink_conn(struct server_conn *conn)
+{
+	struct server_worker *w = conn->worker;
+	struct server_conn **pp = &w->conn_hash[conn->qp->qp_num % CONN_HASH_SIZE];
+	while (*pp && *pp != conn)
+		pp = &(*pp)->hash_next;
+	if (*pp)
+		*pp = conn->hash_next;
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		w->conns = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	conn->linked = 0;
+}
+
+/* Wakes up whoever sleeps on an eventfd */
+static void wake(int fd)
+{
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		rdma_error("Failed to wake up a thread, errno: %d \n", -errno);
+}
+
+/* Hands a connection to its worker: a new one, or one that is gone and has
+ * to be cleaned up. The CM thread must not touch a gone connection after
+ * this. */
+static void worker_post(struct server_conn *conn, int gone)
+{
+	struct server_worker *w = conn->worker;
+	pthread_mutex_lock(&w->lock);
+	conn->gone |= gone;
+	if (!conn->mailed)
+	{
+		conn->mailed = 1;
+		conn->mail_next = w->mail;
+		w->mail = conn;
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (threaded)
+		wake(w->wake_fd);
+}
+
+/* Creates the CQ and the receive queue of a worker */
+static int setup_worker(struct server_worker *w, struct ibv_context *verbs)
+{
+	unsigned int per_worker = (max_conns + nr_workers - 1) / nr_workers;
+	int ret;
+	w->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (w->wake_fd < 0)
+	{
+		rdma_error("Failed to create a worker eventfd, errno: %d \n", -errno);
+		return -errno;
+	}
+	/* Now we need a completion channel, were the I/O completion
+	 * notifications are sent. Remember, this is different from connection
+	 * management (CM) event notifications.
+	 */
+	w->channel = ibv_create_comp_channel(verbs);
+	if (!w->channel)
+	{
+		rdma_error("Failed to create an I/O completion event channel, %d\n",
+		           -errno);
+		return -errno;
+	}
+	debug("An I/O completion event channel is created at %p \n",
+	      w->channel);
+	/* The CQ of a worker has room for the completions of every client the
+	 * worker can get, and clients are spread evenly. With a shared receive
+	 * queue there are never more receive completions than shared buffers.
+	 * The completion vector decides which interrupt, and so which core, the
+	 * completion events of the CQ are raised on. */
+	w->cq = ibv_create_cq(verbs /* which device*/,
+	                      rdma_sizing_cq(&sizing, srq_bufs ?
+	                                     srq_bufs + (uint64_t) conn_send_wr * per_worker :
+	                                     (uint64_t) (conn_send_wr + conn_recv_wr) * per_worker)
+	                      /* maximum capacity*/,
+	                      w /* user context, the worker */,
+	                      w->channel /* which IO completion channel */,
+	                      w->id % verbs->num_comp_vectors /* signaling vector */);
+	if (!w->cq)
+	{
+		rdma_error("Failed to create a completion queue (cq), errno: %d\n",
+		           -errno);
+		return -errno;
+	}
+	debug("Completion queue (CQ) is created at %p with %d elements on vector %d \n",
+	      w->cq, w->cq->cqe, w->id % verbs->num_comp_vectors);
+	if (srq_bufs)
+	{
+		/* Every receive has to fit the largest message a client sends us,
+		 * which is its metadata */
+		ret = rdma_srq_create(&w->srq, pd, srq_bufs,
+		                      sizeof(struct rdma_client_metadata));
+		if (ret)
+		{
+			rdma_error("Failed to create the shared receive queue, ret = %d \n", ret);
+			return ret;
+		}
+	}
+	/* The poller asks for the event for all activities in the completion
+	 * queue whenever we are about to sleep */
+	ret = rdma_comp_poller_init(&w->poller, w->cq, w->channel,
+	                            comp_mode, comp_spin_us);
+	if (ret)
+	{
+		rdma_error("Failed to set up the completion poller, ret = %d \n", ret);
+		return ret;
+	}
+	w->stats = rdma_stats_get("worker%u", w->id);
+	w->poller.stats = w->stats;
+	rdma_stats_set(w->stats, RDMA_STATS_CQ_SIZE, w->cq->cqe);
+	return 0;
+}
+
+static void *worker_thread(void *arg);
+
+/* Sets up the resources all connections share. These are tied to the RDMA
+ * device, which we only know once the first client connects. */
+static int setup_shared_resources(struct ibv_context *verbs, uint8_t port_num)
+{
+	uint64_t per_worker = (max_conns + nr_workers - 1) / nr_workers;
+	uint32_t depth[2];
+	uint64_t copies[2];
+	int ret = -1, i;
+	long ncpus;
+	cpu_set_t cpus;
+	/* Protection Domain (PD) is similar to a "process abstraction"
+	 * in the operating system. All resources are tied to a particular PD.
+	 * And accessing recourses across PD will result in a protection fault.
+	 */
+	pd = ibv_alloc_pd(verbs
+	                  /* verbs defines a verb's provider,
+	                   * i.e an RDMA device where the incoming
+	                   * client connection came */);
+	if (!pd)
+	{
+		rdma_error("Failed to allocate a protection domain errno: %d\n",
+		           -errno);
+		return -errno;
+	}
+	debug("A new protection domain is allocated at %p \n", pd);
+	ret = rdma_sizing_query(&sizing, verbs, port_num);
+	if (ret)
+		return ret;
+	/* We write little more than ring heads to a client, but keep a round
+	 * trip of page sized transfers possible. Receives are the pool of zero
+	 * length receives for writes with immediate. */
+	conn_send_wr = rdma_sizing_depth(&sizing, 4096);
+	conn_recv_wr = rdma_sizing_wr(&sizing, RECV_POOL_SIZE);
+	if (max_lanes)
+	{
+		rails[0].verbs = verbs;
+		rails[0].pd = pd;
+		rails[0].sizing = sizing;
+		rails[0].cq = ibv_create_cq(verbs, rdma_sizing_cq(&sizing, 16), NULL, NULL, 0);
+		if (!rails[0].cq)
+		{
+			rdma_error("Failed to create the lane CQ, errno: %d \n", -errno);
+			return -errno;
+		}
+		nr_rails = 1;
+	}
+	if (srq_bufs && sizing.max_srq_wr && srq_bufs > sizing.max_srq_wr)
+	{
+		printf("The device takes %u shared receives, not %u \n",
+		       sizing.max_srq_wr, srq_bufs);
+		srq_bufs = sizing.max_srq_wr;
+	}
+	/* The CQ of a worker takes the completions of every client it can get.
+	 * On a device with small CQs the clients get shallower queues rather
+	 * than a CQ that can overrun. */
+	depth[0] = conn_send_wr;
+	copies[0] = per_worker;
+	depth[1] = srq_bufs ? srq_bufs : conn_recv_wr;
+	copies[1] = srq_bufs ? 1 : per_worker;
+	ret = rdma_sizing_fit_cq(&sizing, depth, copies, 2);
+	if (ret < 0)
+		return ret;
+	if (ret)
+	{
+		printf("The device takes CQs of %u entries, so clients get %u sends and %u receives \n",
+		       sizing.max_cqe, depth[0], depth[1]);
+		conn_send_wr = depth[0];
+		if (srq_bufs)
+			srq_bufs = depth[1];
+		else
+			conn_recv_wr = depth[1];
+	}
+	if (srq_bufs)
+	{
+		/* The SRQ limit event comes on the async event fd of the device,
+		 * which the CM event loop polls */
+		i = fcntl(verbs->async_fd, F_GETFL);
+		if (i < 0 || fcntl(verbs->async_fd, F_SETFL, i | O_NONBLOCK) < 0)
+		{
+			rdma_error("Failed to make the async event fd non-blocking, errno: %d \n", -errno);
+			return -errno;
+		}
+	}
+	ret = rdma_pool_init(&pool, pd, (IBV_ACCESS_REMOTE_READ |
+	                                 IBV_ACCESS_LOCAL_WRITE | // Must be set when REMOTE_WRITE is set.
+	                                 IBV_ACCESS_REMOTE_WRITE), 0);
+	if (ret)
+		return ret;
+	pool_ready = 1;
+	rdma_buffer_use_pool(&pool);
+	/* Every block is registered with its arena; the clients get slices of it */
+	for (i = 0; i < BLOCK_NUM; i++)
+	{
+		block_mr[i] = rdma_pool_alloc(&pool, BLOCK_SZ);
+		if (!block_mr[i])
+		{
+			rdma_error("Failed to allocate block %d\n", i);
+			return -ENOMEM;
+		}
+		block_mem[i] = block_mr[i]->addr;
+	}
+	for (i = 0; i < nr_workers; i++)
+	{
+		ret = setup_worker(&workers[i], verbs);
+		if (ret)
+			return ret;
+	}
+	if (threaded)
+	{
+		/* Worker i runs on core i, next to the interrupt of its vector if
+		 * the interrupts are spread the same way */
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		for (i = 0; i < nr_workers; i++)
+		{
+			ret = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+			if (ret)
+			{
+				rdma_error("Failed to start worker %d, ret = %d \n", i, ret);
+				return -ret;
+			}
+			CPU_ZERO(&cpus);
+			CPU_SET(i % (ncpus > 0 ? ncpus : 1), &cpus);
+			ret = pthread_setaffinity_np(workers[i].thread, sizeof(cpus), &cpus);
+			if (ret)
+				rdma_error("Failed to pin worker %d, ret = %d \n", i, ret);
+		}
+		printf("%u workers started \n", nr_workers);
+	}
+	shared_ready = 1;
+	return 0;
+}
+
+/* Creates the QP of a new client on the CQ of its worker and pre-posts the
+ * receive for its metadata */
+static int setup_client_resources(struct server_conn *conn)
+{
+	struct server_worker *w = conn->worker;
+	struct ibv_qp_init_attr qp_init_attr;
+	struct ibv_recv_wr *bad_client_recv_wr = NULL;
+	int ret = -1;
+	/* Now the last step, set up the queue pair (send, recv) queues and their capacity.
+	 * The capacity was derived from the device limits when the shared
+	 * resources were set up, see rdma_sizing.h */
+	bzero(&qp_init_attr, sizeof qp_init_attr);
+	qp_init_attr.cap.max_recv_sge = MAX_SGE; /* Maximum SGE per receive posting */
+	qp_init_attr.cap.max_recv_wr = conn_recv_wr; /* Maximum receive posting capacity */
+	qp_init_attr.cap.max_send_sge = MAX_SGE; /* Maximum SGE per send posting */
+	qp_init_attr.cap.max_send_wr = conn_send_wr; /* Maximum send posting capacity */
+	qp_init_attr.qp_type = IBV_QPT_RC; /* QP type, RC = Reliable connection */
+	/* All clients of a worker share its completion queue */
+	qp_init_attr.recv_cq = w->cq; /* Where should I notify for receive completion operations */
+	qp_init_attr.send_cq = w->cq; /* Where should I notify for send completion operations */
+	if (w->srq.srq)
+	{
+		/* Receives come from the shared queue, the QP has none of its own */
+		qp_init_attr.srq = w->srq.srq;
+		qp_init_attr.cap.max_recv_sge = 0;
+		qp_init_attr.cap.max_recv_wr = 0;
+	}
+	/*Lets create a QP */
+	ret = rdma_create_qp_inline(conn->cm_id /* which connection id */,
+	                            pd /* which protection domain*/,
+	                            &qp_init_attr /* Initial attributes */);
+	if (ret)
+	{
+		rdma_error("Failed to create QP due to errno: %d\n", -errno);
+		return -errno;
+	}
+	/* Save the reference for handy typing but is not required */
+	conn->qp = conn->cm_id->qp;
+	debug("Client QP created at %p\n", conn->qp);
+	/* The metadata comes in a receive of the shared queue */
+	if (w->srq.srq)
+		return 0;
+	/* we prepare the receive buffer in which we will receive the client metadata*/
+	conn->client_metadata_mr = rdma_buffer_register(pd /* which protection domain */,
+	                           &conn->client_metadata_attr /* what memory */,
+	                           sizeof(conn->client_metadata_attr) /* what length */,
+	                           (IBV_ACCESS_LOCAL_WRITE) /* access permissions */);
+	if (!conn->client_metadata_mr)
+	{
+		rdma_error("Failed to register client attr buffer\n");
+		//we assume ENOMEM
+		return -ENOMEM;
+	}
+	/* We pre-post this receive buffer on the QP. SGE credentials is where we
+	 * receive the metadata from the client */
+	conn->client_recv_sge.addr = (uint64_t) conn->client_metadata_mr->addr;
+	conn->client_recv_sge.length = conn->client_metadata_mr->length;
+	conn->client_recv_sge.lkey = conn->client_metadata_mr->lkey;
+	/* Now we link this SGE to the work request (WR) */
+	bzero(&conn->client_recv_wr, sizeof(conn->client_recv_wr));
+	conn->client_recv_wr.sg_list = &conn->client_recv_sge;
+	conn->client_recv_wr.num_sge = 1; // only one SGE
+	ret = ibv_post_recv(conn->qp /* which QP */,
+	                    &conn->client_recv_wr /* receive work request*/,
+	                    &bad_client_recv_wr /* error WRs */);
+	if (ret)
+	{
+		rdma_error("Failed to pre-post the receive buffer, errno: %d \n", ret);
+		return -ret;
+	}
+	debug("Receive buffer pre-posting is successful \n");
+	return 0;
+}
+
+/* Releases everything a connection holds. Once the connection is accepted,
+ * only its worker may do this. The CM id must not have any unacknowledged
+ * events. */
+static void destroy_conn(struct server_conn *conn)
+{
+	struct server_worker *w = conn->worker;
+	int ret;
+	if (conn->linked)
+		unlink_conn(conn);
+	if (conn->state == CONN_READY && !conn->imm)
+		w->nr_spinning--;
+	rdma_stats_put(conn->ring.stats);
+	/* Destroy QP */
+	if (conn->qp)
+		rdma_destroy_qp(conn->cm_id);
+	rdma_ring_consumer_destroy(&conn->ring);
+	/* Destroy memory buffers */
+	if (conn->slice_mr)
+		rdma_buffer_deregister(conn->slice_mr);
+	if (conn->window_mr)
+		rdma_buffer_deregister(conn->window_mr);
+	if (conn->server_metadata_mr)
+		rdma_buffer_deregister(conn->server_metadata_mr);
+	if (conn->client_metadata_mr)
+		rdma_buffer_deregister(conn->client_metadata_mr);
+	/* The slices go back to the pool */
+	pthread_mutex_lock(&slice_lock);
+	free_slices[nr_free_slices++] = conn->slice;
+	if (conn->window_slice >= 0)
+		free_slices[nr_free_slices++] = conn->window_slice;
+	pthread_mutex_unlock(&slice_lock);
+	/* Destroy client cm id */
+	ret = rdma_destroy_id(conn->cm_id);
+	if (ret)
+	{
+		rdma_error("Failed to destroy client id cleanly, %d \n", -errno);
+		// we continue anyways;
+	}
+	__atomic_sub_fetch(&w->nr_conns, 1, __ATOMIC_RELAXED);
+	printf("Client connection %p is gone after %lu records (%lu reads), %u clients left \n",
+	       conn, (unsigned long) conn->records, (unsigned long) conn->ring.pulls,
+	       __atomic_sub_fetch(&nr_conns, 1, __ATOMIC_RELAXED));
+	free(conn);
+}
+
+/* Picks the worker with the fewest clients */
+static struct server_worker *pick_worker()
+{
+	struct server_worker *best = &workers[0];
+	unsigned int i;
+	for (i = 1; i < nr_workers; i++)
+	{
+		if (__atomic_load_n(&workers[i].nr_conns, __ATOMIC_RELAXED) <
+		        __atomic_load_n(&best->nr_conns, __ATOMIC_RELAXED))
+			best = &workers[i];
+	}
+	return best;
+}
+
+/* Handles an RDMA_CM_EVENT_CONNECT_REQUEST: sets up the resources of the new
+ * client and accepts it */
+static int accept_client_connection(struct rdma_cm_id *cm_client_id,
+                                    struct rdma_conn_param *peer)
+{
+	struct rdma_conn_param conn_param;
+	struct server_conn *conn;
+	int ret = -1, slice = -1;
+	if (!pd)
+	{
+		ret = setup_shared_resources(cm_client_id->verbs,
+		                             cm_client_id->port_num);
+		if (ret)
+			goto reject;
+	}
+	else if (cm_client_id->verbs != pd->context)
+	{
+		rdma_error("Client came in on another device, rejecting it\n");
+		ret = -EINVAL;
+		goto reject;
+	}
+	pthread_mutex_lock(&slice_lock);
+	if (__atomic_load_n(&nr_conns, __ATOMIC_RELAXED) < max_conns && nr_free_slices > 0)
+		slice = free_slices[--nr_free_slices];
+	pthread_mutex_unlock(&slice_lock);
+	if (slice < 0)
+	{
+		rdma_error("Too many clients (%u), rejecting the new one\n", nr_conns);
+		ret = -ENOSPC;
+		goto reject;
+	}
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+	{
+		rdma_error("Failed to allocate a client connection, -ENOMEM\n");
+		pthread_mutex_lock(&slice_lock);
+		free_slices[nr_free_slices++] = slice;
+		pthread_mutex_unlock(&slice_lock);
+		ret = -ENOMEM;
+		goto reject;
+	}
+	conn->cm_id = cm_client_id;
+	conn->window_slice = -1;
+	conn->token = ++next_token;
+	/* the rest of the grant is the worker's once the connection is mailed */
+	conn->grant.token = conn->token;
+	conn->grant.window_slice = -1;
+	conn->worker = pick_worker();
+	__atomic_add_fetch(&conn->worker->nr_conns, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&nr_conns, 1, __ATOMIC_RELAXED);
+	// The slice of the client must not hold records of an earlier client,
+	// they would look like valid ones.
+	conn->slice = slice;
+	conn->buf = block_mem[slice / slices_per_block] +
+	            (slice % slices_per_block) * slice_sz;
+	memset(conn->buf, 0, slice_sz);
+	/* This is how we find the connection again in later CM events */
+	cm_client_id->context = conn;
+	ret = setup_client_resources(conn);
+	if (ret)
+	{
+		rdma_error("Failed to setup client resources, ret = %d \n", ret);
+		rdma_reject(cm_client_id, NULL, 0);
+		destroy_conn(conn);
+		return ret;
+	}
+	/* Now we accept the connection. Recall we have not accepted the connection
+	 * yet because we have to do lots of resource pre-allocation */
+	memset(&conn_param, 0, sizeof(conn_param));
+	/* How many RDMA reads we issue and answer at a time: what the client
+	 * offered, down to what our device can do */
+	rdma_sizing_conn_param(&sizing, &conn_param, peer);
+	/* From now on the connection belongs to its worker. It has to be in
+	 * the mailbox before we accept: the client metadata may come through
+	 * the CQ of the worker right after. The RDMA_CM_EVENT_ESTABLISHED event
+	 * comes through the event loop. */
+	worker_post(conn, 0);
+	ret = rdma_accept(cm_client_id, &conn_param);
+	if (ret)
+	{
+		rdma_error("Failed to accept the connection, errno: %d \n", -errno);
+		ret = -errno;
+		/* the worker cleans up, we must not touch it any more */
+		worker_post(conn, 1);
+		return ret;
+	}
+	/* Its lanes are welcome from now on, as many as the metadata grants */
+	conn->grant.next = grants;
+	grants = &conn->grant;
+	debug("A new RDMA client connection %p is accepted by worker %u\n",
+	      conn, conn->worker->id);
+	return 0;
+reject:
+	rdma_reject(cm_client_id, NULL, 0);
+	rdma_destroy_id(cm_client_id);
+	return ret;
+}
+
+/* Registers one slice of the block memory by itself, for a client to write
+ * and read through its key */
+static struct ibv_mr *register_slice(struct ibv_pd *slice_pd, int slice)
+{
+	return rdma_buffer_register(slice_pd,
+	                            block_mem[slice / slices_per_block] +
+	                            (slice % slices_per_block) * slice_sz,
+	                            slice_sz,
+	                            IBV_ACCESS_LOCAL_WRITE |
+	                            IBV_ACCESS_REMOTE_READ |
+	                            IBV_ACCESS_REMOTE_WRITE);
+}
+
+static void destroy_rail(struct server_rail *rail)
+{
+	struct server_rail_key *key;
+	while (rail->keys)
+	{
+		key = rail->keys;
+		rail->keys = key->next;
+		rdma_buffer_deregister(key->mr);
+		free(key);
+	}
+	if (rail->cq && ibv_destroy_cq(rail->cq))
+		rdma_error("Failed to destroy a lane CQ cleanly, %d \n", -errno);
+	if (rail != &rails[0] && rail->pd && ibv_dealloc_pd(rail->pd))
+		rdma_error("Failed to destroy a rail PD cleanly, %d \n", -errno);
+	bzero(rail, sizeof(*rail));
+}
+
+/* Finds the rail of the device a lane came in on, or sets one up */
+static struct server_rail *get_rail(struct rdma_cm_id *id)
+{
+	struct server_rail *rail;
+	int i;
+	for (i = 0; i < nr_rails; i++)
+	{
+		if (rails[i].verbs == id->verbs)
+			return &rails[i];
+	}
+	if (nr_rails == RDMA_RAIL_MAX)
+		return NULL;
+	rail = &rails[nr_rails];
+	rail->verbs = id->verbs;
+	if (!rdma_sizing_query(&rail->sizing, id->verbs, id->port_num))
+		rail->pd = ibv_alloc_pd(id->verbs);
+	if (rail->pd)
+		rail->cq = ibv_create_cq(id->verbs, rdma_sizing_cq(&rail->sizing, 16),
+		                         NULL, NULL, 0);
+	if (!rail->cq)
+	{
+		rdma_error("Failed to set up the lanes of %s, errno: %d \n",
+		           ibv_get_device_name(id->verbs->device), -errno);
+		destroy_rail(rail);
+		return NULL;
+	}
+	nr_rails++;
+	printf("Lanes come in on %s as well \n", ibv_get_device_name(id->verbs->device));
+	return rail;
+}
+
+/* Turns the key a lane asks for into the key of the window slice the
+ * connection was granted, on the device of the lane, or returns 0 if it is
+ * not the key of that window. On every device, the clients' one included,
+ * only the slice is registered, the first time a lane needs it, so a lane
+ * reaches nothing but its own window. The registration goes away with the
+ * grant, see drop_rail_keys(). */
+static uint32_t rail_key(struct server_rail *rail, struct server_grant *grant,
+                         uint32_t rkey)
+{
+	struct server_rail_key *key;
+	int slice = grant->window_slice;
+	if (slice < 0 || rkey != grant->window_rkey)
+		return 0;
+	for (key = rail->keys; key; key = key->next)
+	{
+		if (key->slice == slice)
+			return key->mr->rkey;
+	}
+	key = calloc(1, sizeof(*key));
+	if (!key)
+		return 0;
+	key->mr = register_slice(rail->pd, slice);
+	if (!key->mr)
+	{
+		free(key);
+		return 0;
+	}
+	key->slice = slice;
+	key->next = rail->keys;
+	rail->keys = key;
+	return key->mr->rkey;
+}
+
+/* Finds the lane of a CM id, or returns NULL */
+static struct server_lane *find_lane(struct rdma_cm_id *id)
+{
+	struct server_lane *lane;
+	for (lane = lanes; lane; lane = lane->next)
+	{
+		if (lane->cm_id == id)
+			return lane;
+	}
+	return NULL;
+}
+
+/* Handles the RDMA_CM_EVENT_CONNECT_REQUEST of a lane: checks that it
+ * belongs to a connection that may open one more, gives it a QP that only
+ * answers the client's RDMA writes and reads, and accepts it */
+static int accept_lane(struct rdma_cm_id *id, struct rdma_conn_param *peer,
+                       struct rdma_lane_hello *hello)
+{
+	struct rdma_conn_param conn_param;
+	struct ibv_qp_init_attr qp_init_attr;
+	struct rdma_lane_welcome welcome;
+	struct server_grant *grant;
+	struct server_lane *lane;
+	struct server_rail *rail = NULL;
+	uint32_t nr = 0;
+	int ret;
+	for (grant = grants; grant; grant = grant->next)
+	{
+		if (grant->token == hello->token)
+			break;
+	}
+	for (lane = lanes; lane; lane = lane->next)
+		nr += lane->token == hello->token;
+	/* the worker sets what it granted before the client learns the token */
+	if (grant && nr < __atomic_load_n(&grant->lanes, __ATOMIC_ACQUIRE) && nr_rails)
+		rail = get_rail(id);
+	welcome.magic = RDMA_LANE_MAGIC;
+	welcome.rkey = rail ? rail_key(rail, grant, hello->rkey) : 0;
+	if (!rail || !welcome.rkey)
+	{
+		rdma_error("Rejecting lane %u of token %u \n", hello->lane, hello->token);
+		ret = -EPERM;
+		goto reject;
+	}
+	lane = calloc(1, sizeof(*lane));
+	if (!lane)
+	{
+		ret = -ENOMEM;
+		goto reject;
+	}
+	/* The reads the client issues are answered by the NIC; we post
+	 * nothing on a lane */
+	bzero(&qp_init_attr, sizeof(qp_init_attr));
+	qp_init_attr.cap.max_send_wr = 1;
+	qp_init_attr.cap.max_send_sge = 1;
+	qp_init_attr.cap.max_recv_wr = 1;
+	qp_init_attr.cap.max_recv_sge = 1;
+	qp_init_attr.qp_type = IBV_QPT_RC;
+	qp_init_attr.send_cq = rail->cq;
+	qp_init_attr.recv_cq = rail->cq;
+	ret = rdma_create_qp(id, rail->pd, &qp_init_attr);
+	if (ret)
+	{
+		rdma_error("Failed to create a lane QP, errno: %d \n", -errno);
+		ret = -errno;
+		free(lane);
+		goto reject;
+	}
+	/* the client learns the key of its memory on this device */
+	memset(&conn_param, 0, sizeof(conn_param));
+	rdma_sizing_conn_param(&rail->sizing, &conn_param, peer);
+	conn_param.private_data = &welcome;
+	conn_param.private_data_len = sizeof(welcome);
+	ret = rdma_accept(id, &conn_param);
+	if (ret)
+	{
+		rdma_error("Failed to accept a lane, errno: %d \n", -errno);
+		ret = -errno;
+		rdma_destroy_qp(id);
+		free(lane);
+		goto reject;
+	}
+	lane->cm_id = id;
+	lane->token = hello->token;
+	lane->next = lanes;
+	lanes = lane;
+	debug("Lane %u of token %u is accepted \n", hello->lane, hello->token);
+	return 0;
+reject:
+	rdma_reject(id, NULL, 0);
+	rdma_destroy_id(id);
+	return ret;
+}
+
+/* Destroys a lane that is disconnected */
+static void destroy_lane(struct server_lane *lane)
+{
+	struct server_lane **p;
+	for (p = &lanes; *p; p = &(*p)->next)
+	{
+		if (*p == lane)
+		{
+			*p = lane->next;
+			break;
+		}
+	}
+	rdma_destroy_qp(lane->cm_id);
+	if (rdma_destroy_id(lane->cm_id))
+		rdma_error("Failed to destroy a lane id cleanly, %d \n", -errno);
+	free(lane);
+}
+
+/* Deregisters the window slice on every rail, before the slice can go to
+ * another client whose lanes would otherwise share the key */
+static void drop_rail_keys(int slice)
+{
+	struct server_rail_key **p, *key;
+	int i;
+	for (i = 0; i < nr_rails; i++)
+	{
+		p = &rails[i].keys;
+		while (*p)
+		{
+			key = *p;
+			if (key->slice != slice)
+			{
+				p = &key->next;
+				continue;
+			}
+			*p = key->next;
+			rdma_buffer_deregister(key->mr);
+			free(key);
+		}
+	}
+}
+
+/* A connection is gone: no more lanes for it, and the ones it has are
+ * disconnected. They are destroyed once their disconnect event comes in,
+ * or right away if they never were established. */
+static void drop_grant(uint32_t token)
+{
+	struct server_grant **p;
+	struct server_lane *lane, *next;
+	for (p = &grants; *p; p = &(*p)->next)
+	{
+		if ((*p)->token == token)
+		{
+			if ((*p)->window_slice >= 0)
+				drop_rail_keys((*p)->window_slice);
+			*p = (*p)->next;
+			break;
+		}
+	}
+	for (lane = lanes; lane; lane = next)
+	{
+		next = lane->next;
+		if (lane->token != token)
+			continue;
+		if (lane->established)
+			rdma_disconnect(lane->cm_id);
+		else
+			destroy_lane(lane);
+	}
+}
+
+/* This function sends server side buffer metadata to a client, once its
+ * metadata has been received */
+static int send_server_metadata_to_client(struct server_conn *conn)
+{
+	struct rdma_client_metadata *client_metadata_attr = &conn->client_metadata_attr;
+	int ret = -1;
+
+	debug("Client side buffer information is received...\n");
+	show_rdma_buffer_attr(&client_metadata_attr->buffer);
+	debug("The client has requested buffer length of : %d bytes\n", client_metadata_attr->buffer.length);
+
+	// Prepare memory region which will be sent to client,
+	// holding information required to access the slice.
+	conn->server_metadata_attr.buffer.address = (uint64_t) conn->buf;
+	conn->server_metadata_attr.buffer.length = client_metadata_attr->buffer.length < slice_sz ?
+	        client_metadata_attr->buffer.length : slice_sz;
+	/* the client writes into this buffer, so it needs a remote key, one
+	 * that covers the slice and nothing else of the arena */
+	conn->slice_mr = register_slice(pd, conn->slice);
+	if (!conn->slice_mr)
+	{
+		rdma_error("Failed to register the slice of the client, errno: %d \n", -errno);
+		return -errno;
+	}
+	conn->server_metadata_attr.buffer.stag.local_stag = conn->slice_mr->rkey;
+	/* A client that wants to stripe gets its lanes and a second slice to
+	 * stripe into, if there is one to spare: clients still to come go
+	 * first */
+	conn->server_metadata_attr.lanes = client_metadata_attr->lanes < max_lanes ?
+	                                   client_metadata_attr->lanes : max_lanes;
+	if (conn->server_metadata_attr.lanes)
+	{
+		pthread_mutex_lock(&slice_lock);
+		if (nr_free_slices > (int)(max_conns - __atomic_load_n(&nr_conns, __ATOMIC_RELAXED)))
+			conn->window_slice = free_slices[--nr_free_slices];
+		pthread_mutex_unlock(&slice_lock);
+	}
+	if (conn->window_slice >= 0)
+		conn->window_mr = register_slice(pd, conn->window_slice);
+	if (conn->window_mr)
+	{
+		conn->server_metadata_attr.window.address = (uint64_t)
+		        (block_mem[conn->window_slice / slices_per_block] +
+		         (conn->window_slice % slices_per_block) * slice_sz);
+		conn->server_metadata_attr.window.length = slice_sz;
+		conn->server_metadata_attr.window.stag.local_stag = conn->window_mr->rkey;
+		conn->server_metadata_attr.token = conn->token;
+		conn->grant.window_slice = conn->window_slice;
+		conn->grant.window_rkey = conn->window_mr->rkey;
+	}
+	else
+	{
+		/* no window, or it could not be registered: the client does
+		 * without striping */
+		conn->server_metadata_attr.lanes = 0;
+	}
+	__atomic_store_n(&conn->grant.lanes, conn->server_metadata_attr.lanes,
+	                 __ATOMIC_RELEASE);
+	conn->server_metadata_mr = rdma_buffer_register(pd,
+	                           &conn->server_metadata_attr,
+	                           sizeof(conn->server_metadata_attr),
+	                           IBV_ACCESS_LOCAL_WRITE);
+	if (!conn->server_metadata_mr)
+	{
+		rdma_error("Failed to register the server metadata buffer, ret = %d \n", -errno);
+		return -errno;
+	}
+	/* The slice is the log ring the client appends to. We tell the client
+	 * how far we consumed through its ring head. */
+	ret = rdma_ring_consumer_init(&conn->ring, pd, conn->qp,
+	                              conn->buf, conn->server_metadata_attr.buffer.length,
+	                              &client_metadata_attr->ring_head);
+	if (ret)
+	{
+		rdma_error("Failed to set up the ring consumer, ret = %d \n", ret);
+		return ret;
+	}
+	/* The records consumed are counted live, per client */
+	conn->ring.stats = rdma_stats_get("conn %u", conn->qp->qp_num);
+	/* In pull mode we read the records from the client's buffer ourselves,
+	 * into the slice, whenever we run out of them */
+	if (client_metadata_attr->flags & RDMA_META_PULL)
+	{
+		ret = rdma_ring_consumer_enable_pull(&conn->ring, pd,
+		                                     block_mr[conn->slice / slices_per_block]->lkey,
+		                                     &client_metadata_attr->buffer,
+		                                     &client_metadata_attr->ring_tail,
+		                                     pull_chunk);
+		if (ret)
+		{
+			rdma_error("Failed to enable pull mode, ret = %d \n", ret);
+			return ret;
+		}
+	}
+	/* If the client tells us about its records with immediate data, the
+	 * receives for it have to be posted before the client learns where
+	 * our buffer is */
+	conn->imm = !!(client_metadata_attr->flags & RDMA_META_WRITE_IMM);
+	if (conn->imm && !conn->worker->srq.srq)
+	{
+		ret = rdma_ring_consumer_enable_imm(&conn->ring, conn_recv_wr);
+		if (ret)
+		{
+			rdma_error("Failed to enable immediate notifications, ret = %d \n", ret);
+			return ret;
+		}
+	}
+
+	// Create sge which holds information required by client to access
+	// the buffer allocated above.
+	struct ibv_sge server_send_sge;
+	server_send_sge.addr = (uint64_t)conn->server_metadata_mr->addr;
+	server_send_sge.length = conn->server_metadata_mr->length;
+	server_send_sge.lkey = conn->server_metadata_mr->lkey;
+
+	// Create work request to send to client
+	struct ibv_send_wr server_send_wr;
+	bzero(&server_send_wr, sizeof(server_send_wr));
+	server_send_wr.sg_list = &server_send_sge;
+	server_send_wr.num_sge = 1;
+	server_send_wr.opcode = IBV_WR_SEND;
+	// The completion is reaped by the worker and ignored.
+	server_send_wr.send_flags = IBV_SEND_SIGNALED;
+
+	// Create WR used by ibv_post_send(3) to tell us which of the WRs
+	// given was bad. Since we give only one value, it should be
+	// bad_wr == server_send_wr in case of an error and
+	// bad_wr == NULL if everything's OK.
+	struct ibv_send_wr *bad_wr = NULL;
+
+	// Send WR to client.
+	ret = ibv_post_send(conn->qp, &server_send_wr, &bad_wr);
+	if (ret)
+	{
+		rdma_error("Failed to send server metadata, errno: %d\n", -ret);
+		return -ret;
+	}
+	conn->state = CONN_READY;
+	if (!conn->imm)
+		conn->worker->nr_spinning++;
+	return 0;
+}
+
+/* A connection failed. We disconnect it and clean up once the
+ * RDMA_CM_EVENT_DISCONNECTED event comes in. */
+static void fail_conn(struct server_conn *conn)
+{
+	if (conn->state == CONN_ERROR)
+		return;
+	if (conn->state == CONN_READY && !conn->imm)
+		conn->worker->nr_spinning--;
+	conn->state = CONN_ERROR;
+	rdma_disconnect(conn->cm_id);
+}
+
+static int take_mail(struct server_worker *w);
+
+/* Handles one work completion of the CQ of a worker */
+static void handle_work_completion(struct server_worker *w, struct ibv_wc *wc)
+{
+	struct server_conn *conn = find_conn(w, wc->qp_num);
+	int shared = rdma_srq_owns(&w->srq, wc->wr_id);
+	/* A connection is mailed before it is accepted, so one we do not know
+	 * yet may be waiting in the mailbox */
+	if (!conn && take_mail(w))
+		conn = find_conn(w, wc->qp_num);
+	if (!conn || conn->state == CONN_ERROR)
+	{
+		/* left over from a connection that is gone or going */
+		goto out;
+	}
+	if (wc->status != IBV_WC_SUCCESS)
+	{
+		rdma_error("Work completion (WC) has error status: %d (means: %s) on connection %p\n",
+		           -wc->status, ibv_wc_status_str(wc->status), conn);
+		fail_conn(conn);
+		goto out;
+	}
+	if (conn->state == CONN_ACCEPTING)
+	{
+		if (wc->opcode != IBV_WC_RECV)
+			goto out;
+		/* A shared buffer goes back to the pool, so we keep a copy */
+		if (shared)
+			memcpy(&conn->client_metadata_attr, rdma_srq_buffer(&w->srq, wc->wr_id),
+			       sizeof(conn->client_metadata_attr));
+		if (send_server_metadata_to_client(conn))
+			fail_conn(conn);
+		goto out;
+	}
+	if (wc->opcode == IBV_WC_SEND)
+	{
+		/* our metadata made it to the client */
+		goto out;
+	}
+	if (rdma_ring_consumer_complete(&conn->ring, wc) < 0)
+		fail_conn(conn);
+out:
+	if (shared && rdma_srq_release(&w->srq, wc->wr_id))
+		rdma_error("Failed to recycle a shared receive buffer\n");
+}
+
+/* Reaps what is on the CQ of a worker. Returns how many completions there
+ * were. */
+static int reap_completions(struct server_worker *w)
+{
+	struct ibv_wc wc[32];
+	int ret, i, total = 0;
+	if (!w->cq)
+		return 0;
+	do
+	{
+		ret = ibv_poll_cq(w->cq, 32, wc);
+		if (ret < 0)
+		{
+			rdma_error("Failed to poll cq for wc due to %d \n", ret);
+			return ret;
+		}
+		rdma_stats_add(w->stats, RDMA_STATS_CQ_POLLS, 1);
+		if (ret > 0)
+		{
+			rdma_hist_record(RDMA_HIST_CQ_BATCH, ret);
+			rdma_stats_add(w->stats, RDMA_STATS_CQ_WCS, ret);
+		}
+		for (i = 0; i < ret; i++)
+			handle_work_completion(w, &wc[i]);
+		total += ret;
+	}
+	while (ret == 32);
+	return total;
+}
+
+/* Consumes what the clients of a worker appended to their rings. We take at
+ * most a batch of records from each, so that no client starves the others. */
+static int consume_records(struct server_worker *w)
+{
+	struct server_conn *conn;
+	uint32_t len;
+	int total = 0, n;
+	for (conn = w->conns; conn; conn = conn->next)
+	{
+		if (conn->state != CONN_READY)
+			continue;
+		for (n = 0; n < 64; n++)
+		{
+			int* buf = rdma_ring_peek(&conn->ring, &len);
+			struct rdma_bulk_hdr *chunk;
+			if (!buf)
+			{
+				/* a corrupt ring is of no more use */
+				if (conn->ring.error)
+					fail_conn(conn);
+				break;
+			}
+			/* A chunk of a bulk transfer is processed while the next
+			 * ones are still on the wire */
+			chunk = rdma_bulk_parse(buf, len);
+			if (chunk)
+			{
+				conn->bulk_bytes += len - sizeof(*chunk);
+				/* chunks of the next transfer may already be
+				 * interleaved, the last chunk still comes last */
+				if (chunk->chunk + 1 == chunk->nr_chunks)
+					printf("bulk %u of %lu bytes from %p done, %lu bulk bytes so far\n",
+					       chunk->id, (unsigned long) chunk->total, conn,
+					       (unsigned long) conn->bulk_bytes);
+				rdma_ring_release(&conn->ring);
+				conn->records++;
+				continue;
+			}
+			/* The count and the doubles behind it; logging each of
+			 * them with printf made us as slow as the terminal */
+			rdma_trace(RDMA_TRACE_RECORD, (uintptr_t) conn, *buf, 0, 0);
+			rdma_ring_release(&conn->ring);
+			conn->records++;
+		}
+		w->records += n;
+		total += n;
+	}
+	return total;
+}
+
+/* Takes over the connections the CM thread handed to the worker. Returns how
+ * many there were. */
+static int take_mail(struct server_worker *w)
+{
+	struct server_conn *mail, *conn;
+	int total = 0, gone;
+	pthread_mutex_lock(&w->lock);
+	mail = w->mail;
+	w->mail = NULL;
+	pthread_mutex_unlock(&w->lock);
+	while (mail)
+	{
+		conn = mail;
+		mail = conn->mail_next;
+		total++;
+		/* Once it is out of the mailbox, the CM thread may post the
+		 * connection again, so mail_next is read before */
+		pthread_mutex_lock(&w->lock);
+		conn->mailed = 0;
+		gone = conn->gone;
+		pthread_mutex_unlock(&w->lock);
+		if (!conn->linked)
+			link_conn(conn);
+		if (gone)
+			destroy_conn(conn);
+	}
+	return total;
+}
+
+/* One round of work of a worker. Returns how much it did, or a negative
+ * error. */
+static int worker_step(struct server_worker *w)
+{
+	int ret, work;
+	work = take_mail(w);
+	if (__atomic_exchange_n(&w->refill, 0, __ATOMIC_ACQ_REL))
+	{
+		ret = rdma_srq_refill(&w->srq);
+		if (ret)
+			return ret;
+	}
+	ret = reap_completions(w);
+	if (ret < 0)
+		return ret;
+	work += ret;
+	work += consume_records(w);
+	return work;
+}
+
+/* Handles the asynchronous events of the device that are pending. We only
+ * care about the SRQ limit event, which tells a worker to refill its SRQ. */
+static int process_async_events()
+{
+	struct ibv_async_event event;
+	unsigned int i;
+	int total = 0;
+	if (!shared_ready || !srq_bufs)
+		return 0;
+	/* the fd is non-blocking, so this stops once nothing is pending */
+	while (ibv_get_async_event(pd->context, &event) == 0)
+	{
+		total++;
+		rdma_trace(RDMA_TRACE_ASYNC_EVENT, event.event_type, 0, 0, 0);
+		for (i = 0; i < nr_workers; i++)
+		{
+			if (event.event_type != IBV_EVENT_SRQ_LIMIT_REACHED ||
+			        event.element.srq != workers[i].srq.srq)
+				continue;
+			__atomic_add_fetch(&workers[i].srq.limit_events, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&workers[i].refill, 1, __ATOMIC_RELEASE);
+			if (threaded)
+				wake(workers[i].wake_fd);
+		}
+		ibv_ack_async_event(&event);
+	}
+	return total;
+}
+
+/* Handles a CM event of a client connection, before it is acknowledged */
+static void handle_conn_event(struct server_conn *conn, enum rdma_cm_event_type event)
+{
+	struct sockaddr_in remote_sockaddr;
+	/* Once gone, the connection is the worker's; a TIMEWAIT_EXIT, a second
+	 * disconnect or an error may still come in for it. Only the CM thread
+	 * sets gone, so it reads it without the lock. */
+	if (conn->gone)
+		return;
+	switch (event)
+	{
+	case RDMA_CM_EVENT_ESTABLISHED:
+		/* Just FYI: How to extract connection information */
+		memcpy(&remote_sockaddr /* where to save */,
+		       rdma_get_peer_addr(conn->cm_id) /* gives you remote sockaddr */,
+		       sizeof(struct sockaddr_in) /* max size */);
+		printf("A new connection is accepted from %s, %u clients \n",
+		       inet_ntoa(remote_sockaddr.sin_addr),
+		       __atomic_load_n(&nr_conns, __ATOMIC_RELAXED));
+		break;
+	case RDMA_CM_EVENT_DISCONNECTED:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+		/* The worker cleans up, the connection is its own */
+		printf("A disconnect event is received from the client %p...\n", conn);
+		drop_grant(conn->token);
+		worker_post(conn, 1);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Handles all connection management (CM) events that are pending. Returns
+ * how many there were, or a negative error. */
+static int process_cm_events()
 {
-	int ret = -1;
-	if (!cm_client_id)
+	struct rdma_cm_event *cm_event = NULL;
+	struct rdma_conn_param peer;
+	struct rdma_lane_hello hello;
+	struct rdma_cm_id *id;
+	struct server_conn *conn;
+	struct server_lane *lane;
+	enum rdma_cm_event_type event;
+	int ret, status, total = 0;
+	/* the channel is non-blocking, so this stops once nothing is pending */
+	while (rdma_get_cm_event(cm_event_channel, &cm_event) == 0)
 	{
-		rdma_error("Client id is still NULL \n");
-		return -EINVAL;
+		total++;
+		id = cm_event->id;
+		event = cm_event->event;
+		status = cm_event->status;
+		/* what the client asks for goes away with the event, and so does
+		 * the hello of a lane */
+		bzero(&hello, sizeof(hello));
+		if (event == RDMA_CM_EVENT_CONNECT_REQUEST)
+		{
+			peer = cm_event->param.conn;
+			if (peer.private_data && peer.private_data_len >= sizeof(hello))
+				memcpy(&hello, peer.private_data, sizeof(hello));
+			peer.private_data = NULL;
+			peer.private_data_len = 0;
+		}
+		rdma_trace(RDMA_TRACE_CM_EVENT, event, (uintptr_t) id, 0, 0);
+		/* Listening ids and lanes have no connection in their context */
+		lane = event != RDMA_CM_EVENT_CONNECT_REQUEST ? find_lane(id) : NULL;
+		conn = event != RDMA_CM_EVENT_CONNECT_REQUEST && !lane ? id->context : NULL;
+		if (conn)
+		{
+			/* The event of a connection is acknowledged only after we
+			 * acted on it: the worker destroys a gone connection, and
+			 * rdma_destroy_id() waits for the acknowledgement, so until
+			 * then the connection is still there */
+			handle_conn_event(conn, event);
+			if (rdma_ack_cm_event(cm_event))
+				rdma_error("Failed to acknowledge the cm event %d\n", -errno);
+			continue;
+		}
+		/* We acknowledge the event before we act on it: destroying a cm id
+		 * waits until all its events are acknowledged. */
+		ret = rdma_ack_cm_event(cm_event);
+		if (ret)
+		{
+			rdma_error("Failed to acknowledge the cm event %d\n", -errno);
+		}
+		if (event == RDMA_CM_EVENT_CONNECT_REQUEST)
+		{
+			/* Much like TCP connection, listening returns a new connection
+			 * identifier for newly connected client */
+			if (status == 0 && hello.magic == RDMA_LANE_MAGIC)
+			{
+				if (!shared_ready)
+				{
+					rdma_reject(id, NULL, 0);
+					rdma_destroy_id(id);
+				}
+				else
+				{
+					accept_lane(id, &peer, &hello);
+				}
+			}
+			else if (status == 0)
+			{
+				ret = accept_client_connection(id, &peer);
+				/* without the shared resources nobody can be served */
+				if (ret && !shared_ready)
+					return ret;
+			}
+			continue;
+		}
+		if (!lane)
+			continue;
+		switch (event)
+		{
+		case RDMA_CM_EVENT_ESTABLISHED:
+			lane->established = 1;
+			break;
+		case RDMA_CM_EVENT_DISCONNECTED:
+		case RDMA_CM_EVENT_CONNECT_ERROR:
+		case RDMA_CM_EVENT_UNREACHABLE:
+		case RDMA_CM_EVENT_REJECTED:
+			/* the lane is done for, it no longer counts */
+			destroy_lane(lane);
+			break;
+		default:
+			break;
+		}
 	}
-	/* We have a valid connection identifier, lets start to allocate
-	 * resources. We need:
-	 * 1. Protection Domains (PD)
-	 * 2. Memory Buffers
-	 * 3. Completion Queues (CQ)
-	 * 4. Queue Pair (QP)
-	 * Protection Domain (PD) is similar to a "process abstraction"
-	 * in the operating system. All resources are tied to a particular PD.
-	 * And accessing recourses across PD will result in a protection fault.
-	 */
-	pd = ibv_alloc_pd(cm_client_id->verbs
-	                  /* verbs defines a verb's provider,
-	                   * i.e an RDMA device where the incoming
-	                   * client connection came */);
-	if (!pd)
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
 	{
-		rdma_error("Failed to allocate a protection domain errno: %d\n",
-		           -errno);
+		rdma_error("Failed to retrieve a cm event, errno: %d \n", -errno);
 		return -errno;
 	}
-	debug("A new protection domain is allocated at %p \n", pd);
-	/* Now we need a completion channel, were the I/O completion
-	 * notifications are sent. Remember, this is different from connection
-	 * management (CM) event notifications.
-	 * A completion channel is also tied to an RDMA device, hence we will
-	 * use cm_client_id->verbs.
-	 */
-	io_completion_channel = ibv_create_comp_channel(cm_client_id->verbs);
-	if (!io_completion_channel)
+	return total;
+}
+
+/* Nothing to do: wait for the next completion or mail of a worker, as the
+ * completion mode says. The worker run by the main thread also waits for CM
+ * and device events. */
+static int wait_for_events(struct server_worker *w, uint64_t idle_since)
+{
+	struct pollfd fds[4];
+	uint64_t count;
+	int ret, nfds = 0;
+	/* Records of clients that do not send immediate data only show up in
+	 * memory, so as long as there is such a client we keep spinning */
+	if (comp_mode == RDMA_COMP_POLL || w->nr_spinning > 0 ||
+	        (comp_mode == RDMA_COMP_ADAPTIVE &&
+	         rdma_now_ns() - idle_since < (uint64_t) comp_spin_us * 1000))
 	{
-		rdma_error("Failed to create an I/O completion event channel, %d\n",
-		           -errno);
-		return -errno;
+		cpu_relax();
+		return 0;
 	}
-	debug("An I/O completion event channel is created at %p \n",
-	      io_completion_channel);
-	/* Now we create a completion queue (CQ) where actual I/O
-	 * completion metadata is placed. The metadata is packed into a structure
-	 * called struct ibv_wc (wc = work completion). ibv_wc has detailed
-	 * information about the work completion. An I/O request in RDMA world
-	 * is called "work" ;)
-	 */
-	cq = ibv_create_cq(cm_client_id->verbs /* which device*/,
-	                   CQ_CAPACITY /* maximum capacity*/,
-	                   NULL /* user context, not used here */,
-	                   io_completion_channel /* which IO completion channel */,
-	                   0 /* signaling vector, not used here*/);
-	if (!cq)
+	if (w->cq)
 	{
-		rdma_error("Failed to create a completion queue (cq), errno: %d\n",
-		           -errno);
-		return -errno;
+		/* A completion that came in before we armed the CQ raises no
+		 * event, so we look once more after arming */
+		ret = rdma_comp_poller_arm(&w->poller);
+		if (ret)
+			return ret;
+		ret = reap_completions(w);
+		if (ret)
+			return ret < 0 ? ret : 0;
+		/* Buffers released since the last batch are no use in the pool */
+		if (w->srq.srq)
+		{
+			ret = rdma_srq_refill(&w->srq);
+			if (ret)
+				return ret;
+		}
+		fds[0].fd = w->channel->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = w->wake_fd;
+		fds[1].events = POLLIN;
+		nfds = 2;
 	}
-	debug("Completion queue (CQ) is created at %p with %d elements \n",
-	      cq, cq->cqe);
-	/* Ask for the event for all activities in the completion queue*/
-	ret = ibv_req_notify_cq(cq /* on which CQ */,
-	                        0 /* 0 = all event type, no filter*/);
-	if (ret)
+	if (!threaded)
 	{
-		rdma_error("Failed to request notifications on CQ errno: %d \n",
-		           -errno);
-		return -errno;
+		fds[nfds].fd = cm_event_channel->fd;
+		fds[nfds++].events = POLLIN;
+		if (shared_ready && srq_bufs)
+		{
+			fds[nfds].fd = pd->context->async_fd;
+			fds[nfds++].events = POLLIN;
+		}
 	}
-	/* Now the last step, set up the queue pair (send, recv) queues and their capacity.
-	 * The capacity here is define statically but this can be probed from the
-	 * device. We just use a small number as defined in rdma_common.h */
-	bzero(&qp_init_attr, sizeof qp_init_attr);
-	qp_init_attr.cap.max_recv_sge = MAX_SGE; /* Maximum SGE per receive posting */
-	qp_init_attr.cap.max_recv_wr = MAX_WR; /* Maximum receive posting capacity */
-	qp_init_attr.cap.max_send_sge = MAX_SGE; /* Maximum SGE per send posting */
-	qp_init_attr.cap.max_send_wr = MAX_WR; /* Maximum send posting capacity */
-	qp_init_attr.qp_type = IBV_QPT_RC; /* QP type, RC = Reliable connection */
-	/* We use same completion queue, but one can use different queues */
-	qp_init_attr.recv_cq = cq; /* Where should I notify for receive completion operations */
-	qp_init_attr.send_cq = cq; /* Where should I notify for send completion operations */
-	/*Lets create a QP */
-	ret = rdma_create_qp(cm_client_id /* which connection id */,
-	                     pd /* which protection domain*/,
-	                     &qp_init_attr /* Initial attributes */);
-	if (ret)
+	ret = poll(fds, nfds, -1);
+	if (ret < 0)
 	{
-		rdma_error("Failed to create QP due to errno: %d\n", -errno);
+		if (errno == EINTR)
+			return 0;
+		rdma_error("Failed to wait for events, errno: %d \n", -errno);
 		return -errno;
 	}
-	/* Save the reference for handy typing but is not required */
-	client_qp = cm_client_id->qp;
-	debug("Client QP created at %p\n", client_qp);
-	return ret;
+	if (!w->cq)
+		return 0;
+	/* The eventfd is only reset, the mail is taken in the next step */
+	if ((fds[1].revents & POLLIN) &&
+	        read(w->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -errno;
+	if (fds[0].revents & POLLIN)
+		return rdma_comp_poller_get_event(&w->poller);
+	return 0;
 }
 
-/* Starts an RDMA server by allocating basic connection resources */
-static int start_rdma_server(struct sockaddr_in *server_addr)
+/* The loop of a worker that has a thread of its own */
+static void *worker_thread(void *arg)
 {
-	struct rdma_cm_event *cm_event = NULL;
-	int ret = -1;
-	/*  Open a channel used to report asynchronous communication event */
-	cm_event_channel = rdma_create_event_channel();
-	if (!cm_event_channel)
+	struct server_worker *w = arg;
+	uint64_t idle_since = rdma_now_ns();
+	char name[32];
+	int ret;
+	snprintf(name, sizeof(name), "worker%u", w->id);
+	if (hist && rdma_hist_thread_init(name))
+		rdma_error("Worker %u records no histograms\n", w->id);
+	if (trace_path && rdma_trace_thread_init(name, 0))
+		rdma_error("Worker %u does not trace\n", w->id);
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE))
 	{
-		rdma_error("Creating cm event channel failed with errno : (%d)", -errno);
-		return -errno;
+		ret = worker_step(w);
+		if (ret > 0)
+		{
+			idle_since = rdma_now_ns();
+			continue;
+		}
+		if (ret == 0)
+			ret = wait_for_events(w, idle_since);
+		if (ret < 0)
+		{
+			rdma_error("Worker %u failed, ret = %d \n", w->id, ret);
+			__atomic_store_n(&worker_failed, ret, __ATOMIC_RELEASE);
+			wake(main_wake_fd);
+			break;
+		}
 	}
-	debug("RDMA CM event channel is created successfully at %p \n",
-	      cm_event_channel);
+	return NULL;
+}
+
+/* Starts an RDMA server by allocating basic connection resources */
+/* Listens on one address, with an id of its own on the shared channel */
+static int listen_on(struct sockaddr_in *server_addr)
+{
+	struct rdma_cm_id *cm_server_id;
+	int ret = -1;
 	/* rdma_cm_id is the connection identifier (like socket) which is used
 	 * to define an RDMA connection.
 	 */
@@ -156,6 +1616,7 @@ static int start_rdma_server(struct sockaddr_in *server_addr)
 		rdma_error("Creating server cm id failed with errno: %d ", -errno);
 		return -errno;
 	}
+	cm_server_ids[nr_listeners++] = cm_server_id;
 	debug("A RDMA connection id for the server is created \n");
 	/* Explicit binding of rdma cm id to the socket credentials */
 	ret = rdma_bind_addr(cm_server_id, (struct sockaddr*) server_addr);
@@ -168,9 +1629,8 @@ static int start_rdma_server(struct sockaddr_in *server_addr)
 	/* Now we start to listen on the passed IP and port. However unlike
 	 * normal TCP listen, this is a non-blocking call. When a new client is
 	 * connected, a new connection management (CM) event is generated on the
-	 * RDMA CM event channel from where the listening id was created. Here we
-	 * have only one channel, so it is easy. */
-	ret = rdma_listen(cm_server_id, 8); /* backlog = 8 clients, same as TCP, see man listen*/
+	 * RDMA CM event channel from where the listening id was created. */
+	ret = rdma_listen(cm_server_id, max_conns); /* backlog, same as TCP, see man listen*/
 	if (ret)
 	{
 		rdma_error("rdma_listen failed to listen on server address, errno: %d ",
@@ -180,286 +1640,279 @@ static int start_rdma_server(struct sockaddr_in *server_addr)
 	printf("Server is listening successfully at: %s , port: %d \n",
 	       inet_ntoa(server_addr->sin_addr),
 	       ntohs(server_addr->sin_port));
-	/* now, we expect a client to connect and generate a RDMA_CM_EVNET_CONNECT_REQUEST
-	 * We wait (block) on the connection management event channel for
-	 * the connect event.
-	 */
-	ret = process_rdma_cm_event(cm_event_channel,
-	                            RDMA_CM_EVENT_CONNECT_REQUEST,
-	                            &cm_event);
-	if (ret)
+	return 0;
+}
+
+static int start_rdma_server(struct sockaddr_in *server_addrs, int nr_addrs)
+{
+	int ret = -1, flags, i;
+	/*  Open a channel used to report asynchronous communication event */
+	cm_event_channel = rdma_create_event_channel();
+	if (!cm_event_channel)
 	{
-		rdma_error("Failed to get cm event, ret = %d \n" , ret);
-		return ret;
+		rdma_error("Creating cm event channel failed with errno : (%d)", -errno);
+		return -errno;
 	}
-	/* Much like TCP connection, listening returns a new connection identifier
-	 * for newly connected client. In the case of RDMA, this is stored in id
-	 * field. For more details: man rdma_get_cm_event
-	 */
-	cm_client_id = cm_event->id;
-	/* now we acknowledge the event. Acknowledging the event free the resources
-	 * associated with the event structure. Hence any reference to the event
-	 * must be made before acknowledgment. Like, we have already saved the
-	 * client id from "id" field before acknowledging the event.
-	 */
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret)
+	debug("RDMA CM event channel is created successfully at %p \n",
+	      cm_event_channel);
+	/* The event loop polls the channel, so it must never block */
+	flags = fcntl(cm_event_channel->fd, F_GETFL);
+	if (flags < 0 || fcntl(cm_event_channel->fd, F_SETFL, flags | O_NONBLOCK) < 0)
 	{
-		rdma_error("Failed to acknowledge the cm event errno: %d \n", -errno);
+		rdma_error("Failed to make the cm event channel non-blocking, errno: %d \n", -errno);
 		return -errno;
 	}
-	debug("A new RDMA client connection id is stored at %p\n", cm_client_id);
-	return ret;
+	/* One listening id per address, all on the same channel */
+	for (i = 0; i < nr_addrs; i++)
+	{
+		ret = listen_on(&server_addrs[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
 }
 
-/* Pre-posts a receive buffer and accepts an RDMA client connection */
-static int accept_client_connection()
+/* Cuts the block memory into client slices */
+static int setup_slices()
 {
-	struct rdma_conn_param conn_param;
-	struct rdma_cm_event *cm_event = NULL;
-	struct sockaddr_in remote_sockaddr;
-	int ret = -1;
-	if (!cm_client_id || !client_qp)
+	int i;
+	slice_sz = rdma_ring_usable_size(slice_sz);
+	if (slice_sz == 0 || slice_sz > BLOCK_SZ)
 	{
-		rdma_error("Client resources are not properly setup\n");
+		rdma_error("Invalid slice size %lu\n", (unsigned long) slice_sz);
 		return -EINVAL;
 	}
-	/* we prepare the receive buffer in which we will receive the client metadata*/
-	client_metadata_mr = rdma_buffer_register(pd /* which protection domain */,
-	                     &client_metadata_attr /* what memory */,
-	                     sizeof(client_metadata_attr) /* what length */,
-	                     (IBV_ACCESS_LOCAL_WRITE) /* access permissions */);
-	if (!client_metadata_mr)
-	{
-		rdma_error("Failed to register client attr buffer\n");
-		//we assume ENOMEM
+	slices_per_block = BLOCK_SZ / slice_sz;
+	free_slices = calloc(slices_per_block * BLOCK_NUM, sizeof(*free_slices));
+	if (!free_slices)
 		return -ENOMEM;
-	}
-	/* We pre-post this receive buffer on the QP. SGE credentials is where we
-	 * receive the metadata from the client */
-	client_recv_sge.addr = (uint64_t) client_metadata_mr->addr; // same as &client_buffer_attr
-	client_recv_sge.length = client_metadata_mr->length;
-	client_recv_sge.lkey = client_metadata_mr->lkey;
-	/* Now we link this SGE to the work request (WR) */
-	bzero(&client_recv_wr, sizeof(client_recv_wr));
-	client_recv_wr.sg_list = &client_recv_sge;
-	client_recv_wr.num_sge = 1; // only one SGE
-	ret = ibv_post_recv(client_qp /* which QP */,
-	                    &client_recv_wr /* receive work request*/,
-	                    &bad_client_recv_wr /* error WRs */);
-	if (ret)
+	/* handed out from the end, so the first client gets slice 0 */
+	for (i = slices_per_block * BLOCK_NUM - 1; i >= 0; i--)
+		free_slices[nr_free_slices++] = i;
+	if (max_conns > (unsigned int) nr_free_slices)
+		max_conns = nr_free_slices;
+	debug("%d slices of %lu bytes for at most %u clients \n",
+	      nr_free_slices, (unsigned long) slice_sz, max_conns);
+	return 0;
+}
+
+/* Sets up the workers; their device resources come with the first client */
+static int setup_workers()
+{
+	unsigned int i;
+	int ret;
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+	for (i = 0; i < nr_workers; i++)
 	{
-		rdma_error("Failed to pre-post the receive buffer, errno: %d \n", ret);
-		return ret;
+		workers[i].id = i;
+		workers[i].wake_fd = -1;
+		pthread_mutex_init(&workers[i].lock, NULL);
 	}
-	debug("Receive buffer pre-posting is successful \n");
-	/* Now we accept the connection. Recall we have not accepted the connection
-	 * yet because we have to do lots of resource pre-allocation */
-	memset(&conn_param, 0, sizeof(conn_param));
-	/* this tell how many outstanding requests can we handle */
-	conn_param.initiator_depth = 3; /* For this exercise, we put a small number here */
-	/* This tell how many outstanding requests we expect other side to handle */
-	conn_param.responder_resources = 3; /* For this exercise, we put a small number */
-	// cm_client_id is set in start_rdma_server, to the first client that connected.
-	ret = rdma_accept(cm_client_id, &conn_param);
-	if (ret)
-	{
-		rdma_error("Failed to accept the connection, errno: %d \n", -errno);
+	/* a failing worker thread wakes the main thread up with this */
+	main_wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (main_wake_fd < 0)
 		return -errno;
-	}
-	/* We expect an RDMA_CM_EVNET_ESTABLISHED to indicate that the RDMA
-	* connection has been established and everything is fine on both, server
-	* as well as the client sides.
-	*/
-	debug("Going to wait for : RDMA_CM_EVENT_ESTABLISHED event \n");
-	ret = process_rdma_cm_event(cm_event_channel,
-	                            RDMA_CM_EVENT_ESTABLISHED,
-	                            &cm_event);
-	if (ret)
+	/* rdma_stat shows what we do, we serve clients without it as well */
+	if (rdma_stats_open("rdma_server"))
+		rdma_error("Running without live statistics\n");
+	if (hist)
 	{
-		rdma_error("Failed to get the cm event, errnp: %d \n", -errno);
-		return -errno;
+		ret = rdma_hist_thread_init("main");
+		if (ret)
+			return ret;
+		ret = rdma_hist_dump_on_signal(SIGUSR1, main_wake_fd);
+		if (ret)
+			return ret;
 	}
-	/* We acknowledge the event */
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret)
+	if (trace_path)
 	{
-		rdma_error("Failed to acknowledge the cm event %d\n", -errno);
-		return -errno;
+		ret = rdma_trace_thread_init("main", 0);
+		if (ret)
+			return ret;
+		ret = rdma_trace_start(trace_path);
+		if (ret)
+			return ret;
 	}
-	/* Just FYI: How to extract connection information */
-	memcpy(&remote_sockaddr /* where to save */,
-	       rdma_get_peer_addr(cm_client_id) /* gives you remote sockaddr */,
-	       sizeof(struct sockaddr_in) /* max size */);
-	printf("A new connection is accepted from %s \n",
-	       inet_ntoa(remote_sockaddr.sin_addr));
-	return ret;
+	return 0;
 }
 
-/* This function sends server side buffer metadata to the connected client */
-static int send_server_metadata_to_client()
+/* Serves clients until something goes fatally wrong. Without worker threads
+ * the main thread also does the work of the one worker. */
+static int run_event_loop()
 {
-	int ret = -1;
-
-	// At this point we expect to have one work completion; the receival of
-	// client meta data.
-	struct ibv_wc wc[1];
-	ret = process_work_completion_events(io_completion_channel, wc, 1);
-	if (ret != 1)
-	{
-		rdma_error("We failed to get 1 work completions , ret = %d \n", ret);
-		return ret;
-	}
-
-	debug("Client side buffer information is received...\n");
-	show_rdma_buffer_attr(&client_metadata_attr);
-	debug("The client has requested buffer length of : %d bytes\n", client_metadata_attr.length);
-
-	// Allocate buffer to be used by client for RDMA.
-	//buf_for_rwrite = calloc(client_metadata_attr.length, 0);
-	buf_for_rwrite = block_mem[0];
-	debug("Before register buf = %s   %p\n", buf_for_rwrite, buf_for_rwrite);
-	server_buffer_mr = rdma_buffer_alloc1(pd, buf_for_rwrite, client_metadata_attr.length,
-	                                      (IBV_ACCESS_REMOTE_READ |
-	                                       IBV_ACCESS_LOCAL_WRITE | // Must be set when REMOTE_WRITE is set.
-	                                       IBV_ACCESS_REMOTE_WRITE));
-
-	// Prepare memory region which will be sent to client,
-	// holding information required to access buffer allocated above.
-	server_metadata_attr.address = (uint64_t)server_buffer_mr->addr;
-	server_metadata_attr.length = server_buffer_mr->length;
-	server_metadata_attr.stag.local_stag = server_buffer_mr->lkey;
-	server_metadata_mr = rdma_buffer_register(pd,
-	                     &server_metadata_attr,
-	                     sizeof(server_metadata_attr),
-	                     IBV_ACCESS_LOCAL_WRITE);
-	if (!server_metadata_mr)
-	{
-		rdma_error("Failed to register the server metadata buffer, ret = %d \n", -errno);
-		return -errno;
-	}
-
-	// Create sge which holds information required by client to access
-	// the buffer allocated above.
-	struct ibv_sge server_send_sge;
-	server_send_sge.addr = (uint64_t)server_metadata_mr->addr;
-	server_send_sge.length = server_metadata_mr->length;
-	server_send_sge.lkey = server_metadata_mr->lkey;
-
-	// Create work request to send to client
-	struct ibv_send_wr server_send_wr;
-	bzero(&server_send_wr, sizeof(server_send_wr));
-	server_send_wr.sg_list = &server_send_sge;
-	server_send_wr.num_sge = 1;
-	server_send_wr.opcode = IBV_WR_SEND;
-	// This is what's used on the client.
-	// sq_sig_all is (implicitly) set to 0, so according to the docs (
-	// man ibv_post_send(3)) this should be OK.
-	server_send_wr.send_flags = IBV_SEND_SIGNALED;
-
-	// Create WR used by ibv_post_send(3) to tell us which of the WRs
-	// given was bad. Since we give only one value, it should be
-	// bad_wr == server_send_wr in case of an error and
-	// bad_wr == NULL if everything's OK.
-	struct ibv_send_wr *bad_wr = NULL;
-
-	//change  to 5
-	int* tmp_cnt = (int*)(void*)buf_for_rwrite;
-	*tmp_cnt = (int)(-1);
-	debug("tmp_cnt=%d\n", *tmp_cnt );
-	// Send WR to client.
-	ret = ibv_post_send(client_qp, &server_send_wr, &bad_wr);
-	debug("After11  post send  to sleep\n");
-	long long L1, L2;
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-	L1 = tv.tv_sec * 1000 * 1000 + tv.tv_usec;
-	int sh = 1;
-	gettimeofday(&tv, NULL);
-	L2 = tv.tv_sec * 1000 * 1000 + tv.tv_usec;
-	printf("%d ops  duration =  %lld  micro seconds \n", (*tmp_cnt), L2 - L1);
-
-	if (ret)
+	struct server_worker *w = &workers[0];
+	uint64_t idle_since = rdma_now_ns(), count;
+	struct pollfd fds[3];
+	int ret, work, nfds;
+	while (1 == 1)
 	{
-		rdma_error("Failed to send server metadata, errno: %d\n", -ret);
-		return -ret;
+		rdma_hist_poll(stdout);
+		ret = process_cm_events();
+		if (ret < 0)
+			return ret;
+		work = ret;
+		ret = process_async_events();
+		if (ret < 0)
+			return ret;
+		work += ret;
+		if (!threaded)
+		{
+			ret = worker_step(w);
+			if (ret < 0)
+				return ret;
+			work += ret;
+		}
+		ret = __atomic_load_n(&worker_failed, __ATOMIC_ACQUIRE);
+		if (ret)
+			return ret;
+		if (work)
+		{
+			idle_since = rdma_now_ns();
+			continue;
+		}
+		if (!threaded)
+		{
+			ret = wait_for_events(w, idle_since);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		/* The workers do the rest, we only sleep until the next CM or
+		 * device event, or until a worker fails */
+		nfds = 0;
+		fds[nfds].fd = cm_event_channel->fd;
+		fds[nfds++].events = POLLIN;
+		fds[nfds].fd = main_wake_fd;
+		fds[nfds++].events = POLLIN;
+		if (shared_ready && srq_bufs)
+		{
+			fds[nfds].fd = pd->context->async_fd;
+			fds[nfds++].events = POLLIN;
+		}
+		ret = poll(fds, nfds, -1);
+		if (ret < 0 && errno != EINTR)
+		{
+			rdma_error("Failed to wait for events, errno: %d \n", -errno);
+			return -errno;
+		}
+		if (ret > 0 && (fds[1].revents & POLLIN) &&
+		        read(main_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			return -errno;
 	}
-
-	// Here, we could check how many work completions we have on our
-	// io_completion_channel, to "ensure" that everything went well.
-	// This is done in rdma_client.c->client_send_metadata_to_server.
-	// I guess we don't really have to do that.
 	return 0;
 }
 
-/* This is server side logic. Server passively waits for the client to call
- * rdma_disconnect() and then it will clean up its resources */
+/* Cleans up what is left once the event loop stopped */
 static int disconnect_and_cleanup()
 {
-	struct rdma_cm_event *cm_event = NULL;
-	int ret = -1;
-	/* Now we wait for the client to send us disconnect event */
-	debug("Waiting for cm event: RDMA_CM_EVENT_DISCONNECTED\n");
-	ret = process_rdma_cm_event(cm_event_channel,
-	                            RDMA_CM_EVENT_DISCONNECTED,
-	                            &cm_event);
-	if (ret)
+	struct server_worker *w;
+	int ret = -1, i;
+	/* The workers stop first, then nobody else touches their connections */
+	for (i = 0; threaded && shared_ready && i < nr_workers; i++)
 	{
-		rdma_error("Failed to get disconnect event, ret = %d \n", ret);
-		return ret;
+		__atomic_store_n(&workers[i].stop, 1, __ATOMIC_RELEASE);
+		wake(workers[i].wake_fd);
+		pthread_join(workers[i].thread, NULL);
 	}
-	/* We acknowledge the event */
-	ret = rdma_ack_cm_event(cm_event);
-	if (ret)
+	/* We free all the resources */
+	for (i = 0; workers && i < nr_workers; i++)
 	{
-		rdma_error("Failed to acknowledge the cm event %d\n", -errno);
-		return -errno;
+		w = &workers[i];
+		take_mail(w);
+		while (w->conns)
+		{
+			rdma_disconnect(w->conns->cm_id);
+			destroy_conn(w->conns);
+		}
+		/* The QPs are gone, so nobody uses the shared receive queue any more */
+		if (w->srq.srq)
+		{
+			printf("The shared receive queue of worker %u took %lu messages, hit its limit %lu times \n",
+			       w->id, (unsigned long) w->srq.received,
+			       (unsigned long) w->srq.limit_events);
+			rdma_srq_destroy(&w->srq);
+		}
+		printf("Worker %u consumed %lu records \n", w->id, (unsigned long) w->records);
+		if (w->cq)
+		{
+			/* Destroy CQ */
+			rdma_comp_poller_destroy(&w->poller);
+			ret = ibv_destroy_cq(w->cq);
+			if (ret)
+			{
+				rdma_error("Failed to destroy completion queue cleanly, %d \n", -errno);
+				// we continue anyways;
+			}
+		}
+		if (w->channel)
+		{
+			/* Destroy completion channel */
+			ret = ibv_destroy_comp_channel(w->channel);
+			if (ret)
+			{
+				rdma_error("Failed to destroy completion channel cleanly, %d \n", -errno);
+				// we continue anyways;
+			}
+		}
+		if (w->wake_fd >= 0)
+			close(w->wake_fd);
+		rdma_stats_put(w->stats);
 	}
-	printf("A disconnect event is received from the client...\n");
-	/* We free all the resources */
-	/* Destroy QP */
-	rdma_destroy_qp(cm_client_id);
-	/* Destroy client cm id */
-	ret = rdma_destroy_id(cm_client_id);
-	if (ret)
+	/* The lanes go the same way */
+	while (lanes)
 	{
-		rdma_error("Failed to destroy client id cleanly, %d \n", -errno);
-		// we continue anyways;
+		rdma_disconnect(lanes->cm_id);
+		destroy_lane(lanes);
 	}
-	/* Destroy CQ */
-	ret = ibv_destroy_cq(cq);
-	if (ret)
+	/* the grants went with their connections */
+	grants = NULL;
+	/* The rails hold registrations of the pool, so they go before it */
+	for (i = nr_rails - 1; i >= 0; i--)
+		destroy_rail(&rails[i]);
+	/* Destroy memory buffers */
+	for (i = 0; i < BLOCK_NUM; i++)
 	{
-		rdma_error("Failed to destroy completion queue cleanly, %d \n", -errno);
-		// we continue anyways;
+		if (block_mr[i])
+			rdma_pool_free(&pool, block_mr[i]);
 	}
-	/* Destroy completion channel */
-	ret = ibv_destroy_comp_channel(io_completion_channel);
-	if (ret)
+	if (pool_ready)
 	{
-		rdma_error("Failed to destroy completion channel cleanly, %d \n", -errno);
-		// we continue anyways;
+		rdma_buffer_use_pool(NULL);
+		rdma_pool_destroy(&pool);
 	}
-	/* Destroy memory buffers */
-	rdma_buffer_free(server_buffer_mr);
-	rdma_buffer_deregister(server_metadata_mr);
-	rdma_buffer_deregister(client_metadata_mr);
-	/* Destroy protection domain */
-	ret = ibv_dealloc_pd(pd);
-	if (ret)
+	free(free_slices);
+	if (pd)
 	{
-		rdma_error("Failed to destroy client protection domain cleanly, %d \n", -errno);
-		// we continue anyways;
+		/* Destroy protection domain */
+		ret = ibv_dealloc_pd(pd);
+		if (ret)
+		{
+			rdma_error("Failed to destroy client protection domain cleanly, %d \n", -errno);
+			// we continue anyways;
+		}
 	}
-	/* Destroy rdma server id */
-	ret = rdma_destroy_id(cm_server_id);
-	if (ret)
+	free(workers);
+	if (main_wake_fd >= 0)
+		close(main_wake_fd);
+	/* Destroy rdma server ids */
+	for (i = 0; i < nr_listeners; i++)
 	{
-		rdma_error("Failed to destroy server id cleanly, %d \n", -errno);
-		// we continue anyways;
+		ret = rdma_destroy_id(cm_server_ids[i]);
+		if (ret)
+		{
+			rdma_error("Failed to destroy server id cleanly, %d \n", -errno);
+			// we continue anyways;
+		}
 	}
 	rdma_destroy_event_channel(cm_event_channel);
+	if (hist)
+		rdma_hist_dump(stdout);
+	if (trace_path)
+		printf("Trace is in %s, %lu records were lost \n", trace_path,
+		       (unsigned long) rdma_trace_stop());
+	rdma_stats_close();
 	printf("Server shut-down is complete \n");
 	return 0;
 }
@@ -468,77 +1921,134 @@ static int disconnect_and_cleanup()
 void usage()
 {
 	printf("Usage:\n");
-	printf("rdma_server: [-a <server_addr>] [-p <server_port>]\n");
+	printf("rdma_server: [-a <server_addr>[,<server_addr>...]] [-p <server_port>] [-c <event|poll|adaptive>] [-w <spin_us>] [-n <max_clients>] [-s <slice_bytes>] [-q <srq_buffers>] [-t <workers>] [-P <pull_bytes>] [-L <lanes>] [-H] [-T <trace_file>]\n");
 	printf("(default port is %d)\n", DEFAULT_RDMA_PORT);
+	printf("-a: listen on every one of these addresses, for instance one per port or device (at most %d)\n",
+	       RDMA_RAIL_MAX);
+	printf("-c: how to wait for completions (default event), -w: spin budget of the adaptive mode (default %d us)\n",
+	       DEFAULT_COMP_SPIN_US);
+	printf("-n: how many clients are served at once (default 64), -s: buffer slice per client (default %d)\n",
+	       DEFAULT_SLICE_SZ);
+	printf("-q: share one receive queue of this many buffers among the clients of a worker (default: one receive queue per client)\n");
+	printf("-t: serve the clients with this many worker threads, each with its own CQ and core (default: one worker in the main thread)\n");
+	printf("-P: read at most this many bytes at once from clients in pull mode (default %d)\n",
+	       RDMA_RING_PULL_CHUNK);
+	printf("-L: let a client open up to this many more QPs to stripe over, 0 = none (default %d)\n",
+	       RDMA_STRIPE_MAX_QPS - 1);
+	printf("-H: record latency histograms, printed on SIGUSR1 and at shutdown\n");
+	printf("-T: trace into this file, see rdma_trace_decode\n");
 	exit(1);
 }
 
 int main(int argc, char **argv)
 {
-	for (int i = 0; i < BLOCK_NUM ; i++)
-	{
-		block_mem[i] = calloc(BLOCK_SZ, 1);
-	}
-	int ret, option;
-	struct sockaddr_in server_sockaddr;
-	bzero(&server_sockaddr, sizeof server_sockaddr);
-	server_sockaddr.sin_family = AF_INET; /* standard IP NET address */
-	server_sockaddr.sin_addr.s_addr = htonl(INADDR_ANY); /* passed address */
+	int ret, option, i, nr_addrs = 1;
+	uint16_t port = htons(DEFAULT_RDMA_PORT); /* use default port */
+	struct sockaddr_in server_sockaddrs[RDMA_RAIL_MAX];
+	char *save = NULL, *item;
+	bzero(server_sockaddrs, sizeof server_sockaddrs);
+	server_sockaddrs[0].sin_family = AF_INET; /* standard IP NET address */
+	server_sockaddrs[0].sin_addr.s_addr = htonl(INADDR_ANY); /* passed address */
 
-	get_addr("12.12.10.17", (struct sockaddr*) &server_sockaddr);
-	server_sockaddr.sin_port = htons(DEFAULT_RDMA_PORT); /* use default port */
-
-	ret = start_rdma_server(&server_sockaddr);
-	if (ret)
+	get_addr("12.12.10.17", (struct sockaddr*) &server_sockaddrs[0]);
+	/* Parse Command Line Arguments, not the most reliable code */
+	while ((option = getopt(argc, argv, "a:p:c:w:n:s:q:t:P:L:HT:")) != -1)
 	{
-		rdma_error("RDMA server failed to start cleanly, ret = %d \n", ret);
-		return ret;
+		switch (option)
+		{
+		case 'a':
+			/* a comma separated list, one listening id each */
+			nr_addrs = 0;
+			for (item = strtok_r(optarg, ",", &save); item;
+			        item = strtok_r(NULL, ",", &save))
+			{
+				if (nr_addrs == RDMA_RAIL_MAX)
+					usage();
+				ret = get_addr(item, (struct sockaddr*) &server_sockaddrs[nr_addrs++]);
+				if (ret)
+				{
+					rdma_error("Invalid IP \n");
+					return ret;
+				}
+			}
+			if (!nr_addrs)
+				usage();
+			break;
+		case 'p':
+			/* passed port to listen on */
+			port = htons(strtol(optarg, NULL, 0));
+			break;
+		case 'c':
+			ret = rdma_comp_mode_parse(optarg);
+			if (ret < 0)
+				usage();
+			comp_mode = ret;
+			break;
+		case 'w':
+			comp_spin_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			max_conns = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			slice_sz = strtoull(optarg, NULL, 0);
+			break;
+		case 'q':
+			srq_bufs = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_workers = strtoul(optarg, NULL, 0);
+			threaded = 1;
+			break;
+		case 'P':
+			pull_chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			max_lanes = strtoul(optarg, NULL, 0);
+			if (max_lanes > RDMA_STRIPE_MAX_QPS - 1)
+				max_lanes = RDMA_STRIPE_MAX_QPS - 1;
+			break;
+		case 'H':
+			hist = 1;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		default:
+			usage();
+			break;
+		}
 	}
-	ret = setup_client_resources();
+	if (max_conns == 0 || nr_workers == 0)
+		usage();
+	/* get_addr() overwrites the port info, so it goes in last */
+	for (i = 0; i < nr_addrs; i++)
+		server_sockaddrs[i].sin_port = port;
+	next_token = (uint32_t)(rdma_now_ns() ^ getpid());
+	ret = setup_slices();
 	if (ret)
 	{
-		rdma_error("Failed to setup client resources, ret = %d \n", ret);
+		rdma_error("Failed to set up the buffer slices, ret = %d \n", ret);
 		return ret;
 	}
-	ret = accept_client_connection();
+	ret = setup_workers();
 	if (ret)
 	{
-		rdma_error("Failed to handle client cleanly, ret = %d \n", ret);
+		rdma_error("Failed to set up the workers, ret = %d \n", ret);
 		return ret;
 	}
-	ret = send_server_metadata_to_client();
+
+	ret = start_rdma_server(server_sockaddrs, nr_addrs);
 	if (ret)
 	{
-		rdma_error("Failed to send server metadata to the client, ret = %d \n", ret);
+		rdma_error("RDMA server failed to start cleanly, ret = %d \n", ret);
 		return ret;
 	}
-	int* buf = (void*)block_mem[0];
-	while (1 == 1)
-	{
-		printf("buf=%d\n", *buf);
-		if (*buf > 0 )
-		{
-			printf("recv=%d\n", *buf );
-			char* ddata = (void*)buf;
-			ddata = ddata + sizeof(int);
-			double* real_data = (void*)ddata;
-			for (int j = 0; j < *buf; j++)
-			{
-				printf("%lf", real_data[j]);
-			}
-			printf("\n");
-		}
-		else
-		{
-			printf("no data\n");
-		}
-		sleep(1);
-	}
-	ret = disconnect_and_cleanup();
+	ret = run_event_loop();
 	if (ret)
 	{
-		rdma_error("Failed to clean up resources properly, ret = %d \n", ret);
-		return ret;
+		rdma_error("The event loop failed, ret = %d \n", ret);
 	}
-	return 0;
+	disconnect_and_cleanup();
+	return ret;
 }
@@ -0,0 +1,158 @@
+/*
+ * Implementation of sizing queues from what the device can do.
+ */
+
+#include "rdma_sizing.h"
+
+/* Lane rate of an active_speed value of ibv_port_attr, in Mbit/s */
+static uint64_t lane_mbps(uint8_t active_speed)
+{
+	switch (active_speed)
+	{
+	case 1: return 2500;    /* SDR */
+	case 2: return 5000;    /* DDR */
+	case 4: return 10000;   /* QDR */
+	case 8: return 10000;   /* FDR10 */
+	case 16: return 14000;  /* FDR */
+	case 32: return 25000;  /* EDR */
+	case 64: return 50000;  /* HDR */
+	case 128: return 100000; /* NDR */
+	default: return 0;
+	}
+}
+
+/* Lanes of an active_width value of ibv_port_attr */
+static uint64_t lanes(uint8_t active_width)
+{
+	switch (active_width)
+	{
+	case 1: return 1;
+	case 2: return 4;
+	case 4: return 8;
+	case 8: return 12;
+	case 16: return 2;
+	default: return 0;
+	}
+}
+
+uint64_t rdma_sizing_port_mbps(const struct ibv_port_attr *port_attr)
+{
+	return lane_mbps(port_attr->active_speed) * lanes(port_attr->active_width);
+}
+
+int rdma_sizing_query(struct rdma_sizing *sz, struct ibv_context *verbs,
+                      uint8_t port_num)
+{
+	struct ibv_device_attr dev_attr;
+	struct ibv_port_attr port_attr;
+	uint64_t mbps;
+	if (!sz || !verbs)
+	{
+		rdma_error("Passed sizing or device is NULL\n");
+		return -EINVAL;
+	}
+	bzero(sz, sizeof(*sz));
+	if (ibv_query_device(verbs, &dev_attr))
+	{
+		rdma_error("Failed to query the device, errno: %d \n", -errno);
+		return -errno;
+	}
+	sz->max_qp_wr = dev_attr.max_qp_wr;
+	sz->max_cqe = dev_attr.max_cqe;
+	sz->max_sge = dev_attr.max_sge;
+	sz->max_srq_wr = dev_attr.max_srq_wr;
+	sz->max_qp_rd_atom = dev_attr.max_qp_rd_atom > 255 ? 255 : dev_attr.max_qp_rd_atom;
+	sz->max_qp_init_rd_atom = dev_attr.max_qp_init_rd_atom > 255 ? 255 :
+	                          dev_attr.max_qp_init_rd_atom;
+	sz->rtt_ns = RDMA_SIZING_RTT_NS;
+	mbps = 0;
+	if (ibv_query_port(verbs, port_num ? port_num : 1, &port_attr) == 0)
+		mbps = rdma_sizing_port_mbps(&port_attr);
+	if (!mbps)
+		mbps = RDMA_SIZING_DEFAULT_GBPS * 1000;
+	sz->link_bytes_per_s = mbps * 1000000 / 8;
+	debug("Device: %u WRs per QP, %u CQEs, %u SGEs, %u/%u reads in flight, link %lu Mbit/s \n",
+	      sz->max_qp_wr, sz->max_cqe, sz->max_sge, sz->max_qp_init_rd_atom,
+	      sz->max_qp_rd_atom, (unsigned long) mbps);
+	return 0;
+}
+
+uint32_t rdma_sizing_gbps(struct rdma_sizing *sz)
+{
+	uint64_t gbps = sz->link_bytes_per_s * 8 / 1000000000;
+	return gbps ? gbps : 1;
+}
+
+uint32_t rdma_sizing_wr(struct rdma_sizing *sz, uint64_t wrs)
+{
+	if (wrs < RDMA_SIZING_MIN_DEPTH)
+		wrs = RDMA_SIZING_MIN_DEPTH;
+	if (sz->max_qp_wr && wrs > sz->max_qp_wr)
+		wrs = sz->max_qp_wr;
+	return wrs;
+}
+
+uint32_t rdma_sizing_cq(struct rdma_sizing *sz, uint64_t entries)
+{
+	if (sz->max_cqe && entries > sz->max_cqe)
+		entries = sz->max_cqe;
+	return entries;
+}
+
+static uint64_t cq_entries(uint32_t *depth, const uint64_t *copies, int nr)
+{
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < nr; i++)
+		total += copies[i] * depth[i];
+	return total;
+}
+
+int rdma_sizing_fit_cq(struct rdma_sizing *sz, uint32_t *depth,
+                       const uint64_t *copies, int nr)
+{
+	uint64_t total = cq_entries(depth, copies, nr), scaled;
+	uint32_t floor;
+	int i;
+	if (!sz->max_cqe || total <= sz->max_cqe)
+		return 0;
+	for (i = 0; i < nr; i++)
+	{
+		floor = depth[i] < RDMA_SIZING_MIN_DEPTH ? depth[i] : RDMA_SIZING_MIN_DEPTH;
+		scaled = (uint64_t) depth[i] * sz->max_cqe / total;
+		depth[i] = scaled > floor ? scaled : floor;
+	}
+	if (cq_entries(depth, copies, nr) > sz->max_cqe)
+	{
+		rdma_error("Queues do not fit into a CQ of %u entries\n", sz->max_cqe);
+		return -ENOSPC;
+	}
+	return 1;
+}
+
+uint32_t rdma_sizing_depth(struct rdma_sizing *sz, uint32_t bytes_per_wr)
+{
+	uint64_t bdp = sz->link_bytes_per_s * sz->rtt_ns / 1000000000ULL;
+	if (bytes_per_wr == 0)
+		bytes_per_wr = 1;
+	return rdma_sizing_wr(sz, (2 * bdp + bytes_per_wr - 1) / bytes_per_wr);
+}
+
+void rdma_sizing_conn_param(struct rdma_sizing *sz,
+                            struct rdma_conn_param *param,
+                            const struct rdma_conn_param *peer)
+{
+	param->initiator_depth = sz->max_qp_init_rd_atom;
+	param->responder_resources = sz->max_qp_rd_atom;
+	if (peer)
+	{
+		/* we answer no more reads than the peer issues, and issue no more
+		 * than it answers */
+		if (peer->initiator_depth < param->responder_resources)
+			param->responder_resources = peer->initiator_depth;
+		if (peer->responder_resources < param->initiator_depth)
+			param->initiator_depth = peer->responder_resources;
+	}
+	debug("Connection allows %u reads out, %u reads in \n",
+	      param->initiator_depth, param->responder_resources);
+}
@@ -0,0 +1,95 @@
+/*
+ * Header file for sizing queues from what the device can do.
+ *
+ * A pipeline fills the link when it has a bandwidth-delay product (BDP)
+ * worth of bytes in flight: at 100 Gbit/s and 10 us round trip that is
+ * 125 KB, or some 2000 messages of 64 bytes. Fewer outstanding work requests
+ * (WRs) leave the link idle, more only cost memory. The sizing module asks
+ * the device for its limits (ibv_query_device) and the port for its link
+ * speed (ibv_query_port), and turns a message size into a queue depth that
+ * covers the BDP without exceeding what the device supports.
+ *
+ * It also negotiates how many RDMA reads (and atomics) may be outstanding on
+ * a connection: the initiator depth of one side must not exceed the
+ * responder resources of the other, and neither may exceed the device's
+ * max_qp_init_rd_atom and max_qp_rd_atom.
+ */
+
+#ifndef RDMA_SIZING_H
+#define RDMA_SIZING_H
+
+#include "rdma_common.h"
+
+/* Round trip we plan for when nothing better is known */
+#define RDMA_SIZING_RTT_NS (10000)
+/* Link speed we assume when the port does not report one, in Gbit/s */
+#define RDMA_SIZING_DEFAULT_GBPS (10)
+/* No queue is made smaller than this */
+#define RDMA_SIZING_MIN_DEPTH (16)
+
+struct rdma_sizing
+{
+	/* device limits */
+	uint32_t max_qp_wr;
+	uint32_t max_cqe;
+	uint32_t max_sge;
+	uint32_t max_srq_wr;
+	uint8_t max_qp_rd_atom;
+	uint8_t max_qp_init_rd_atom;
+	/* link bandwidth of the port, and the round trip the queues cover */
+	uint64_t link_bytes_per_s;
+	uint64_t rtt_ns;
+};
+
+/*
+ * Queries the device limits and the link speed of a port.
+ * @sz: sizing to fill in
+ * @verbs: device of the connection, cm_id->verbs
+ * @port_num: port of the connection, cm_id->port_num
+ */
+int rdma_sizing_query(struct rdma_sizing *sz, struct ibv_context *verbs,
+                      uint8_t port_num);
+
+/* Link speed of a port in Mbit/s, or 0 if it does not report one */
+uint64_t rdma_sizing_port_mbps(const struct ibv_port_attr *port_attr);
+
+/* Link speed the sizing was made for, in whole Gbit/s, at least 1 */
+uint32_t rdma_sizing_gbps(struct rdma_sizing *sz);
+
+/*
+ * Returns how many WRs, each moving 'bytes_per_wr' bytes, keep the link busy
+ * for two round trips: one covers the flight, the other the time it takes
+ * to reap completions and post again. At least RDMA_SIZING_MIN_DEPTH, at
+ * most what a QP may have.
+ */
+uint32_t rdma_sizing_depth(struct rdma_sizing *sz, uint32_t bytes_per_wr);
+
+/* Clamps a number of WRs to what a QP may have */
+uint32_t rdma_sizing_wr(struct rdma_sizing *sz, uint64_t wrs);
+
+/* Clamps a number of CQ entries to what a CQ may have. A clamped CQ is
+ * smaller than the queues feeding it, see rdma_sizing_fit_cq(). */
+uint32_t rdma_sizing_cq(struct rdma_sizing *sz, uint64_t entries);
+
+/*
+ * Scales queue depths down, all by the same factor, until the completions
+ * they may have outstanding fit into one CQ. Queue i takes copies[i] *
+ * depth[i] entries, as 'copies' QPs of that depth would. No depth goes below
+ * RDMA_SIZING_MIN_DEPTH, unless it was smaller to begin with. Returns 1 if it
+ * had to scale, 0 if not, or -ENOSPC if the queues do not fit even then.
+ * @depth: nr depths, scaled in place
+ */
+int rdma_sizing_fit_cq(struct rdma_sizing *sz, uint32_t *depth,
+                       const uint64_t *copies, int nr);
+
+/*
+ * Sets initiator_depth and responder_resources of the parameters for
+ * rdma_connect() (peer == NULL), which offer as much as the device allows,
+ * or for rdma_accept(), which take the connect request's parameters down to
+ * what the device allows.
+ */
+void rdma_sizing_conn_param(struct rdma_sizing *sz,
+                            struct rdma_conn_param *param,
+                            const struct rdma_conn_param *peer);
+
+#endif /* RDMA_SIZING_H */
@@ -0,0 +1,122 @@
+/*
+ * Implementation of the pool of pre-registered message slots.
+ */
+
+#include "rdma_slots.h"
+
+static uint64_t make_top(uint64_t old, uint32_t index_plus_one)
+{
+	return (((old >> 32) + 1) << 32) | index_plus_one;
+}
+
+int rdma_slots_create(struct rdma_slots *slots, struct ibv_pd *pd,
+                      uint32_t nr_slots, uint32_t slot_size)
+{
+	uint64_t total;
+	uint32_t i;
+	if (!slots || !pd || !nr_slots || !slot_size)
+	{
+		rdma_error("Passed slot pool, pd or sizes are invalid\n");
+		return -EINVAL;
+	}
+	bzero(slots, sizeof(*slots));
+	slots->slot_size = (slot_size + RDMA_SLOTS_ALIGN - 1) &
+	                   ~((uint32_t) RDMA_SLOTS_ALIGN - 1);
+	slots->nr_slots = nr_slots;
+	total = (uint64_t) nr_slots * slots->slot_size;
+	/* rdma_buffer_register() takes a 32 bit length */
+	if (total > UINT32_MAX)
+	{
+		rdma_error("%u slots of %u bytes are too many\n", nr_slots, slot_size);
+		return -EINVAL;
+	}
+	slots->next = calloc(nr_slots, sizeof(*slots->next));
+	if (!slots->next)
+	{
+		rdma_error("Failed to allocate the slot list, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	if (posix_memalign((void**) &slots->base, RDMA_SLOTS_ALIGN, total))
+	{
+		rdma_error("Failed to allocate %u slots, -ENOMEM\n", nr_slots);
+		free(slots->next);
+		slots->next = NULL;
+		return -ENOMEM;
+	}
+	bzero(slots->base, total);
+	/* The RDMA writes only read from the slots */
+	slots->mr = rdma_buffer_register(pd, slots->base, total,
+	                                 IBV_ACCESS_LOCAL_WRITE);
+	if (!slots->mr)
+	{
+		free(slots->base);
+		free(slots->next);
+		slots->base = NULL;
+		slots->next = NULL;
+		return -ENOMEM;
+	}
+	/* Stack them up with slot 0 on top, so they are used in order */
+	for (i = 0; i < nr_slots; i++)
+		slots->next[i] = i + 1 < nr_slots ? i + 2 : 0;
+	slots->free_top = 1;
+	debug("%u message slots of %u bytes at %p \n", nr_slots, slots->slot_size,
+	      slots->base);
+	return 0;
+}
+
+void rdma_slots_destroy(struct rdma_slots *slots)
+{
+	if (!slots)
+		return;
+	if (slots->mr)
+		rdma_buffer_deregister(slots->mr);
+	free(slots->base);
+	free(slots->next);
+	slots->mr = NULL;
+	slots->base = NULL;
+	slots->next = NULL;
+}
+
+void *rdma_slots_get(struct rdma_slots *slots)
+{
+	uint64_t top = __atomic_load_n(&slots->free_top, __ATOMIC_ACQUIRE);
+	uint32_t index;
+	do
+	{
+		index = (uint32_t) top;
+		if (!index)
+		{
+			__atomic_fetch_add(&slots->empty, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		/* If another thread took this slot meanwhile, the tag changed and
+		 * the swap fails, so a stale next does no harm */
+	}
+	while (!__atomic_compare_exchange_n(&slots->free_top, &top,
+	                                    make_top(top, __atomic_load_n(&slots->next[index - 1], __ATOMIC_RELAXED)),
+	                                    1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return slots->base + (uint64_t)(index - 1) * slots->slot_size;
+}
+
+void rdma_slots_put(struct rdma_slots *slots, void *slot)
+{
+	uint32_t index = rdma_slots_index(slots, slot);
+	uint64_t top;
+	if (slots->on_put)
+		slots->on_put(slots, slot);
+	top = __atomic_load_n(&slots->free_top, __ATOMIC_RELAXED);
+	do
+	{
+		__atomic_store_n(&slots->next[index], (uint32_t) top, __ATOMIC_RELAXED);
+	}
+	while (!__atomic_compare_exchange_n(&slots->free_top, &top,
+	                                    make_top(top, index + 1),
+	                                    1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void rdma_slots_retire(struct rdma_sendq *sq, uint64_t wr_id)
+{
+	struct rdma_slots *slots = sq->context;
+	if (slots && rdma_slots_owns(slots, (uintptr_t) wr_id))
+		rdma_slots_put(slots, (void*)(uintptr_t) wr_id);
+}
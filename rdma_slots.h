@@ -0,0 +1,93 @@
+/*
+ * Header file for the pool of pre-registered message slots.
+ *
+ * A sender that mallocs a message, fills it, and copies it into a registered
+ * buffer pays for an allocation and a copy per message. The slot pool instead
+ * hands out fixed size slots of one registered buffer: the application
+ * serializes its message straight into a slot, the slot is the source of the
+ * RDMA write, and it goes back to the pool once the send queue manager
+ * retires the WR that last reads from it.
+ *
+ * Free slots are kept in a lock-free stack of slot indices, so slots may be
+ * taken and given back from any thread without a lock. The stack head carries
+ * a tag that changes on every update, which keeps a thread that was preempted
+ * between reading the head and swapping it from resurrecting a stale head.
+ */
+
+#ifndef RDMA_SLOTS_H
+#define RDMA_SLOTS_H
+
+#include "rdma_common.h"
+#include "rdma_sendq.h"
+
+/* Slots start on, and are a multiple of, a cache line */
+#define RDMA_SLOTS_ALIGN (64)
+
+struct rdma_slots;
+
+/* Called for every slot that is given back, before it is free again */
+typedef void (*rdma_slots_put_fn)(struct rdma_slots *slots, void *slot);
+
+struct rdma_slots
+{
+	struct ibv_mr *mr;
+	char *base;
+	uint32_t slot_size;
+	uint32_t nr_slots;
+	/* next free slot after each slot, by index */
+	uint32_t *next;
+	/* top of the free stack: tag in the upper half, index + 1 in the lower
+	 * half, 0 when the stack is empty */
+	uint64_t free_top;
+	/* lets go of what the application keeps per slot, may be NULL. It
+	 * runs in the thread that gives the slot back, whether the send queue
+	 * retired the slot or the ring recycled it when it was posted. */
+	rdma_slots_put_fn on_put;
+	/* totals, for whoever is curious */
+	uint64_t empty;
+};
+
+/*
+ * Allocates and registers 'nr_slots' slots of at least 'slot_size' bytes.
+ * @slots: slot pool to initialize
+ * @pd: protection domain the slots are registered in
+ * @nr_slots: number of slots
+ * @slot_size: bytes per slot, rounded up to RDMA_SLOTS_ALIGN
+ */
+int rdma_slots_create(struct rdma_slots *slots, struct ibv_pd *pd,
+                      uint32_t nr_slots, uint32_t slot_size);
+
+/* Frees the slots. None may be in use any more. */
+void rdma_slots_destroy(struct rdma_slots *slots);
+
+/* Takes a free slot, or returns NULL when all slots are in use */
+void *rdma_slots_get(struct rdma_slots *slots);
+
+/* Gives a slot back, after slots->on_put() */
+void rdma_slots_put(struct rdma_slots *slots, void *slot);
+
+/* Tells whether an address is the start of one of the slots */
+static inline int rdma_slots_owns(struct rdma_slots *slots, uintptr_t addr)
+{
+	uintptr_t base = (uintptr_t) slots->base;
+	return addr >= base &&
+	       addr < base + (uint64_t) slots->nr_slots * slots->slot_size &&
+	       (addr - base) % slots->slot_size == 0;
+}
+
+/* Index of a slot, from 0 to nr_slots - 1. Lets the application keep data
+ * of its own per slot, which is free again whenever the slot is. */
+static inline uint32_t rdma_slots_index(struct rdma_slots *slots, void *slot)
+{
+	return ((char*) slot - slots->base) / slots->slot_size;
+}
+
+/*
+ * Retire callback for a send queue manager whose context is a slot pool: a
+ * WR whose wr_id is a slot gives that slot back. Post the last WR that reads
+ * from a slot with wr_id set to the slot, and all others with a wr_id that is
+ * not a slot, such as 0.
+ */
+void rdma_slots_retire(struct rdma_sendq *sq, uint64_t wr_id);
+
+#endif /* RDMA_SLOTS_H */
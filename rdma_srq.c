@@ -0,0 +1,155 @@
+/*
+ * Implementation of the shared receive queue (SRQ) pool.
+ */
+
+#include "rdma_srq.h"
+
+/* Posts the pending buffers as one chain of receives */
+static int post_pending(struct rdma_srq *srq)
+{
+	struct ibv_recv_wr *first = NULL, *last = NULL, *wr, *bad_wr = NULL;
+	uint32_t i, posted;
+	int ret;
+	if (srq->nr_pending == 0)
+		return 0;
+	for (i = 0 ; i < srq->nr_pending ; i++)
+	{
+		wr = &srq->wrs[srq->pending[i]];
+		wr->next = NULL;
+		if (last)
+			last->next = wr;
+		else
+			first = wr;
+		last = wr;
+	}
+	ret = ibv_post_srq_recv(srq->srq, first, &bad_wr);
+	/* Whatever did not make it stays pending */
+	for (posted = 0, wr = first ; wr && wr != bad_wr ; wr = wr->next)
+		posted++;
+	memmove(srq->pending, srq->pending + posted,
+	        (srq->nr_pending - posted) * sizeof(*srq->pending));
+	srq->nr_pending -= posted;
+	if (ret)
+	{
+		rdma_error("Failed to post %u shared receives, errno: %d \n",
+		           srq->nr_pending, ret);
+		return -ret;
+	}
+	return 0;
+}
+
+/* The limit event fires only once, it has to be armed after every event */
+static int arm_limit(struct rdma_srq *srq)
+{
+	struct ibv_srq_attr attr;
+	int ret;
+	bzero(&attr, sizeof(attr));
+	attr.srq_limit = srq->limit;
+	ret = ibv_modify_srq(srq->srq, &attr, IBV_SRQ_LIMIT);
+	if (ret)
+	{
+		rdma_error("Failed to arm the SRQ limit, errno: %d \n", ret);
+		return -ret;
+	}
+	return 0;
+}
+
+int rdma_srq_create(struct rdma_srq *srq, struct ibv_pd *pd,
+                    uint32_t nr_bufs, uint32_t buf_size)
+{
+	struct ibv_srq_init_attr init_attr;
+	char *base;
+	uint32_t i;
+	int ret;
+	if (!srq || !pd || nr_bufs == 0 || buf_size == 0)
+	{
+		rdma_error("Passed SRQ resources are NULL or empty\n");
+		return -EINVAL;
+	}
+	bzero(srq, sizeof(*srq));
+	srq->nr_bufs = nr_bufs;
+	srq->buf_size = buf_size;
+	srq->limit = nr_bufs / 4;
+	bzero(&init_attr, sizeof(init_attr));
+	init_attr.attr.max_wr = nr_bufs;
+	init_attr.attr.max_sge = 1;
+	srq->srq = ibv_create_srq(pd, &init_attr);
+	if (!srq->srq)
+	{
+		rdma_error("Failed to create an SRQ of %u receives, errno: %d \n",
+		           nr_bufs, -errno);
+		return -errno;
+	}
+	srq->mr = rdma_buffer_alloc(pd, nr_bufs * buf_size, IBV_ACCESS_LOCAL_WRITE);
+	srq->wrs = calloc(nr_bufs, sizeof(*srq->wrs));
+	srq->sges = calloc(nr_bufs, sizeof(*srq->sges));
+	srq->pending = calloc(nr_bufs, sizeof(*srq->pending));
+	if (!srq->mr || !srq->wrs || !srq->sges || !srq->pending)
+	{
+		rdma_error("Failed to allocate the SRQ buffers, -ENOMEM\n");
+		rdma_srq_destroy(srq);
+		return -ENOMEM;
+	}
+	base = srq->mr->addr;
+	for (i = 0 ; i < nr_bufs ; i++)
+	{
+		srq->sges[i].addr = (uint64_t)(uintptr_t)(base + (uint64_t) i * buf_size);
+		srq->sges[i].length = buf_size;
+		srq->sges[i].lkey = srq->mr->lkey;
+		srq->wrs[i].wr_id = (uintptr_t) &srq->wrs[i];
+		srq->wrs[i].sg_list = &srq->sges[i];
+		srq->wrs[i].num_sge = 1;
+		srq->pending[i] = i;
+	}
+	srq->nr_pending = nr_bufs;
+	ret = rdma_srq_refill(srq);
+	if (ret)
+	{
+		rdma_srq_destroy(srq);
+		return ret;
+	}
+	debug("SRQ with %u buffers of %u bytes is ready, limit: %u \n",
+	      nr_bufs, buf_size, srq->limit);
+	return 0;
+}
+
+void rdma_srq_destroy(struct rdma_srq *srq)
+{
+	if (!srq)
+		return;
+	if (srq->srq)
+		ibv_destroy_srq(srq->srq);
+	if (srq->mr)
+		rdma_buffer_free(srq->mr);
+	free(srq->wrs);
+	free(srq->sges);
+	free(srq->pending);
+	bzero(srq, sizeof(*srq));
+}
+
+int rdma_srq_release(struct rdma_srq *srq, uint64_t wr_id)
+{
+	struct ibv_recv_wr *wr = (struct ibv_recv_wr*)(uintptr_t) wr_id;
+	uint32_t batch = srq->nr_bufs / 4;
+	if (!rdma_srq_owns(srq, wr_id))
+		return -EINVAL;
+	srq->received++;
+	srq->pending[srq->nr_pending++] = wr - srq->wrs;
+	/* A small pool is topped up sooner, so the limit event stays rare */
+	if (batch > RDMA_SRQ_REFILL_BATCH)
+		batch = RDMA_SRQ_REFILL_BATCH;
+	if (srq->nr_pending < batch)
+		return 0;
+	return post_pending(srq);
+}
+
+int rdma_srq_refill(struct rdma_srq *srq)
+{
+	int ret = post_pending(srq);
+	if (ret)
+		return ret;
+	/* A limit of 0 would never fire */
+	if (srq->limit == 0)
+		return 0;
+	return arm_limit(srq);
+}
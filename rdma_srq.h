@@ -0,0 +1,84 @@
+/*
+ * Header file for the shared receive queue (SRQ) pool.
+ *
+ * Without an SRQ every QP has its own receive queue, and the receives posted
+ * on it pin their buffers whether the client sends anything or not, so the
+ * receive memory grows with the number of clients. With an SRQ all QPs take
+ * their receives from one queue, which is fed from one registered pool of
+ * buffers. The pool size is fixed, no matter how many clients there are.
+ *
+ * Consumed buffers are handed back with rdma_srq_release() and posted again
+ * in batches. If the queue still runs low, the device raises the SRQ limit
+ * (low-watermark) event, and rdma_srq_refill() posts everything that is
+ * pending and arms the limit again.
+ */
+
+#ifndef RDMA_SRQ_H
+#define RDMA_SRQ_H
+
+#include "rdma_common.h"
+
+/* Released buffers are posted again once there are this many */
+#define RDMA_SRQ_REFILL_BATCH (16)
+
+struct rdma_srq
+{
+	struct ibv_srq *srq;
+	/* one registered region holding all buffers */
+	struct ibv_mr *mr;
+	uint32_t buf_size;
+	uint32_t nr_bufs;
+	/* the limit event fires when fewer receives than this are posted */
+	uint32_t limit;
+	/* one receive per buffer, the wr_id is the address of the receive */
+	struct ibv_recv_wr *wrs;
+	struct ibv_sge *sges;
+	/* buffers consumed and not yet posted again */
+	uint32_t *pending;
+	uint32_t nr_pending;
+	/* totals, for whoever is curious */
+	uint64_t received, limit_events;
+};
+
+/*
+ * Creates an SRQ and posts a receive for each of its buffers.
+ * @srq: pool to initialize
+ * @pd: protection domain the QPs using the SRQ are in
+ * @nr_bufs: number of receive buffers
+ * @buf_size: bytes per buffer, the largest message a peer may send
+ */
+int rdma_srq_create(struct rdma_srq *srq, struct ibv_pd *pd,
+                    uint32_t nr_bufs, uint32_t buf_size);
+
+/* Destroys the SRQ. No QP may be using it any more. */
+void rdma_srq_destroy(struct rdma_srq *srq);
+
+/* Tells whether a completion with this wr_id belongs to a receive of the
+ * SRQ. This also works for failed completions, whose opcode is undefined. */
+static inline int rdma_srq_owns(struct rdma_srq *srq, uint64_t wr_id)
+{
+	return srq->wrs && wr_id >= (uintptr_t) srq->wrs &&
+	       wr_id < (uintptr_t)(srq->wrs + srq->nr_bufs);
+}
+
+/* Returns the buffer the receive with this wr_id placed its message in */
+static inline void *rdma_srq_buffer(struct rdma_srq *srq, uint64_t wr_id)
+{
+	struct ibv_recv_wr *wr = (struct ibv_recv_wr*)(uintptr_t) wr_id;
+	return (void*)(uintptr_t) wr->sg_list->addr;
+}
+
+/*
+ * Hands the buffer of a completed receive back. Buffers are posted again
+ * once RDMA_SRQ_REFILL_BATCH of them are pending. Returns 0 or a negative
+ * error.
+ */
+int rdma_srq_release(struct rdma_srq *srq, uint64_t wr_id);
+
+/*
+ * Posts all pending buffers and arms the limit event again. Called when the
+ * limit event came in, or whenever the owner has nothing better to do.
+ */
+int rdma_srq_refill(struct rdma_srq *srq);
+
+#endif /* RDMA_SRQ_H */
@@ -0,0 +1,211 @@
+/*
+ * Shows the live statistics of a running rdma_server or rdma_client (see
+ * rdma_stats.h).
+ *
+ * Samples the counters every interval and prints, for every slot in use,
+ * the gauges as they are and the counters as their total and their rate
+ * since the last sample. Counters that are 0 are left out.
+ *
+ * Usage: rdma_stat [-i seconds] [-c count] [pid]
+ * Without a pid, the one process that has a segment is picked.
+ */
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "rdma_stats.h"
+
+#define RDMA_STATS_NAMES(name, kind) #name,
+static const char *counter_names[RDMA_STATS_NR] =
+{
+	RDMA_STATS_COUNTERS(RDMA_STATS_NAMES)
+};
+#undef RDMA_STATS_NAMES
+
+#define RDMA_STATS_KINDS(name, kind) RDMA_STATS_##kind,
+static const enum rdma_stats_kind counter_kinds[RDMA_STATS_NR] =
+{
+	RDMA_STATS_COUNTERS(RDMA_STATS_KINDS)
+};
+#undef RDMA_STATS_KINDS
+
+/* What we saw of a slot in the last sample */
+struct seen
+{
+	uint32_t gen;
+	uint64_t counters[RDMA_STATS_NR];
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Finds the pid of the only process with a segment, or returns -1 */
+static int find_pid()
+{
+	struct dirent *d;
+	DIR *dir = opendir("/dev/shm");
+	int pid = -1, found = 0, p;
+	if (!dir)
+		return -1;
+	while ((d = readdir(dir)) != NULL)
+	{
+		if (sscanf(d->d_name, "rdma_stats.%d", &p) != 1)
+			continue;
+		/* list them once there is a choice */
+		if (++found == 2)
+			fprintf(stderr, "pid %d\n", pid);
+		if (found >= 2)
+			fprintf(stderr, "pid %d\n", p);
+		pid = p;
+	}
+	closedir(dir);
+	return found == 1 ? pid : -1;
+}
+
+/* Prints a number with a K/M/G suffix */
+static const char *human(double v, char *buf, size_t len)
+{
+	const char *suffix = "";
+	if (v >= 1e9)
+	{
+		v /= 1e9;
+		suffix = "G";
+	}
+	else if (v >= 1e6)
+	{
+		v /= 1e6;
+		suffix = "M";
+	}
+	else if (v >= 1e3)
+	{
+		v /= 1e3;
+		suffix = "K";
+	}
+	snprintf(buf, len, suffix[0] ? "%.2f%s" : "%.0f%s", v, suffix);
+	return buf;
+}
+
+static void sample(const struct rdma_stats_hdr *hdr, struct seen *seen,
+                   double secs)
+{
+	const struct rdma_stats_slot *slots = (const void*)(hdr + 1), *slot;
+	struct rdma_stats_slot copy;
+	uint32_t i, c, nr = hdr->nr_counters < RDMA_STATS_NR ?
+	                    hdr->nr_counters : RDMA_STATS_NR;
+	char a[32], b[32];
+	for (i = 0; i < hdr->nr_slots; i++)
+	{
+		slot = &slots[i];
+		if (!__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE))
+			continue;
+		copy = *slot;
+		/* A slot that changed hands since the last sample has no rate */
+		if (copy.gen != seen[i].gen)
+		{
+			bzero(&seen[i], sizeof(seen[i]));
+			seen[i].gen = copy.gen;
+		}
+		printf("%-16.*s", (int) sizeof(copy.name), copy.name);
+		for (c = 0; c < nr; c++)
+		{
+			if (!copy.counters[c])
+				continue;
+			if (counter_kinds[c] == RDMA_STATS_GAUGE || secs <= 0)
+			{
+				printf(" %s %s", counter_names[c],
+				       human(copy.counters[c], a, sizeof(a)));
+			}
+			else
+			{
+				printf(" %s %s (%s/s)", counter_names[c],
+				       human(copy.counters[c], a, sizeof(a)),
+				       human((copy.counters[c] - seen[i].counters[c]) / secs,
+				             b, sizeof(b)));
+			}
+			seen[i].counters[c] = copy.counters[c];
+		}
+		printf("\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const struct rdma_stats_hdr *hdr;
+	struct seen *seen;
+	double interval = 1.0, secs = 0;
+	uint64_t last, now;
+	long count = -1;
+	size_t size;
+	int pid, option;
+	while ((option = getopt(argc, argv, "i:c:")) != -1)
+	{
+		switch (option)
+		{
+		case 'i':
+			interval = strtod(optarg, NULL);
+			break;
+		case 'c':
+			count = strtol(optarg, NULL, 0);
+			break;
+		default:
+			printf("Usage: rdma_stat [-i seconds] [-c count] [pid]\n");
+			return 1;
+		}
+	}
+	if (interval <= 0)
+		interval = 1.0;
+	if (optind < argc)
+	{
+		pid = atoi(argv[optind]);
+	}
+	else
+	{
+		pid = find_pid();
+		if (pid < 0)
+		{
+			rdma_error("Found no single process to look at, pass a pid\n");
+			return 1;
+		}
+	}
+	hdr = rdma_stats_attach(pid, &size);
+	if (!hdr)
+	{
+		rdma_error("Failed to attach to the statistics of %d, errno: %d \n",
+		           pid, -errno);
+		return 1;
+	}
+	seen = calloc(hdr->nr_slots, sizeof(*seen));
+	if (!seen)
+	{
+		rdma_error("Failed to allocate %u slots, -ENOMEM\n", hdr->nr_slots);
+		return 1;
+	}
+	last = now_ns();
+	while (count < 0 || count-- > 0)
+	{
+		/* A process that died leaves its segment behind */
+		if (kill(pid, 0) && errno == ESRCH)
+		{
+			printf("%.*s (pid %d) is gone\n", (int) sizeof(hdr->prog),
+			       hdr->prog, pid);
+			break;
+		}
+		printf("%.*s (pid %d)\n", (int) sizeof(hdr->prog), hdr->prog, pid);
+		sample(hdr, seen, secs);
+		fflush(stdout);
+		if (!count)
+			break;
+		usleep((useconds_t)(interval * 1e6));
+		now = now_ns();
+		secs = (now - last) / 1e9;
+		last = now;
+	}
+	free(seen);
+	munmap((void*) hdr, size);
+	return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Implementation of the live statistics.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rdma_stats.h"
+
+struct rdma_stats_slot *rdma_stats_process = NULL;
+
+/* Our segment. The lock is only taken to hand out and give back slots. */
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rdma_stats_hdr *segment = NULL;
+static struct rdma_stats_slot *slots = NULL;
+static size_t segment_size = 0;
+static char segment_name[64];
+static int registered = 0;
+
+/* Other threads may still count while the process exits, so the mapping
+ * stays, only the name goes */
+static void unlink_at_exit(void)
+{
+	if (segment)
+		shm_unlink(segment_name);
+}
+
+static size_t size_of(uint32_t nr_slots)
+{
+	return sizeof(struct rdma_stats_hdr) +
+	       (size_t) nr_slots * sizeof(struct rdma_stats_slot);
+}
+
+int rdma_stats_open(const char *prog)
+{
+	int fd, ret;
+	if (segment)
+		return 0;
+	snprintf(segment_name, sizeof(segment_name), RDMA_STATS_NAME, (int) getpid());
+	segment_size = size_of(RDMA_STATS_SLOTS);
+	fd = shm_open(segment_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		rdma_error("Failed to create shared memory %s, errno: %d \n",
+		           segment_name, -errno);
+		return -errno;
+	}
+	if (ftruncate(fd, segment_size))
+	{
+		ret = -errno;
+		rdma_error("Failed to size shared memory %s, errno: %d \n",
+		           segment_name, ret);
+		close(fd);
+		shm_unlink(segment_name);
+		return ret;
+	}
+	segment = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED)
+	{
+		ret = -errno;
+		rdma_error("Failed to map shared memory %s, errno: %d \n",
+		           segment_name, ret);
+		segment = NULL;
+		shm_unlink(segment_name);
+		return ret;
+	}
+	/* ftruncate() handed us zeroes, every slot is free */
+	slots = (struct rdma_stats_slot*)(segment + 1);
+	segment->nr_slots = RDMA_STATS_SLOTS;
+	segment->nr_counters = RDMA_STATS_NR;
+	segment->slot_size = sizeof(struct rdma_stats_slot);
+	segment->pid = getpid();
+	snprintf(segment->prog, sizeof(segment->prog), "%s", prog ? prog : "?");
+	snprintf(slots[0].name, sizeof(slots[0].name), "process");
+	slots[0].gen = 1;
+	slots[0].in_use = 1;
+	rdma_stats_process = &slots[0];
+	/* The magic goes last, the tool does not look at a segment without */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(segment->magic, RDMA_STATS_MAGIC, sizeof(segment->magic));
+	/* Whichever way we exit, the segment should not outlive us */
+	if (!registered)
+	{
+		atexit(unlink_at_exit);
+		registered = 1;
+	}
+	debug("Statistics are in shared memory %s \n", segment_name);
+	return 0;
+}
+
+void rdma_stats_close(void)
+{
+	if (!segment)
+		return;
+	rdma_stats_process = NULL;
+	munmap(segment, segment_size);
+	shm_unlink(segment_name);
+	segment = NULL;
+	slots = NULL;
+}
+
+struct rdma_stats_slot *rdma_stats_get(const char *fmt, ...)
+{
+	struct rdma_stats_slot *slot = NULL;
+	va_list args;
+	uint32_t i;
+	if (!segment)
+		return NULL;
+	pthread_mutex_lock(&slots_lock);
+	for (i = 1; i < segment->nr_slots; i++)
+	{
+		if (!slots[i].in_use)
+		{
+			slot = &slots[i];
+			break;
+		}
+	}
+	if (slot)
+	{
+		/* The tool may look at the slot meanwhile; the new generation
+		 * tells it to start over once in_use is set again */
+		bzero(slot->counters, sizeof(slot->counters));
+		va_start(args, fmt);
+		vsnprintf(slot->name, sizeof(slot->name), fmt, args);
+		va_end(args);
+		slot->gen++;
+		__atomic_store_n(&slot->in_use, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&slots_lock);
+	if (!slot)
+	{
+		debug("All %u statistics slots are taken \n", segment->nr_slots);
+	}
+	return slot;
+}
+
+void rdma_stats_put(struct rdma_stats_slot *slot)
+{
+	if (!slot)
+		return;
+	pthread_mutex_lock(&slots_lock);
+	__atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&slots_lock);
+}
+
+const struct rdma_stats_hdr *rdma_stats_attach(int pid, size_t *size)
+{
+	struct rdma_stats_hdr *hdr;
+	struct stat st;
+	char name[64];
+	int fd;
+	snprintf(name, sizeof(name), RDMA_STATS_NAME, pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(*hdr))
+	{
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return NULL;
+	if (memcmp(hdr->magic, RDMA_STATS_MAGIC, sizeof(hdr->magic)) ||
+	        hdr->slot_size != sizeof(struct rdma_stats_slot) ||
+	        (size_t) st.st_size < size_of(hdr->nr_slots))
+	{
+		munmap(hdr, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+	*size = st.st_size;
+	return hdr;
+}
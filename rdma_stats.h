@@ -0,0 +1,139 @@
+/*
+ * Header file for the live statistics.
+ *
+ * A running server or client keeps its counters in a POSIX shared memory
+ * segment, /rdma_stats.<pid>, where the rdma_stat tool reads them while the
+ * process runs. No debugger, no signal and no lock on the data path: the
+ * process only stores to memory that happens to be shared.
+ *
+ * The segment is cut into slots of counters. A slot belongs to one
+ * connection, worker or other part of the process and is only ever written
+ * by the thread that runs that part, with plain stores. Slots are padded to
+ * whole cache lines, so two threads never write to the same line, and
+ * counters are 64 bit words, which the reader always sees whole. The first
+ * slot counts what the whole process does, memory registrations for
+ * instance, and is written with atomic adds, since any thread may register
+ * memory.
+ *
+ * Every counter either counts up, and the tool shows its rate, or is a
+ * gauge, whose value the tool shows as is.
+ */
+
+#ifndef RDMA_STATS_H
+#define RDMA_STATS_H
+
+#include "rdma_common.h"
+
+/* Slots in a segment, including the process slot */
+#define RDMA_STATS_SLOTS (256)
+/* Name of the segment of a process */
+#define RDMA_STATS_NAME "/rdma_stats.%d"
+
+enum rdma_stats_kind
+{
+	RDMA_STATS_COUNTER = 0,
+	RDMA_STATS_GAUGE,
+};
+
+/*
+ * The counters of a slot, with their kind. A slot only uses the ones that
+ * make sense for it. Add new counters at the end, the tool goes by the
+ * number.
+ */
+#define RDMA_STATS_COUNTERS(X) \
+	X(WRS_POSTED, COUNTER) \
+	X(BYTES_POSTED, COUNTER) \
+	X(WRS_COMPLETED, COUNTER) \
+	X(OUTSTANDING, GAUGE) \
+	X(SENDQ_FULL, COUNTER) \
+	X(POST_ENOMEM, COUNTER) \
+	X(MESSAGES, COUNTER) \
+	X(MESSAGE_BYTES, COUNTER) \
+	X(CQ_POLLS, COUNTER) \
+	X(CQ_WCS, COUNTER) \
+	X(CQ_SIZE, GAUGE) \
+	X(REGISTRATIONS, GAUGE) \
+	X(PINNED_BYTES, GAUGE)
+
+#define RDMA_STATS_ENUM(name, kind) RDMA_STATS_##name,
+enum rdma_stats_counter
+{
+	RDMA_STATS_COUNTERS(RDMA_STATS_ENUM)
+	RDMA_STATS_NR,
+};
+#undef RDMA_STATS_ENUM
+
+/* One slot. 'gen' changes whenever the slot is handed to somebody new, so
+ * the tool does not take the counters of two owners for a rate. */
+struct rdma_stats_slot
+{
+	uint32_t in_use;
+	uint32_t gen;
+	char name[32];
+	uint64_t counters[RDMA_STATS_NR];
+} __attribute__((aligned(64)));
+
+/* What a segment starts with, followed by its slots */
+#define RDMA_STATS_MAGIC "RDMASTA1"
+struct rdma_stats_hdr
+{
+	char magic[8];
+	uint32_t nr_slots;
+	uint32_t nr_counters;
+	uint32_t slot_size;
+	int32_t pid;
+	char prog[32];
+} __attribute__((aligned(64)));
+
+/* Slot of the whole process, NULL while there is no segment */
+extern struct rdma_stats_slot *rdma_stats_process;
+
+/* Adds to a counter of a slot that only the calling thread writes */
+static inline void rdma_stats_add(struct rdma_stats_slot *slot,
+                                  enum rdma_stats_counter id, uint64_t v)
+{
+	if (slot)
+		__atomic_store_n(&slot->counters[id], slot->counters[id] + v,
+		                 __ATOMIC_RELAXED);
+}
+
+/* Sets a gauge of a slot that only the calling thread writes */
+static inline void rdma_stats_set(struct rdma_stats_slot *slot,
+                                  enum rdma_stats_counter id, uint64_t v)
+{
+	if (slot)
+		__atomic_store_n(&slot->counters[id], v, __ATOMIC_RELAXED);
+}
+
+/* Adds to a counter of the process slot, from any thread */
+static inline void rdma_stats_add_process(enum rdma_stats_counter id, int64_t v)
+{
+	if (rdma_stats_process)
+		__atomic_fetch_add(&rdma_stats_process->counters[id], (uint64_t) v,
+		                   __ATOMIC_RELAXED);
+}
+
+/*
+ * Creates the segment of the calling process. Without it every slot is NULL
+ * and counting costs a compare. The segment is removed at exit, or by
+ * rdma_stats_close(); only a crash leaves it behind.
+ * @prog: what the tool calls the process
+ */
+int rdma_stats_open(const char *prog);
+
+/* Removes the segment. Slots must not be used any more. */
+void rdma_stats_close(void);
+
+/* Hands out a free slot with all counters at 0, or NULL if there is no
+ * segment or it is full */
+struct rdma_stats_slot *rdma_stats_get(const char *fmt, ...)
+__attribute__((format(printf, 1, 2)));
+
+/* Gives a slot back */
+void rdma_stats_put(struct rdma_stats_slot *slot);
+
+/* Maps the segment of process 'pid' read only, for the tool. Returns the
+ * header, or NULL with errno set. */
+const struct rdma_stats_hdr *rdma_stats_attach(int pid, size_t *size);
+
+#endif /* RDMA_STATS_H */
@@ -0,0 +1,509 @@
+/*
+ * Implementation of striping transfers over several QPs of one connection.
+ */
+
+#include <stddef.h>
+
+#include "rdma_stripe.h"
+
+int rdma_stripe_init(struct rdma_stripe *st, struct rdma_sendq *sq, uint32_t unit,
+                     uint32_t weight)
+{
+	if (!st || !sq)
+	{
+		rdma_error("Passed stripe resources are NULL\n");
+		return -EINVAL;
+	}
+	bzero(st, sizeof(*st));
+	st->sqs[0] = sq;
+	st->nr_qps = 1;
+	st->unit = unit ? unit : RDMA_STRIPE_UNIT;
+	st->weight[0] = weight ? weight : 1;
+	return 0;
+}
+
+/* Retire callback of the lanes' send queues */
+static void lane_retire(struct rdma_sendq *sq, uint64_t wr_id)
+{
+	struct rdma_stripe_lane *lane = (struct rdma_stripe_lane*)
+	                                ((char*) sq - offsetof(struct rdma_stripe_lane, sq));
+	/* a lane only carries units, and retires them in posting order */
+	if (rdma_stripe_retire(sq->context, wr_id))
+		lane->uhead++;
+}
+
+/* Waits for one CM event of the lane and acknowledges it */
+static int wait_cm_event(struct rdma_event_channel *channel,
+                         enum rdma_cm_event_type expected)
+{
+	struct rdma_cm_event *cm_event = NULL;
+	int ret = process_rdma_cm_event(channel, expected, &cm_event);
+	if (ret)
+		return ret;
+	if (rdma_ack_cm_event(cm_event))
+	{
+		rdma_error("Failed to acknowledge the CM event, errno: %d \n", -errno);
+		return -errno;
+	}
+	return 0;
+}
+
+static void destroy_lane(struct rdma_stripe_lane *lane)
+{
+	uint32_t i;
+	rdma_sendq_destroy(&lane->sq);
+	free(lane->units);
+	if (lane->cm_id && lane->cm_id->qp)
+		rdma_destroy_qp(lane->cm_id);
+	if (lane->cq && ibv_destroy_cq(lane->cq))
+		rdma_error("Failed to destroy a lane CQ cleanly, %d \n", -errno);
+	for (i = 0; i < RDMA_STRIPE_MRS; i++)
+	{
+		if (lane->mrs[i])
+			rdma_buffer_deregister(lane->mrs[i]);
+	}
+	if (lane->pd && ibv_dealloc_pd(lane->pd))
+		rdma_error("Failed to destroy a lane PD cleanly, %d \n", -errno);
+	if (lane->cm_id && rdma_destroy_id(lane->cm_id))
+		rdma_error("Failed to destroy a lane id cleanly, %d \n", -errno);
+	bzero(lane, sizeof(*lane));
+}
+
+/* Registers a memory region of the stripe with a lane that has its own PD */
+static int register_with_lane(struct rdma_stripe_lane *lane, uint32_t i,
+                              struct ibv_mr *mr)
+{
+	lane->mrs[i] = rdma_buffer_register(lane->pd, mr->addr, mr->length,
+	                                    IBV_ACCESS_LOCAL_WRITE);
+	return lane->mrs[i] ? 0 : -ENOMEM;
+}
+
+int rdma_stripe_register(struct rdma_stripe *st, struct ibv_mr *mr)
+{
+	uint32_t i, q;
+	int ret;
+	for (i = 0; i < st->nr_mrs; i++)
+	{
+		if (st->mrs[i] == mr)
+			return 0;
+	}
+	if (st->nr_mrs == RDMA_STRIPE_MRS)
+		return -ENOSPC;
+	for (q = 1; q < st->nr_qps; q++)
+	{
+		if (!st->lanes[q].pd)
+			continue;
+		ret = register_with_lane(&st->lanes[q], st->nr_mrs, mr);
+		if (ret)
+			return ret;
+	}
+	st->mrs[st->nr_mrs++] = mr;
+	return 0;
+}
+
+int rdma_stripe_add_lane(struct rdma_stripe *st, struct rdma_event_channel *channel,
+                         struct ibv_pd *pd, const struct rdma_rail *rail,
+                         uint32_t token, uint32_t rkey)
+{
+	struct rdma_stripe_lane *lane;
+	struct rdma_cm_event *cm_event = NULL;
+	struct ibv_qp_init_attr qp_init_attr;
+	struct rdma_conn_param conn_param;
+	struct rdma_lane_hello hello;
+	struct rdma_lane_welcome welcome;
+	struct rdma_sizing sizing;
+	const uint64_t one = 1;
+	uint32_t depth, i;
+	int ret;
+	if (st->nr_qps == RDMA_STRIPE_MAX_QPS)
+		return -ENOSPC;
+	lane = &st->lanes[st->nr_qps];
+	bzero(lane, sizeof(*lane));
+	ret = rdma_create_id(channel, &lane->cm_id, NULL, RDMA_PS_TCP);
+	if (ret)
+	{
+		rdma_error("Creating a lane cm id failed with errno: %d \n", -errno);
+		return -errno;
+	}
+	/* The local address of the rail picks the device and port */
+	ret = rdma_resolve_addr(lane->cm_id,
+	                        rail->src.sin_family ? (struct sockaddr*) &rail->src : NULL,
+	                        (struct sockaddr*) &rail->dst, 2000);
+	if (!ret)
+		ret = wait_cm_event(channel, RDMA_CM_EVENT_ADDR_RESOLVED);
+	if (!ret)
+		ret = rdma_resolve_route(lane->cm_id, 2000);
+	if (!ret)
+		ret = wait_cm_event(channel, RDMA_CM_EVENT_ROUTE_RESOLVED);
+	if (ret)
+	{
+		rdma_error("Failed to resolve the server for a lane, ret = %d \n", ret);
+		goto fail;
+	}
+	ret = rdma_sizing_query(&sizing, lane->cm_id->verbs, lane->cm_id->port_num);
+	if (ret)
+		goto fail;
+	/* On another device the lane needs a PD of its own, and its own keys
+	 * of the memory we stripe from and into */
+	if (lane->cm_id->verbs != pd->context)
+	{
+		lane->pd = ibv_alloc_pd(lane->cm_id->verbs);
+		if (!lane->pd)
+		{
+			rdma_error("Failed to allocate a lane PD, errno: %d \n", -errno);
+			ret = -errno;
+			goto fail;
+		}
+		for (i = 0; i < st->nr_mrs; i++)
+		{
+			ret = register_with_lane(lane, i, st->mrs[i]);
+			if (ret)
+				goto fail;
+		}
+	}
+	/* Enough units in flight to keep the link busy, and nothing to
+	 * receive: units are one-sided */
+	depth = rdma_sizing_depth(&sizing, st->unit);
+	ret = rdma_sizing_fit_cq(&sizing, &depth, &one, 1);
+	if (ret < 0)
+		goto fail;
+	lane->cq = ibv_create_cq(lane->cm_id->verbs, depth, NULL, NULL, 0);
+	if (!lane->cq)
+	{
+		rdma_error("Failed to create a lane CQ, errno: %d \n", -errno);
+		ret = -errno;
+		goto fail;
+	}
+	bzero(&qp_init_attr, sizeof(qp_init_attr));
+	qp_init_attr.cap.max_send_wr = depth;
+	qp_init_attr.cap.max_send_sge = 1;
+	qp_init_attr.cap.max_recv_wr = 1;
+	qp_init_attr.cap.max_recv_sge = 1;
+	qp_init_attr.qp_type = IBV_QPT_RC;
+	qp_init_attr.send_cq = lane->cq;
+	qp_init_attr.recv_cq = lane->cq;
+	ret = rdma_create_qp(lane->cm_id, lane->pd ? lane->pd : pd, &qp_init_attr);
+	if (ret)
+	{
+		rdma_error("Failed to create a lane QP, errno: %d \n", -errno);
+		ret = -errno;
+		goto fail;
+	}
+	ret = rdma_sendq_init(&lane->sq, lane->cm_id->qp, lane->cq,
+	                      qp_init_attr.cap.max_send_wr, RDMA_SENDQ_SIGNAL_EVERY);
+	if (ret)
+		goto fail;
+	lane->sq.retire = lane_retire;
+	lane->sq.context = st;
+	/* a unit is kept from before it is posted until it is retired */
+	lane->nr_units = qp_init_attr.cap.max_send_wr + 1;
+	lane->units = calloc(lane->nr_units, sizeof(*lane->units));
+	if (!lane->units)
+	{
+		ret = -ENOMEM;
+		goto fail;
+	}
+	/* The token tells the server whose lane this is */
+	hello.magic = RDMA_LANE_MAGIC;
+	hello.token = token;
+	hello.lane = st->nr_qps;
+	hello.rkey = rkey;
+	bzero(&conn_param, sizeof(conn_param));
+	rdma_sizing_conn_param(&sizing, &conn_param, NULL);
+	conn_param.retry_count = 3;
+	conn_param.private_data = &hello;
+	conn_param.private_data_len = sizeof(hello);
+	ret = rdma_connect(lane->cm_id, &conn_param);
+	if (ret)
+	{
+		rdma_error("Failed to connect a lane, errno: %d \n", -errno);
+		ret = -errno;
+		goto fail;
+	}
+	ret = process_rdma_cm_event(channel, RDMA_CM_EVENT_ESTABLISHED, &cm_event);
+	if (ret)
+	{
+		rdma_error("The server did not take lane %u, ret = %d \n", st->nr_qps, ret);
+		goto fail;
+	}
+	/* the key of the server memory on the device the lane went to */
+	bzero(&welcome, sizeof(welcome));
+	if (cm_event->param.conn.private_data &&
+	        cm_event->param.conn.private_data_len >= sizeof(welcome))
+		memcpy(&welcome, cm_event->param.conn.private_data, sizeof(welcome));
+	if (rdma_ack_cm_event(cm_event))
+	{
+		rdma_error("Failed to acknowledge the CM event, errno: %d \n", -errno);
+		ret = -errno;
+		goto fail;
+	}
+	lane->rkey_from = rkey;
+	lane->rkey_to = welcome.magic == RDMA_LANE_MAGIC ? welcome.rkey : rkey;
+	st->weight[st->nr_qps] = rail->weight ? rail->weight : rdma_sizing_gbps(&sizing);
+	st->credit[st->nr_qps] = 0;
+	st->failed[st->nr_qps] = 0;
+	st->sqs[st->nr_qps++] = &lane->sq;
+	debug("Lane %u is connected on %s, weight %u, %u units in flight \n",
+	      st->nr_qps - 1, ibv_get_device_name(lane->cm_id->verbs->device),
+	      st->weight[st->nr_qps - 1], depth);
+	return 0;
+fail:
+	destroy_lane(lane);
+	return ret;
+}
+
+void rdma_stripe_close(struct rdma_stripe *st, struct rdma_event_channel *channel)
+{
+	uint32_t i;
+	for (i = 1; i < st->nr_qps; i++)
+	{
+		/* a lane that failed may have lost its peer, we do not wait for it */
+		if (st->failed[i])
+		{
+			debug("Lane %u failed, destroying it \n", i);
+		}
+		else if (rdma_disconnect(st->lanes[i].cm_id))
+		{
+			rdma_error("Failed to disconnect lane %u, errno: %d \n", i, -errno);
+		}
+		else if (wait_cm_event(channel, RDMA_CM_EVENT_DISCONNECTED))
+		{
+			rdma_error("Failed to get the disconnect of lane %u\n", i);
+		}
+		destroy_lane(&st->lanes[i]);
+		st->sqs[i] = NULL;
+	}
+	st->nr_qps = 1;
+	st->nr_mrs = 0;
+}
+
+int rdma_stripe_retire(struct rdma_stripe *st, uint64_t wr_id)
+{
+	uintptr_t first = (uintptr_t) &st->xfers[0];
+	struct rdma_stripe_xfer *xfer;
+	if (wr_id < first || wr_id >= (uintptr_t) &st->xfers[RDMA_STRIPE_XFERS] ||
+	        (wr_id - first) % sizeof(st->xfers[0]) != 0)
+		return 0;
+	xfer = (struct rdma_stripe_xfer*)(uintptr_t) wr_id;
+	xfer->pending--;
+	/* The merge: a transfer is only reported once every one before it is */
+	while (st->head != st->tail)
+	{
+		xfer = &st->xfers[st->head % RDMA_STRIPE_XFERS];
+		if (xfer->pending)
+			break;
+		st->head++;
+		if (st->on_done)
+			st->on_done(st, xfer->cookie);
+	}
+	return 1;
+}
+
+/*
+ * Weighted round robin that spreads a QP's units evenly: every QP that did
+ * not fail is owed its weight, the one owed most gets the unit and is owed
+ * the total weight less. Three QPs of weights 2, 1, 1 take turns as
+ * 0 1 2 0, not 0 0 1 2.
+ */
+static uint32_t pick_qp(struct rdma_stripe *st, int64_t *credit)
+{
+	int64_t total = 0;
+	uint32_t q, best = 0;
+	for (q = 0; q < st->nr_qps; q++)
+	{
+		if (st->failed[q])
+			continue;
+		credit[q] += st->weight[q];
+		total += st->weight[q];
+		if (credit[q] > credit[best] || st->failed[best])
+			best = q;
+	}
+	credit[best] -= total;
+	return best;
+}
+
+static int fail_lane(struct rdma_stripe *st, uint32_t q);
+
+/* Posts a unit on QP q, in the keys of that QP */
+static int post_unit(struct rdma_stripe *st, uint32_t q,
+                     struct rdma_stripe_unit *unit, int signaled)
+{
+	struct rdma_stripe_lane *lane = q ? &st->lanes[q] : NULL;
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	struct ibv_sge sge;
+	uint32_t i;
+	int ret;
+	sge.addr = unit->addr;
+	sge.length = unit->length;
+	sge.lkey = unit->mr->lkey;
+	bzero(&wr, sizeof(wr));
+	wr.opcode = unit->opcode;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.wr_id = (uintptr_t) unit->xfer;
+	wr.wr.rdma.remote_addr = unit->remote_addr;
+	wr.wr.rdma.rkey = unit->rkey;
+	if (signaled)
+		wr.send_flags = IBV_SEND_SIGNALED;
+	if (lane)
+	{
+		if (lane->pd)
+		{
+			for (i = 0; i < st->nr_mrs && st->mrs[i] != unit->mr; i++)
+				;
+			if (i == st->nr_mrs)
+			{
+				rdma_error("Striped memory region %p is not registered\n", unit->mr);
+				return -EINVAL;
+			}
+			sge.lkey = lane->mrs[i]->lkey;
+		}
+		if (wr.wr.rdma.rkey == lane->rkey_from)
+			wr.wr.rdma.rkey = lane->rkey_to;
+		lane->units[lane->utail++ % lane->nr_units] = *unit;
+	}
+	ret = rdma_sendq_post(st->sqs[q], &wr, &bad_wr);
+	if (ret && lane)
+		return fail_lane(st, q);
+	if (ret)
+	{
+		rdma_error("Failed to post a unit of a striped transfer, ret = %d \n", ret);
+		return ret;
+	}
+	st->qp_bytes[q] += unit->length;
+	return 0;
+}
+
+/* Leaves a lane out and posts its units in flight on the other QPs. They
+ * may have landed already, but we can not know. */
+static int fail_lane(struct rdma_stripe *st, uint32_t q)
+{
+	struct rdma_stripe_lane *lane = &st->lanes[q];
+	struct rdma_stripe_unit unit;
+	int ret;
+	st->failed[q] = 1;
+	rdma_error("Lane %u failed, %lu units go to the other QPs\n", q,
+	           (unsigned long) (lane->utail - lane->uhead));
+	while (lane->uhead != lane->utail)
+	{
+		unit = lane->units[lane->uhead++ % lane->nr_units];
+		ret = post_unit(st, pick_qp(st, st->credit), &unit, 1);
+		if (ret)
+			return ret;
+		st->resent++;
+	}
+	return 0;
+}
+
+int rdma_stripe_progress(struct rdma_stripe *st)
+{
+	uint64_t before = st->head;
+	uint32_t q;
+	int ret;
+	for (q = 0; q < st->nr_qps; q++)
+	{
+		if (st->failed[q])
+			continue;
+		ret = rdma_sendq_reap(st->sqs[q]);
+		if (ret < 0 && q == 0)
+			return ret;
+		if (ret < 0)
+		{
+			ret = fail_lane(st, q);
+			if (ret)
+				return ret;
+		}
+	}
+	return (int)(st->head - before);
+}
+
+int rdma_stripe_wait(struct rdma_stripe *st)
+{
+	int ret;
+	while (st->head != st->tail)
+	{
+		ret = rdma_stripe_progress(st);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			cpu_relax();
+	}
+	return 0;
+}
+
+int rdma_stripe_post(struct rdma_stripe *st, enum ibv_wr_opcode opcode,
+                     struct ibv_mr *mr, void *addr, uint64_t length,
+                     struct rdma_buffer_attr *remote, uint64_t offset,
+                     uint64_t cookie)
+{
+	struct rdma_stripe_xfer *xfer;
+	struct rdma_stripe_unit unit, held[RDMA_STRIPE_MAX_QPS];
+	int have[RDMA_STRIPE_MAX_QPS];
+	uint64_t nr_units, i, off;
+	uint32_t q;
+	int ret;
+	if ((opcode != IBV_WR_RDMA_WRITE && opcode != IBV_WR_RDMA_READ) || !length)
+		return -EINVAL;
+	if ((char*) addr < (char*) mr->addr ||
+	        (char*) addr + length > (char*) mr->addr + mr->length ||
+	        offset + length > remote->length)
+	{
+		rdma_error("Striped transfer of %lu bytes does not fit its buffers\n",
+		           (unsigned long) length);
+		return -EINVAL;
+	}
+	nr_units = (length + st->unit - 1) / st->unit;
+	if (nr_units > UINT32_MAX)
+		return -EINVAL;
+	while (st->tail - st->head == RDMA_STRIPE_XFERS)
+	{
+		ret = rdma_stripe_progress(st);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			cpu_relax();
+	}
+	/* Every unit is counted before the first goes out, so the merge can
+	 * not take the transfer for done halfway */
+	xfer = &st->xfers[st->tail % RDMA_STRIPE_XFERS];
+	xfer->cookie = cookie;
+	xfer->pending = nr_units;
+	st->tail++;
+	/* The last unit of the transfer on every QP is signaled, so the
+	 * transfer completes without waiting for more traffic. Every QP holds
+	 * its latest unit back until it gets the next one, or until all are
+	 * out, and then posts it signaled. */
+	bzero(have, sizeof(have));
+	unit.xfer = xfer;
+	unit.opcode = opcode;
+	unit.mr = mr;
+	unit.rkey = remote->stag.remote_stag;
+	for (i = 0; i < nr_units; i++)
+	{
+		off = i * st->unit;
+		q = pick_qp(st, st->credit);
+		unit.addr = (uintptr_t) addr + off;
+		unit.length = length - off < st->unit ? length - off : st->unit;
+		unit.remote_addr = remote->address + offset + off;
+		if (have[q])
+		{
+			ret = post_unit(st, q, &held[q], 0);
+			if (ret)
+				return ret;
+		}
+		held[q] = unit;
+		have[q] = 1;
+		st->bytes += unit.length;
+	}
+	for (q = 0; q < st->nr_qps; q++)
+	{
+		if (!have[q])
+			continue;
+		/* the QP may have failed meanwhile */
+		ret = post_unit(st, st->failed[q] ? pick_qp(st, st->credit) : q, &held[q], 1);
+		if (ret)
+			return ret;
+	}
+	st->units += nr_units;
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Header file for striping transfers over several QPs of one connection.
+ *
+ * A QP is served by one processing engine of the NIC, and its RDMA reads are
+ * limited to initiator_depth in flight, so a single QP rarely fills a fast
+ * link with one large transfer. A stripe is a connection that, next to its
+ * own QP, opens a few more RC QPs, lanes, to the same server, and cuts every
+ * large RDMA write or read into units that go round robin over all of them.
+ * How many lanes a client may open is negotiated in the metadata exchange,
+ * see struct rdma_client_metadata and struct rdma_server_metadata. Every lane
+ * connects with the token the server handed out, so the server knows whose
+ * lane it is.
+ *
+ * A lane goes over a rail (see rdma_rail.h), which may be another device
+ * than the connection's. Such a lane has a PD of its own, the memory the
+ * stripe moves is registered there as well, and the server tells it the key
+ * of its memory on that device. The round robin is weighted: every QP takes
+ * units in proportion to its weight, the link speed of its port unless the
+ * rail says otherwise. A lane whose QP fails is left out from then on, and
+ * the units it had in flight are posted again on the others; writes and
+ * reads of the same bytes to the same place may well happen twice.
+ *
+ * Each QP completes its units in order, but the QPs race each other. The
+ * completion merge counts the units of every transfer as the send queues
+ * retire them, and reports transfers done in the order they were posted,
+ * once all their units completed. A unit written over one lane may land
+ * after a later unit written over another, so the peer must not look at
+ * the data before the transfer is reported done and told about, over the
+ * ordered connection QP.
+ */
+
+#ifndef RDMA_STRIPE_H
+#define RDMA_STRIPE_H
+
+#include "rdma_sendq.h"
+#include "rdma_sizing.h"
+#include "rdma_rail.h"
+
+/* Most QPs of a stripe, the connection's own included */
+#define RDMA_STRIPE_MAX_QPS (8)
+/* Default bytes per unit */
+#define RDMA_STRIPE_UNIT (64 * 1024)
+/* Transfers in flight */
+#define RDMA_STRIPE_XFERS (64)
+/* Memory regions a stripe moves data from and to */
+#define RDMA_STRIPE_MRS (4)
+
+struct rdma_stripe;
+
+/* Called once per transfer, in posting order, when all its units completed */
+typedef void (*rdma_stripe_done_fn)(struct rdma_stripe *st, uint64_t cookie);
+
+/* A transfer in flight: units not yet retired */
+struct rdma_stripe_xfer
+{
+	uint64_t cookie;
+	uint32_t pending;
+};
+
+/* A unit posted on a lane, kept until the lane retires it, to post it
+ * again elsewhere should the lane fail */
+struct rdma_stripe_unit
+{
+	struct rdma_stripe_xfer *xfer;
+	enum ibv_wr_opcode opcode;
+	struct ibv_mr *mr;
+	uint64_t addr;
+	uint32_t length;
+	uint64_t remote_addr;
+	uint32_t rkey;
+};
+
+/* An extra QP we opened, with a CQ and a send queue of its own */
+struct rdma_stripe_lane
+{
+	struct rdma_cm_id *cm_id;
+	struct ibv_cq *cq;
+	struct rdma_sendq sq;
+	/* own PD on another device than the connection's, or NULL */
+	struct ibv_pd *pd;
+	/* the remote key as the connection knows it, and as the lane does */
+	uint32_t rkey_from, rkey_to;
+	/* with an own PD: our registrations of the stripe's memory regions */
+	struct ibv_mr *mrs[RDMA_STRIPE_MRS];
+	/* FIFO of the units in flight, in posting order, nr_units entries */
+	struct rdma_stripe_unit *units;
+	uint64_t uhead, utail;
+	uint32_t nr_units;
+};
+
+struct rdma_stripe
+{
+	/* send queues of all QPs; [0] is the connection's own, the others are
+	 * lanes[i].sq */
+	struct rdma_sendq *sqs[RDMA_STRIPE_MAX_QPS];
+	struct rdma_stripe_lane lanes[RDMA_STRIPE_MAX_QPS];
+	uint32_t nr_qps;
+	uint32_t unit;
+	/* weighted round robin: the share of each QP, what it is owed, and
+	 * whether it failed and is left out */
+	uint32_t weight[RDMA_STRIPE_MAX_QPS];
+	int64_t credit[RDMA_STRIPE_MAX_QPS];
+	int failed[RDMA_STRIPE_MAX_QPS];
+	/* memory regions the stripe moves data from and to */
+	struct ibv_mr *mrs[RDMA_STRIPE_MRS];
+	uint32_t nr_mrs;
+	/* transfers reported done, and transfers posted */
+	struct rdma_stripe_xfer xfers[RDMA_STRIPE_XFERS];
+	uint64_t head, tail;
+	rdma_stripe_done_fn on_done;
+	void *context;
+	/* totals, for whoever is curious */
+	uint64_t units, bytes, resent;
+	uint64_t qp_bytes[RDMA_STRIPE_MAX_QPS];
+};
+
+/*
+ * Sets up a stripe of the connection's own QP only.
+ * @st: stripe to initialize
+ * @sq: send queue of the connection's QP. Its retire callback has to hand
+ *      every wr_id to rdma_stripe_retire().
+ * @unit: bytes per unit, 0 for RDMA_STRIPE_UNIT
+ * @weight: share of the connection's QP, its link speed in Gbit/s for one
+ */
+int rdma_stripe_init(struct rdma_stripe *st, struct rdma_sendq *sq, uint32_t unit,
+                     uint32_t weight);
+
+/*
+ * Opens a lane to the server the connection goes to, over a rail: resolves
+ * it, creates a QP in 'pd', or in a PD of its own if the rail is on another
+ * device, and connects with the token. Waits for the CM events on
+ * 'channel', which must not have any other events coming meanwhile.
+ * Memory regions registered with rdma_stripe_register() so far are
+ * registered with the lane as well.
+ * @rail: where the lane goes, and its weight
+ * @token: what the server handed out in struct rdma_server_metadata
+ * @rkey: key of the server memory the stripe is going to access
+ */
+int rdma_stripe_add_lane(struct rdma_stripe *st, struct rdma_event_channel *channel,
+                         struct ibv_pd *pd, const struct rdma_rail *rail,
+                         uint32_t token, uint32_t rkey);
+
+/* Tells the stripe about a memory region it is going to move data from or
+ * to; lanes on other devices register the same memory with their PD */
+int rdma_stripe_register(struct rdma_stripe *st, struct ibv_mr *mr);
+
+/* Disconnects and destroys the lanes, and their registrations. Nothing may
+ * be in flight. */
+void rdma_stripe_close(struct rdma_stripe *st, struct rdma_event_channel *channel);
+
+/*
+ * Posts an RDMA write or read of 'length' bytes at 'addr', inside 'mr', from
+ * or to 'offset' bytes into the remote buffer, striped over the QPs. 'mr'
+ * has to be registered with rdma_stripe_register() first. Waits,
+ * reaping, while RDMA_STRIPE_XFERS transfers are in flight. The on_done
+ * callback may run from in here, for earlier transfers. Returns 0 or a
+ * negative error, after which the stripe is of no more use.
+ * @opcode: IBV_WR_RDMA_WRITE or IBV_WR_RDMA_READ
+ * @cookie: passed to on_done
+ */
+int rdma_stripe_post(struct rdma_stripe *st, enum ibv_wr_opcode opcode,
+                     struct ibv_mr *mr, void *addr, uint64_t length,
+                     struct rdma_buffer_attr *remote, uint64_t offset,
+                     uint64_t cookie);
+
+/*
+ * Counts a retired unit if 'wr_id' is one of ours and reports the transfers
+ * that are done by now. Returns 1 if it was ours, 0 if not.
+ */
+int rdma_stripe_retire(struct rdma_stripe *st, uint64_t wr_id);
+
+/* Reaps the send queues of all QPs without waiting. A lane that failed is
+ * left out and its units are posted again on the other QPs. Returns the
+ * number of transfers reported done, or a negative error, which only the
+ * connection's own QP fails with. */
+int rdma_stripe_progress(struct rdma_stripe *st);
+
+/* Waits until every transfer posted is done */
+int rdma_stripe_wait(struct rdma_stripe *st);
+
+#endif /* RDMA_STRIPE_H */
@@ -0,0 +1,211 @@
+/*
+ * Implementation of the binary trace.
+ */
+
+#include <pthread.h>
+
+#include "rdma_trace.h"
+
+__thread struct rdma_trace_ring *rdma_trace_self = NULL;
+
+/* Every ring ever handed out. Taken to add a thread and to copy the rings,
+ * never by a thread that traces. */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rdma_trace_ring *rings = NULL;
+static uint32_t nr_rings = 0;
+/* where the time in a trace file starts: when the first thread traced */
+static uint64_t tsc_start = 0;
+
+/* The drainer and its file */
+static FILE *trace_file = NULL;
+static pthread_t drainer;
+static int stop_drainer = 0;
+
+int rdma_trace_thread_init(const char *name, uint32_t nr_records)
+{
+	struct rdma_trace_ring *ring = NULL;
+	uint64_t size = 1, packed[4];
+	if (rdma_trace_self)
+		return 0;
+	if (!nr_records)
+		nr_records = RDMA_TRACE_RECORDS;
+	while (size < nr_records)
+		size <<= 1;
+	if (posix_memalign((void**) &ring, 64, sizeof(*ring)))
+		ring = NULL;
+	if (!ring)
+	{
+		rdma_error("Failed to allocate a trace ring, -ENOMEM\n");
+		return -ENOMEM;
+	}
+	bzero(ring, sizeof(*ring));
+	ring->recs = calloc(size, sizeof(*ring->recs));
+	if (!ring->recs)
+	{
+		rdma_error("Failed to allocate %lu trace records, -ENOMEM\n",
+		           (unsigned long) size);
+		free(ring);
+		return -ENOMEM;
+	}
+	ring->mask = size - 1;
+	/* the name rides in the arguments, NUL terminated */
+	bzero(packed, sizeof(packed));
+	strncpy((char*) packed, name ? name : "thread", sizeof(packed) - 1);
+	ring->name.tsc = rdma_tsc();
+	ring->name.event = RDMA_TRACE_THREAD;
+	memcpy(ring->name.args, packed, sizeof(packed));
+	pthread_mutex_lock(&rings_lock);
+	if (!tsc_start)
+		tsc_start = ring->name.tsc;
+	ring->id = nr_rings++;
+	ring->name.thread = ring->id;
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+	rdma_trace_self = ring;
+	return 0;
+}
+
+/*
+ * Writes the records of a ring from 'from' up to its head to 'out', as far
+ * as the writer did not overwrite them, and counts the ones it did into
+ * 'lost'. Returns where the next copy starts.
+ */
+static uint64_t copy_ring(struct rdma_trace_ring *ring, uint64_t from,
+                          FILE *out, uint64_t *lost)
+{
+	struct rdma_trace_rec rec;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), now;
+	uint64_t size = ring->mask + 1;
+	if (head - from > size)
+	{
+		*lost += head - size - from;
+		from = head - size;
+	}
+	for (; from < head; from++)
+	{
+		rec = ring->recs[from & ring->mask];
+		/* The copy is good unless the writer got to the slot of record
+		 * from + size meanwhile, which it writes while that is its head */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		if (now - from >= size)
+		{
+			(*lost)++;
+			continue;
+		}
+		if (fwrite(&rec, sizeof(rec), 1, out) != 1)
+			break;
+	}
+	return from;
+}
+
+static FILE *open_trace_file(const char *path)
+{
+	struct rdma_trace_file_hdr hdr;
+	FILE *out = fopen(path, "w");
+	if (!out)
+	{
+		rdma_error("Failed to open trace file %s, errno: %d \n", path, -errno);
+		return NULL;
+	}
+	bzero(&hdr, sizeof(hdr));
+	memcpy(hdr.magic, RDMA_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.rec_size = sizeof(struct rdma_trace_rec);
+	hdr.nr_events = RDMA_TRACE_NR_EVENTS;
+	hdr.ns_per_tick = rdma_tsc_ns_per_tick();
+	pthread_mutex_lock(&rings_lock);
+	if (!tsc_start)
+		tsc_start = rdma_tsc();
+	hdr.tsc_start = tsc_start;
+	pthread_mutex_unlock(&rings_lock);
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+	{
+		rdma_error("Failed to write trace file %s\n", path);
+		fclose(out);
+		return NULL;
+	}
+	return out;
+}
+
+static void drain_rings()
+{
+	struct rdma_trace_ring *ring;
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = ring->next)
+	{
+		if (!ring->named &&
+		        fwrite(&ring->name, sizeof(ring->name), 1, trace_file) == 1)
+			ring->named = 1;
+		ring->drained = copy_ring(ring, ring->drained, trace_file, &ring->lost);
+	}
+	pthread_mutex_unlock(&rings_lock);
+	fflush(trace_file);
+}
+
+static void *drain_loop(void *arg)
+{
+	while (!__atomic_load_n(&stop_drainer, __ATOMIC_ACQUIRE))
+	{
+		drain_rings();
+		usleep(RDMA_TRACE_DRAIN_MS * 1000);
+	}
+	drain_rings();
+	return NULL;
+}
+
+int rdma_trace_start(const char *path)
+{
+	int ret;
+	if (trace_file)
+		return -EBUSY;
+	trace_file = open_trace_file(path);
+	if (!trace_file)
+		return -EIO;
+	stop_drainer = 0;
+	ret = pthread_create(&drainer, NULL, drain_loop, NULL);
+	if (ret)
+	{
+		rdma_error("Failed to start the trace drainer, ret = %d \n", ret);
+		fclose(trace_file);
+		trace_file = NULL;
+		return -ret;
+	}
+	debug("Tracing to %s \n", path);
+	return 0;
+}
+
+uint64_t rdma_trace_stop(void)
+{
+	struct rdma_trace_ring *ring;
+	uint64_t lost = 0;
+	if (!trace_file)
+		return 0;
+	__atomic_store_n(&stop_drainer, 1, __ATOMIC_RELEASE);
+	pthread_join(drainer, NULL);
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = ring->next)
+		lost += ring->lost;
+	pthread_mutex_unlock(&rings_lock);
+	return lost;
+}
+
+int rdma_trace_dump(const char *path)
+{
+	struct rdma_trace_ring *ring;
+	uint64_t lost = 0;
+	FILE *out = open_trace_file(path);
+	if (!out)
+		return -EIO;
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = ring->next)
+	{
+		if (fwrite(&ring->name, sizeof(ring->name), 1, out) == 1)
+			copy_ring(ring, 0, out, &lost);
+	}
+	pthread_mutex_unlock(&rings_lock);
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Header file for the binary trace.
+ *
+ * printf() formats its arguments and writes them out while the caller
+ * waits, so logging from the hot paths slows them down to the speed of the
+ * terminal. A trace record is instead a fixed size binary record: a cycle
+ * counter timestamp, an event id and four 64 bit arguments. Every thread
+ * appends its records to a ring of its own, which takes a few stores and no
+ * lock, atomic or system call. Formatting happens much later, in the
+ * rdma_trace_decode tool.
+ *
+ * The rings are flight recorders: a thread never waits for anybody, it
+ * overwrites its oldest records when the ring is full. A drainer thread
+ * (rdma_trace_start()) copies new records to a file every few milliseconds,
+ * and only loses records when a thread fills its whole ring in between.
+ * Without a drainer, rdma_trace_dump() writes out whatever the rings still
+ * hold, for a post-mortem look.
+ *
+ * The reader copies a record and then checks that the writer did not come
+ * around to the slot while it was copying, like the reader of a seqlock.
+ */
+
+#ifndef RDMA_TRACE_H
+#define RDMA_TRACE_H
+
+#include "rdma_hist.h"
+
+/* Default records per thread, a power of two */
+#define RDMA_TRACE_RECORDS (1 << 16)
+/* How often the drainer copies the rings to the file */
+#define RDMA_TRACE_DRAIN_MS (10)
+
+/*
+ * The events, with the format the decoder prints their arguments with. All
+ * four arguments are passed to the format as unsigned longs, unused ones are
+ * 0. Add new events at the end, the decoder goes by the number.
+ */
+#define RDMA_TRACE_EVENTS(X) \
+	X(THREAD, "thread %s") \
+	X(RING_COMMIT, "ring commit seq %lu, %lu payload bytes, tail %lu") \
+	X(RING_RELEASE, "ring release seq %lu, %lu payload bytes, head %lu") \
+	X(HEAD_PUBLISH, "head published %lu") \
+	X(PULL, "pull %lu bytes at %lu") \
+	X(SENDQ_FULL, "send queue full, %lu outstanding, %lu more") \
+	X(MESSAGE, "message %lu: %lu doubles, %lu bytes") \
+	X(RECORD, "record from %#lx: %lu doubles") \
+	X(HEAD_PUBLISH_FAIL, "head publish failed, errno %lu, head %lu") \
+	X(WC_BATCH, "%lu work completions") \
+	X(CM_EVENT, "cm event %lu on id %#lx") \
+	X(ASYNC_EVENT, "async event %lu")
+
+#define RDMA_TRACE_ENUM(name, fmt) RDMA_TRACE_##name,
+enum rdma_trace_event
+{
+	RDMA_TRACE_EVENTS(RDMA_TRACE_ENUM)
+	RDMA_TRACE_NR_EVENTS,
+};
+#undef RDMA_TRACE_ENUM
+
+/* One record, as it is kept in memory and written to the file */
+struct rdma_trace_rec
+{
+	uint64_t tsc;
+	uint32_t event;
+	/* which thread, in the order they started tracing */
+	uint32_t thread;
+	uint64_t args[4];
+};
+
+/* The ring of one thread. Only the thread writes, and only 'head'. */
+struct rdma_trace_ring
+{
+	uint64_t head __attribute__((aligned(64)));
+	/* what the drainer copied so far, and what it lost */
+	uint64_t drained __attribute__((aligned(64)));
+	uint64_t lost;
+	uint64_t mask;
+	uint32_t id;
+	/* the record that names the thread, written ahead of the others */
+	struct rdma_trace_rec name;
+	int named;
+	struct rdma_trace_rec *recs;
+	struct rdma_trace_ring *next;
+};
+
+/* What a trace file starts with */
+#define RDMA_TRACE_MAGIC "RDMATRC1"
+struct rdma_trace_file_hdr
+{
+	char magic[8];
+	uint32_t rec_size;
+	uint32_t nr_events;
+	/* to turn timestamps into time */
+	double ns_per_tick;
+	uint64_t tsc_start;
+};
+
+/* Ring of the calling thread, NULL while it does not trace */
+extern __thread struct rdma_trace_ring *rdma_trace_self;
+
+/* Appends a record to the calling thread's ring, if it traces */
+static inline void rdma_trace(enum rdma_trace_event event, uint64_t a0,
+                              uint64_t a1, uint64_t a2, uint64_t a3)
+{
+	struct rdma_trace_ring *ring = rdma_trace_self;
+	struct rdma_trace_rec *rec;
+	uint64_t head;
+	if (!ring)
+		return;
+	head = ring->head;
+	/* The head we published last must be visible before we overwrite an
+	 * old record, or a reader could take the new bytes for the old ones */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec = &ring->recs[head & ring->mask];
+	rec->tsc = rdma_tsc();
+	rec->event = event;
+	rec->thread = ring->id;
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	rec->args[3] = a3;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Makes the calling thread trace from now on, into a ring that stays around
+ * after the thread is gone. The file gets a THREAD record that names it.
+ * @name: up to 31 characters
+ * @nr_records: ring size, rounded up to a power of two, 0 for
+ *              RDMA_TRACE_RECORDS
+ */
+int rdma_trace_thread_init(const char *name, uint32_t nr_records);
+
+/* Starts a thread that copies new records of every ring to the file at
+ * 'path' every RDMA_TRACE_DRAIN_MS */
+int rdma_trace_start(const char *path);
+
+/* Copies what is left, stops the drainer and closes the file. Returns the
+ * number of records that were overwritten before the drainer got to them. */
+uint64_t rdma_trace_stop(void);
+
+/* Writes every record the rings still hold to the file at 'path', without
+ * a drainer, for instance after something went wrong */
+int rdma_trace_dump(const char *path);
+
+#endif /* RDMA_TRACE_H */
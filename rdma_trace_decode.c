@@ -0,0 +1,124 @@
+/*
+ * Decoder for the files written by the binary trace (see rdma_trace.h).
+ *
+ * Prints one line per record, in the order of their timestamps across all
+ * threads: the time since tracing started in microseconds, the thread, and
+ * the event formatted with its arguments.
+ *
+ * Usage: rdma_trace_decode <trace file>
+ */
+
+#include "rdma_trace.h"
+
+#define RDMA_TRACE_NAME(name, fmt) #name,
+static const char *event_names[RDMA_TRACE_NR_EVENTS] =
+{
+	RDMA_TRACE_EVENTS(RDMA_TRACE_NAME)
+};
+#undef RDMA_TRACE_NAME
+
+#define RDMA_TRACE_FORMAT(name, fmt) fmt,
+static const char *event_formats[RDMA_TRACE_NR_EVENTS] =
+{
+	RDMA_TRACE_EVENTS(RDMA_TRACE_FORMAT)
+};
+#undef RDMA_TRACE_FORMAT
+
+/* Thread names, as the THREAD records tell them */
+#define MAX_THREADS (1024)
+static char thread_names[MAX_THREADS][32];
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const struct rdma_trace_rec *x = a, *y = b;
+	if (x->tsc != y->tsc)
+		return x->tsc < y->tsc ? -1 : 1;
+	return x->thread < y->thread ? -1 : x->thread > y->thread;
+}
+
+static void print_rec(struct rdma_trace_rec *rec, struct rdma_trace_file_hdr *hdr)
+{
+	double us = (double)(int64_t)(rec->tsc - hdr->tsc_start) * hdr->ns_per_tick / 1000;
+	char text[256];
+	const char *thread = rec->thread < MAX_THREADS && thread_names[rec->thread][0] ?
+	                     thread_names[rec->thread] : "?";
+	if (rec->event >= RDMA_TRACE_NR_EVENTS)
+	{
+		snprintf(text, sizeof(text), "event %u: %#lx %#lx %#lx %#lx", rec->event,
+		         (unsigned long) rec->args[0], (unsigned long) rec->args[1],
+		         (unsigned long) rec->args[2], (unsigned long) rec->args[3]);
+	}
+	else if (rec->event == RDMA_TRACE_THREAD)
+	{
+		/* the name is packed into the arguments */
+		snprintf(text, sizeof(text), event_formats[rec->event], (char*) rec->args);
+	}
+	else
+	{
+		snprintf(text, sizeof(text), event_formats[rec->event],
+		         (unsigned long) rec->args[0], (unsigned long) rec->args[1],
+		         (unsigned long) rec->args[2], (unsigned long) rec->args[3]);
+	}
+	printf("%14.3f %3u %-10s %-12s %s\n", us, rec->thread, thread,
+	       rec->event < RDMA_TRACE_NR_EVENTS ? event_names[rec->event] : "?", text);
+}
+
+int main(int argc, char **argv)
+{
+	struct rdma_trace_file_hdr hdr;
+	struct rdma_trace_rec *recs = NULL, *more;
+	size_t nr = 0, cap = 0, i;
+	FILE *in;
+	if (argc != 2)
+	{
+		printf("Usage: rdma_trace_decode <trace file>\n");
+		return 1;
+	}
+	in = fopen(argv[1], "r");
+	if (!in)
+	{
+		rdma_error("Failed to open %s, errno: %d \n", argv[1], -errno);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	        memcmp(hdr.magic, RDMA_TRACE_MAGIC, sizeof(hdr.magic)) ||
+	        hdr.rec_size != sizeof(struct rdma_trace_rec))
+	{
+		rdma_error("%s is not a trace file this decoder understands\n", argv[1]);
+		fclose(in);
+		return 1;
+	}
+	if (hdr.nr_events > RDMA_TRACE_NR_EVENTS)
+		fprintf(stderr, "The trace knows %u events, we only %u \n",
+		        hdr.nr_events, RDMA_TRACE_NR_EVENTS);
+	while (1)
+	{
+		if (nr == cap)
+		{
+			cap = cap ? cap * 2 : 4096;
+			more = realloc(recs, cap * sizeof(*recs));
+			if (!more)
+			{
+				rdma_error("Failed to allocate %lu records, -ENOMEM\n",
+				           (unsigned long) cap);
+				free(recs);
+				fclose(in);
+				return 1;
+			}
+			recs = more;
+		}
+		if (fread(&recs[nr], sizeof(*recs), 1, in) != 1)
+			break;
+		if (recs[nr].event == RDMA_TRACE_THREAD && recs[nr].thread < MAX_THREADS)
+			memcpy(thread_names[recs[nr].thread], recs[nr].args,
+			       sizeof(thread_names[0]) - 1);
+		nr++;
+	}
+	fclose(in);
+	/* The drainer writes ring after ring, the timestamps put them in order */
+	qsort(recs, nr, sizeof(*recs), cmp_rec);
+	for (i = 0; i < nr; i++)
+		print_rec(&recs[i], &hdr);
+	free(recs);
+	return 0;
+}